@@ -1,9 +1,12 @@
 ST_retcode sf_egen_multiple_sources (struct StataInfo *st_info, int level);
 ST_retcode sf_egen_bulk             (struct StataInfo *st_info, int level);
+ST_retcode sf_egen_nunique_hll      (struct StataInfo *st_info, int level);
+GT_bool    gf_egen_hll_only         (struct StataInfo *st_info);
 ST_retcode sf_write_output          (struct StataInfo *st_info, int level, GT_size wtargets, char *fname);
 ST_retcode sf_write_collapsed       (struct StataInfo *st_info, int level, GT_size wtargets, char *fname);
 ST_retcode sf_write_byvars          (struct StataInfo *st_info, int level);
 ST_retcode sf_read_collapsed        (GT_size J, GT_size kextra, char *fname);
+ST_retcode sf_write_collapsed_disk  (struct StataInfo *st_info, GT_size wtargets, GT_size ktargets, char *fname);
 
 /**
  * @brief egen stata variables in bulk
@@ -30,6 +33,10 @@ ST_retcode sf_egen_bulk (struct StataInfo *st_info, int level)
         return (0);
     }
 
+    if ( gf_egen_hll_only (st_info) ) {
+        return (sf_egen_nunique_hll (st_info, level));
+    }
+
     GT_bool multiple_sources = (st_info->kvars_sources > 1);
     GT_bool one_target = (st_info->kvars_targets == 1)
                       || ( (st_info->kvars_targets == 2) & (st_info->statcode[1] == -14) );
@@ -92,17 +99,13 @@ ST_retcode sf_egen_bulk (struct StataInfo *st_info, int level)
             nj_max = (st_info->info[j + 1] - st_info->info[j]);
     }
 
-    GT_size   *nuniq_ix    = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_ix);
-    uint64_t  *nuniq_h1    = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_h1);
-    uint64_t  *nuniq_h2    = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_h2);
-    uint64_t  *nuniq_h3    = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_h3);
-    uint64_t  *nuniq_xcopy = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_xcopy);
+    GT_bool nuniq_exact = st_info->nunique & (st_info->nunique_approx == 0);
+
+    struct GtoolsNuniqSet nuniq_set;
+    if ( (rc = gf_nuniq_set_init(&nuniq_set, nuniq_exact? nj_max: 0)) ) return (rc);
 
-    if ( nuniq_ix    == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_ix"));
-    if ( nuniq_h1    == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_h1"));
-    if ( nuniq_h2    == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_h2"));
-    if ( nuniq_h3    == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_h3"));
-    if ( nuniq_xcopy == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_xcopy"));
+    struct GtoolsHLL hll;
+    if ( (rc = gf_hll_init(&hll, st_info->nunique? st_info->nunique_approx: 0)) ) return (rc);
 
     ST_double *all_buffer     = calloc(N * ksources, sizeof *all_buffer);
     GT_bool   *all_firstmiss  = calloc(J * ksources, sizeof *all_firstmiss);
@@ -291,17 +294,21 @@ ST_retcode sf_egen_bulk (struct StataInfo *st_info, int level)
                     // this is only missing is all are missing.
                     output[offset_output + k] = lastnm[st_info->pos_targets[k]];
                 }
+                else if ( (scode == -18) & (st_info->nunique_approx > 0) ) { // nunique (approx)
+                    if ( (rc = gf_array_nunique_hll (
+                            output + offset_output + k,
+                            all_buffer + start,
+                            nj,
+                            &hll
+                        )
+                    ) ) return (rc);
+                }
                 else if ( scode == -18 ) { // nunique
-                    if ( (rc = gf_array_nunique_range (
+                    if ( (rc = gf_array_nunique_set (
                             output + offset_output + k,
                             all_buffer + start,
                             nj,
-                            (end == 0),
-                            nuniq_h1,
-                            nuniq_h2,
-                            nuniq_h3,
-                            nuniq_ix,
-                            nuniq_xcopy
+                            &nuniq_set
                         )
                     ) ) return (rc);
                 }
@@ -370,11 +377,8 @@ exit:
 
     free (index_st);
 
-    free (nuniq_h1);
-    free (nuniq_h2);
-    free (nuniq_h3);
-    free (nuniq_ix);
-    free (nuniq_xcopy);
+    gf_nuniq_set_free (&nuniq_set);
+    gf_hll_free (&hll);
 
     free (all_buffer);
     free (all_firstmiss);
@@ -457,17 +461,13 @@ ST_retcode sf_egen_multiple_sources (struct StataInfo *st_info, int level)
             nj_max = (st_info->info[j + 1] - st_info->info[j]);
     }
 
-    GT_size   *nuniq_ix    = calloc(st_info->nunique? nj_max * ksources: 1, sizeof *nuniq_ix);
-    uint64_t  *nuniq_h1    = calloc(st_info->nunique? nj_max * ksources: 1, sizeof *nuniq_h1);
-    uint64_t  *nuniq_h2    = calloc(st_info->nunique? nj_max * ksources: 1, sizeof *nuniq_h2);
-    uint64_t  *nuniq_h3    = calloc(st_info->nunique? nj_max * ksources: 1, sizeof *nuniq_h3);
-    uint64_t  *nuniq_xcopy = calloc(st_info->nunique? nj_max * ksources: 1, sizeof *nuniq_xcopy);
+    GT_bool nuniq_exact = st_info->nunique & (st_info->nunique_approx == 0);
 
-    if ( nuniq_ix    == NULL ) return(sf_oom_error("sf_egen_multiple_sources", "nuniq_ix"));
-    if ( nuniq_h1    == NULL ) return(sf_oom_error("sf_egen_multiple_sources", "nuniq_h1"));
-    if ( nuniq_h2    == NULL ) return(sf_oom_error("sf_egen_multiple_sources", "nuniq_h2"));
-    if ( nuniq_h3    == NULL ) return(sf_oom_error("sf_egen_multiple_sources", "nuniq_h3"));
-    if ( nuniq_xcopy == NULL ) return(sf_oom_error("sf_egen_multiple_sources", "nuniq_xcopy"));
+    struct GtoolsNuniqSet nuniq_set;
+    if ( (rc = gf_nuniq_set_init(&nuniq_set, nuniq_exact? nj_max * ksources: 0)) ) return (rc);
+
+    struct GtoolsHLL hll;
+    if ( (rc = gf_hll_init(&hll, st_info->nunique? st_info->nunique_approx: 0)) ) return (rc);
 
     ST_double *all_buffer     = calloc(N * ksources, sizeof *all_buffer);
     GT_bool   *all_firstmiss  = calloc(J, sizeof *all_firstmiss);
@@ -638,17 +638,21 @@ ST_retcode sf_egen_multiple_sources (struct StataInfo *st_info, int level)
                     // this is only missing is all are missing.
                     output[offset_output + k] = lastnm[0];
                 }
+                else if ( (scode == -18) & (st_info->nunique_approx > 0) ) { // nunique (approx)
+                    if ( (rc = gf_array_nunique_hll (
+                            output + offset_output + k,
+                            all_buffer + start,
+                            nj * ksources,
+                            &hll
+                        )
+                    ) ) return (rc);
+                }
                 else if ( scode == -18 ) { // nunique
-                    if ( (rc = gf_array_nunique_range (
+                    if ( (rc = gf_array_nunique_set (
                             output + offset_output + k,
                             all_buffer + start,
                             nj * ksources,
-                            (end == 0),
-                            nuniq_h1,
-                            nuniq_h2,
-                            nuniq_h3,
-                            nuniq_ix,
-                            nuniq_xcopy
+                            &nuniq_set
                         )
                     ) ) return (rc);
                 }
@@ -717,11 +721,8 @@ exit:
 
     free (index_st);
 
-    free (nuniq_h1);
-    free (nuniq_h2);
-    free (nuniq_h3);
-    free (nuniq_ix);
-    free (nuniq_xcopy);
+    gf_nuniq_set_free (&nuniq_set);
+    gf_hll_free (&hll);
 
     free (all_buffer);
     free (all_firstmiss);
@@ -738,6 +739,100 @@ exit:
     return (rc);
 }
 
+/**
+ * @brief Whether every target is approximate nunique (or freq)
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @return 1 if the stats can be computed by sf_egen_nunique_hll
+ */
+GT_bool gf_egen_hll_only (struct StataInfo *st_info)
+{
+    GT_size k;
+
+    if ( st_info->nunique_approx <= 0 ) return (0);
+    for (k = 0; k < st_info->kvars_targets; k++) {
+        if ( (st_info->statcode[k] != -18) && (st_info->statcode[k] != -14) ) {
+            return (0);
+        }
+    }
+
+    return (1);
+}
+
+/**
+ * @brief Approximate nunique straight from Stata
+ *
+ * When every target is approximate nunique (or freq) there is no need to
+ * buffer the source variables: each group's values are read from Stata
+ * into the HyperLogLog registers and counted, so the only scratch memory
+ * is the registers themselves.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param level (unused) level of function call
+ * @return Stores the stats in st_info->output, as sf_egen_bulk
+ */
+ST_retcode sf_egen_nunique_hll (struct StataInfo *st_info, int level)
+{
+    ST_retcode rc = 0;
+    ST_double z;
+    GT_size i, j, k, l, s, nj, start, end, offset_output;
+    clock_t timer = clock();
+
+    GT_size J             = st_info->J;
+    GT_size ksources      = st_info->kvars_sources;
+    GT_size ktargets      = st_info->kvars_targets;
+    GT_size start_sources = st_info->kvars_by + st_info->kvars_group + 1;
+
+    // With several sources and one target, nunique counts the values of
+    // every source together (see sf_egen_multiple_sources)
+    GT_bool pooled = (ksources > 1) & (
+        (ktargets == 1) || ( (ktargets == 2) & (st_info->statcode[1] == -14) )
+    );
+
+    st_info->output = calloc(J * ktargets, sizeof *st_info->output);
+    if ( st_info->output == NULL ) return(sf_oom_error("sf_egen_nunique_hll", "st_info->output"));
+
+    GTOOLS_GC_ALLOCATED("st_info->output")
+    ST_double *output = st_info->output;
+    st_info->free = 9;
+
+    struct GtoolsHLL hll;
+    if ( (rc = gf_hll_init(&hll, st_info->nunique_approx)) ) goto exit;
+
+    for (j = 0; j < J; j++) {
+        l     = st_info->ix[j];
+        start = st_info->info[l];
+        end   = st_info->info[l + 1];
+        nj    = end - start;
+        offset_output = j * ktargets;
+
+        for (k = 0; k < ktargets; k++) {
+            if ( st_info->statcode[k] == -14 ) { // freq
+                output[offset_output + k] = pooled? nj * ksources: nj;
+                continue;
+            }
+
+            for (s = 0; s < ksources; s++) {
+                if ( !pooled && (s != st_info->pos_targets[k]) ) continue;
+                for (i = start; i < end; i++) {
+                    if ( (rc = SF_vdata(start_sources + s,
+                                        st_info->index[i] + st_info->in1,
+                                        &z)) ) goto exit;
+                    gf_hll_add(&hll, z);
+                }
+            }
+            gf_hll_count(output + offset_output + k, pooled? nj * ksources: nj, &hll);
+        }
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 5: Counted approximate nunique from Stata");
+
+exit:
+    gf_hll_free (&hll);
+    return (rc);
+}
+
 ST_retcode sf_write_output (struct StataInfo *st_info, int level, GT_size wtargets, char *fname)
 {
 
@@ -823,15 +918,7 @@ ST_retcode sf_write_output (struct StataInfo *st_info, int level, GT_size wtarge
         sf_running_timer (&timer, "\tPlugin step 6: Copied summary stats to stata");
 
     if ( (wtargets < ktargets) & (level == 2) & (within == 0) ) {
-        GT_size kextra = ktargets - wtargets;
-        FILE *fhandle = fopen(fname, "wb");
-
-        for (j = 0; j < st_info->J; j++) {
-            fwrite (st_info->output + j * ktargets + wtargets,
-                    sizeof *st_info->output, kextra, fhandle);
-        }
-
-        fclose (fhandle);
+        if ( (rc = sf_write_collapsed_disk (st_info, wtargets, ktargets, fname)) ) goto exit;
 
         if ( st_info->benchmark > 1 )
             sf_running_timer (&timer, "\tPlugin step 7: Copied some targets to disk");
@@ -928,15 +1015,7 @@ ST_retcode sf_write_collapsed (struct StataInfo *st_info, int level, GT_size wta
      *********************************************************************/
 
     if ( (wtargets < ktargets) & (level == 2) ) {
-        GT_size kextra = ktargets - wtargets;
-        FILE *fhandle = fopen(fname, "wb");
-
-        for (j = 0; j < st_info->J; j++) {
-            fwrite (st_info->output + j * ktargets + wtargets,
-                    sizeof *st_info->output, kextra, fhandle);
-        }
-
-        fclose (fhandle);
+        if ( (rc = sf_write_collapsed_disk (st_info, wtargets, ktargets, fname)) ) goto exit;
 
         if ( st_info->benchmark > 1 )
             sf_running_timer (&timer, "\tPlugin step 7: Copied some targets to disk");
@@ -1003,6 +1082,39 @@ exit:
     return (rc);
 }
 
+/**
+ * @brief Write the targets past @wtargets to disk
+ *
+ * The file is compressed (see gf_spill_compress) if the temporary
+ * directory is slow enough for that to pay off; the read step is told
+ * via __gtools_gc_zspill, since the file is raw doubles otherwise.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param wtargets targets already stored in Stata
+ * @param ktargets targets per row of st_info->output
+ * @param fname temporary file
+ * @return Writes the extra targets to @fname
+ */
+ST_retcode sf_write_collapsed_disk (struct StataInfo *st_info, GT_size wtargets, GT_size ktargets, char *fname)
+{
+    ST_retcode rc;
+    GT_bool zspill = gf_spill_compress(fname);
+
+    if ( zspill ) {
+        rc = gf_write_collapsed_spill (fname, st_info->output, wtargets, ktargets, st_info->J);
+    }
+    else {
+        rc = gf_write_collapsed (fname, st_info->output, wtargets, ktargets, st_info->J);
+    }
+
+    if ( rc ) {
+        sf_errprintf("unable to write collapsed targets to disk\n");
+        return (rc);
+    }
+
+    return (SF_scal_save("__gtools_gc_zspill", (ST_double) zspill));
+}
+
 ST_retcode sf_read_collapsed (GT_size J, GT_size kextra, char *fname)
 {
     if ( kextra < 1 ) {
@@ -1012,10 +1124,29 @@ ST_retcode sf_read_collapsed (GT_size J, GT_size kextra, char *fname)
     GT_size j, k;
     ST_retcode rc = 0;
 
-    ST_double *output = calloc(J * kextra, sizeof *output);
-    if ( output == NULL ) return(sf_oom_error("sf_read_collapsed", "output"));
+    if ( J == 0 ) {
+        return (0);
+    }
+
+    ST_double zspill;
+    ST_double *output = NULL;
+    if ( (rc = SF_scal_use("__gtools_gc_zspill", &zspill)) ) return (rc);
 
-    gf_read_collapsed (fname, output, kextra, J);
+    if ( zspill ) {
+        if ( (output = calloc(J * kextra, sizeof *output)) == NULL ) {
+            return (sf_oom_error("sf_read_collapsed", "output"));
+        }
+        rc = gf_read_collapsed_spill (fname, output, kextra, J);
+    }
+    else {
+        output = gf_map_collapsed (fname, kextra, J);
+        rc = (output == NULL)? 692: 0;
+    }
+
+    if ( rc ) {
+        sf_errprintf("unable to read collapsed targets from disk\n");
+        goto exit;
+    }
 
     for (j = 0; j < J; j++) {
         for (k = 0; k < kextra; k++) {
@@ -1024,6 +1155,7 @@ ST_retcode sf_read_collapsed (GT_size J, GT_size kextra, char *fname)
     }
 
 exit:
-    free (output);
+    if ( zspill ) free (output);
+    else gf_unmap_collapsed (output, kextra, J);
     return (rc);
 }
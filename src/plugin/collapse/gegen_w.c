@@ -80,17 +80,13 @@ ST_retcode sf_egen_bulk_w (struct StataInfo *st_info, int level)
             nj_max = (st_info->info[j + 1] - st_info->info[j]);
     }
 
-    GT_size   *nuniq_ix    = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_ix);
-    uint64_t  *nuniq_h1    = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_h1);
-    uint64_t  *nuniq_h2    = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_h2);
-    uint64_t  *nuniq_h3    = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_h3);
-    uint64_t  *nuniq_xcopy = calloc(st_info->nunique? nj_max: 1, sizeof *nuniq_xcopy);
-
-    if ( nuniq_ix    == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_ix"));
-    if ( nuniq_h1    == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_h1"));
-    if ( nuniq_h2    == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_h2"));
-    if ( nuniq_h3    == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_h3"));
-    if ( nuniq_xcopy == NULL ) return(sf_oom_error("sf_egen_bulk_w", "nuniq_xcopy"));
+    GT_bool nuniq_exact = st_info->nunique & (st_info->nunique_approx == 0);
+
+    struct GtoolsNuniqSet nuniq_set;
+    if ( (rc = gf_nuniq_set_init(&nuniq_set, nuniq_exact? nj_max: 0)) ) return (rc);
+
+    struct GtoolsHLL hll;
+    if ( (rc = gf_hll_init(&hll, st_info->nunique? st_info->nunique_approx: 0)) ) return (rc);
 
     ST_double *p_buffer = calloc(2 * nj_max, sizeof *p_buffer);
     ST_double *weights  = calloc(N, sizeof *weights);
@@ -300,17 +296,21 @@ ST_retcode sf_egen_bulk_w (struct StataInfo *st_info, int level)
                     // this is only missing is all are missing.
                     output[offset_output + k] = lastnm[st_info->pos_targets[k]];
                 }
+                else if ( (scode == -18) & (st_info->nunique_approx > 0) ) { // nunique (approx)
+                    if ( (rc = gf_array_nunique_hll (
+                            output + offset_output + k,
+                            all_buffer + start,
+                            nj,
+                            &hll
+                        )
+                    ) ) return (rc);
+                }
                 else if ( scode == -18 ) { // nunique
-                    if ( (rc = gf_array_nunique_range (
+                    if ( (rc = gf_array_nunique_set (
                             output + offset_output + k,
                             all_buffer + start,
                             nj,
-                            (endwraw == SV_missval),
-                            nuniq_h1,
-                            nuniq_h2,
-                            nuniq_h3,
-                            nuniq_ix,
-                            nuniq_xcopy
+                            &nuniq_set
                         )
                     ) ) return (rc);
                 }
@@ -488,17 +488,21 @@ ST_retcode sf_egen_bulk_w (struct StataInfo *st_info, int level)
                     // this is only missing is all are missing.
                     output[offset_output + k] = lastnm[st_info->pos_targets[k]];
                 }
+                else if ( (scode == -18) & (st_info->nunique_approx > 0) ) { // nunique (approx)
+                    if ( (rc = gf_array_nunique_hll (
+                            output + offset_output + k,
+                            all_buffer + start,
+                            nj,
+                            &hll
+                        )
+                    ) ) return (rc);
+                }
                 else if ( scode == -18 ) { // nunique
-                    if ( (rc = gf_array_nunique_range (
+                    if ( (rc = gf_array_nunique_set (
                             output + offset_output + k,
                             all_buffer + start,
                             nj,
-                            (endwraw == SV_missval),
-                            nuniq_h1,
-                            nuniq_h2,
-                            nuniq_h3,
-                            nuniq_ix,
-                            nuniq_xcopy
+                            &nuniq_set
                         )
                     ) ) return (rc);
                 }
@@ -618,11 +622,8 @@ exit:
 
     free (index_st);
 
-    free (nuniq_h1);
-    free (nuniq_h2);
-    free (nuniq_h3);
-    free (nuniq_ix);
-    free (nuniq_xcopy);
+    gf_nuniq_set_free (&nuniq_set);
+    gf_hll_free (&hll);
 
     free (p_buffer);
     free (weights);
@@ -84,15 +84,16 @@ ST_double gf_array_drawsum_weighted (ST_double *v, GT_size N)
 /**
  * @brief Weighted quantile of enries in range of array
  *
- * This computes the (quantile)th quantile using qsort. When
- * computing multiple quantiles, the data will already be sorted for the
- * next iteration, so it's faster than sorting every time, but it it
- * still a VERY inefficient implementation.
+ * This computes the (quantile)th quantile via weighted selection: The
+ * copy of v and w is partitioned around pivots while keeping track of
+ * the partial sum of the weights, which finds the same element as
+ * sorting and then scanning the cumulative weights but in expected
+ * linear time.
  *
  * @param v vector of doubles containing the current group's variables
  * @param N number of elements
  * @param w weights
- * @param p_buffer Buffer where to put a copy of v and w to sort
+ * @param p_buffer Buffer where to put a copy of v and w to select from
  * @param quantile Quantile to compute
  * @param wsum sum(w_i)
  * @param vcount sum(v_i < SV_missval)
@@ -112,13 +113,13 @@ ST_double gf_array_dquantile_weighted (
     ST_double *vptr = v;
     ST_double *wptr = w;
 
-    ST_double q, qdbl, qfoo, cumsum, cumnorm, Ndbl;
+    ST_double q, qdbl, prev, cumsum, cumnorm, Ndbl;
     GT_size   Ndiv, qth, i;
     GT_bool   rfoo, Nmod;
 
     if ( N == 1 ) return (*v);
 
-    // Sort group elements and weights
+    // Copy group elements and weights
     // -------------------------------
 
     Ndbl = (ST_double) vcount;
@@ -127,23 +128,6 @@ ST_double gf_array_dquantile_weighted (
         p_buffer[2 * i + 1] = *wptr;
     }
 
-    // quicksort_bsd(
-    //     p_buffer,
-    //     N,
-    //     2 * (sizeof *p_buffer),
-    //     xtileCompare,
-    //     NULL
-    // );
-    GT_size invert[2]; invert[0] = 0; invert[1] = 0;
-    MultiQuicksortDbl(
-        p_buffer,
-        N,
-        0,
-        1,
-        2 * (sizeof *p_buffer),
-        invert
-    );
-
     // Numerical precision foo
     // -----------------------
 
@@ -160,15 +144,10 @@ ST_double gf_array_dquantile_weighted (
     // ------------------------
 
     // i s.t. cumsum w_i > quantile
-    i = 0;
     cumsum  = 0;
+    prev    = 0;
     cumnorm = Ndbl / wsum;
-    do {
-        cumsum += (qfoo = p_buffer[2 * i + 1] * cumnorm);
-    } while ( ((cumsum - qdbl) < GTOOLS_WQUANTILES_TOL) & (++i < N) );
-
-    qth     = i - 1;
-    cumsum -= qfoo;
+    qth     = gf_qselect_weighted(p_buffer, 0, N, 2, qdbl, cumnorm, &cumsum, &prev);
     rfoo    = !((qdbl - cumsum) > GTOOLS_WQUANTILES_TOL);
 
     // Return qth element or average
@@ -176,7 +155,7 @@ ST_double gf_array_dquantile_weighted (
 
     q = p_buffer[2 * qth];
     if ( rfoo && qth > 0 ) {
-        q += p_buffer[2 * (qth - 1)];
+        q += prev;
         q /= 2;
     }
 
@@ -1,210 +1,311 @@
-ST_retcode gf_array_nunique_range (
+/*
+ * Exact distinct counts via an open-addressing hash set (linear probing).
+ * The table is allocated once, for the largest group, but each group only
+ * uses the smallest power of two that keeps the load factor under 3/4, so
+ * small and medium groups stay in cache. Instead of clearing the table
+ * between groups, each slot records the generation (call) that filled it;
+ * a slot is empty for the current group unless its generation matches.
+ * Values are compared directly, so there are no hash collisions to check.
+ */
+
+struct GtoolsNuniqSet {
+    GT_size   size;
+    uint32_t  current;
+    uint32_t  *gen;
+    ST_double *keys;
+};
+
+ST_retcode gf_nuniq_set_init (struct GtoolsNuniqSet *set, GT_size nmax);
+void gf_nuniq_set_free (struct GtoolsNuniqSet *set);
+GT_size gf_nuniq_set_size (GT_size N);
+uint64_t gf_nuniq_hash (ST_double z);
+
+ST_retcode gf_array_nunique_set (
     ST_double *output,
-    void *x,
+    ST_double *x,
     const GT_size N,
-    const GT_bool hmethod,
-    uint64_t *h1,
-    uint64_t *h2,
-    uint64_t *h3,
-    uint64_t *ix,
-    uint64_t *xcopy
+    struct GtoolsNuniqSet *set
 );
 
-ST_retcode gf_counting_sort_noix (
-    uint64_t *hash, GT_size N,
-    uint64_t range,
-    uint64_t *xcopy
-);
+/*
+ * Approximate distinct counts via HyperLogLog. Each value is hashed to 64
+ * bits with gf_nuniq_hash; the top p bits pick one of m = 2^p registers
+ * and the register keeps the largest number of leading zeros (plus one)
+ * seen in the remaining 64 - p bits. The relative standard error of the
+ * count is about 1.04 / sqrt(m). Only one set of registers is needed,
+ * since groups are processed one at a time; the registers touched by a
+ * group are recorded so that clearing them costs O(touched), not O(m).
+ */
+
+#define GTOOLS_HLL_MINP 4
+#define GTOOLS_HLL_MAXP 18
 
-ST_retcode gf_array_nunique_range (
+struct GtoolsHLL {
+    GT_size p;
+    GT_size m;
+    GT_size ndirty;
+    uint8_t *registers;
+    GT_size *dirty;
+};
+
+ST_retcode gf_hll_init (struct GtoolsHLL *hll, ST_double epsilon);
+void gf_hll_free (struct GtoolsHLL *hll);
+ST_double gf_hll_error (struct GtoolsHLL *hll);
+void gf_hll_add (struct GtoolsHLL *hll, ST_double z);
+void gf_hll_count (ST_double *output, const GT_size N, struct GtoolsHLL *hll);
+
+ST_retcode gf_array_nunique_hll (
     ST_double *output,
-    void *x,
+    ST_double *x,
     const GT_size N,
-    const GT_bool hmethod,
-    uint64_t *h1,
-    uint64_t *h2,
-    uint64_t *h3,
-    uint64_t *ix,
-    uint64_t *xcopy)
+    struct GtoolsHLL *hll
+);
+
+/**
+ * @brief Table size for N values: power of two, load factor <= 3/4
+ */
+GT_size gf_nuniq_set_size (GT_size N)
 {
-    spookyhash_context context;
-    ST_double *v = (ST_double *) x;
+    GT_size size = 8;
+    while ( size < (N + N / 3 + 1) ) size <<= 1;
+    return (size);
+}
 
-    GT_size nunique = 1;
-    GT_size ctol    = pow(2, 24);
+/**
+ * @brief Mix the bits of a double (-0 and 0 map to the same value)
+ */
+uint64_t gf_nuniq_hash (ST_double z)
+{
+    uint64_t u;
+    if ( z == 0 ) z = 0;
+    memcpy(&u, &z, sizeof u);
+    u ^= u >> 33;
+    u *= 0xff51afd7ed558ccdULL;
+    u ^= u >> 33;
+    u *= 0xc4ceb9fe1a85ec53ULL;
+    u ^= u >> 33;
+    return (u);
+}
 
-    GT_bool biject, anymiss, allmiss, rsort;
-    GT_size i, j, range, npos;
-    ST_double min = 0, max = 0;
+/**
+ * @brief Allocate a hash set that can hold the largest group
+ *
+ * @param set Hash set
+ * @param nmax Largest number of values per call; 0 allocates nothing
+ * @return Allocated @set with every slot empty
+ */
+ST_retcode gf_nuniq_set_init (struct GtoolsNuniqSet *set, GT_size nmax)
+{
+    set->size    = nmax? gf_nuniq_set_size(nmax): 1;
+    set->current = 0;
+    set->gen     = calloc(set->size, sizeof *set->gen);
+    set->keys    = calloc(set->size, sizeof *set->keys);
 
+    if ( set->gen  == NULL ) return(sf_oom_error("gf_nuniq_set_init", "set->gen"));
+    if ( set->keys == NULL ) return(sf_oom_error("gf_nuniq_set_init", "set->keys"));
+
+    return (0);
+}
+
+void gf_nuniq_set_free (struct GtoolsNuniqSet *set)
+{
+    free (set->gen);
+    free (set->keys);
+}
+
+/**
+ * @brief Exact number of distinct values in x
+ *
+ * Missing values count as distinct values; -0 and 0 are the same value.
+ *
+ * @param output Where to store the count
+ * @param x Values
+ * @param N Number of values (at most the nmax the set was built for)
+ * @param set Hash set from gf_nuniq_set_init
+ * @return Count of distinct values in @output
+ */
+ST_retcode gf_array_nunique_set (
+    ST_double *output,
+    ST_double *x,
+    const GT_size N,
+    struct GtoolsNuniqSet *set)
+{
+    GT_size i, slot, mask;
+    GT_size nunique = 0;
+    uint32_t gen;
     ST_double z;
-    ST_retcode rc;
 
-    GT_bool sorted = gf_array_dsorted_range(v, 0, N);
+    mask = GTOOLS_PWMIN(gf_nuniq_set_size(N), set->size) - 1;
 
-    if ( hmethod || sorted ) {
-        biject  = 0;
-        anymiss = 1;
-        allmiss = 1;
-    }
-    else {
-        biject  = 1;
-        anymiss = 0;
-        allmiss = 1;
+    // Start a new generation; on wrap-around actually clear the table
+    if ( ++(set->current) == 0 ) {
+        memset(set->gen, 0, set->size * sizeof *set->gen);
+        set->current = 1;
     }
+    gen = set->current;
 
-    if ( biject ) {
-        for (i = 0; i < N; i++) {
-            z = v[i];
-            if ( (ceil(z) != z) || (z > SV_missval) ) {
-                biject = 0;
-                break;
-            }
-            else if ( z < SV_missval ) {
-                if ( allmiss ) {
-                    min = z;
-                    max = z;
-                    allmiss = 0;
-                }
-                else {
-                    if ( z < min ) min = z;
-                    if ( z > max ) max = z;
-                }
-            }
-            else {
-                // All missing should be handled in the call (i.e. all
-                // missing forces spooky hash)
-                anymiss = 1;
-            }
+    for (i = 0; i < N; i++) {
+        z    = (x[i] == 0)? 0: x[i];
+        slot = gf_nuniq_hash(z) & mask;
+        while ( (set->gen[slot] == gen) && (set->keys[slot] != z) ) {
+            slot = (slot + 1) & mask;
         }
-    }
 
-    if ( sorted ) {
-        rsort = 3;
-    }
-    else {
-        if ( biject ) {
-            range = ((GT_int) max - (GT_int) min + anymiss + 1);
-            rsort = range < ctol? 0: 1;
-            for (i = 0; i < N; i++) {
-                if ( (z = v[i]) == SV_missval ) z = max + 1;
-                h1[i] = ((GT_int) z - min);
-            }
-        }
-        else {
-            rsort = 2;
-            for (i = 0; i < N; i++) {
-                // spookyhash_128(v + i, sizeof(ST_double), h1 + i, h2 + i);
-                spookyhash_context_init(&context, 0, 1);
-                spookyhash_update(&context, v + i, sizeof(ST_double));
-                spookyhash_final(&context, h1 + i, h2 + i);
-            }
+        if ( set->gen[slot] != gen ) {
+            set->gen[slot]  = gen;
+            set->keys[slot] = z;
+            nunique++;
         }
+    }
 
-        if ( rsort ) {
-            // This has to be indexed because of h2
-            for (i = 0; i < N; i++)
-                ix[i] = i;
-
-            if ( (rc = gf_radix_sort16 (h1, ix, N)) ) return (rc);
+    *output = ((ST_double) nunique);
 
-            for (i = 0; i < N; i++)
-                h3[i] = h2[ix[i]];
+    return (0);
+}
 
+/**
+ * @brief Allocate HyperLogLog registers for a target relative error
+ *
+ * @param hll HyperLogLog registers
+ * @param epsilon Target relative standard error; 0 allocates nothing
+ * @return Smallest m = 2^p with 1.04 / sqrt(m) <= epsilon (within bounds)
+ */
+ST_retcode gf_hll_init (struct GtoolsHLL *hll, ST_double epsilon)
+{
+    GT_size p = GTOOLS_HLL_MINP;
+    if ( epsilon > 0 ) {
+        while ( (p < GTOOLS_HLL_MAXP) && (1.04 / sqrt((ST_double) ((GT_size) 1 << p)) > epsilon) ) {
+            p++;
         }
-        else {
-            if ( (rc = gf_counting_sort_noix (h1, N, range, xcopy)) ) return(rc);
-        }
-        sorted = 1;
     }
 
-    if ( (rsort == 0) || (rsort == 1) ) {
-        npos = 0;
-        for (i = 1; i < N; i++) {
-            if ( h1[npos] == h1[i] ) continue;
-            npos = i;
-            nunique++;
-        }
-    }
-    else if ( rsort == 2 ) {
-        // Unique count using h1, h3, ix
-        npos = 0;
-        for (i = 1; i < N; i++) {
-            if ( h1[npos] == h1[i] ) continue;
-
-            if ( i > npos + 1 ) {
-                for (j = npos + 1; j < i; j++) {
-                    if ( h3[npos] != h3[j] ) break;
-                }
-
-                if ( j < i ) {
-                    if ( (rc = gf_radix_sort16 (h3, ix, i - npos)) ) return (rc);
-                    for (j = npos + 1; j < i; j++) {
-                        if ( h3[npos] == h3[j] ) {
-                            if ( v[ix[npos]] != v[ix[j]] ) return (17999);
-                            continue;
-                        }
-                        npos = j;
-                        nunique++;
-                    }
-                }
-                else {
-                    for (j = npos + 1; j < i; j++) {
-                        if ( v[ix[npos]] != v[ix[j]] ) return (17999);
-                    }
-                }
-            }
-
-            npos = i;
-            nunique++;
-        }
-    }
-    else if ( rsort == 3 ) {
-        npos = 0;
-        for (i = 1; i < N; i++) {
-            if ( v[npos] == v[i] ) continue;
-            npos = i;
-            nunique++;
-        }
-    }
+    hll->p      = p;
+    hll->m      = (GT_size) 1 << p;
+    hll->ndirty = 0;
 
-    *output = ((ST_double) nunique);
+    hll->registers = calloc(epsilon > 0? hll->m: 1, sizeof *hll->registers);
+    hll->dirty     = calloc(epsilon > 0? hll->m: 1, sizeof *hll->dirty);
+
+    if ( hll->registers == NULL ) return(sf_oom_error("gf_hll_init", "hll->registers"));
+    if ( hll->dirty     == NULL ) return(sf_oom_error("gf_hll_init", "hll->dirty"));
 
     return (0);
 }
 
-// Assumes normalized array (i.e. each element - min)
-ST_retcode gf_counting_sort_noix (uint64_t *hash, GT_size N, uint64_t range, uint64_t *xcopy)
+void gf_hll_free (struct GtoolsHLL *hll)
 {
+    free (hll->registers);
+    free (hll->dirty);
+}
 
-    GT_size *count = calloc(range + 1, sizeof *count);
-    if ( count == NULL ) return(sf_oom_error("gf_counting_sort_noix", "count"));
+ST_double gf_hll_error (struct GtoolsHLL *hll)
+{
+    return (1.04 / sqrt((ST_double) hll->m));
+}
 
-    uint64_t *xptr;
-    uint64_t *hptr;
-    GT_size *cptr;
+/**
+ * @brief Add one value to the HyperLogLog registers
+ *
+ * @param hll HyperLogLog registers
+ * @param z Value
+ * @return Updates the register picked by the hash of @z
+ */
+void gf_hll_add (struct GtoolsHLL *hll, ST_double z)
+{
+    GT_size r;
+    uint64_t h = gf_nuniq_hash(z);
+    uint8_t rho = 1, rhomax = 64 - hll->p + 1;
 
-    // Initialize count as 0s
-    for (cptr = count; cptr < count + range + 1; cptr++)
-        *cptr = 0;
+    r   = (GT_size) (h >> (64 - hll->p));
+    h <<= hll->p;
+    while ( (rho < rhomax) && !(h & ((uint64_t) 1 << 63)) ) {
+        h <<= 1;
+        rho++;
+    }
 
-    // Freq count of hash
-    xptr = xcopy;
-    for (hptr  = hash; hptr < hash + N; hptr++, xptr++)
-        count[ *xptr = (*hptr + 1) ]++;
+    if ( hll->registers[r] == 0 ) {
+        hll->dirty[hll->ndirty++] = r;
+    }
+    if ( rho > hll->registers[r] ) {
+        hll->registers[r] = rho;
+    }
+}
 
-    // Cummulative freq count (position in output)
-    for (cptr = count + 1; cptr < count + range; cptr++)
-        *cptr += *(cptr - 1);
+/**
+ * @brief Estimate the number of distinct values added and reset
+ *
+ * Uses the HyperLogLog estimate and, for small counts (when some registers
+ * are still empty), linear counting, which is nearly exact when N is small
+ * relative to m.
+ *
+ * @param output Where to store the count
+ * @param N Number of values added (the count is at most N)
+ * @param hll HyperLogLog registers (all zero on exit)
+ * @return Approximate count of distinct values in @output
+ */
+void gf_hll_count (ST_double *output, const GT_size N, struct GtoolsHLL *hll)
+{
+    GT_size i, V;
+    ST_double sum, alpha, estimate, m = (ST_double) hll->m;
+
+    // Empty registers contribute 2^0 = 1 each to the harmonic sum
+    V   = hll->m - hll->ndirty;
+    sum = (ST_double) V;
+    for (i = 0; i < hll->ndirty; i++) {
+        sum += ldexp(1, -((int) hll->registers[hll->dirty[i]]));
+    }
+
+    if ( hll->m >= 128 ) {
+        alpha = 0.7213 / (1 + 1.079 / m);
+    }
+    else if ( hll->m >= 64 ) {
+        alpha = 0.709;
+    }
+    else if ( hll->m >= 32 ) {
+        alpha = 0.697;
+    }
+    else {
+        alpha = 0.673;
+    }
 
-    // Copy back in stable sorted order
-    xptr = xcopy;
-    for (hptr = hash; hptr < hash + N; hptr++, xptr++) {
-        hash[count[*xptr - 1]++] = *xptr - 1;
+    estimate = alpha * m * m / sum;
+    if ( (estimate <= 2.5 * m) && (V > 0) ) {
+        estimate = m * log(m / (ST_double) V);
     }
 
-    // Free space
-    free (count);
+    for (i = 0; i < hll->ndirty; i++) {
+        hll->registers[hll->dirty[i]] = 0;
+    }
+    hll->ndirty = 0;
+
+    estimate = round(estimate);
+    if ( estimate > N ) estimate = N;
+    *output  = ((estimate < 1) && (N > 0))? 1: estimate;
+}
+
+/**
+ * @brief Approximate number of distinct values in x
+ *
+ * Missing values count as distinct values, as in the exact version.
+ *
+ * @param output Where to store the count
+ * @param x Values
+ * @param N Number of values
+ * @param hll HyperLogLog registers (all zero on entry and on exit)
+ * @return Approximate count of distinct values in @output
+ */
+ST_retcode gf_array_nunique_hll (
+    ST_double *output,
+    ST_double *x,
+    const GT_size N,
+    struct GtoolsHLL *hll)
+{
+    GT_size i;
+
+    for (i = 0; i < N; i++) {
+        gf_hll_add(hll, x[i]);
+    }
+    gf_hll_count(output, N, hll);
 
     return (0);
 }
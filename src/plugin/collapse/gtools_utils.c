@@ -1,9 +1,29 @@
 #include "gtools_utils.h"
 
+/**
+ * @brief Wall-clock time from a monotonic clock
+ *
+ * clock() is CPU time on POSIX systems, which leaves out the time spent
+ * waiting on the disk; on Windows it already counts wall time.
+ *
+ * @return Seconds since an arbitrary, fixed point
+ */
+ST_double gf_wall_time (void)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    return ((ST_double) clock() / CLOCKS_PER_SEC);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((ST_double) ts.tv_sec + (ST_double) ts.tv_nsec / 1e9);
+#endif
+}
+
 /**
  * @brief Benchmark I/O
  *
- * @return Time to read/write 1MiB to disk
+ * @param fname file to write to and read from
+ * @return Wall time to write and read back 1MiB to disk; -1 on error
  */
 ST_double gf_benchmark (char *fname)
 {
@@ -16,20 +36,32 @@ ST_double gf_benchmark (char *fname)
     srand (time(NULL));
 
     ST_double *A = malloc(J * k2 * sizeof(ST_double));
-    ST_double *B = malloc(J * kw * sizeof(ST_double));
+    ST_double *B = calloc(J * kw, sizeof(ST_double));
+    ST_double *C, iops;
+
+    if ( A == NULL || B == NULL ) {
+        free (A);
+        free (B);
+        return (-1);
+    }
+
     for (j = 0; j < J; j++) {
         for (k = 0; k < k2; k++)
             A[k2 * j + k] = (ST_double) rand() / RAND_MAX;
     }
 
-    clock_t timer = clock(); ST_double iops;
-    gf_write_collapsed (fname, A, k1, k2, J);
-    gf_read_collapsed (fname, B, kw, J);
-    iops = (ST_double) (clock() - timer) / CLOCKS_PER_SEC;
+    iops = gf_wall_time();
+    if ( gf_write_collapsed (fname, A, k1, k2, J) == 0 ) {
+        if ( (C = gf_map_collapsed (fname, kw, J)) != NULL ) {
+            memcpy(B, C, J * kw * sizeof(ST_double));
+            gf_unmap_collapsed (C, kw, J);
+        }
+    }
+    iops = gf_wall_time() - iops;
 
     for (j = 0; j < 20; j++) {
         for (k = 0; k < kw; k++)
-            if ( A[k2 * j + k1 + k] != B[kw * j + k] ) return(-1);
+            if ( A[k2 * j + k1 + k] != B[kw * j + k] ) iops = -1;
     }
 
     free (A);
@@ -38,6 +70,230 @@ ST_double gf_benchmark (char *fname)
     return (iops);
 }
 
+/**
+ * @brief Path to the I/O rate cache in the directory of fname
+ *
+ * The temporary directory may be shared (e.g. /tmp), so the cache is
+ * per user: the file name ends in the user ID (the user name on
+ * Windows, where the temporary directory is per user anyway).
+ *
+ * @param fname file in the temporary directory
+ * @return malloc'd path; NULL if out of memory
+ */
+char * gf_io_cache_path (char *fname)
+{
+    char *filepath, *filename, *cache;
+    char user[GTOOLS_IO_CACHE_USER + 1];
+
+#if defined(_WIN64) || defined(_WIN32)
+    GT_size k = 0;
+    char *uname = getenv("USERNAME");
+    for (; (uname != NULL) && (*uname != '\0') && (k < GTOOLS_IO_CACHE_USER); uname++) {
+        if ( ((*uname >= '0') && (*uname <= '9')) ||
+             ((*uname >= 'a') && (*uname <= 'z')) ||
+             ((*uname >= 'A') && (*uname <= 'Z')) ) {
+            user[k++] = *uname;
+        }
+    }
+    user[k] = '\0';
+#else
+    snprintf(user, GTOOLS_IO_CACHE_USER + 1, "%lu", (unsigned long) getuid());
+#endif
+
+    gf_split_path_file (&filepath, &filename, fname);
+    cache = malloc(strlen(filepath) + strlen(GTOOLS_IO_CACHE_FILE) + strlen(user) + 2);
+    if ( cache != NULL ) {
+        sprintf(cache, "%s%s_%s", filepath, GTOOLS_IO_CACHE_FILE, user);
+    }
+
+    free (filepath);
+    free (filename);
+
+    return (cache);
+}
+
+/**
+ * @brief Whether a rate read from the cache is plausible
+ */
+GT_bool gf_io_cache_rate (ST_double rate)
+{
+    return ( (rate > 0) && (rate < GTOOLS_IO_CACHE_MAXRATE) );
+}
+
+/**
+ * @brief Read the cached I/O rates for the directory of fname
+ *
+ * The cache is a one-line text file with the disk rate, the SPI rate,
+ * the spill codec rate, and the time at which they were measured. It is
+ * ignored once it is more than GTOOLS_IO_CACHE_EXPIRY seconds old, if it
+ * cannot be parsed, has anything after the four numbers, or has rates
+ * that are not positive and finite, and (except on Windows) unless it is
+ * a regular file owned by the user. The SPI rate is negative if it has
+ * not been measured (only gcollapse measures it).
+ *
+ * @param fname file in the temporary directory
+ * @param disk_rate seconds to write and read 1MiB
+ * @param spi_rate seconds to store one value in Stata
+ * @param codec_rate seconds to compress and decompress 1MiB
+ * @return 1 if valid rates were read, 0 otherwise
+ */
+GT_bool gf_io_cache_read (char *fname, ST_double *disk_rate, ST_double *spi_rate, ST_double *codec_rate)
+{
+    FILE *fhandle;
+    double stamp, age;
+    char extra;
+    GT_bool ok = 0;
+    char *cache = gf_io_cache_path(fname);
+
+    if ( cache == NULL ) return (0);
+    if ( (fhandle = fopen(cache, "r")) != NULL ) {
+#if !defined(_WIN64) && !defined(_WIN32)
+        struct stat info;
+        if ( fstat(fileno(fhandle), &info) || !S_ISREG(info.st_mode) || (info.st_uid != getuid()) ) {
+            fclose(fhandle);
+            free (cache);
+            return (0);
+        }
+#endif
+        if ( fscanf(fhandle, "%lf %lf %lf %lf %c", disk_rate, spi_rate, codec_rate, &stamp, &extra) == 4 ) {
+            age = difftime(time(NULL), (time_t) stamp);
+            ok  = (age >= 0) && (age < GTOOLS_IO_CACHE_EXPIRY)
+               && gf_io_cache_rate(*disk_rate)
+               && gf_io_cache_rate(*codec_rate)
+               && ((*spi_rate == -1) || gf_io_cache_rate(*spi_rate));
+        }
+        fclose(fhandle);
+    }
+
+    free (cache);
+    return (ok);
+}
+
+/**
+ * @brief Save the I/O rates for the directory of fname
+ *
+ * Failing to write the cache is not an error; the rates are simply
+ * measured again next time. Except on Windows the file is created
+ * readable only by the user and is not written through a symbolic link
+ * or if someone else owns it.
+ *
+ * @param fname file in the temporary directory
+ * @param disk_rate seconds to write and read 1MiB
+ * @param spi_rate seconds to store one value in Stata; negative if unknown
+ * @param codec_rate seconds to compress and decompress 1MiB
+ * @return Writes the rates to GTOOLS_IO_CACHE_FILE
+ */
+void gf_io_cache_write (char *fname, ST_double disk_rate, ST_double spi_rate, ST_double codec_rate)
+{
+    FILE *fhandle;
+    char *cache = gf_io_cache_path(fname);
+
+    if ( cache == NULL ) return;
+#if defined(_WIN64) || defined(_WIN32)
+    fhandle = fopen(cache, "w");
+#else
+    struct stat info;
+    int fd = open(cache, O_WRONLY | O_CREAT | O_NOFOLLOW, 0600);
+    fhandle = NULL;
+    if ( fd != -1 ) {
+        if ( fstat(fd, &info) || !S_ISREG(info.st_mode) || (info.st_uid != getuid()) || ftruncate(fd, 0) ) {
+            close (fd);
+        }
+        else if ( (fhandle = fdopen(fd, "w")) == NULL ) {
+            close (fd);
+        }
+    }
+#endif
+    if ( fhandle != NULL ) {
+        fprintf(fhandle, "%.17g %.17g %.17g %.0f\n",
+                disk_rate, spi_rate < 0? -1: spi_rate, codec_rate, (double) time(NULL));
+        fclose(fhandle);
+    }
+
+    free (cache);
+}
+
+/**
+ * @brief Benchmark the spill codec
+ *
+ * Shuffles, compresses, decompresses, and unshuffles 1MiB of doubles
+ * with a few distinct values, which is roughly what summary stats and
+ * reshaped data look like.
+ *
+ * @return Wall time to compress and decompress 1MiB; -1 on error
+ */
+ST_double gf_spill_benchmark (void)
+{
+    GT_size j;
+    GT_size J      = 128 * 1024;
+    GT_size bytes  = J * sizeof(ST_double);
+    ST_double *A   = malloc(bytes);
+    ST_double *B   = malloc(bytes);
+    char *shuf     = malloc(bytes);
+    char *packed   = malloc(gf_lz_bound(bytes));
+    ST_double secs = -1;
+    GT_size p;
+
+    if ( A == NULL || B == NULL || shuf == NULL || packed == NULL ) goto exit;
+
+    for (j = 0; j < J; j++)
+        A[j] = (ST_double) (rand() % 4096) / 16;
+
+    secs = gf_wall_time();
+    gf_shuffle(shuf, (char *) A, J, sizeof(ST_double));
+    p = gf_lz_compress((unsigned char *) packed, (unsigned char *) shuf, bytes);
+    if ( p < bytes && gf_lz_decompress((unsigned char *) shuf, bytes, (unsigned char *) packed, p) == 0 ) {
+        gf_unshuffle((char *) B, shuf, J, sizeof(ST_double));
+        secs = gf_wall_time() - secs;
+        if ( memcmp(A, B, bytes) ) secs = -1;
+    }
+    else {
+        secs = -1;
+    }
+
+exit:
+    free (A);
+    free (B);
+    free (shuf);
+    free (packed);
+
+    return (secs);
+}
+
+/**
+ * @brief Whether to compress spill files written to the directory of fname
+ *
+ * Compressing pays off if the time it saves writing and reading the file
+ * is more than the time it takes; at a ratio of GTOOLS_SPILL_SAVING
+ * that is when the disk rate times the ratio exceeds the codec rate.
+ * The rates are taken from the cache, and measured and cached if it is
+ * missing or stale. For testing, global GTOOLS_SPILL_COMPRESS set to 1
+ * (0) always (never) compresses.
+ *
+ * @param fname spill file (it is overwritten if the rates are measured)
+ * @return 1 if spill files should be compressed
+ */
+GT_bool gf_spill_compress (char *fname)
+{
+    ST_double disk_rate, spi_rate, codec_rate;
+    char force[4] = "";
+
+    if ( SF_macro_use(GTOOLS_SPILL_FORCE, force, 4) == 0 ) {
+        if ( strcmp(force, "1") == 0 ) return (1);
+        if ( strcmp(force, "0") == 0 ) return (0);
+    }
+
+    if ( !gf_io_cache_read(fname, &disk_rate, &spi_rate, &codec_rate) ) {
+        disk_rate  = gf_benchmark(fname);
+        codec_rate = gf_spill_benchmark();
+        if ( (disk_rate > 0) && (codec_rate > 0) ) {
+            gf_io_cache_write(fname, disk_rate, -1, codec_rate);
+        }
+    }
+
+    return ( (disk_rate > 0) && (codec_rate > 0) && (disk_rate * GTOOLS_SPILL_SAVING > codec_rate) );
+}
+
 /**
  * @brief Write collapsed summary stats to binary file
  *
@@ -49,14 +305,21 @@ ST_double gf_benchmark (char *fname)
  *
  * And we save 0 to @J from @kstart to @kend in each row.
  *
+ * On Linux the file's blocks are reserved up front and the file is
+ * mapped, so the rows are copied into it directly instead of through one
+ * fwrite per row; msync then flushes the pages and reports any write
+ * error. Elsewhere (macOS lacks posix_fallocate, Windows lacks mmap) the
+ * rows are packed into a buffer and written in one checked call.
+ *
  * @param collapsed_file File where to save collapsed stats
  * @param collapsed_data Vector of doubles with collapsed stats
  * @param kstart First position of data in each row.
  * @param kend Last position of data in each row.
  * @param J Number of rows.
- * @return Writes @collapsed_data to disk.
+ * @return Writes @collapsed_data to disk; 603 if the file could not be
+ *         opened, 693 if it could not be written.
  */
-void gf_write_collapsed(
+ST_retcode gf_write_collapsed(
     char *collapsed_file,
     ST_double *collapsed_data,
     GT_size kstart,
@@ -64,41 +327,227 @@ void gf_write_collapsed(
     GT_size J)
 {
     GT_size j;
-    GT_size knum = kend - kstart;
-    FILE *collapsed_handle = fopen(collapsed_file, "wb");
+    GT_size knum  = kend - kstart;
+    GT_size bytes = J * knum * sizeof *collapsed_data;
+    ST_double *map;
+
+#if GTOOLS_MMAP_WRITE
+    int fd = open(collapsed_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if ( fd == -1 ) return (603);
+    if ( bytes == 0 ) {
+        close (fd);
+        return (0);
+    }
+
+    // Out of space or over quota is caught here rather than as SIGBUS
+    // when the pages are touched
+    if ( posix_fallocate(fd, 0, (off_t) bytes) ) {
+        close (fd);
+        return (693);
+    }
+
+    map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if ( map == MAP_FAILED ) return (693);
+
     for (j = 0; j < J; j++) {
-        fwrite (collapsed_data + j * kend + kstart, sizeof *collapsed_data, knum, collapsed_handle);
+        memcpy(map + j * knum, collapsed_data + j * kend + kstart, knum * sizeof *map);
     }
+
+    int synced = msync(map, bytes, MS_SYNC);
+    munmap(map, bytes);
+
+    return (synced? 693: 0);
+#else
+    GT_size ret;
+    FILE *collapsed_handle;
+
+    map = malloc(bytes + sizeof *map);
+    if ( map == NULL ) return (sf_oom_error("gf_write_collapsed", "map"));
+
+    for (j = 0; j < J; j++) {
+        memcpy(map + j * knum, collapsed_data + j * kend + kstart, knum * sizeof *map);
+    }
+
+    if ( (collapsed_handle = fopen(collapsed_file, "wb")) == NULL ) {
+        free (map);
+        return (603);
+    }
+
+    ret = fwrite(map, sizeof *map, J * knum, collapsed_handle);
     fclose(collapsed_handle);
+    free (map);
+
+    return (ret == J * knum? 0: 693);
+#endif
 }
 
 /**
- * @brief Read collapsed summary stats from binary file
+ * @brief Map collapsed summary stats from binary file
  *
- * Reads collapsed data from file. The collapsed data is
- * in a manualy indexed vector using row-major order. So for
- * a J by k set of collapsed summary stats, we have
+ * Maps the file written by gf_write_collapsed read-only. The collapsed
+ * data is a J by @knum matrix in row-major order. Without mmap
+ * (Windows) the file is read into a buffer instead.
  *
- *     [(0, 0) (0, 1) ... (0, k) (1, 0) ... (J, 0) ... (J, k)]
+ * @param collapsed_file File with the collapsed stats
+ * @param knum Number of entries in each row.
+ * @param J Number of rows.
+ * @return J by @knum matrix; NULL if the file could not be read or is
+ *         too short. Release it with gf_unmap_collapsed.
+ */
+ST_double * gf_map_collapsed(
+    char *collapsed_file,
+    GT_size knum,
+    GT_size J)
+{
+    GT_size bytes = J * knum * sizeof(ST_double);
+    ST_double *map;
+
+    if ( bytes == 0 ) return (NULL);
+
+#if GTOOLS_MMAP
+    struct stat finfo;
+    int fd = open(collapsed_file, O_RDONLY);
+    if ( fd == -1 ) return (NULL);
+
+    if ( fstat(fd, &finfo) || ((GT_size) finfo.st_size < bytes) ) {
+        close (fd);
+        return (NULL);
+    }
+
+    map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    return (map == MAP_FAILED? NULL: map);
+#else
+    GT_size ret;
+    FILE *collapsed_handle = fopen(collapsed_file, "rb");
+    if ( collapsed_handle == NULL ) return (NULL);
+
+    map = malloc(bytes);
+    ret = (map == NULL)? 0: fread(map, sizeof *map, J * knum, collapsed_handle);
+    fclose(collapsed_handle);
+
+    if ( ret != J * knum ) {
+        free (map);
+        return (NULL);
+    }
+
+    return (map);
+#endif
+}
+
+/**
+ * @brief Release the matrix returned by gf_map_collapsed
  *
- * And we read @knum entries for @J rows.
+ * @param collapsed_data J by @knum matrix from gf_map_collapsed
+ * @param knum Number of entries in each row.
+ * @param J Number of rows.
+ * @return Unmaps (or frees) @collapsed_data
+ */
+void gf_unmap_collapsed(
+    ST_double *collapsed_data,
+    GT_size knum,
+    GT_size J)
+{
+    if ( collapsed_data == NULL ) return;
+#if GTOOLS_MMAP
+    munmap(collapsed_data, J * knum * sizeof *collapsed_data);
+#else
+    free (collapsed_data);
+#endif
+}
+
+/**
+ * @brief Write collapsed summary stats to a compressed spill file
+ *
+ * Same data as gf_write_collapsed, but written in frames of at most
+ * GTOOLS_SPILL_BLOCK MiB via gf_spill_write (each frame is a block of
+ * rows, shuffled as doubles and compressed).
  *
  * @param collapsed_file File where to save collapsed stats
  * @param collapsed_data Vector of doubles with collapsed stats
+ * @param kstart First position of data in each row.
+ * @param kend Last position of data in each row.
+ * @param J Number of rows.
+ * @return Writes @collapsed_data to disk; 603 if the file could not be
+ *         opened, 693 if it could not be written.
+ */
+ST_retcode gf_write_collapsed_spill(
+    char *collapsed_file,
+    ST_double *collapsed_data,
+    GT_size kstart,
+    GT_size kend,
+    GT_size J)
+{
+    ST_retcode rc = 0;
+    GT_size j, j0, n;
+    GT_size knum   = kend - kstart;
+    GT_size width  = sizeof(ST_double);
+    GT_size nframe = GTOOLS_PWMAX(1, (GTOOLS_SPILL_BLOCK * 1024 * 1024) / (knum * width));
+    GT_size nwork  = 0;
+    char *work     = NULL;
+    FILE *collapsed_handle;
+
+    ST_double *frame = malloc(GTOOLS_PWMIN(nframe, GTOOLS_PWMAX(J, 1)) * knum * width);
+    if ( frame == NULL ) return (sf_oom_error("gf_write_collapsed_spill", "frame"));
+
+    if ( (collapsed_handle = fopen(collapsed_file, "wb")) == NULL ) {
+        free (frame);
+        return (603);
+    }
+
+    for (j0 = 0; j0 < J; j0 += n) {
+        n = GTOOLS_PWMIN(nframe, J - j0);
+        for (j = 0; j < n; j++) {
+            memcpy(frame + j * knum, collapsed_data + (j0 + j) * kend + kstart, knum * width);
+        }
+        rc = gf_spill_write(collapsed_handle, (char *) frame, n * knum, 1, &width, 1, &work, &nwork);
+        if ( rc ) break;
+    }
+
+    fclose(collapsed_handle);
+    free (frame);
+    free (work);
+
+    return (rc);
+}
+
+/**
+ * @brief Read collapsed summary stats from a compressed spill file
+ *
+ * @param collapsed_file File written by gf_write_collapsed_spill
+ * @param collapsed_data J by @knum matrix to fill
  * @param knum Number of entries in each row.
  * @param J Number of rows.
- * @return Reads @collapsed_data from disk.
+ * @return Reads @collapsed_data from disk; 692 if it could not be read.
  */
-void gf_read_collapsed(
+ST_retcode gf_read_collapsed_spill(
     char *collapsed_file,
     ST_double *collapsed_data,
     GT_size knum,
     GT_size J)
 {
-    FILE *collapsed_handle = fopen(collapsed_file, "rb");
-    GT_size ret = fread (collapsed_data, sizeof *collapsed_data, knum * J, collapsed_handle);
-    if ( ret == 0 ) printf(" "); // So it doesn't nag about ret unused...
+    ST_retcode rc = 0;
+    GT_size j0, n;
+    GT_size width  = sizeof(ST_double);
+    GT_size nframe = GTOOLS_PWMAX(1, (GTOOLS_SPILL_BLOCK * 1024 * 1024) / (knum * width));
+    GT_size nwork  = 0;
+    char *work     = NULL;
+    FILE *collapsed_handle;
+
+    if ( (collapsed_handle = fopen(collapsed_file, "rb")) == NULL ) return (692);
+
+    for (j0 = 0; j0 < J; j0 += n) {
+        n  = GTOOLS_PWMIN(nframe, J - j0);
+        rc = gf_spill_read(collapsed_handle, (char *) (collapsed_data + j0 * knum), n * knum, 1, &width, &work, &nwork);
+        if ( rc ) break;
+    }
+
     fclose(collapsed_handle);
+    free (work);
+
+    return (rc);
 }
 
 /**
@@ -129,10 +578,7 @@ void gf_split_path_file(char** p, char** f, char *pf) {
 ST_double gf_query_free_space (char *fname)
 {
     struct statvfs finfo;
-    char *filepath = malloc((strlen(fname) + 1) * sizeof(char));
-    char *filename = malloc((strlen(fname) + 1) * sizeof(char));
-    memset (filepath, '\0', (strlen(fname) + 1) * sizeof(char));
-    memset (filename, '\0', (strlen(fname) + 1) * sizeof(char));
+    char *filepath, *filename;
 
     // char rpath [PATH_MAX+1];
     // char *rc = realpath (fname, rpath);
@@ -1,11 +1,52 @@
 #ifndef GTOOLS_UTILS
 #define GTOOLS_UTILS
 
+// Cached I/O rates are re-measured after this many seconds; rates
+// (seconds per MiB or per value) at or above MAXRATE are rejected
+#define GTOOLS_IO_CACHE_EXPIRY  86400
+#define GTOOLS_IO_CACHE_MAXRATE 3600
+#define GTOOLS_IO_CACHE_USER    32
+#define GTOOLS_IO_CACHE_FILE    "__gtools_io_rates"
+
+// Spill files are compressed if that is expected to save time assuming
+// they shrink by this fraction
+#define GTOOLS_SPILL_SAVING    0.5
+
+// Global that forces spill files to be compressed (1) or not (0)
+#define GTOOLS_SPILL_FORCE     "GTOOLS_SPILL_COMPRESS"
+
+ST_double gf_wall_time (void);
 ST_double gf_benchmark (char *fname);
+char * gf_io_cache_path (char *fname);
+GT_bool gf_io_cache_rate (ST_double rate);
+GT_bool gf_io_cache_read (char *fname, ST_double *disk_rate, ST_double *spi_rate, ST_double *codec_rate);
+void gf_io_cache_write (char *fname, ST_double disk_rate, ST_double spi_rate, ST_double codec_rate);
+ST_double gf_spill_benchmark (void);
+GT_bool gf_spill_compress (char *fname);
 ST_double gf_query_free_space (char *fname);
 void gf_split_path_file(char** p, char** f, char *pf);
 
-void gf_write_collapsed(
+ST_retcode gf_write_collapsed(
+    char *collapsed_file,
+    ST_double *collapsed_data,
+    GT_size kstart,
+    GT_size kend,
+    GT_size J
+);
+
+ST_double * gf_map_collapsed(
+    char *collapsed_file,
+    GT_size knum,
+    GT_size J
+);
+
+void gf_unmap_collapsed(
+    ST_double *collapsed_data,
+    GT_size knum,
+    GT_size J
+);
+
+ST_retcode gf_write_collapsed_spill(
     char *collapsed_file,
     ST_double *collapsed_data,
     GT_size kstart,
@@ -13,7 +54,7 @@ void gf_write_collapsed(
     GT_size J
 );
 
-void gf_read_collapsed(
+ST_retcode gf_read_collapsed_spill(
     char *collapsed_file,
     ST_double *collapsed_data,
     GT_size knum,
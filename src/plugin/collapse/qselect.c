@@ -198,3 +198,187 @@ void gf_qselect_xtile_partition(
     *less_size    = greater_idx;
     *greater_size = less_idx;
 }
+
+/*********************************************************************
+ *                        Weighted selection                         *
+ *********************************************************************/
+
+// Find the weighted quantile by partitioning around a pivot and keeping
+// track of the partial sum of the weights to the left of the partition,
+// rather than sorting the entire (x, w) array. Expected time is linear.
+
+#define GTOOLS_QSELECT_W_SMALL 16
+
+GT_size gf_qselect_weighted (
+    ST_double *x,
+    GT_size   start,
+    GT_size   end,
+    GT_size   kx,
+    ST_double qdbl,
+    ST_double cumnorm,
+    ST_double *cumsum,
+    ST_double *prev
+);
+
+void gf_qselect_weighted_swap (ST_double *a, ST_double *b, GT_size kx);
+void gf_qselect_weighted_isort (ST_double *x, GT_size start, GT_size end, GT_size kx);
+void gf_qselect_weighted_partition (
+    ST_double *x,
+    GT_size   start,
+    GT_size   end,
+    GT_size   kx,
+    GT_size   *less_size,
+    GT_size   *equal_size
+);
+
+/**
+ * @brief Weighted selection on (x, w, ...) rows
+ *
+ * Each row has kx entries: The value, its weight, and anything else
+ * that should travel with it. With the rows sorted by value, the
+ * target is the first row i >= start with
+ *
+ *     cumsum + (w_start + ... + w_i) * cumnorm - qdbl >= GTOOLS_WQUANTILES_TOL
+ *
+ * or the last row if there is no such row. This is the same position
+ * the cumulative-weight scan of the weighted quantile functions stops
+ * at, but we only partially order the rows. On exit, rows before the
+ * target are <= the target and rows after the target are >= the target,
+ * so successive (increasing) quantiles can start at the last target.
+ *
+ * @param x Rows to select from
+ * @param start First row to consider; all rows before are <= rows after
+ * @param end Number of rows
+ * @param kx Entries per row
+ * @param qdbl Quantile in units of cumulative (normalized) weight
+ * @param cumnorm Weight normalization
+ * @param cumsum In: Sum of normalized weights before @start; out: before target
+ * @param prev In: Largest value before @start; out: largest value before target
+ * @return Row of the target
+ */
+GT_size gf_qselect_weighted (
+    ST_double *x,
+    GT_size   start,
+    GT_size   end,
+    GT_size   kx,
+    ST_double qdbl,
+    ST_double cumnorm,
+    ST_double *cumsum,
+    ST_double *prev)
+{
+    GT_size i, lo, hi, less_size, equal_size;
+    ST_double base, pv, wl, we, lmax, s;
+
+    lo   = start;
+    hi   = end;
+    base = *cumsum;
+    pv   = *prev;
+
+    while ( (hi - lo) > GTOOLS_QSELECT_W_SMALL ) {
+        gf_qselect_weighted_partition (x, lo, hi, kx, &less_size, &equal_size);
+
+        wl   = 0;
+        lmax = x[kx * lo];
+        for (i = lo; i < lo + less_size; i++) {
+            wl += x[kx * i + 1] * cumnorm;
+            if ( x[kx * i] > lmax ) lmax = x[kx * i];
+        }
+
+        if ( (base + wl - qdbl) >= GTOOLS_WQUANTILES_TOL ) {
+            // target lies in the less-than-pivot partition
+            hi = lo + less_size;
+            continue;
+        }
+
+        we = 0;
+        for (i = lo + less_size; i < lo + less_size + equal_size; i++) {
+            we += x[kx * i + 1] * cumnorm;
+        }
+
+        if ( ((base + wl + we - qdbl) >= GTOOLS_WQUANTILES_TOL)
+                || (lo + less_size + equal_size == hi) ) {
+            // target lies in the equals-to-pivot partition
+            if ( less_size ) pv = lmax;
+            base += wl;
+            lo   += less_size;
+            hi    = lo + equal_size;
+            break;
+        }
+
+        // target lies in the greater-than-pivot partition
+        pv    = x[kx * (lo + less_size)];
+        base += wl + we;
+        lo   += less_size + equal_size;
+    }
+
+    gf_qselect_weighted_isort (x, lo, hi, kx);
+    for (i = lo; i < hi - 1; i++) {
+        s = base + x[kx * i + 1] * cumnorm;
+        if ( (s - qdbl) >= GTOOLS_WQUANTILES_TOL ) break;
+        base = s;
+        pv   = x[kx * i];
+    }
+
+    *cumsum = base;
+    *prev   = pv;
+    return (i);
+}
+
+void gf_qselect_weighted_swap (ST_double *a, ST_double *b, GT_size kx)
+{
+    GT_size k;
+    for (k = 0; k < kx; k++) {
+        SWAP(a[k], b[k]);
+    }
+}
+
+void gf_qselect_weighted_isort (ST_double *x, GT_size start, GT_size end, GT_size kx)
+{
+    GT_size i, j;
+    for (i = start + 1; i < end; i++) {
+        for (j = i; (j > start) && (x[kx * (j - 1)] > x[kx * j]); j--) {
+            gf_qselect_weighted_swap (x + kx * (j - 1), x + kx * j, kx);
+        }
+    }
+}
+
+void gf_qselect_weighted_partition (
+    ST_double *x,
+    GT_size   start,
+    GT_size   end,
+    GT_size   kx,
+    GT_size   *less_size,
+    GT_size   *equal_size)
+{
+    // Median-of-three pivot; the rows are split as < pivot, == pivot,
+    // and > pivot, in that order.
+    GT_size nj   = end - start;
+    ST_double a  = x[kx * start];
+    ST_double b  = x[kx * (start + nj / 2)];
+    ST_double c  = x[kx * (end - 1)];
+    ST_double pivot_value = (a < b)? ((b < c)? b: ((a < c)? c: a)):
+                                     ((a < c)? a: ((b < c)? c: b));
+
+    ST_double elem_value;
+    GT_size lt = start;
+    GT_size gt = end;
+    GT_size i  = start;
+    while ( i < gt ) {
+        elem_value = x[kx * i];
+        if ( elem_value < pivot_value ) {
+            gf_qselect_weighted_swap (x + kx * lt, x + kx * i, kx);
+            lt++;
+            i++;
+        }
+        else if ( elem_value > pivot_value ) {
+            gt--;
+            gf_qselect_weighted_swap (x + kx * i, x + kx * gt, kx);
+        }
+        else {
+            i++;
+        }
+    }
+
+    *less_size  = lt - start;
+    *equal_size = gt - lt;
+}
@@ -0,0 +1,334 @@
+#include "gtools_spill.h"
+
+/**
+ * @brief Byte-shuffle @n elements of @width bytes
+ *
+ * Byte b of element i goes to dst[b * n + i], so the sign and exponent
+ * bytes of a column of doubles (or the trailing padding of a column of
+ * strings) end up next to each other, which is what makes them
+ * compressible.
+ *
+ * @param dst output, n * width bytes
+ * @param src input, n * width bytes
+ * @param n number of elements
+ * @param width bytes per element
+ * @return @src shuffled into @dst
+ */
+void gf_shuffle (char *dst, char *src, GT_size n, GT_size width)
+{
+    GT_size i, b;
+    for (i = 0; i < n; i++, src += width) {
+        for (b = 0; b < width; b++)
+            dst[b * n + i] = src[b];
+    }
+}
+
+/**
+ * @brief Undo gf_shuffle
+ *
+ * @param dst output, n * width bytes
+ * @param src shuffled input, n * width bytes
+ * @param n number of elements
+ * @param width bytes per element
+ * @return @src unshuffled into @dst
+ */
+void gf_unshuffle (char *dst, char *src, GT_size n, GT_size width)
+{
+    GT_size i, b;
+    for (i = 0; i < n; i++, dst += width) {
+        for (b = 0; b < width; b++)
+            dst[b] = src[b * n + i];
+    }
+}
+
+/**
+ * @brief Largest output of gf_lz_compress for @n bytes of input
+ */
+GT_size gf_lz_bound (GT_size n)
+{
+    return (n + n / 255 + 16);
+}
+
+/**
+ * @brief Write one sequence: literals and then a match
+ *
+ * The token has the number of literals in the high 4 bits and the match
+ * length (less GTOOLS_LZ_MINMATCH) in the low 4 bits; either continues
+ * in extra bytes of 255 plus a final byte < 255 if it is 15 or more. The
+ * literals follow, then the 2-byte match offset. The last sequence of a
+ * block has no match (@offset 0).
+ *
+ * @return bytes written to @dst
+ */
+GT_size gf_lz_emit (unsigned char *dst, unsigned char *lits, GT_size lit, GT_size offset, GT_size len)
+{
+    GT_size r;
+    GT_size mlen = offset? len - GTOOLS_LZ_MINMATCH: 0;
+    unsigned char *op = dst + 1;
+
+    *dst = (unsigned char) ((GTOOLS_PWMIN(lit, 15) << 4) | GTOOLS_PWMIN(mlen, 15));
+    if ( lit >= 15 ) {
+        for (r = lit - 15; r >= 255; r -= 255) *op++ = 255;
+        *op++ = (unsigned char) r;
+    }
+
+    memcpy(op, lits, lit);
+    op += lit;
+
+    if ( offset ) {
+        *op++ = (unsigned char) (offset & 255);
+        *op++ = (unsigned char) (offset >> 8);
+        if ( mlen >= 15 ) {
+            for (r = mlen - 15; r >= 255; r -= 255) *op++ = 255;
+            *op++ = (unsigned char) r;
+        }
+    }
+
+    return (op - dst);
+}
+
+/**
+ * @brief Compress @n bytes with a greedy LZ77 (LZ4-style) codec
+ *
+ * Matches of at least 4 bytes within the previous 64KiB are found via a
+ * hash table of the last position of each 4-byte sequence. Runs without
+ * a match are skipped over progressively faster, so data that does not
+ * compress costs little.
+ *
+ * @param dst output, at least gf_lz_bound(n) bytes
+ * @param src input
+ * @param n bytes of input
+ * @return bytes written to @dst; @n if the data would not get smaller
+ */
+GT_size gf_lz_compress (unsigned char *dst, unsigned char *src, GT_size n)
+{
+    GT_size ip, op, ref, cand, lit, len, h;
+    uint32_t seq, seqref;
+    GT_size *table;
+
+    if ( n < 16 ) return (n);
+    if ( (table = calloc(1 << GTOOLS_LZ_HASHLOG, sizeof *table)) == NULL ) return (n);
+
+    GT_size anchor = 0;
+    GT_size limit  = n - 8;
+    ip = op = 0;
+    while ( ip < limit ) {
+        memcpy(&seq, src + ip, sizeof seq);
+        h    = (seq * 2654435761U) >> (32 - GTOOLS_LZ_HASHLOG);
+        cand = table[h];
+        table[h] = ip + 1;
+
+        if ( cand == 0 || (ip + 1 - cand) > GTOOLS_LZ_MAXOFFSET ) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        ref = cand - 1;
+        memcpy(&seqref, src + ref, sizeof seqref);
+        if ( seqref != seq ) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        len = GTOOLS_LZ_MINMATCH;
+        while ( (ip + len < n) && (src[ref + len] == src[ip + len]) ) len++;
+
+        lit = ip - anchor;
+        if ( op + lit + lit / 255 + len / 255 + 6 >= n ) {
+            free (table);
+            return (n);
+        }
+
+        op += gf_lz_emit(dst + op, src + anchor, lit, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+
+    lit = n - anchor;
+    free (table);
+    if ( op + lit + lit / 255 + 2 >= n ) return (n);
+    op += gf_lz_emit(dst + op, src + anchor, lit, 0, 0);
+
+    return (op);
+}
+
+/**
+ * @brief Decompress the output of gf_lz_compress
+ *
+ * @param dst output, @n bytes
+ * @param n bytes of output expected
+ * @param src compressed input
+ * @param p bytes of input
+ * @return 0 on success; 692 if @src is corrupt or does not decompress
+ *         to exactly @n bytes
+ */
+ST_retcode gf_lz_decompress (unsigned char *dst, GT_size n, unsigned char *src, GT_size p)
+{
+    GT_size ip, op, lit, len, offset, b;
+    unsigned char token;
+
+    ip = op = 0;
+    while ( ip < p ) {
+        token = src[ip++];
+
+        lit = token >> 4;
+        if ( lit == 15 ) {
+            do {
+                if ( ip >= p ) return (692);
+                b = src[ip++];
+                lit += b;
+            } while ( b == 255 );
+        }
+
+        if ( lit > p - ip || lit > n - op ) return (692);
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+
+        if ( ip == p ) return (op == n? 0: 692);
+        if ( p - ip < 2 ) return (692);
+
+        offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if ( offset == 0 || offset > op ) return (692);
+
+        len = (token & 15) + GTOOLS_LZ_MINMATCH;
+        if ( (token & 15) == 15 ) {
+            do {
+                if ( ip >= p ) return (692);
+                b = src[ip++];
+                len += b;
+            } while ( b == 255 );
+        }
+
+        if ( len > n - op ) return (692);
+        if ( offset >= len ) {
+            memcpy(dst + op, dst + op - offset, len);
+        }
+        else {
+            for (b = 0; b < len; b++)
+                dst[op + b] = dst[op - offset + b];
+        }
+        op += len;
+    }
+
+    return (692);
+}
+
+/**
+ * @brief Make sure the spill work buffer holds @bytes of data
+ *
+ * The buffer is @bytes for the shuffled data plus gf_lz_bound(@bytes)
+ * for the compressed data.
+ */
+ST_retcode gf_spill_work (GT_size bytes, char **work, GT_size *nwork)
+{
+    GT_size need = bytes + gf_lz_bound(bytes);
+    if ( need > *nwork ) {
+        free (*work);
+        *nwork = 0;
+        if ( (*work = malloc(need)) == NULL ) return (sf_oom_error("gf_spill_work", "work"));
+        *nwork = need;
+    }
+    return (0);
+}
+
+/**
+ * @brief Write one frame of a spill file
+ *
+ * @src holds @kcols columns of @n entries each, column k being
+ * @width[k] bytes wide. With @compress, each column is byte-shuffled
+ * and the whole frame compressed; it is written raw if that does not
+ * make it smaller.
+ *
+ * @param fhandle open spill file
+ * @param src frame data
+ * @param n entries per column
+ * @param kcols number of columns
+ * @param width bytes per entry of each column
+ * @param compress whether to try to compress the frame
+ * @param work work buffer, grown as needed; the caller frees it
+ * @param nwork size of @work
+ * @return 693 if the frame could not be written
+ */
+ST_retcode gf_spill_write (
+    FILE *fhandle,
+    char *src,
+    GT_size n,
+    GT_size kcols,
+    GT_size *width,
+    GT_bool compress,
+    char **work,
+    GT_size *nwork)
+{
+    ST_retcode rc;
+    GT_size k, offset, p;
+    GT_size bytes = 0;
+
+    for (k = 0; k < kcols; k++)
+        bytes += n * width[k];
+
+    p = bytes;
+    if ( compress && bytes ) {
+        if ( (rc = gf_spill_work(bytes, work, nwork)) ) return (rc);
+        for (k = offset = 0; k < kcols; offset += n * width[k], k++)
+            gf_shuffle(*work + offset, src + offset, n, width[k]);
+
+        p = gf_lz_compress((unsigned char *) *work + bytes, (unsigned char *) *work, bytes);
+    }
+
+    if ( fwrite(&p, sizeof p, 1, fhandle) != 1 ) return (693);
+    if ( p < bytes ) {
+        if ( fwrite(*work + bytes, 1, p, fhandle) != p ) return (693);
+    }
+    else {
+        if ( fwrite(src, 1, bytes, fhandle) != bytes ) return (693);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Read one frame of a spill file written by gf_spill_write
+ *
+ * @param fhandle open spill file
+ * @param dst frame data
+ * @param n entries per column
+ * @param kcols number of columns
+ * @param width bytes per entry of each column
+ * @param work work buffer, grown as needed; the caller frees it
+ * @param nwork size of @work
+ * @return 692 if the frame could not be read or is corrupt
+ */
+ST_retcode gf_spill_read (
+    FILE *fhandle,
+    char *dst,
+    GT_size n,
+    GT_size kcols,
+    GT_size *width,
+    char **work,
+    GT_size *nwork)
+{
+    ST_retcode rc;
+    GT_size k, offset, p;
+    GT_size bytes = 0;
+
+    for (k = 0; k < kcols; k++)
+        bytes += n * width[k];
+
+    if ( fread(&p, sizeof p, 1, fhandle) != 1 || p > bytes ) return (692);
+    if ( p == bytes ) {
+        return (fread(dst, 1, bytes, fhandle) == bytes? 0: 692);
+    }
+
+    if ( (rc = gf_spill_work(bytes, work, nwork)) ) return (rc);
+    if ( fread(*work + bytes, 1, p, fhandle) != p ) return (692);
+    if ( gf_lz_decompress((unsigned char *) *work, bytes, (unsigned char *) *work + bytes, p) ) {
+        return (692);
+    }
+
+    for (k = offset = 0; k < kcols; offset += n * width[k], k++)
+        gf_unshuffle(dst + offset, *work + offset, n, width[k]);
+
+    return (0);
+}
@@ -0,0 +1,45 @@
+#ifndef GTOOLS_SPILL
+#define GTOOLS_SPILL
+
+// Spill files are written in frames of at most GTOOLS_SPILL_BLOCK MiB.
+// Each frame is the number of bytes that follow, p, and then either the
+// raw data (p is the size of the data) or the data byte-shuffled and
+// compressed with gf_lz_compress (p is smaller).
+
+#define GTOOLS_SPILL_BLOCK   8
+#define GTOOLS_LZ_HASHLOG    16
+#define GTOOLS_LZ_MINMATCH   4
+#define GTOOLS_LZ_MAXOFFSET  65535
+
+void gf_shuffle   (char *dst, char *src, GT_size n, GT_size width);
+void gf_unshuffle (char *dst, char *src, GT_size n, GT_size width);
+
+GT_size gf_lz_bound (GT_size n);
+GT_size gf_lz_emit (unsigned char *dst, unsigned char *lits, GT_size lit, GT_size offset, GT_size len);
+GT_size gf_lz_compress (unsigned char *dst, unsigned char *src, GT_size n);
+ST_retcode gf_lz_decompress (unsigned char *dst, GT_size n, unsigned char *src, GT_size p);
+
+ST_retcode gf_spill_work (GT_size bytes, char **work, GT_size *nwork);
+
+ST_retcode gf_spill_write (
+    FILE *fhandle,
+    char *src,
+    GT_size n,
+    GT_size kcols,
+    GT_size *width,
+    GT_bool compress,
+    char **work,
+    GT_size *nwork
+);
+
+ST_retcode gf_spill_read (
+    FILE *fhandle,
+    char *dst,
+    GT_size n,
+    GT_size kcols,
+    GT_size *width,
+    char **work,
+    GT_size *nwork
+);
+
+#endif
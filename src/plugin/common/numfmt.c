@@ -0,0 +1,121 @@
+/*
+ * Fast formatting for numeric levels (glevelsof, gtop). The levels are
+ * printed with the user's numfmt, which is typically %.16g or %.8g. For
+ * those formats, integer levels are by far the common case and the
+ * integer digits can be written directly instead of going through
+ * sprintf. Anything the fast path cannot reproduce exactly (non-integers,
+ * integers that %g would print in scientific notation, negative zero,
+ * formats with flags or extra text) falls back to sprintf(numfmt).
+ */
+
+struct GtoolsNumFmt {
+    char    *fmt;
+    GT_bool fast;
+    GT_int  width;
+    GT_int  prec;
+    char    conv;
+};
+
+void gf_numfmt_init (struct GtoolsNumFmt *nf, char *fmt);
+GT_size gf_numfmt_print (char *buf, ST_double z, struct GtoolsNumFmt *nf);
+
+/**
+ * @brief Parse a numeric format for the integer fast path
+ *
+ * Only formats of the form %[width].(prec)(g|f) with no flags and no
+ * surrounding text are eligible; a width with a leading 0 is the zero
+ * padding flag and is not eligible either.
+ *
+ * @param nf format info to fill in
+ * @param fmt printf format (kept as the fallback)
+ * @return fills @nf; nf->fast is 0 if the format is not eligible
+ */
+void gf_numfmt_init (struct GtoolsNumFmt *nf, char *fmt)
+{
+    char *p = fmt;
+    nf->fmt   = fmt;
+    nf->fast  = 0;
+    nf->width = 0;
+    nf->prec  = 0;
+    nf->conv  = 0;
+
+    if ( *p++ != '%' ) return;
+    if ( *p == '0' ) return;
+    while ( *p >= '0' && *p <= '9' ) {
+        nf->width = 10 * nf->width + (*p++ - '0');
+        if ( nf->width > 1024 ) return;
+    }
+
+    if ( *p++ != '.' ) return;
+    if ( !(*p >= '0' && *p <= '9') ) return;
+    while ( *p >= '0' && *p <= '9' ) {
+        nf->prec = 10 * nf->prec + (*p++ - '0');
+        if ( nf->prec > 1024 ) return;
+    }
+
+    if ( *p != 'g' && *p != 'f' ) return;
+    nf->conv = *p++;
+    if ( *p != '\0' ) return;
+
+    if ( nf->conv == 'g' && nf->prec == 0 ) nf->prec = 1;
+    nf->fast = 1;
+}
+
+/**
+ * @brief Print a non-missing numeric level
+ *
+ * Integers below 1e18 in absolute value are written digit by digit; %g
+ * prints them as plain integers so long as they have at most prec
+ * digits, and %f appends prec zeros after the decimal point. Output is
+ * right-justified to the format width, same as printf.
+ *
+ * @param buf output buffer
+ * @param z value to print
+ * @param nf parsed format
+ * @return number of characters written (excluding the NUL)
+ */
+GT_size gf_numfmt_print (char *buf, ST_double z, struct GtoolsNumFmt *nf)
+{
+    char digits[24], *d;
+    GT_int nd, len, pad, i;
+    GT_bool neg;
+    uint64_t u;
+
+    if ( !nf->fast || !(z > -1e18 && z < 1e18) || z != floor(z) || (z == 0 && signbit(z)) ) {
+        return (sprintf(buf, nf->fmt, z));
+    }
+
+    neg = z < 0;
+    u   = (uint64_t) (neg? -z: z);
+    d   = digits + sizeof(digits);
+    do {
+        *--d = '0' + (u % 10);
+        u   /= 10;
+    } while ( u );
+    nd = digits + sizeof(digits) - d;
+
+    if ( nf->conv == 'g' ) {
+        if ( nd > nf->prec ) return (sprintf(buf, nf->fmt, z));
+        len = neg + nd;
+    }
+    else {
+        len = neg + nd + (nf->prec > 0? nf->prec + 1: 0);
+    }
+
+    pad = nf->width > len? nf->width - len: 0;
+    for (i = 0; i < pad; i++)
+        *buf++ = ' ';
+
+    if ( neg ) *buf++ = '-';
+    memcpy(buf, d, nd);
+    buf += nd;
+
+    if ( nf->conv == 'f' && nf->prec > 0 ) {
+        *buf++ = '.';
+        for (i = 0; i < nf->prec; i++)
+            *buf++ = '0';
+    }
+
+    *buf = '\0';
+    return (pad + len);
+}
@@ -9,6 +9,20 @@ ST_retcode gf_bijection_limits (
     int level
 );
 
+struct GtoolsIsIDSet;
+struct GtoolsIsIDSet *gf_isid_stream_init (GT_size N, GT_size rowbytes, char *base);
+void gf_isid_stream_free (struct GtoolsIsIDSet *set);
+GT_bool gf_isid_stream_add (struct GtoolsIsIDSet *set, struct StataInfo *st_info, GT_size obs);
+
+// With isid (level 2), each row is added to a hash set as soon as it is
+// read; the read stops at the first duplicate. If the set cannot be
+// allocated, isid falls back to the sort/hash check after the read.
+#define GTOOLS_ISID_STREAM(obs)                                            \
+    if ( (isidset != NULL) && gf_isid_stream_add(isidset, st_info, obs) ) { \
+        rc = 17459;                                                        \
+        goto exit;                                                         \
+    }
+
 
 ST_retcode sf_read_byvars (
     struct StataInfo *st_info,
@@ -27,6 +41,7 @@ ST_retcode sf_read_byvars (
     GT_size kstr       = st_info->kvars_by_str;
     // GT_size kstrL      = st_info->kvars_by_strL;
     GT_size *positions = st_info->positions;
+    struct GtoolsIsIDSet *isidset = NULL;
 
     // index = calloc(N, sizeof *index);
     // if ( index == NULL ) return (sf_oom_error("sf_read_byvars", "index"));
@@ -48,6 +63,10 @@ ST_retcode sf_read_byvars (
 
         st_info->free = 3;
 
+        if ( level == 2 ) {
+            isidset = gf_isid_stream_init(N, rowbytes, st_info->st_charx);
+        }
+
         // In this case, you need to clean all the chunks
         for (i = 0; i < N; i++)
             memset (st_info->st_charx + i * rowbytes, '\0', rowbytes);
@@ -110,6 +129,7 @@ ST_retcode sf_read_byvars (
                                 memcpy (st_info->st_charx + sel, &z, sizeof(ST_double));
                             }
                         }
+                        GTOOLS_ISID_STREAM(obs)
                         index[obs] = i;
                         ++obs;
 next_inner1: continue;
@@ -145,6 +165,7 @@ next_inner1: continue;
                                 memcpy (st_info->st_charx + sel, &z, sizeof(ST_double));
                             }
                         }
+                        GTOOLS_ISID_STREAM(obs)
                         index[obs] = i;
                         ++obs;
                     }
@@ -204,6 +225,7 @@ next_inner1: continue;
                             memcpy (st_info->st_charx + sel, &z, sizeof(ST_double));
                         }
                     }
+                    GTOOLS_ISID_STREAM(obs)
                     index[obs] = i;
                     ++obs;
 next_inner2: continue;
@@ -239,6 +261,7 @@ next_inner2: continue;
                         memcpy (st_info->st_charx + sel, &z, sizeof(ST_double));
                     }
                 }
+                GTOOLS_ISID_STREAM(i)
             }
         }
     }
@@ -257,6 +280,10 @@ next_inner2: continue;
 
         st_info->free = 3;
 
+        if ( level == 2 ) {
+            isidset = gf_isid_stream_init(N, kvars * sizeof(ST_double), (char *) st_info->st_numx);
+        }
+
         // Loop through all the by variables
         obs = 0;
         if ( st_info->any_if || (st_info->missing == 0) ) {
@@ -276,6 +303,7 @@ next_inner2: continue;
                                 goto next_inner3;
                             }
                         }
+                        GTOOLS_ISID_STREAM(obs)
                         index[obs] = i;
                         ++obs;
 next_inner3: continue;
@@ -290,6 +318,7 @@ next_inner3: continue;
                             if ( (rc = SF_vdata(k + 1, i + in1, st_info->st_numx + sel)) )
                                 goto exit;
                         }
+                        GTOOLS_ISID_STREAM(obs)
                         index[obs] = i;
                         ++obs;
                     }
@@ -310,6 +339,7 @@ next_inner3: continue;
                             goto next_inner4;
                         }
                     }
+                    GTOOLS_ISID_STREAM(obs)
                     index[obs] = i;
                     ++obs;
 next_inner4: continue;
@@ -325,11 +355,14 @@ next_inner4: continue;
                     if ( (rc = SF_vdata(k + 1, i + in1, st_info->st_numx + sel)) )
                         goto exit;
                 }
+                GTOOLS_ISID_STREAM(i)
             }
         }
     }
 
 exit:
+    st_info->isid_stream = (isidset != NULL);
+    gf_isid_stream_free (isidset);
     return (rc);
 }
 
@@ -287,6 +287,73 @@ void sf_format_size(GT_size n, char *out)
     *--out = 0;
 }
 
+/**
+ * @brief Write mixed string and numeric by variables in column blocks
+ *
+ * The numeric by variables are written first as a single nrows x knum
+ * block of doubles (row-major), followed by one block per string
+ * variable with nrows entries of lens[k] + 1 bytes. Each block can be
+ * read back in mata with a single fbufget call.
+ *
+ * @param st_info object with meta info
+ * @param fbyvar open file to write to
+ * @param nrows number of levels to write
+ * @param topix index of levels to write (NULL writes the first nrows)
+ * @return Saves by variables in column blocks to @fbyvar
+ */
+ST_retcode sf_byx_save_blocks (
+    struct StataInfo *st_info,
+    FILE *fbyvar,
+    GT_size nrows,
+    GT_size *topix)
+{
+    ST_retcode rc = 0;
+    GT_size j, k, l, numpos;
+    GT_size kvars    = st_info->kvars_by;
+    GT_size knum     = st_info->kvars_by_num;
+    GT_size rowbytes = (st_info->rowbytes + sizeof(GT_size));
+    GT_size maxbytes = knum * sizeof(ST_double);
+    ST_double *numbuf;
+    char *buffer, *row;
+
+    for (k = 0; k < kvars; k++) {
+        if ( st_info->byvars_lens[k] + 1 > maxbytes ) {
+            maxbytes = st_info->byvars_lens[k] + 1;
+        }
+    }
+
+    buffer = malloc(GTOOLS_PWMAX(nrows * maxbytes, 1));
+    if ( buffer == NULL ) return (sf_oom_error("sf_byx_save_blocks", "buffer"));
+    numbuf = (ST_double *) buffer;
+
+    if ( knum > 0 ) {
+        for (j = 0; j < nrows; j++) {
+            row    = st_info->st_by_charx + (topix == NULL? j: topix[j]) * rowbytes;
+            numpos = 0;
+            for (k = 0; k < kvars; k++) {
+                if ( st_info->byvars_lens[k] == 0 ) {
+                    memcpy(numbuf + j * knum + numpos, row + st_info->positions[k], sizeof(ST_double));
+                    numpos++;
+                }
+            }
+        }
+        rc = rc | (fwrite(numbuf, sizeof(ST_double), nrows * knum, fbyvar) != nrows * knum);
+    }
+
+    for (k = 0; k < kvars; k++) {
+        if ( (l = st_info->byvars_lens[k] + 1) > 1 ) {
+            for (j = 0; j < nrows; j++) {
+                row = st_info->st_by_charx + (topix == NULL? j: topix[j]) * rowbytes;
+                memcpy(buffer + j * l, row + st_info->positions[k], l);
+            }
+            rc = rc | (fwrite(buffer, sizeof(char), nrows * l, fbyvar) != nrows * l);
+        }
+    }
+
+    free (buffer);
+    return (rc);
+}
+
 /**
  * @brief Write by variables to disk
  * @param st_info object with meta info
@@ -334,8 +401,7 @@ ST_retcode sf_byx_save (struct StataInfo *st_info)
                 rc = rc | (fwrite(&z, sizeof(ST_double), 1, fbycol) != 1);
             }
 
-            total = st_info->J * rowbytes;
-            rc = rc | (fwrite(st_info->st_by_charx, sizeof *st_info->st_by_charx, total, fbyvar) != total);
+            if ( rc == 0 ) rc = sf_byx_save_blocks(st_info, fbyvar, st_info->J, NULL);
         }
         else {
             total = st_info->J * (kvars + 1);
@@ -438,14 +504,11 @@ ST_retcode sf_byx_save_top (struct StataInfo *st_info, GT_size ntop, GT_size *to
             //     }
             // }
 
-            total = st_info->J * rowbytes;
             if ( ntop > 0 ) {
-                for (j = 0; j < ntop; j++) {
-                    rc = rc | (fwrite(st_info->st_by_charx + topix[j] * rowbytes, sizeof *st_info->st_by_charx, rowbytes, fbyvar) != rowbytes);
-                }
+                if ( rc == 0 ) rc = sf_byx_save_blocks(st_info, fbyvar, ntop, topix);
             }
             else {
-                rc = rc | (fwrite(st_info->st_by_charx, sizeof *st_info->st_by_charx, total, fbyvar) != total);
+                if ( rc == 0 ) rc = sf_byx_save_blocks(st_info, fbyvar, st_info->J, NULL);
             }
         }
         else {
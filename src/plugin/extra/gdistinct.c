@@ -0,0 +1,339 @@
+/*
+ * Distinct counts for each variable in one pass over the data. Every
+ * variable gets its own open-addressing hash table (linear probing)
+ * that stores each level once along with its frequency; tables start
+ * small and double whenever the load factor would exceed 3/4. Numeric
+ * values are compared directly and strings are stored in a per-table
+ * arena and compared byte by byte, so there are no collisions to check.
+ */
+
+#define GTOOLS_DISTINCT_MINSIZE 16
+
+struct GtoolsDistinctTable {
+    GT_bool   isstr;
+    GT_size   size;
+    GT_size   used;
+    GT_size   nobs;
+    GT_size   *counts;
+    ST_double *keys;
+    uint64_t  *hashes;
+    GT_size   *offsets;
+    GT_size   *lens;
+    char      *arena;
+    GT_size   arena_used;
+    GT_size   arena_size;
+};
+
+ST_retcode sf_distinct (struct StataInfo *st_info, int level);
+
+ST_retcode gf_distinct_init (struct GtoolsDistinctTable *table, GT_bool isstr);
+void gf_distinct_free (struct GtoolsDistinctTable *table);
+ST_retcode gf_distinct_grow (struct GtoolsDistinctTable *table);
+
+ST_retcode gf_distinct_add_num (struct GtoolsDistinctTable *table, ST_double z);
+ST_retcode gf_distinct_add_str (
+    struct GtoolsDistinctTable *table,
+    char *s,
+    GT_size len
+);
+
+/**
+ * @brief Allocate an empty table for a numeric or string variable
+ */
+ST_retcode gf_distinct_init (struct GtoolsDistinctTable *table, GT_bool isstr)
+{
+    table->isstr      = isstr;
+    table->size       = GTOOLS_DISTINCT_MINSIZE;
+    table->used       = 0;
+    table->nobs       = 0;
+    table->arena_used = 0;
+    table->arena_size = isstr? 1024: 1;
+
+    table->counts  = calloc(table->size, sizeof *table->counts);
+    table->keys    = calloc(isstr? 1: table->size, sizeof *table->keys);
+    table->hashes  = calloc(isstr? table->size: 1, sizeof *table->hashes);
+    table->offsets = calloc(isstr? table->size: 1, sizeof *table->offsets);
+    table->lens    = calloc(isstr? table->size: 1, sizeof *table->lens);
+    table->arena   = calloc(table->arena_size, sizeof *table->arena);
+
+    if ( table->counts  == NULL ) return(sf_oom_error("gf_distinct_init", "table->counts"));
+    if ( table->keys    == NULL ) return(sf_oom_error("gf_distinct_init", "table->keys"));
+    if ( table->hashes  == NULL ) return(sf_oom_error("gf_distinct_init", "table->hashes"));
+    if ( table->offsets == NULL ) return(sf_oom_error("gf_distinct_init", "table->offsets"));
+    if ( table->lens    == NULL ) return(sf_oom_error("gf_distinct_init", "table->lens"));
+    if ( table->arena   == NULL ) return(sf_oom_error("gf_distinct_init", "table->arena"));
+
+    return (0);
+}
+
+void gf_distinct_free (struct GtoolsDistinctTable *table)
+{
+    free (table->counts);
+    free (table->keys);
+    free (table->hashes);
+    free (table->offsets);
+    free (table->lens);
+    free (table->arena);
+}
+
+/**
+ * @brief Double the number of slots and re-insert every level
+ */
+ST_retcode gf_distinct_grow (struct GtoolsDistinctTable *table)
+{
+    GT_size i, l, mask;
+    GT_size size = table->size << 1;
+    mask = size - 1;
+
+    GT_size   *counts  = calloc(size, sizeof *counts);
+    ST_double *keys    = calloc(table->isstr? 1: size, sizeof *keys);
+    uint64_t  *hashes  = calloc(table->isstr? size: 1, sizeof *hashes);
+    GT_size   *offsets = calloc(table->isstr? size: 1, sizeof *offsets);
+    GT_size   *lens    = calloc(table->isstr? size: 1, sizeof *lens);
+
+    if ( counts  == NULL ) return(sf_oom_error("gf_distinct_grow", "counts"));
+    if ( keys    == NULL ) return(sf_oom_error("gf_distinct_grow", "keys"));
+    if ( hashes  == NULL ) return(sf_oom_error("gf_distinct_grow", "hashes"));
+    if ( offsets == NULL ) return(sf_oom_error("gf_distinct_grow", "offsets"));
+    if ( lens    == NULL ) return(sf_oom_error("gf_distinct_grow", "lens"));
+
+    for (i = 0; i < table->size; i++) {
+        if ( table->counts[i] == 0 ) continue;
+        if ( table->isstr ) {
+            l = table->hashes[i] & mask;
+            while ( counts[l] ) l = (l + 1) & mask;
+            hashes[l]  = table->hashes[i];
+            offsets[l] = table->offsets[i];
+            lens[l]    = table->lens[i];
+        }
+        else {
+            l = gf_nuniq_hash(table->keys[i]) & mask;
+            while ( counts[l] ) l = (l + 1) & mask;
+            keys[l] = table->keys[i];
+        }
+        counts[l] = table->counts[i];
+    }
+
+    free (table->counts);
+    free (table->keys);
+    free (table->hashes);
+    free (table->offsets);
+    free (table->lens);
+
+    table->size    = size;
+    table->counts  = counts;
+    table->keys    = keys;
+    table->hashes  = hashes;
+    table->offsets = offsets;
+    table->lens    = lens;
+
+    return (0);
+}
+
+/**
+ * @brief Count one numeric value (-0 and 0 are the same level)
+ */
+ST_retcode gf_distinct_add_num (struct GtoolsDistinctTable *table, ST_double z)
+{
+    ST_retcode rc = 0;
+    GT_size l, mask = table->size - 1;
+
+    table->nobs++;
+    l = gf_nuniq_hash(z) & mask;
+    while ( table->counts[l] ) {
+        if ( table->keys[l] == z ) {
+            table->counts[l]++;
+            return (0);
+        }
+        l = (l + 1) & mask;
+    }
+
+    table->keys[l]   = z;
+    table->counts[l] = 1;
+    if ( 4 * (++table->used) > 3 * table->size ) {
+        rc = gf_distinct_grow(table);
+    }
+
+    return (rc);
+}
+
+/**
+ * @brief Count one string of length len; new levels are copied to the arena
+ */
+ST_retcode gf_distinct_add_str (
+    struct GtoolsDistinctTable *table,
+    char *s,
+    GT_size len)
+{
+    ST_retcode rc = 0;
+    uint64_t h1 = 0, h2 = 0;
+    GT_size l, mask = table->size - 1;
+
+    table->nobs++;
+    spookyhash_128(s, len, &h1, &h2);
+    l = h1 & mask;
+    while ( table->counts[l] ) {
+        if ( (table->hashes[l] == h1)
+             && (table->lens[l] == len)
+             && (memcmp(table->arena + table->offsets[l], s, len) == 0) ) {
+            table->counts[l]++;
+            return (0);
+        }
+        l = (l + 1) & mask;
+    }
+
+    if ( table->arena_used + len > table->arena_size ) {
+        while ( table->arena_used + len > table->arena_size ) {
+            table->arena_size <<= 1;
+        }
+        char *arena = realloc(table->arena, table->arena_size * sizeof *arena);
+        if ( arena == NULL ) return(sf_oom_error("gf_distinct_add_str", "table->arena"));
+        table->arena = arena;
+    }
+
+    memcpy(table->arena + table->arena_used, s, len);
+    table->hashes[l]   = h1;
+    table->offsets[l]  = table->arena_used;
+    table->lens[l]     = len;
+    table->counts[l]   = 1;
+    table->arena_used += len;
+
+    if ( 4 * (++table->used) > 3 * table->size ) {
+        rc = gf_distinct_grow(table);
+    }
+
+    return (rc);
+}
+
+/**
+ * @brief Number of distinct levels of each by variable, separately
+ *
+ * Reads every by variable in a single pass over the data and stores,
+ * for the kth variable, the number of observations, the number of
+ * distinct levels, and the smallest and largest level frequencies in
+ * row k of __gtools_distinct. Unless st_info->missing, missing values
+ * are skipped for each variable independently of the others.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param level (Ignored)
+ * @return Stores distinct counts in Stata matrix __gtools_distinct
+ */
+ST_retcode sf_distinct (struct StataInfo *st_info, int level)
+{
+    ST_retcode rc = 0;
+    ST_double z;
+    GT_int  bytes;
+    GT_size i, j, k, l, len, nj_min, nj_max, strmax;
+    GT_size kvars = st_info->kvars_by;
+    GT_size in1   = st_info->in1;
+    GT_size N     = st_info->N;
+    clock_t timer = clock();
+    char *strbuf;
+
+    struct GtoolsDistinctTable *tables = calloc(kvars, sizeof *tables);
+    if ( tables == NULL ) return(sf_oom_error("sf_distinct", "tables"));
+
+    strmax = 1;
+    for (k = 0; k < kvars; k++) {
+        if ( st_info->byvars_lens[k] > 0 && !st_info->byvars_strL[k] ) {
+            strmax = GTOOLS_PWMAX(strmax, (GT_size) st_info->byvars_lens[k] + 1);
+        }
+    }
+
+    strbuf = calloc(strmax, sizeof *strbuf);
+    if ( strbuf == NULL ) {
+        free (tables);
+        return(sf_oom_error("sf_distinct", "strbuf"));
+    }
+
+    for (k = 0; k < kvars; k++) {
+        if ( (rc = gf_distinct_init(tables + k, st_info->byvars_lens[k] > 0)) ) {
+            for (j = 0; j < k; j++)
+                gf_distinct_free(tables + j);
+            free (tables);
+            free (strbuf);
+            return (rc);
+        }
+    }
+
+    for (i = 0; i < N; i++) {
+        if ( st_info->any_if && !SF_ifobs(i + in1) ) continue;
+        for (k = 0; k < kvars; k++) {
+            if ( st_info->byvars_strL[k] ) {
+                bytes = SF_sdatalen(k + 1, i + in1);
+                if ( bytes < 0 ) {
+                    rc = -1;
+                    goto exit;
+                }
+                len = (GT_size) bytes;
+                if ( len + 1 > strmax ) {
+                    strmax = len + 1;
+                    free (strbuf);
+                    strbuf = calloc(strmax, sizeof *strbuf);
+                    if ( strbuf == NULL ) {
+                        rc = sf_oom_error("sf_distinct", "strbuf");
+                        goto exit;
+                    }
+                }
+                if ( len > 0 ) {
+                    if ( SF_strldata (k + 1, i + in1, strbuf, len + 1) == -1 ) {
+                        rc = -1;
+                        goto exit;
+                    }
+                }
+            }
+            else if ( st_info->byvars_lens[k] > 0 ) {
+                if ( (rc = SF_sdata(k + 1, i + in1, strbuf)) ) goto exit;
+                len = strlen(strbuf);
+            }
+            else {
+                if ( (rc = SF_vdata(k + 1, i + in1, &z)) ) goto exit;
+                if ( !st_info->missing && SF_is_missing(z) ) continue;
+                if ( (rc = gf_distinct_add_num(tables + k, z)) ) goto exit;
+                continue;
+            }
+
+            if ( !st_info->missing && (len == 0) ) continue;
+            if ( (rc = gf_distinct_add_str(tables + k, strbuf, len)) ) goto exit;
+        }
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 1: Counted levels of each variable");
+
+    for (k = 0; k < kvars; k++) {
+        nj_min = nj_max = 0;
+        for (l = 0; l < tables[k].size; l++) {
+            if ( tables[k].counts[l] == 0 ) continue;
+            if ( nj_max == 0 ) {
+                nj_min = nj_max = tables[k].counts[l];
+            }
+            else {
+                nj_min = GTOOLS_PWMIN(nj_min, tables[k].counts[l]);
+                nj_max = GTOOLS_PWMAX(nj_max, tables[k].counts[l]);
+            }
+        }
+
+        if ( (rc = SF_mat_store("__gtools_distinct", k + 1, 1, (ST_double) tables[k].nobs)) ) goto exit;
+        if ( (rc = SF_mat_store("__gtools_distinct", k + 1, 2, (ST_double) tables[k].used)) ) goto exit;
+        if ( (rc = SF_mat_store("__gtools_distinct", k + 1, 3, (ST_double) nj_min))         ) goto exit;
+        if ( (rc = SF_mat_store("__gtools_distinct", k + 1, 4, (ST_double) nj_max))         ) goto exit;
+
+        if ( st_info->debug ) {
+            sf_printf_debug("\tvar "GT_size_cfmt": N = "GT_size_cfmt", J = "GT_size_cfmt"\n",
+                            k + 1, tables[k].nobs, tables[k].used);
+        }
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 2: Saved distinct counts");
+
+exit:
+    for (k = 0; k < kvars; k++)
+        gf_distinct_free(tables + k);
+
+    free (tables);
+    free (strbuf);
+
+    return (rc);
+}
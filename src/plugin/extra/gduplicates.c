@@ -0,0 +1,103 @@
+ST_retcode sf_duplicates (struct StataInfo *st_info, int level);
+
+/**
+ * @brief duplicates tag, drop, and report from the group info
+ *
+ * After sf_hash_byvars, the observations of group j are index[info[j]]
+ * through index[info[j + 1] - 1]. The target variables come right after
+ * the by variables:
+ *
+ *     level 1 (tag):    # of surplus copies for each obs (nj - 1)
+ *     level 2 (drop):   keep flag; set to 0 for every obs but the
+ *                       first of its group (the caller initializes it
+ *                       to 1, so only dropped obs are written)
+ *     level 3 (report): copies, observations, and surplus, one row per
+ *                       distinct group size, in obs 1 through # sizes
+ *
+ * Tag and drop are written in one sequential pass over the data.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param level 1 for tag, 2 for drop, 3 for report
+ * @return Writes results to the target variables
+ */
+ST_retcode sf_duplicates (struct StataInfo *st_info, int level)
+{
+    ST_retcode rc = 0;
+    GT_size i, j, start, end, first, nj, nrows;
+    GT_size J       = st_info->J;
+    GT_size Nread   = st_info->Nread;
+    GT_size in1     = st_info->in1;
+    GT_size *info   = st_info->info;
+    GT_size *index  = st_info->index;
+    GT_size tpos    = st_info->kvars_by + st_info->kvars_group + st_info->kvars_sources + 1;
+    GT_size *copies = NULL;
+    GT_bool *drop   = NULL;
+    clock_t timer   = clock();
+
+    if ( level == 1 ) {
+        copies = calloc(Nread, sizeof *copies);
+        if ( copies == NULL ) return (sf_oom_error("sf_duplicates", "copies"));
+
+        for (j = 0; j < J; j++) {
+            nj = info[j + 1] - info[j];
+            for (i = info[j]; i < info[j + 1]; i++)
+                copies[index[i]] = nj;
+        }
+
+        for (i = 0; i < Nread; i++) {
+            if ( copies[i] ) {
+                if ( (rc = SF_vstore(tpos, i + in1, (ST_double) (copies[i] - 1))) ) goto exit;
+            }
+        }
+    }
+    else if ( level == 2 ) {
+        drop = calloc(Nread, sizeof *drop);
+        if ( drop == NULL ) return (sf_oom_error("sf_duplicates", "drop"));
+
+        for (j = 0; j < J; j++) {
+            start = info[j];
+            end   = info[j + 1];
+            first = index[start];
+            for (i = start + 1; i < end; i++) {
+                if ( index[i] < first ) {
+                    drop[first] = 1;
+                    first = index[i];
+                }
+                else {
+                    drop[index[i]] = 1;
+                }
+            }
+        }
+
+        for (i = 0; i < Nread; i++) {
+            if ( drop[i] ) {
+                if ( (rc = SF_vstore(tpos, i + in1, 0)) ) goto exit;
+            }
+        }
+    }
+    else if ( level == 3 ) {
+        copies = calloc(st_info->nj_max + 1, sizeof *copies);
+        if ( copies == NULL ) return (sf_oom_error("sf_duplicates", "copies"));
+
+        for (j = 0; j < J; j++)
+            copies[info[j + 1] - info[j]]++;
+
+        nrows = 0;
+        for (nj = 1; nj <= st_info->nj_max; nj++) {
+            if ( copies[nj] ) {
+                if ( (rc = SF_vstore(tpos + 0, nrows + in1, (ST_double) nj)) ) goto exit;
+                if ( (rc = SF_vstore(tpos + 1, nrows + in1, (ST_double) (nj * copies[nj]))) ) goto exit;
+                if ( (rc = SF_vstore(tpos + 2, nrows + in1, (ST_double) ((nj - 1) * copies[nj]))) ) goto exit;
+                nrows++;
+            }
+        }
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 5: Wrote duplicates info");
+
+exit:
+    free (copies);
+    free (drop);
+    return (rc);
+}
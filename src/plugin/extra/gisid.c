@@ -1,3 +1,19 @@
+struct GtoolsIsIDSet {
+    GT_size   rowbytes;
+    GT_size   tsize;
+    GT_size   *slots;
+    uint64_t  *hashes;
+    char      *base;
+};
+
+struct GtoolsIsIDSet *gf_isid_stream_init (GT_size N, GT_size rowbytes, char *base);
+void gf_isid_stream_free (struct GtoolsIsIDSet *set);
+GT_bool gf_isid_stream_add (
+    struct GtoolsIsIDSet *set,
+    struct StataInfo *st_info,
+    GT_size obs
+);
+
 ST_retcode gf_isid (
     uint64_t *h1,
     uint64_t *h2,
@@ -17,6 +33,99 @@ ST_retcode gf_check_isid_collision (
     GT_size obs2
 );
 
+/**
+ * @brief Allocate a hash set to check for duplicate rows as they are read
+ *
+ * Rows are stored by the caller in @base (rowbytes bytes each); the
+ * set only keeps the row index and its 64-bit hash, and rows with
+ * equal hashes are compared byte by byte. Rows are zero-padded as they
+ * are read, so equal levels have equal bytes.
+ *
+ * @param N maximum number of rows that will be added
+ * @param rowbytes bytes per row in @base
+ * @param base array with the rows that are read in
+ * @return set with room for @N rows at load factor <= 0.5 (NULL if OOM)
+ */
+struct GtoolsIsIDSet *gf_isid_stream_init (GT_size N, GT_size rowbytes, char *base)
+{
+    struct GtoolsIsIDSet *set = malloc(sizeof *set);
+    if ( set == NULL ) return (NULL);
+
+    set->rowbytes = rowbytes;
+    set->base     = base;
+    set->tsize    = 16;
+    while ( set->tsize < 2 * N ) set->tsize <<= 1;
+
+    set->slots  = calloc(set->tsize, sizeof *set->slots);
+    set->hashes = calloc(set->tsize, sizeof *set->hashes);
+    if ( (set->slots == NULL) || (set->hashes == NULL) ) {
+        gf_isid_stream_free(set);
+        return (NULL);
+    }
+
+    return (set);
+}
+
+void gf_isid_stream_free (struct GtoolsIsIDSet *set)
+{
+    if ( set == NULL ) return;
+    free (set->slots);
+    free (set->hashes);
+    free (set);
+}
+
+/**
+ * @brief Add a row to the set; report whether it was already there
+ *
+ * Numeric entries equal to 0 are normalized to +0 first so that 0 and
+ * -0 are treated as the same level, as they are when sorting.
+ *
+ * @param set hash set from gf_isid_stream_init
+ * @param st_info object with meta info (by variable types and positions)
+ * @param obs row index into set->base
+ * @return 1 if an identical row was added before, 0 otherwise
+ */
+GT_bool gf_isid_stream_add (
+    struct GtoolsIsIDSet *set,
+    struct StataInfo *st_info,
+    GT_size obs)
+{
+    GT_size k, pos, j;
+    uint64_t h1, h2;
+    ST_double z;
+    GT_size kvars = st_info->kvars_by;
+    GT_size mask  = set->tsize - 1;
+    char *row     = set->base + obs * set->rowbytes;
+    char *sel;
+
+    for (k = 0; k < kvars; k++) {
+        if ( st_info->byvars_lens[k] == 0 ) {
+            sel = row + (st_info->kvars_by_str > 0? st_info->positions[k]: k * sizeof(ST_double));
+            memcpy(&z, sel, sizeof(ST_double));
+            if ( z == 0 ) {
+                z = 0;
+                memcpy(sel, &z, sizeof(ST_double));
+            }
+        }
+    }
+
+    h1 = h2 = 0;
+    spookyhash_128(row, set->rowbytes, &h1, &h2);
+
+    pos = h1 & mask;
+    while ( (j = set->slots[pos]) ) {
+        if ( set->hashes[pos] == h1 ) {
+            if ( memcmp(set->base + (j - 1) * set->rowbytes, row, set->rowbytes) == 0 )
+                return (1);
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    set->slots[pos]  = obs + 1;
+    set->hashes[pos] = h1;
+    return (0);
+}
+
 ST_retcode gf_isid_bijection (uint64_t *h1, struct StataInfo *st_info)
 {
     GT_size i;
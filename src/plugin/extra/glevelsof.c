@@ -114,6 +114,9 @@ ST_retcode sf_levelsof (struct StataInfo *st_info, int level)
     if ( (rc = SF_macro_use("_sep",    sep,    (st_info->sep_len    + 1) * sizeof(char))) ) goto exit;
     if ( (rc = SF_macro_use("_numfmt", numfmt, (st_info->numfmt_len + 1) * sizeof(char))) ) goto exit;
 
+    struct GtoolsNumFmt nf;
+    gf_numfmt_init(&nf, numfmt);
+
     if ( debug ) {
         sf_printf_debug("debug 2 (sf_levelsof): Read in locals info.\n");
     }
@@ -137,7 +140,7 @@ ST_retcode sf_levelsof (struct StataInfo *st_info, int level)
                                 GTOOLS_SWITCH_MISSING
                             }
                             else {
-                                strpos += sprintf(strpos, numfmt, z);
+                                strpos += gf_numfmt_print(strpos, z, &nf);
                             }
                         }
                     }
@@ -157,7 +160,7 @@ ST_retcode sf_levelsof (struct StataInfo *st_info, int level)
                             GTOOLS_SWITCH_MISSING
                         }
                         else {
-                            strpos += sprintf(strpos, numfmt, z);
+                            strpos += gf_numfmt_print(strpos, z, &nf);
                         }
                     }
                     strpos += sprintf(strpos, "\"'");
@@ -208,7 +211,7 @@ ST_retcode sf_levelsof (struct StataInfo *st_info, int level)
                             GTOOLS_SWITCH_MISSING
                         }
                         else {
-                            strpos += sprintf(strpos, numfmt, z);
+                            strpos += gf_numfmt_print(strpos, z, &nf);
                         }
                     }
                 }
@@ -223,7 +226,7 @@ ST_retcode sf_levelsof (struct StataInfo *st_info, int level)
                         GTOOLS_SWITCH_MISSING
                     }
                     else {
-                        strpos += sprintf(strpos, numfmt, z);
+                        strpos += gf_numfmt_print(strpos, z, &nf);
                     }
                 }
             }
@@ -3,6 +3,95 @@ ST_retcode sf_reshape_wide  (struct StataInfo *st_info, int level, char *fname);
 ST_retcode sf_reshape_long  (struct StataInfo *st_info, int level, char *fname);
 ST_retcode sf_reshape_read  (struct StataInfo *st_info, int level, char *fname);
 GT_size sf_reshape_bytes(struct StataInfo *st_info, GT_size *outpos, GT_size *outtyp);
+ST_retcode sf_reshape_save (struct StataInfo *st_info, void *out, GT_size outbytes, GT_size nrows, char *fname);
+ST_retcode sf_reshape_save_chunk (struct StataInfo *st_info, FILE *fhandle, void *out, GT_size outbytes, GT_size nrows, GT_bool zspill);
+GT_size sf_reshape_chunk (struct StataInfo *st_info, GT_size N, GT_size bytes);
+void *sf_reshape_kept (GT_size bytes);
+
+// Sparse map of the reshape long output: for each level j, the stubs that
+// have a source variable at that level, plus a template output row for
+// the level (j, then missing for every stub). Each wide observation is
+// first read into a source row (the xi variables in output layout, then
+// every source variable present in the map, in map order); its long rows
+// are the template, the by variables, the stubs present at j, and the xi
+// variables, all copied from memory. Absent stubs cost nothing per row,
+// and filling the rows does not touch Stata (see greshape_threads.c).
+
+struct GtoolsReshapeMap {
+    GT_size *lvlptr;
+    GT_size *stubs;
+    GT_size *srcs;
+    GT_size *srcoff;
+    GT_size *outpos;
+    GT_size *outtyp;
+    char    *tmpl;
+    GT_size klevels;
+    GT_size outbytes;
+    GT_size srcbytes;
+    GT_size xipos;
+    GT_size xibytes;
+    GT_bool dropmiss;
+};
+
+ST_retcode sf_reshape_map (
+    struct StataInfo *st_info,
+    struct GtoolsReshapeMap *map,
+    GT_size outbytes,
+    GT_size *outpos,
+    GT_size *outtyp,
+    char *jstr,
+    GT_size jbytes
+);
+
+void sf_reshape_map_free (struct GtoolsReshapeMap *map);
+ST_retcode sf_reshape_long_read (struct StataInfo *st_info, struct GtoolsReshapeMap *map, GT_size obs, char *src);
+
+void sf_reshape_long_rows (
+    struct GtoolsReshapeMap *map,
+    char *src,
+    char *byrow,
+    char *out,
+    GT_size *nout
+);
+
+// With greshape, inmemory the output of the write step is kept here for
+// the read step instead of going through fname. The plugin stays loaded
+// between the two calls, so the buffer survives; it is handed over (and
+// then freed) by the read step, or freed by the next write.
+
+static void    *GtoolsReshapeBuffer = NULL;
+static GT_size  GtoolsReshapeBytes  = 0;
+
+// The reshaped data is written to disk column-major, in blocks of at most
+// GTOOLS_RESHAPE_BLOCK MiB (or maxmem, if smaller). Each block is the
+// number of rows, n, followed by a spill frame (see gtools_spill.h) with n
+// entries of the first output variable, n of the second, and so on, so
+// the read step goes through one variable at a time. The columns are the
+// by variables and then outpos/outtyp from sf_reshape_bytes; a column is
+// as wide as it is in the output row. Frames are compressed if
+// gf_spill_compress says that pays off for the temporary directory.
+
+#define GTOOLS_RESHAPE_BLOCK 8
+
+struct GtoolsReshapeCols {
+    GT_size krow;
+    GT_size outbytes;
+    GT_size nblock;
+    GT_size *pos;
+    GT_size *width;
+    GT_bool *isstr;
+    char    *buf;
+    char    *work;
+    GT_size nwork;
+};
+
+ST_retcode sf_reshape_cols (struct StataInfo *st_info, struct GtoolsReshapeCols *cols);
+void sf_reshape_cols_free (struct GtoolsReshapeCols *cols);
+void sf_reshape_transpose (struct GtoolsReshapeCols *cols, char *rows, GT_size nrows);
+ST_retcode sf_reshape_store_cols (struct StataInfo *st_info, struct GtoolsReshapeCols *cols, GT_size r0, GT_size nrows);
+ST_retcode sf_reshape_write_cols (struct StataInfo *st_info, FILE *fhandle, char *rows, GT_size outbytes, GT_size nrows, GT_bool zspill);
+
+#include "greshape_threads.c"
 
 ST_retcode sf_reshape (struct StataInfo *st_info, int level, char *fname)
 {
@@ -37,12 +126,13 @@ ST_retcode sf_reshape_wide (struct StataInfo *st_info, int level, char *fname)
 
     GT_size *ixptr;
     GT_size i, j, k, l, m, n, cmp;
-    GT_size selx, start, end, jpos, jold, rowbytes, outbytes, srcbytes, xibytes;
+    GT_size selx, start, end, jpos, rowbytes, outbytes, srcbytes, xibytes;
+    GT_size *srcoff = NULL, *srcwid = NULL;
     GT_bool outanystr, xianystr;
+    struct GtoolsReshapeWideShared shared;
 
-    FILE *fhandle;
-    char *strptr, *jstr, *outstr, *bufstr, *endstr, *xistr, *xibuffer;
-    ST_double *dblptr, *jdbl, *outdbl, *bufdbl, *enddbl;
+    char *strptr, *jstr, *outstr, *bufstr, *xistr, *xibuffer;
+    ST_double *dblptr, *jdbl, *outdbl, *bufdbl;
 
     // Note that the xi variables are collapsed! One per group is kept.
     // In this case the default is (first); but it could be any stat.
@@ -363,364 +453,47 @@ ST_retcode sf_reshape_wide (struct StataInfo *st_info, int level, char *fname)
     // }
     //     printf("\n");
 
-    rowbytes = (st_info->rowbytes + sizeof(GT_size));
-    if ( st_info->greshape_anystr == 0 ) {
-        if ( st_info->kvars_by_str == 0 ) {
-            if ( xianystr == 0 ) {
-
-                // All numeric
-                // -----------
-
-                for (j = 0; j < J; j++) {
-                    start  = nj[j];
-                    end    = nj[j + 1];
-                    quicksort_bsd (
-                        bufdbl + start * ksources,
-                        end - start,
-                        ksources * (sizeof *bufdbl),
-                        xtileCompare,
-                        NULL
-                    );
-
-                    selx = j * krow;
-                    dblptr = st_info->st_by_numx + j * (kvars + 1);
-                    for (k = 0; k < kvars; k++) {
-                        outdbl[selx + k] = dblptr[k];
-                    }
-                    selx += kvars;
-
-                    dblptr = bufdbl + start * ksources;
-                    enddbl = bufdbl + end * ksources;
-                    jpos   = jold = ((GT_size) dblptr[0]) - 1;
-                    for (l = 0; l < klevels; l++) {
-                        if ( jpos == l && dblptr < enddbl ) {
-                            for (k = 0; k < kout; k++) {
-                                outdbl[selx + klevels * k + l] = dblptr[k + 1];
-                            }
-                            dblptr += ksources;
-                            if ( dblptr < enddbl ) {
-                                jpos = ((GT_size) dblptr[0]) - 1;
-                                if ( jpos == jold ) {
-                                    rc = 18102;
-                                    goto exit;
-                                }
-                                else {
-                                    jold = jpos;
-                                }
-                            }
-                        }
-
-                        else {
-                            for (k = 0; k < kout; k++) {
-                                outdbl[selx + klevels * k + l] = SV_missval;
-                            }
-                        }
-                    }
+    // Each group is sorted by j and copied to its own output row, so
+    // groups are independent and can be filled in threads; see
+    // greshape_threads.c. An all-numeric output row is krow doubles and
+    // all-numeric sources are ksources doubles, so the byte layout from
+    // sf_reshape_bytes covers every case.
 
-                    if ( kxi ) {
-                        selx += klevels * kout;
-                        memcpy(
-                            outdbl + selx,
-                            xistr + j * xibytes,
-                            xibytes
-                        );
-                    }
-                }
-            }
-            else {
-
-                // All numeric
-                // -----------
-
-                for (j = 0; j < J; j++) {
-                    start  = nj[j];
-                    end    = nj[j + 1];
-                    quicksort_bsd (
-                        bufdbl + start * ksources,
-                        end - start,
-                        ksources * (sizeof *bufdbl),
-                        xtileCompare,
-                        NULL
-                    );
-
-                    selx = j * outbytes;
-                    dblptr = st_info->st_by_numx + j * (kvars + 1);
-                    memcpy(
-                        outstr + selx,
-                        dblptr,
-                        outpos[0]
-                    );
-
-                    dblptr = bufdbl + start * ksources;
-                    enddbl = bufdbl + end * ksources;
-                    jpos   = jold = ((GT_size) dblptr[0]) - 1;
-                    for (l = 0; l < klevels; l++) {
-                        if ( jpos == l && dblptr < enddbl ) {
-                            for (k = 0; k < kout; k++) {
-                                memcpy(
-                                    outstr + selx + outpos[klevels * k + l],
-                                    dblptr + k + 1,
-                                    sizeof(ST_double)
-                                );
-                            }
-                            dblptr += ksources;
-                            if ( dblptr < enddbl ) {
-                                jpos = ((GT_size) dblptr[0]) - 1;
-                                if ( jpos == jold ) {
-                                    rc = 18102;
-                                    goto exit;
-                                }
-                                else {
-                                    jold = jpos;
-                                }
-                            }
-                        }
-                        else {
-                            for (k = 0; k < kout; k++) {
-                                memcpy(
-                                    outstr + selx + outpos[klevels * k + l],
-                                    &SV_missval,
-                                    sizeof(ST_double)
-                                );
-                            }
-                        }
-                    }
+    srcoff = calloc(kout + 1, sizeof *srcoff);
+    srcwid = calloc(kout + 1, sizeof *srcwid);
 
-                    if ( kxi ) {
-                        memcpy(
-                            outstr + selx + outpos[klevels * kout],
-                            xistr + j * xibytes,
-                            xibytes
-                        );
-                    }
-                }
-            }
-        }
-        else {
-
-            // Sources numeric, by vars str
-            // ----------------------------
-
-            for (j = 0; j < J; j++) {
-                start  = nj[j];
-                end    = nj[j + 1];
-                quicksort_bsd (
-                    bufdbl + start * ksources,
-                    end - start,
-                    ksources * (sizeof *bufdbl),
-                    xtileCompare,
-                    NULL
-                );
-
-                selx = j * outbytes;
-                strptr = st_info->st_by_charx + j * rowbytes;
-                memcpy(
-                    outstr + selx,
-                    strptr,
-                    outpos[0]
-                );
-
-                dblptr = bufdbl + start * ksources;
-                enddbl = bufdbl + end * ksources;
-                jpos   = jold = ((GT_size) dblptr[0]) - 1;
-                for (l = 0; l < klevels; l++) {
-                    if ( jpos == l && dblptr < enddbl ) {
-                        for (k = 0; k < kout; k++) {
-                            memcpy(
-                                outstr + selx + outpos[klevels * k + l],
-                                dblptr + k + 1,
-                                sizeof(ST_double)
-                            );
-                        }
-                        dblptr += ksources;
-                        if ( dblptr < enddbl ) {
-                            jpos = ((GT_size) dblptr[0]) - 1;
-                            if ( jpos == jold ) {
-                                rc = 18102;
-                                goto exit;
-                            }
-                            else {
-                                jold = jpos;
-                            }
-                        }
-                    }
-                    else {
-                        for (k = 0; k < kout; k++) {
-                            memcpy(
-                                outstr + selx + outpos[klevels * k + l],
-                                &SV_missval,
-                                sizeof(ST_double)
-                            );
-                        }
-                    }
-                }
+    if ( srcoff == NULL ) return(sf_oom_error("sf_reshape_wide", "srcoff"));
+    if ( srcwid == NULL ) return(sf_oom_error("sf_reshape_wide", "srcwid"));
 
-                if ( kxi ) {
-                    memcpy(
-                        outstr + selx + outpos[klevels * kout],
-                        xistr + j * xibytes,
-                        xibytes
-                    );
-                }
-            }
-        }
+    m = sizeof(ST_double);
+    for (k = 0; k < kout; k++) {
+        srcoff[k] = m;
+        srcwid[k] = st_info->greshape_types[k]? st_info->greshape_types[k] + 1: sizeof(ST_double);
+        m += srcwid[k];
     }
-    else {
-        if ( st_info->kvars_by_str == 0 ) {
-
-            // Sources str, by vars numeric
-            // ----------------------------
-
-            for (j = 0; j < J; j++) {
-                start = nj[j];
-                end   = nj[j + 1];
-                quicksort_bsd (
-                    bufstr + start * srcbytes,
-                    end - start,
-                    srcbytes,
-                    xtileCompare,
-                    NULL
-                );
-
-                selx = j * outbytes;
-                dblptr = st_info->st_by_numx + j * (kvars + 1);
-                memcpy(
-                    outstr + selx,
-                    dblptr,
-                    outpos[0]
-                );
-
-                strptr = bufstr + start * srcbytes;
-                endstr = bufstr + end * srcbytes;
-                jpos   = jold = (*(GT_size*) strptr) - 1;
-                for (l = 0; l < klevels; l++) {
-                    if ( jpos == l && strptr < endstr ) {
-                        strptr += sizeof(ST_double);
-                        for (k = 0; k < kout; k++) {
-                            m = st_info->greshape_types[k];
-                            if ( m == 0 ) {
-                                m = sizeof(ST_double);
-                            }
-                            else {
-                                m++;
-                            }
-                            memcpy(
-                                outstr + selx + outpos[klevels * k + l],
-                                strptr,
-                                m
-                            );
-                            strptr += m;
-                        }
-                        if ( strptr < endstr ) {
-                            jpos = (*(GT_size*) strptr) - 1;
-                            if ( jpos == jold ) {
-                                rc = 18102;
-                                goto exit;
-                            }
-                            else {
-                                jold = jpos;
-                            }
-                        }
-                    }
-                    else {
-                        for (k = 0; k < kout; k++) {
-                            memcpy(
-                                outstr + selx + outpos[klevels * k + l],
-                                &SV_missval,
-                                sizeof(ST_double)
-                            );
-                        }
-                    }
-                }
 
-                if ( kxi ) {
-                    memcpy(
-                        outstr + selx + outpos[klevels * kout],
-                        xistr + j * xibytes,
-                        xibytes
-                    );
-                }
-            }
-        }
-        else {
-
-            // All str
-            // -------
-
-            for (j = 0; j < J; j++) {
-                start = nj[j];
-                end   = nj[j + 1];
-                quicksort_bsd (
-                    bufstr + start * srcbytes,
-                    end - start,
-                    srcbytes,
-                    xtileCompare,
-                    NULL
-                );
-
-                selx = j * outbytes;
-                strptr = st_info->st_by_charx + j * rowbytes;
-                memcpy(
-                    outstr + selx,
-                    strptr,
-                    outpos[0]
-                );
-
-                strptr  = bufstr + start * srcbytes;
-                endstr  = bufstr + end * srcbytes;
-                jpos    = jold = (*(GT_size*) strptr) - 1;
-                for (l = 0; l < klevels; l++) {
-                    if ( jpos == l && strptr < endstr ) {
-                        strptr += sizeof(ST_double);
-                        for (k = 0; k < kout; k++) {
-                            m = st_info->greshape_types[k];
-                            if ( m == 0 ) {
-                                m = sizeof(ST_double);
-                            }
-                            else {
-                                m++;
-                            }
-                            memcpy(
-                                outstr + selx + outpos[klevels * k + l],
-                                strptr,
-                                m
-                            );
-                            strptr += m;
-                        }
-                        if ( strptr < endstr ) {
-                            jpos = (*(GT_size*) strptr) - 1;
-                            if ( jpos == jold ) {
-                                rc = 18102;
-                                goto exit;
-                            }
-                            else {
-                                jold = jpos;
-                            }
-                        }
-                    }
-                    else {
-                        for (k = 0; k < kout; k++) {
-                            if ( st_info->greshape_types[k] == 0 ) {
-                                memcpy(
-                                    outstr + selx + outpos[klevels * k + l],
-                                    &SV_missval,
-                                    sizeof(ST_double)
-                                );
-                            }
-                        }
-                    }
-                }
+    rowbytes = (st_info->rowbytes + sizeof(GT_size));
 
-                if ( kxi ) {
-                    memcpy(
-                        outstr + selx + outpos[klevels * kout],
-                        xistr + j * xibytes,
-                        xibytes
-                    );
-                }
-            }
-        }
-    }
+    shared.buf      = st_info->greshape_anystr? bufstr: (char *) bufdbl;
+    shared.out      = outanystr? outstr: (char *) outdbl;
+    shared.byrows   = st_info->kvars_by_str? st_info->st_by_charx: (char *) st_info->st_by_numx;
+    shared.bystride = st_info->kvars_by_str? rowbytes: (kvars + 1) * sizeof(ST_double);
+    shared.bybytes  = outpos[0];
+    shared.xistr    = xistr;
+    shared.nj       = nj;
+    shared.outpos   = outpos;
+    shared.srcoff   = srcoff;
+    shared.srcwid   = srcwid;
+    shared.srctyp   = st_info->greshape_types;
+    shared.kout     = kout;
+    shared.kxi      = kxi;
+    shared.klevels  = klevels;
+    shared.srcbytes = srcbytes;
+    shared.outbytes = outbytes;
+    shared.xibytes  = xibytes;
+    shared.jdbl     = (st_info->greshape_anystr == 0);
+
+    if ( (rc = sf_reshape_fill(st_info, sf_reshape_wide_group, &shared, 0, J)) ) goto exit;
 
     if ( st_info->benchmark > 2 )
         sf_running_timer (&timer, "\t\treshape wide step 2: transposed data");
@@ -818,20 +591,15 @@ ST_retcode sf_reshape_wide (struct StataInfo *st_info, int level, char *fname)
     if ( (rc = SF_scal_save ("__gtools_greshape_nrows", (ST_double) J))    ) goto exit;
     if ( (rc = SF_scal_save ("__gtools_greshape_ncols", (ST_double) krow)) ) goto exit;
 
-    fhandle = fopen(fname, "wb");
     if ( outanystr ) {
-        rc = (fwrite(outstr, outbytes, J, fhandle) != J);
+        rc = sf_reshape_save(st_info, outstr, outbytes, J, fname);
+        if ( st_info->greshape_inmem ) outstr = NULL;
     }
     else {
-        rc = (fwrite(outdbl, sizeof *outdbl, J * krow, fhandle) != J * krow);
-    }
-    fclose (fhandle);
-
-    if ( rc ) {
-        sf_errprintf("unable to write output to disk\n");
-        rc = 198;
-        goto exit;
+        rc = sf_reshape_save(st_info, outdbl, outbytes, J, fname);
+        if ( st_info->greshape_inmem ) outdbl = NULL;
     }
+    if ( rc ) goto exit;
 
     if ( st_info->benchmark > 2 )
         sf_running_timer (&timer, "\t\treshape wide step 3: copied reshaped data to disk");
@@ -856,6 +624,9 @@ exit:
     free(jdbl);
     free(jstr);
 
+    free(srcoff);
+    free(srcwid);
+
     return(rc);
 }
 
@@ -875,14 +646,16 @@ ST_retcode sf_reshape_long (struct StataInfo *st_info, int level, char *fname)
      *********************************************************************/
 
     ST_retcode rc = 0;
-    ST_double z;
 
     GT_size *ixptr;
-    GT_size selx, i, j, k, l, m, rowbytes, outbytes, xibytes;
+    GT_size i, j, l, m, r0, r1, nchunk, nrows, rowbytes, outbytes;
+    GT_size *cnt = NULL;
+    struct GtoolsReshapeMap map;
+    struct GtoolsReshapeLongShared shared;
 
-    FILE *fhandle;
-    char *strptr, *jstr, *outstr, *xistr;
-    ST_double *dblptr, *jdbl, *outdbl, *xidbl;
+    FILE *fhandle, *fchunk = NULL;
+    GT_bool zspill = 0;
+    char *jstr, *outstr = NULL, *srcbuf = NULL;
 
     GT_size kvars    = st_info->kvars_by;
     GT_size kout     = st_info->greshape_kout;
@@ -933,64 +706,19 @@ ST_retcode sf_reshape_long (struct StataInfo *st_info, int level, char *fname)
 
     char ReS_jfile[st_info->greshape_jfile];
 
-    GT_size *xitypes  = st_info->greshape_xitypes;
-    GT_size *xipos    = calloc(GTOOLS_PWMAX(kxi, 1), sizeof *xipos);
     GT_size *outpos   = calloc(kout + kxi + 1, sizeof *outpos);
     GT_size *outtyp   = calloc(kout + kxi + 1, sizeof *outtyp);
     GT_size *index_st = calloc(Nread, sizeof *index_st);
-    GT_size *maplevel = st_info->greshape_maplevel;
 
-    if ( xipos    == NULL ) return(sf_oom_error("sf_reshape_long", "xipos"));
     if ( outpos   == NULL ) return(sf_oom_error("sf_reshape_long", "outpos"));
     if ( outtyp   == NULL ) return(sf_oom_error("sf_reshape_long", "outtyp"));
     if ( index_st == NULL ) return(sf_oom_error("sf_reshape_long", "index_st"));
 
     jstr = calloc(klevels, jbytes);
-    if ( st_info->greshape_str ) {
-        jdbl = calloc(1, sizeof *jdbl);
-    }
-    else {
-        jdbl = calloc(klevels, sizeof *jdbl);
-    }
+    if ( jstr == NULL ) return(sf_oom_error("sf_reshape_long", "jstr"));
 
+    memset(&map, '\0', sizeof map);
     outbytes = sf_reshape_bytes(st_info, outpos, outtyp);
-    if ( st_info->greshape_anystr ) {
-        outdbl = malloc(sizeof(ST_double));
-        outstr = calloc(Nread * klevels, GTOOLS_PWMAX(outbytes, 1));
-        memset(outstr, '\0', Nread * klevels * GTOOLS_PWMAX(outbytes, 1));
-    }
-    else {
-        outstr = malloc(sizeof(char));
-        outdbl = calloc(Nread * klevels * krow, sizeof *outdbl);
-    }
-
-    xipos[0] = xibytes = 0;
-    for (k = 0; k < kxi; k++) {
-        if ( (l = xitypes[k]) ) {
-            xibytes += ((l + 1) * sizeof(char));
-        }
-        else {
-            xibytes += sizeof(ST_double);
-        }
-        if ( k < kxi - 1 ) {
-            xipos[k + 1] = xibytes;
-        }
-    }
-
-    xibytes = GTOOLS_PWMAX(xibytes, 1);
-    xistr   = calloc(1, xibytes);
-    xidbl   = calloc(GTOOLS_PWMAX(kxi, 1), sizeof *xidbl);
-    memset(xistr, '\0', xibytes);
-
-    if ( outdbl == NULL ) return(sf_oom_error("sf_reshape_long", "outdbl"));
-    if ( outstr == NULL ) return(sf_oom_error("sf_reshape_long", "outstr"));
-    if ( xistr  == NULL ) return(sf_oom_error("sf_reshape_long", "xistr"));
-    if ( xidbl  == NULL ) return(sf_oom_error("sf_reshape_long", "xidbl"));
-
-    if ( outbytes == 0 ) {
-        rc = 198;
-        goto exit;
-    }
 
     /*********************************************************************
      *                      Step 2: Read in varlist                      *
@@ -1002,13 +730,7 @@ ST_retcode sf_reshape_long (struct StataInfo *st_info, int level, char *fname)
 
     if ( (rc = SF_macro_use("ReS_jfile", ReS_jfile, st_info->greshape_jfile) )) goto exit;
     fhandle = fopen(ReS_jfile, "rb");
-    if ( st_info->greshape_str == 0 ) {
-        rc = fread(jdbl, sizeof *jdbl, klevels, fhandle) != klevels;
-    }
-    fclose (fhandle);
-
-    fhandle = fopen(ReS_jfile, "rb");
-    rc = rc | (fread(jstr, jbytes, klevels, fhandle) != klevels);
+    rc = (fread(jstr, jbytes, klevels, fhandle) != klevels);
     fclose (fhandle);
 
     if ( rc ) {
@@ -1017,6 +739,24 @@ ST_retcode sf_reshape_long (struct StataInfo *st_info, int level, char *fname)
         goto exit;
     }
 
+    if ( (rc = sf_reshape_map(st_info, &map, outbytes, outpos, outtyp, jstr, jbytes)) ) goto exit;
+
+    // With greshape, maxmem(#) only the output for groups r0 through r1 - 1
+    // (in sorted order) is built at a time; see Step 3. Every output row
+    // uses the layout from sf_reshape_bytes; when it is all numeric that
+    // is just krow doubles. Each group in the chunk also gets a source
+    // row, and cnt has its number of output rows, which is less than
+    // klevels with greshape, dropmiss.
+
+    nchunk = sf_reshape_chunk(st_info, Nread, klevels * outbytes + map.srcbytes);
+    outstr = calloc(nchunk * klevels, outbytes);
+    srcbuf = calloc(nchunk, map.srcbytes);
+    cnt    = calloc(nchunk, sizeof *cnt);
+
+    if ( outstr == NULL ) return(sf_oom_error("sf_reshape_long", "outstr"));
+    if ( srcbuf == NULL ) return(sf_oom_error("sf_reshape_long", "srcbuf"));
+    if ( cnt    == NULL ) return(sf_oom_error("sf_reshape_long", "cnt"));
+
     for (i = 0; i < Nread; i++)
         index_st[i] = 0;
 
@@ -1031,350 +771,101 @@ ST_retcode sf_reshape_long (struct StataInfo *st_info, int level, char *fname)
         sf_running_timer (&timer, "\t\treshape long step 1: Indexed in stata order");
 
     /*********************************************************************
-     *                       Step 3: Reshape long                        *
+     *               Step 3: Reshape long and copy to disk               *
      *********************************************************************/
 
+    // The output is in sorted order but the data is read in Stata order,
+    // so each chunk is a range of groups and the data is scanned once per
+    // chunk, reading the sources of the observations whose group is in
+    // range. The long rows of each group are then filled from its source
+    // row into its klevels slots (in threads with greshape, threads(#);
+    // see greshape_threads.c); with greshape, dropmiss the rows that are
+    // kept are packed together before the chunk is written.
+
     if ( debug ) {
         sf_printf_debug("debug 3 (sf_reshape): Reshape long\n");
     }
 
-    rowbytes = (st_info->rowbytes + sizeof(GT_size));
-    if ( st_info->greshape_anystr == 0 ) {
-        i = 0;
-        for (ixptr = index_st; ixptr < index_st + Nread; ixptr++, i++) {
-            if ( *ixptr ) {
-                // m is the level, in order, of st_by_numx
-                // m = st_info->info[*ixptr - 1];
-                m = *ixptr - 1;
-
-                // Copy each of the xi variables
-                for (k = 0; k < kxi; k++) {
-                    if ( (rc = SF_vdata(kvars + k + 1,
-                                        i + st_info->in1,
-                                        xidbl + k)) ) goto exit;
-                }
-
-                // dblptr is the row of the by variables
-                dblptr = st_info->st_by_numx + m * (kvars + 1);
-                for (j = 0; j < klevels; j++) {
-                    // selx is the row in the output (long) vector
-                    selx = m * krow * klevels + j * krow;
-
-                    // copy a row of the by variables to the output vector
-                    for (k = 0; k < kvars; k++) {
-                        outdbl[selx + k] = dblptr[k];
-                    }
-
-                    // Copy the j variable value
-                    outdbl[selx + kvars] = jdbl[j];
-
-                    // Copy each of the xij variables
-                    for (k = 0; k < kout; k++) {
-                        if ( (l = maplevel[k * klevels + j]) > 0 ) {
-                            if ( (rc = SF_vdata(l, i + st_info->in1, &z)) ) goto exit;
-                            outdbl[selx + kvars + k + 1] = z;
-                        }
-                        else {
-                            outdbl[selx + kvars + k + 1] = SV_missval;
-                        }
-                    }
-
-                    // Copy each of the xi variables
-                    if ( kxi ) {
-                        memcpy(
-                            outdbl + selx + kvars + kout + 1,
-                            xidbl,
-                            kxi * sizeof(ST_double)
-                        );
-                    }
-                }
-            }
+    if ( nchunk < Nread ) {
+        zspill = gf_spill_compress(fname);
+        if ( (fchunk = fopen(fname, "wb")) == NULL ) {
+            sf_errprintf("unable to write output to disk\n");
+            rc = 198;
+            goto exit;
         }
     }
-    else {
-        if ( st_info->kvars_by_str ) {
-            i = 0;
-            for (ixptr = index_st; ixptr < index_st + Nread; ixptr++, i++) {
-                if ( *ixptr ) {
-                    // m = st_info->info[*ixptr - 1];
-                    m = *ixptr - 1;
-
-                    memset(xistr, '\0', xibytes);
-                    for (k = 0; k < kxi; k++) {
-                        if ( xitypes[k] ) {
-                            if ( (rc = SF_sdata(kvars + k + 1,
-                                                i + st_info->in1,
-                                                xistr + xipos[k])) ) goto exit;
-                        }
-                        else {
-                            if ( (rc = SF_vdata(kvars + k + 1,
-                                                i + st_info->in1,
-                                                &z)) ) goto exit;
-                            memcpy(xistr + xipos[k], &z, sizeof(ST_double));
-                        }
-                    }
 
-                    strptr = st_info->st_by_charx + m * rowbytes;
-                    for (j = 0; j < klevels; j++) {
-                        selx = m * klevels * outbytes + j * outbytes;
-                        memcpy(
-                            outstr + selx,
-                            strptr,
-                            outpos[0]
-                        );
-
-                        memcpy(
-                            outstr + selx + outpos[0],
-                            jstr + j * jbytes,
-                            jbytes
-                        );
-
-                        for (k = 0; k < kout; k++) {
-                            l = maplevel[k * klevels + j];
-                            if ( outtyp[k + 1] && (l > 0) ) {
-                                if ( (rc = SF_sdata(l,
-                                                    i + st_info->in1,
-                                                    outstr + selx + outpos[k + 1])) ) goto exit;
-                            }
-                            else {
-                                if ( l > 0 ) {
-                                    if ( (rc = SF_vdata(l, i + st_info->in1, &z)) ) goto exit;
-                                }
-                                else {
-                                    z = SV_missval;
-                                }
-                                memcpy(
-                                    outstr + selx + outpos[k + 1],
-                                    &z,
-                                    sizeof(ST_double)
-                                );
-                            }
-                        }
-
-                        if ( kxi ) {
-                            memcpy(
-                                outstr + selx + outpos[kout + 1],
-                                xistr,
-                                xibytes
-                            );
-                        }
-                    }
-                }
+    rowbytes = (st_info->rowbytes + sizeof(GT_size));
+
+    shared.map      = &map;
+    shared.src      = srcbuf;
+    shared.out      = outstr;
+    shared.cnt      = cnt;
+    shared.byrows   = st_info->kvars_by_str? st_info->st_by_charx: (char *) st_info->st_by_numx;
+    shared.bystride = st_info->kvars_by_str? rowbytes: (kvars + 1) * sizeof(ST_double);
+
+    nrows = 0;
+    for (r0 = 0; r0 < Nread; r0 = r1) {
+        r1 = GTOOLS_PWMIN(Nread, r0 + nchunk);
+        i  = 0;
+        for (ixptr = index_st; ixptr < index_st + Nread; ixptr++, i++) {
+            if ( (*ixptr > r0) && (*ixptr <= r1) ) {
+                // *ixptr - 1 is the level, in order, of st_by_numx/st_by_charx
+                if ( (rc = sf_reshape_long_read(st_info,
+                                                &map,
+                                                i + st_info->in1,
+                                                srcbuf + (*ixptr - 1 - r0) * map.srcbytes)) ) goto exit;
             }
         }
-        else {
-            i = 0;
-            for (ixptr = index_st; ixptr < index_st + Nread; ixptr++, i++) {
-                if ( *ixptr ) {
-                    // m = st_info->info[*ixptr - 1];
-                    m = *ixptr - 1;
-
-                    memset(xistr,  '\0', xibytes);
-                    for (k = 0; k < kxi; k++) {
-                        if ( xitypes[k] ) {
-                            if ( (rc = SF_sdata(kvars + k + 1,
-                                                i + st_info->in1,
-                                                xistr + xipos[k])) ) goto exit;
-                        }
-                        else {
-                            if ( (rc = SF_vdata(kvars + k + 1,
-                                                i + st_info->in1,
-                                                &z)) ) goto exit;
-                            memcpy(xistr + xipos[k], &z, sizeof(ST_double));
-                        }
-                    }
 
-                    dblptr = st_info->st_by_numx + m * (kvars + 1);
-                    for (j = 0; j < klevels; j++) {
-                        selx = m * klevels * outbytes + j * outbytes;
-                        memcpy(
-                            outstr + selx,
-                            dblptr,
-                            outpos[0]
-                        );
-
-                        memcpy(
-                            outstr + selx + outpos[0],
-                            jstr + j * jbytes,
-                            jbytes
-                        );
-
-                        for (k = 0; k < kout; k++) {
-                            l = maplevel[k * klevels + j];
-                            if ( outtyp[k + 1] && (l > 0) ) {
-                                if ( (rc = SF_sdata(l,
-                                                    i + st_info->in1,
-                                                    outstr + selx + outpos[k + 1])) ) goto exit;
-                            }
-                            else {
-                                if ( l > 0 ) {
-                                    if ( (rc = SF_vdata(l, i + st_info->in1, &z)) ) goto exit;
-                                }
-                                else {
-                                    z = SV_missval;
-                                }
-                                memcpy(
-                                    outstr + selx + outpos[k + 1],
-                                    &z,
-                                    sizeof(ST_double)
-                                );
-                            }
-                        }
-
-                        if ( kxi ) {
-                            memcpy(
-                                outstr + selx + outpos[kout + 1],
-                                xistr,
-                                xibytes
-                            );
-                        }
-                    }
-                }
+        shared.r0 = r0;
+        if ( (rc = sf_reshape_fill(st_info, sf_reshape_long_group, &shared, r0, r1)) ) goto exit;
+
+        l = 0;
+        for (m = 0; m < r1 - r0; m++) {
+            if ( l < m * klevels ) {
+                memmove(
+                    outstr + l * outbytes,
+                    outstr + m * klevels * outbytes,
+                    cnt[m] * outbytes
+                );
             }
+            l += cnt[m];
         }
-    }
 
-    /* //
-    if ( st_info->greshape_anystr == 0 ) {
-        printf("\n");
-        for (i = 0; i < Nread; i++) {
-            for (j = 0; j < klevels; j++) {
-                selx = i * klevels + j;
-                printf("(%ld, %ld): ", i, j);
-                for (k = 0; k < kvars ; k++) {
-                    z = outdbl[selx + k];
-                    if ( z < SV_missval ) {
-                        printf("\t%.3f", z);
-                    }
-                    else {
-                        printf("\t.");
-                    }
-                }
-                for (k = 0; k < kout; k++) {
-                    l = maplevel[k * klevels + j];
-                    printf("\t(%ld, %ld, %ld)", outtyp[k + 1], l, outpos[k + 1]);
-                    z = outdbl[selx + kvars + k + 1];
-                    if ( z < SV_missval ) {
-                        printf("\t%.3f", z);
-                    }
-                    else {
-                        printf("\t.");
-                    }
-                }
-                for (k = 0; k < kxi; k++) {
-                    z = outdbl[selx + kvars + kout + k + 1];
-                    if ( z < SV_missval ) {
-                        printf("\t%.3f", z);
-                    }
-                    else {
-                        printf("\t.");
-                    }
-                }
-                printf("\n");
-            }
+        if ( fchunk != NULL ) {
+            rc = sf_reshape_save_chunk(st_info, fchunk, outstr, outbytes, l, zspill);
         }
-    }
-    else {
-        printf("\n");
-        for (i = 0; i < Nread; i++) {
-            for (j = 0; j < klevels; j++) {
-                selx = i * klevels * outbytes + j * outbytes;
-                printf("(%ld, %ld): ", i, j);
-                for (k = 0; k < kvars ; k++) {
-                    if ( st_info->byvars_lens[k] > 0) {
-                        printf("\t%s", outstr + selx + st_info->positions[k]);
-                    }
-                    else {
-                        z = *((ST_double *) (outstr + selx + st_info->positions[k]));
-                        if ( z < SV_missval ) {
-                            printf("\t%.3f", z);
-                        }
-                        else {
-                            printf("\t.");
-                        }
-                    }
-                }
-                for (k = 0; k < kout; k++) {
-                    l = maplevel[k * klevels + j];
-                        printf("\t(%ld, %ld, %ld)", outtyp[k + 1], l, outpos[k + 1]);
-                    if ( outtyp[k + 1] && (l > 0) ) {
-                        printf("\t%s", outstr + selx + outpos[k + 1]);
-                    }
-                    else {
-                        z = *((ST_double *) (outstr + selx + outpos[k + 1]));
-                        if ( z < SV_missval ) {
-                            printf("\t%.3f", z);
-                        }
-                        else {
-                            printf("\t.");
-                        }
-                    }
-                }
-                for (k = 0; k < kxi; k++) {
-                    if ( xitypes[k] ) {
-                        printf("\t%s", outstr + selx + outpos[kout + 1 + k]);
-                    }
-                    else {
-                        z = *((ST_double *) (outstr + selx + outpos[kout + 1 + k]));
-                        if ( z < SV_missval ) {
-                            printf("\t%.3f", z);
-                        }
-                        else {
-                            printf("\t.");
-                        }
-                    }
-                }
-                printf("\n");
-            }
+        else {
+            rc = sf_reshape_save(st_info, outstr, outbytes, l, fname);
+            if ( st_info->greshape_inmem ) outstr = NULL;
         }
+        if ( rc ) goto exit;
+        nrows += l;
     }
-    // */
-
-    if ( st_info->benchmark > 2 )
-        sf_running_timer (&timer, "\t\treshape long step 2: transposed data");
-
-    /*********************************************************************
-     *                       Step 4: Copy to disk                        *
-     *********************************************************************/
 
     if ( (rc = SF_scal_save ("__gtools_greshape_nrows",
-                             (ST_double) Nread * klevels)) ) goto exit;
+                             (ST_double) nrows)) ) goto exit;
 
     if ( (rc = SF_scal_save ("__gtools_greshape_ncols",
                              (ST_double) krow)) ) goto exit;
 
-    fhandle = fopen(fname, "wb");
-    if ( st_info->greshape_anystr ) {
-        rc = (fwrite(outstr, outbytes, Nread * klevels, fhandle) != (Nread * klevels));
-    }
-    else {
-        rc = (fwrite(outdbl, sizeof *outdbl, Nread * klevels * krow, fhandle) != (Nread * klevels * krow));
-    }
-    fclose (fhandle);
-
-    if ( rc ) {
-        sf_errprintf("unable to write output to disk\n");
-        rc = 198;
-        goto exit;
-    }
-
     if ( st_info->benchmark > 2 )
-        sf_running_timer (&timer, "\t\treshape long step 3: copied reshaped data to disk");
+        sf_running_timer (&timer, "\t\treshape long step 2: transposed data and copied it to disk");
 
 exit:
+    if ( fchunk != NULL ) fclose (fchunk);
+    sf_reshape_map_free(&map);
+
     free(index_st);
+    free(srcbuf);
+    free(cnt);
 
     free(outpos);
     free(outtyp);
     free(outstr);
-    free(outdbl);
-
-    free(xipos);
-    free(xistr);
-    free(xidbl);
 
     free(jstr);
-    free(jdbl);
 
     return (rc);
 }
@@ -1395,11 +886,10 @@ ST_retcode sf_reshape_read (struct StataInfo *st_info, int level, char *fname)
      *********************************************************************/
 
     ST_retcode rc = 0;
-    ST_double z;
-    GT_size i, k;
-    GT_bool xianystr, outanystr;
-    ST_double *outdbl;
-    char *outstr, *outptr;
+    GT_size r0, n;
+    struct GtoolsReshapeCols cols;
+    char *outstr  = NULL;
+    FILE *fhandle = NULL;
 
     GT_size kvars = st_info->kvars_by;
     GT_size kout  = st_info->greshape_kout;
@@ -1420,103 +910,69 @@ ST_retcode sf_reshape_read (struct StataInfo *st_info, int level, char *fname)
         sf_printf_debug("\tN:     "GT_size_cfmt"\n", N);
     }
 
-    GT_size *allpos  = calloc(krow,  sizeof *allpos);
-    GT_size *alltyp  = calloc(krow,  sizeof *alltyp);
-    GT_size *outpos  = calloc(kread, sizeof *outpos);
-    GT_size *outtyp  = calloc(kread, sizeof *outtyp);
-    GT_size outbytes = sf_reshape_bytes(st_info, outpos, outtyp);
+    memset(&cols, '\0', sizeof cols);
+    if ( (rc = sf_reshape_cols(st_info, &cols)) ) goto exit;
 
-    for (k = 0; k < kvars; k++) {
-        allpos[k] = st_info->positions[k];
-        alltyp[k] = (st_info->byvars_lens[k] > 0)? st_info->byvars_lens[k]: 0;
-    }
-    for (k = 0; k < kread; k++) {
-        allpos[kvars + k] = outpos[k];
-        alltyp[kvars + k] = outtyp[k];
-    }
-
-    xianystr = 0;
-    for (k = 0; k < kxi; k++) {
-        if ( st_info->greshape_xitypes[k] ) {
-            xianystr = 1;
-        }
-    }
-
-    outanystr = st_info->greshape_anystr | st_info->kvars_by_str | xianystr;
-    if ( outanystr ) {
-        outdbl = malloc(sizeof(ST_double));
-        outstr = calloc(N, GTOOLS_PWMAX(outbytes, 1));
-        memset (outstr, '\0', N * GTOOLS_PWMAX(outbytes, 1));
-    }
-    else {
-        outstr = malloc(sizeof(char));
-        outdbl = calloc(N * krow, sizeof *outdbl);
-    }
-
-    if ( outdbl == NULL ) return(sf_oom_error("sf_reshape_read", "outdbl"));
-    if ( outstr == NULL ) return(sf_oom_error("sf_reshape_read", "outstr"));
-
-    if ( outbytes == 0 ) {
+    if ( cols.outbytes == 0 ) {
         rc = 198;
         goto exit;
     }
 
-    FILE *fhandle = fopen(fname, "rb");
-    if ( outanystr ) {
-        if ( fread(outstr, outbytes, N, fhandle) != N ) {
+    if ( st_info->greshape_inmem ) {
+        if ( (outstr = sf_reshape_kept(N * cols.outbytes)) == NULL ) {
+            sf_errprintf("reshaped data not found in memory\n");
             rc = 198;
             goto exit;
         }
     }
     else {
-        if ( fread(outdbl, sizeof *outdbl, krow * N, fhandle) != (krow * N) ) {
+        if ( (fhandle = fopen(fname, "rb")) == NULL ) {
             rc = 198;
             goto exit;
         }
     }
-    fclose(fhandle);
-
-    if ( st_info->benchmark > 2 )
-        sf_running_timer (&timer, "\treshape long step 5: copied reshaped data back to mem");
 
     /*********************************************************************
      *                      Step 2: Read in varlist                      *
      *********************************************************************/
 
-    if ( outanystr ) {
-        outptr = outstr;
-        for (i = 0; i < N; i++) {
-            for (k = 0; k < krow; k++) {
-                if ( alltyp[k] ) {
-                    if ( (rc = SF_sstore(k + 1, i + 1, outptr + allpos[k])) ) goto exit;
-                }
-                else {
-                    z = *((ST_double *) (outptr + allpos[k]));
-                    if ( (rc = SF_vstore(k + 1, i + 1, z)) ) goto exit;
-                }
+    // The file has the data in column-major blocks (see sf_reshape_save),
+    // so each block is copied to Stata one variable at a time. The buffer
+    // kept with greshape, inmemory has the rows as they were written, and
+    // is put in the same layout one block at a time.
+
+    for (r0 = 0; r0 < N; r0 += n) {
+        if ( fhandle != NULL ) {
+            if ( fread(&n, sizeof n, 1, fhandle) != 1 || n == 0 || n > N - r0 ) {
+                rc = 198;
+                goto exit;
             }
-            outptr += outbytes;
-        }
-    }
-    else {
-        for (i = 0; i < N; i++) {
-            for (k = 0; k < krow; k++) {
-                if ( (rc = SF_vstore(k + 1, i + 1, outdbl[i * krow + k])) ) goto exit;
+            if ( n > cols.nblock ) {
+                free(cols.buf);
+                cols.nblock = n;
+                cols.buf    = malloc(n * cols.outbytes);
+                if ( cols.buf == NULL ) return(sf_oom_error("sf_reshape_read", "cols.buf"));
+            }
+            if ( gf_spill_read(fhandle, cols.buf, n, cols.krow, cols.width, &cols.work, &cols.nwork) ) {
+                rc = 198;
+                goto exit;
             }
         }
+        else {
+            n = GTOOLS_PWMIN(N - r0, cols.nblock);
+            sf_reshape_transpose(&cols, outstr + r0 * cols.outbytes, n);
+        }
+
+        if ( (rc = sf_reshape_store_cols(st_info, &cols, r0, n)) ) goto exit;
     }
 
     if ( st_info->benchmark > 2 )
-        sf_running_timer (&timer, "\treshape long step 6: copied reshaped data to stata");
-
+        sf_running_timer (&timer, "\treshape long step 5: copied reshaped data to stata");
 
 exit:
-    free(outpos);
-    free(outtyp);
-    free(outdbl);
+    if ( fhandle != NULL ) fclose(fhandle);
+    sf_reshape_cols_free(&cols);
     free(outstr);
-    free(allpos);
-    free(alltyp);
 
     return(rc);
 }
@@ -1525,6 +981,459 @@ exit:
  *                             Aux stuff                             *
  *********************************************************************/
 
+/**
+ * @brief Hand the output of a reshape write step to the read step
+ *
+ * By default the output is written to @fname in column-major blocks.
+ * With greshape, inmemory the buffer itself is kept as is (the caller
+ * must not free it) and replaces whatever a previous write step left
+ * behind.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param out output buffer, @nrows rows of @outbytes each
+ * @param outbytes bytes per output row
+ * @param nrows number of rows in @out
+ * @param fname file where to write the output
+ * @return 198 if the output could not be written to disk
+ */
+ST_retcode sf_reshape_save (struct StataInfo *st_info, void *out, GT_size outbytes, GT_size nrows, char *fname)
+{
+    ST_retcode rc;
+    GT_bool zspill;
+    FILE *fhandle;
+
+    if ( st_info->greshape_inmem ) {
+        free(GtoolsReshapeBuffer);
+        GtoolsReshapeBuffer = out;
+        GtoolsReshapeBytes  = outbytes * nrows;
+        return (0);
+    }
+
+    zspill = gf_spill_compress(fname);
+    if ( (fhandle = fopen(fname, "wb")) == NULL ) {
+        sf_errprintf("unable to write output to disk\n");
+        return (198);
+    }
+
+    rc = sf_reshape_write_cols(st_info, fhandle, out, outbytes, nrows, zspill);
+    fclose (fhandle);
+
+    return (rc);
+}
+
+/**
+ * @brief Set up the sparse stub by level map for reshape long
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param map map to fill
+ * @param outbytes bytes per output row
+ * @param outpos position of j, each stub, and each xi in the output row
+ * @param outtyp bytes of j, each stub, and each xi if string; 0 if numeric
+ * @param jstr klevels values of j, jbytes each
+ * @param jbytes bytes per value of j
+ * @return fills @map
+ */
+ST_retcode sf_reshape_map (
+    struct StataInfo *st_info,
+    struct GtoolsReshapeMap *map,
+    GT_size outbytes,
+    GT_size *outpos,
+    GT_size *outtyp,
+    char *jstr,
+    GT_size jbytes)
+{
+    GT_size j, k, l, s;
+    char *row;
+
+    GT_size kout     = st_info->greshape_kout;
+    GT_size kxi      = st_info->greshape_kxi;
+    GT_size klevels  = st_info->greshape_klvls;
+    GT_size *maplevel = st_info->greshape_maplevel;
+
+    map->outpos   = outpos;
+    map->outtyp   = outtyp;
+    map->klevels  = klevels;
+    map->outbytes = outbytes;
+    map->xipos    = kxi? outpos[kout + 1]: outbytes;
+    map->xibytes  = outbytes - map->xipos;
+    map->dropmiss = st_info->greshape_dropmiss;
+
+    map->lvlptr = calloc(klevels + 1, sizeof *map->lvlptr);
+    map->stubs  = calloc(GTOOLS_PWMAX(kout * klevels, 1), sizeof *map->stubs);
+    map->srcs   = calloc(GTOOLS_PWMAX(kout * klevels, 1), sizeof *map->srcs);
+    map->srcoff = calloc(GTOOLS_PWMAX(kout * klevels, 1), sizeof *map->srcoff);
+    map->tmpl   = calloc(klevels, outbytes);
+
+    if ( map->lvlptr == NULL ) return(sf_oom_error("sf_reshape_map", "map->lvlptr"));
+    if ( map->stubs  == NULL ) return(sf_oom_error("sf_reshape_map", "map->stubs"));
+    if ( map->srcs   == NULL ) return(sf_oom_error("sf_reshape_map", "map->srcs"));
+    if ( map->srcoff == NULL ) return(sf_oom_error("sf_reshape_map", "map->srcoff"));
+    if ( map->tmpl   == NULL ) return(sf_oom_error("sf_reshape_map", "map->tmpl"));
+
+    s = 0;
+    map->srcbytes = map->xibytes;
+    for (j = 0; j < klevels; j++) {
+        map->lvlptr[j] = s;
+        row = map->tmpl + j * outbytes;
+        memcpy(row + outpos[0], jstr + j * jbytes, jbytes);
+        for (k = 0; k < kout; k++) {
+            if ( outtyp[k + 1] == 0 ) {
+                memcpy(row + outpos[k + 1], &SV_missval, sizeof(ST_double));
+            }
+            if ( (l = maplevel[k * klevels + j]) > 0 ) {
+                map->stubs[s]  = k;
+                map->srcs[s]   = l;
+                map->srcoff[s] = map->srcbytes;
+                map->srcbytes += outtyp[k + 1]? outtyp[k + 1]: sizeof(ST_double);
+                s++;
+            }
+        }
+    }
+    map->lvlptr[klevels] = s;
+    map->srcbytes = GTOOLS_PWMAX(map->srcbytes, 1);
+
+    return (0);
+}
+
+void sf_reshape_map_free (struct GtoolsReshapeMap *map)
+{
+    free(map->lvlptr);
+    free(map->stubs);
+    free(map->srcs);
+    free(map->srcoff);
+    free(map->tmpl);
+}
+
+/**
+ * @brief Read one wide observation into a source row for reshape long
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param map sparse map
+ * @param obs observation to read (1-based)
+ * @param src source row (map->srcbytes)
+ * @return copies the xi and the source variables of @obs to @src
+ */
+ST_retcode sf_reshape_long_read (struct StataInfo *st_info, struct GtoolsReshapeMap *map, GT_size obs, char *src)
+{
+    ST_retcode rc = 0;
+    ST_double z;
+    GT_size k, s, sel;
+    GT_size kvars = st_info->kvars_by;
+    GT_size kout  = st_info->greshape_kout;
+    GT_size kxi   = st_info->greshape_kxi;
+
+    memset(src, '\0', map->srcbytes);
+    for (k = 0; k < kxi; k++) {
+        sel = map->outpos[kout + k + 1] - map->xipos;
+        if ( map->outtyp[kout + k + 1] ) {
+            if ( (rc = SF_sdata(kvars + k + 1, obs, src + sel)) ) return (rc);
+        }
+        else {
+            if ( (rc = SF_vdata(kvars + k + 1, obs, &z)) ) return (rc);
+            memcpy(src + sel, &z, sizeof(ST_double));
+        }
+    }
+
+    for (s = 0; s < map->lvlptr[map->klevels]; s++) {
+        if ( map->outtyp[map->stubs[s] + 1] ) {
+            if ( (rc = SF_sdata(map->srcs[s], obs, src + map->srcoff[s])) ) return (rc);
+        }
+        else {
+            if ( (rc = SF_vdata(map->srcs[s], obs, &z)) ) return (rc);
+            memcpy(src + map->srcoff[s], &z, sizeof(ST_double));
+        }
+    }
+
+    return (rc);
+}
+
+/**
+ * @brief Write the long rows of one wide observation
+ *
+ * Only the stubs present at each level are copied. With greshape,
+ * dropmiss a level where every stub is missing (or blank) is skipped, so
+ * fewer than klevels rows may be written.
+ *
+ * @param map sparse map
+ * @param src source row from sf_reshape_long_read
+ * @param byrow by variables in output layout
+ * @param out where to write the rows (room for klevels rows)
+ * @param nout number of rows written
+ * @return writes the long rows of @src to @out
+ */
+void sf_reshape_long_rows (
+    struct GtoolsReshapeMap *map,
+    char *src,
+    char *byrow,
+    char *out,
+    GT_size *nout)
+{
+    ST_double z;
+    GT_size j, k, s, sel;
+    GT_bool anyval;
+    char *row = out;
+    GT_size outbytes = map->outbytes;
+
+    for (j = 0; j < map->klevels; j++) {
+        memcpy(row, map->tmpl + j * outbytes, outbytes);
+        memcpy(row, byrow, map->outpos[0]);
+
+        anyval = 0;
+        for (s = map->lvlptr[j]; s < map->lvlptr[j + 1]; s++) {
+            k   = map->stubs[s];
+            sel = map->outpos[k + 1];
+            if ( map->outtyp[k + 1] ) {
+                memcpy(row + sel, src + map->srcoff[s], map->outtyp[k + 1]);
+                anyval |= (row[sel] != '\0');
+            }
+            else {
+                memcpy(&z, src + map->srcoff[s], sizeof(ST_double));
+                memcpy(row + sel, &z, sizeof(ST_double));
+                anyval |= (z < SV_missval);
+            }
+        }
+
+        if ( map->xibytes ) {
+            memcpy(row + map->xipos, src, map->xibytes);
+        }
+
+        if ( anyval || !map->dropmiss ) {
+            row += outbytes;
+        }
+    }
+
+    *nout = (row - out) / outbytes;
+}
+
+/**
+ * @brief Append one chunk of reshaped output to disk
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param fhandle open file where to write the output
+ * @param out output buffer, @nrows rows of @outbytes each
+ * @param outbytes bytes per output row
+ * @param nrows number of rows in @out
+ * @param zspill whether to compress the blocks
+ * @return 198 if the output could not be written to disk
+ */
+ST_retcode sf_reshape_save_chunk (struct StataInfo *st_info, FILE *fhandle, void *out, GT_size outbytes, GT_size nrows, GT_bool zspill)
+{
+    return (sf_reshape_write_cols(st_info, fhandle, out, outbytes, nrows, zspill));
+}
+
+/**
+ * @brief Set up the column-major layout of the reshaped data
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param cols layout to fill, plus a buffer for one block
+ * @return fills @cols
+ */
+ST_retcode sf_reshape_cols (struct StataInfo *st_info, struct GtoolsReshapeCols *cols)
+{
+    GT_size k, nmax;
+    GT_size kvars = st_info->kvars_by;
+    GT_size kread = (st_info->greshape_code == 1)?
+        st_info->greshape_kout + 1 + st_info->greshape_kxi:
+        st_info->greshape_kxij + st_info->greshape_kxi;
+
+    GT_size *outpos = calloc(GTOOLS_PWMAX(kread, 1), sizeof *outpos);
+    GT_size *outtyp = calloc(GTOOLS_PWMAX(kread, 1), sizeof *outtyp);
+
+    if ( outpos == NULL ) return(sf_oom_error("sf_reshape_cols", "outpos"));
+    if ( outtyp == NULL ) return(sf_oom_error("sf_reshape_cols", "outtyp"));
+
+    cols->krow     = kvars + kread;
+    cols->outbytes = sf_reshape_bytes(st_info, outpos, outtyp);
+    cols->pos      = calloc(cols->krow, sizeof *cols->pos);
+    cols->width    = calloc(cols->krow, sizeof *cols->width);
+    cols->isstr    = calloc(cols->krow, sizeof *cols->isstr);
+
+    if ( cols->pos   == NULL ) return(sf_oom_error("sf_reshape_cols", "cols->pos"));
+    if ( cols->width == NULL ) return(sf_oom_error("sf_reshape_cols", "cols->width"));
+    if ( cols->isstr == NULL ) return(sf_oom_error("sf_reshape_cols", "cols->isstr"));
+
+    for (k = 0; k < kvars; k++) {
+        cols->pos[k]   = st_info->positions[k];
+        cols->isstr[k] = (st_info->byvars_lens[k] > 0);
+    }
+    for (k = 0; k < kread; k++) {
+        cols->pos[kvars + k]   = outpos[k];
+        cols->isstr[kvars + k] = (outtyp[k] > 0);
+    }
+    for (k = 0; k < cols->krow; k++) {
+        cols->width[k] = ((k + 1 < cols->krow)? cols->pos[k + 1]: cols->outbytes) - cols->pos[k];
+    }
+
+    free(outpos);
+    free(outtyp);
+
+    nmax = GTOOLS_RESHAPE_BLOCK;
+    if ( st_info->greshape_maxmem ) {
+        nmax = GTOOLS_PWMIN(nmax, st_info->greshape_maxmem);
+    }
+    cols->nblock = GTOOLS_PWMAX(1, (nmax * 1024 * 1024) / GTOOLS_PWMAX(cols->outbytes, 1));
+    cols->buf    = malloc(cols->nblock * GTOOLS_PWMAX(cols->outbytes, 1));
+    if ( cols->buf == NULL ) return(sf_oom_error("sf_reshape_cols", "cols->buf"));
+
+    return (0);
+}
+
+void sf_reshape_cols_free (struct GtoolsReshapeCols *cols)
+{
+    free(cols->pos);
+    free(cols->width);
+    free(cols->isstr);
+    free(cols->buf);
+    free(cols->work);
+}
+
+/**
+ * @brief Copy rows of reshaped output into a column-major block
+ *
+ * @param cols layout; the block is written to cols->buf
+ * @param rows @nrows output rows (at most cols->nblock)
+ * @param nrows number of rows
+ * @return @rows in column-major order in cols->buf
+ */
+void sf_reshape_transpose (struct GtoolsReshapeCols *cols, char *rows, GT_size nrows)
+{
+    GT_size i, k, width;
+    char *src, *dst;
+
+    for (k = 0; k < cols->krow; k++) {
+        width = cols->width[k];
+        src   = rows + cols->pos[k];
+        dst   = cols->buf + nrows * cols->pos[k];
+        if ( width == sizeof(ST_double) ) {
+            for (i = 0; i < nrows; i++, src += cols->outbytes, dst += sizeof(ST_double))
+                memcpy(dst, src, sizeof(ST_double));
+        }
+        else {
+            for (i = 0; i < nrows; i++, src += cols->outbytes, dst += width)
+                memcpy(dst, src, width);
+        }
+    }
+}
+
+/**
+ * @brief Copy a column-major block of reshaped data to Stata
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param cols layout; the block is in cols->buf
+ * @param r0 first row of the block in the Stata data (0-based)
+ * @param nrows number of rows in the block
+ * @return stores the block in Stata, one variable at a time
+ */
+ST_retcode sf_reshape_store_cols (struct StataInfo *st_info, struct GtoolsReshapeCols *cols, GT_size r0, GT_size nrows)
+{
+    ST_retcode rc = 0;
+    ST_double z;
+    GT_size i, k;
+    char *col;
+
+    for (k = 0; k < cols->krow; k++) {
+        col = cols->buf + nrows * cols->pos[k];
+        if ( cols->isstr[k] ) {
+            for (i = 0; i < nrows; i++, col += cols->width[k]) {
+                if ( (rc = SF_sstore(k + 1, r0 + i + 1, col)) ) return (rc);
+            }
+        }
+        else {
+            for (i = 0; i < nrows; i++, col += sizeof(ST_double)) {
+                memcpy(&z, col, sizeof(ST_double));
+                if ( (rc = SF_vstore(k + 1, r0 + i + 1, z)) ) return (rc);
+            }
+        }
+    }
+
+    return (rc);
+}
+
+/**
+ * @brief Write rows of reshaped output to disk in column-major blocks
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param fhandle open file where to write the output
+ * @param rows output buffer, @nrows rows of @outbytes each
+ * @param outbytes bytes per output row
+ * @param nrows number of rows in @rows
+ * @param zspill whether to compress the blocks
+ * @return 198 if the output could not be written to disk
+ */
+ST_retcode sf_reshape_write_cols (struct StataInfo *st_info, FILE *fhandle, char *rows, GT_size outbytes, GT_size nrows, GT_bool zspill)
+{
+    ST_retcode rc = 0;
+    GT_size r0, n;
+    struct GtoolsReshapeCols cols;
+
+    memset(&cols, '\0', sizeof cols);
+    if ( (rc = sf_reshape_cols(st_info, &cols)) ) goto exit;
+
+    if ( cols.outbytes != outbytes ) {
+        sf_errprintf("unexpected reshape layout\n");
+        rc = 198;
+        goto exit;
+    }
+
+    for (r0 = 0; r0 < nrows; r0 += n) {
+        n = GTOOLS_PWMIN(nrows - r0, cols.nblock);
+        sf_reshape_transpose(&cols, rows + r0 * outbytes, n);
+        if ( fwrite(&n, sizeof n, 1, fhandle) != 1
+             || gf_spill_write(fhandle, cols.buf, n, cols.krow, cols.width, zspill, &cols.work, &cols.nwork) ) {
+            sf_errprintf("unable to write output to disk\n");
+            rc = 198;
+            goto exit;
+        }
+    }
+
+exit:
+    sf_reshape_cols_free(&cols);
+    return (rc);
+}
+
+/**
+ * @brief Number of rows to reshape at a time
+ *
+ * greshape, maxmem(#) caps the output buffer at # MiB; the write step
+ * then goes through the file one chunk at a time. There is no cap
+ * with inmemory, since the whole buffer is kept anyway.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param N number of rows
+ * @param bytes bytes of output per row
+ * @return rows per chunk, between 1 and @N
+ */
+GT_size sf_reshape_chunk (struct StataInfo *st_info, GT_size N, GT_size bytes)
+{
+    GT_size nchunk;
+    if ( st_info->greshape_maxmem == 0 || st_info->greshape_inmem || bytes == 0 ) {
+        return (N);
+    }
+    nchunk = (st_info->greshape_maxmem * 1024 * 1024) / bytes;
+    return (GTOOLS_PWMAX(1, GTOOLS_PWMIN(N, nchunk)));
+}
+
+/**
+ * @brief Take the buffer kept by sf_reshape_save
+ *
+ * @param bytes expected size of the buffer
+ * @return the buffer (owned by the caller from now on) or NULL if there
+ *         is no buffer of that size
+ */
+void *sf_reshape_kept (GT_size bytes)
+{
+    void *out = NULL;
+    if ( (GtoolsReshapeBuffer != NULL) && (GtoolsReshapeBytes == bytes) ) {
+        out = GtoolsReshapeBuffer;
+    }
+    else {
+        free(GtoolsReshapeBuffer);
+    }
+    GtoolsReshapeBuffer = NULL;
+    GtoolsReshapeBytes  = 0;
+    return (out);
+}
+
 GT_size sf_reshape_bytes(struct StataInfo *st_info, GT_size *outpos, GT_size *outtyp)
 {
     GT_size i, j, k, l, m, outbytes = 0;
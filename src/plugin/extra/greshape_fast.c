@@ -1,5 +1,6 @@
 ST_retcode sf_reshape_fast  (struct StataInfo *st_info, int level, char *fname);
 ST_retcode sf_reshape_flong (struct StataInfo *st_info, int level, char *fname);
+ST_retcode sf_reshape_fwide (struct StataInfo *st_info, int level, char *fname);
 
 ST_retcode sf_reshape_fast (struct StataInfo *st_info, int level, char *fname)
 {
@@ -7,8 +8,7 @@ ST_retcode sf_reshape_fast (struct StataInfo *st_info, int level, char *fname)
         return (sf_reshape_flong(st_info, level, fname));
     }
     else if ( st_info->greshape_code == 2 )  {
-        sf_errprintf("direct reshape wide not available\n");
-        return (198);
+        return (sf_reshape_fwide(st_info, level, fname));
     }
     else {
         return (198);
@@ -29,11 +29,12 @@ ST_retcode sf_reshape_flong (struct StataInfo *st_info, int level, char *fname)
     ST_retcode rc = 0;
     ST_double z;
 
-    GT_size selx, i, j, k, l, outbytes, xibytes;
+    GT_size i, k, l, r0, r1, nchunk, nrows, nout, outbytes;
+    struct GtoolsReshapeMap map;
 
-    FILE *fhandle;
-    char *jstr, *outstr, *xistr;
-    ST_double *jdbl, *outdbl, *xidbl;
+    FILE *fhandle, *fchunk = NULL;
+    GT_bool zspill = 0;
+    char *jstr, *outstr, *srcrow = NULL;
 
     GT_size kvars    = st_info->kvars_by;
     GT_size kout     = st_info->greshape_kout;
@@ -85,60 +86,30 @@ ST_retcode sf_reshape_flong (struct StataInfo *st_info, int level, char *fname)
 
     char ReS_jfile[st_info->greshape_jfile];
 
-    char      *bufstr   = malloc(st_info->rowbytes);
-    ST_double *bufdbl   = calloc(kvars, sizeof *bufdbl);
-    GT_size   *xipos    = calloc(GTOOLS_PWMAX(kxi, 1), sizeof *xipos);
-    GT_size   *outpos   = calloc(kout + kxi + 1, sizeof *outpos);
-    GT_size   *outtyp   = calloc(kout + kxi + 1, sizeof *outtyp);
-    GT_size   *maplevel = st_info->greshape_maplevel;
+    char    *bufstr = calloc(GTOOLS_PWMAX(st_info->rowbytes, 1), sizeof *bufstr);
+    GT_size *outpos = calloc(kout + kxi + 1, sizeof *outpos);
+    GT_size *outtyp = calloc(kout + kxi + 1, sizeof *outtyp);
 
-    if ( xipos  == NULL ) return(sf_oom_error("sf_reshape_flong", "xipos"));
     if ( bufstr == NULL ) return(sf_oom_error("sf_reshape_flong", "bufstr"));
     if ( outpos == NULL ) return(sf_oom_error("sf_reshape_flong", "outpos"));
     if ( outtyp == NULL ) return(sf_oom_error("sf_reshape_flong", "outtyp"));
 
     jstr = calloc(klevels, jbytes);
-    if ( st_info->greshape_str ) {
-        jdbl = calloc(1, sizeof *jdbl);
-    }
-    else {
-        jdbl = calloc(klevels, sizeof *jdbl);
-    }
-
-    outbytes = sf_reshape_bytes(st_info, outpos, outtyp);
-    if ( st_info->greshape_anystr ) {
-        outdbl = malloc(sizeof(ST_double));
-        outstr = calloc(N * klevels, GTOOLS_PWMAX(outbytes, 1));
-        memset(outstr, '\0', N * klevels * GTOOLS_PWMAX(outbytes, 1));
-    }
-    else {
-        outstr = malloc(sizeof(char));
-        outdbl = calloc(N * klevels * krow, sizeof *outdbl);
-    }
+    if ( jstr == NULL ) return(sf_oom_error("sf_reshape_flong", "jstr"));
 
-    xipos[0] = xibytes = 0;
-    for (k = 0; k < kxi; k++) {
-        if ( (l = st_info->greshape_xitypes[k]) ) {
-            xibytes += ((l + 1) * sizeof(char));
-        }
-        else {
-            xibytes += sizeof(ST_double);
-        }
-        if ( k < kxi - 1 ) {
-            xipos[k + 1] = xibytes;
-        }
-    }
+    // With greshape, maxmem(#) the output is built for nchunk wide rows at
+    // a time (nchunk * klevels long rows) and each chunk is appended to
+    // fname, so the buffer stays under the cap. Every output row uses the
+    // layout from sf_reshape_bytes; when it is all numeric that is just
+    // krow doubles.
 
-    xibytes = GTOOLS_PWMAX(xibytes, 1);
-    xistr   = calloc(1, xibytes);
-    xidbl   = calloc(GTOOLS_PWMAX(kxi, 1), sizeof *xidbl);
-    memset(xistr, '\0', xibytes);
+    outbytes = sf_reshape_bytes(st_info, outpos, outtyp);
+    nchunk   = sf_reshape_chunk(st_info, N, klevels * outbytes);
+    outstr   = calloc(nchunk * klevels, GTOOLS_PWMAX(outbytes, 1));
 
-    if ( outdbl == NULL ) return(sf_oom_error("sf_reshape_flong", "outdbl"));
     if ( outstr == NULL ) return(sf_oom_error("sf_reshape_flong", "outstr"));
-    if ( xistr  == NULL ) return(sf_oom_error("sf_reshape_flong", "xistr"));
-    if ( xidbl  == NULL ) return(sf_oom_error("sf_reshape_flong", "xidbl"));
 
+    memset(&map, '\0', sizeof map);
     if ( outbytes == 0 ) {
         rc = 198;
         goto exit;
@@ -154,13 +125,7 @@ ST_retcode sf_reshape_flong (struct StataInfo *st_info, int level, char *fname)
 
     if ( (rc = SF_macro_use("ReS_jfile", ReS_jfile, st_info->greshape_jfile) )) goto exit;
     fhandle = fopen(ReS_jfile, "rb");
-    if ( st_info->greshape_str == 0 ) {
-        rc = fread(jdbl, sizeof *jdbl, klevels, fhandle) != klevels;
-    }
-    fclose (fhandle);
-
-    fhandle = fopen(ReS_jfile, "rb");
-    rc = rc | (fread(jstr, jbytes, klevels, fhandle) != klevels);
+    rc = (fread(jstr, jbytes, klevels, fhandle) != klevels);
     fclose (fhandle);
 
     if ( rc ) {
@@ -169,352 +134,321 @@ ST_retcode sf_reshape_flong (struct StataInfo *st_info, int level, char *fname)
         goto exit;
     }
 
+    if ( (rc = sf_reshape_map(st_info, &map, outbytes, outpos, outtyp, jstr, jbytes)) ) goto exit;
+
+    srcrow = calloc(1, map.srcbytes);
+    if ( srcrow == NULL ) return(sf_oom_error("sf_reshape_flong", "srcrow"));
+
     if ( st_info->benchmark > 2 )
         sf_running_timer (&timer, "\treshape long step 1: allocated memory");
 
     /*********************************************************************
-     *                       Step 3: Reshape long                        *
+     *               Step 3: Reshape long and copy to disk               *
      *********************************************************************/
 
     if ( debug ) {
         sf_printf_debug("debug 3 (sf_reshape): Reshape long\n");
     }
 
-    if ( st_info->greshape_anystr == 0 ) {
-        for (i = 0; i < N; i++) {
-            // bufdbl is the row of the by variables
+    if ( nchunk < N ) {
+        zspill = gf_spill_compress(fname);
+        if ( (fchunk = fopen(fname, "wb")) == NULL ) {
+            sf_errprintf("unable to write output to disk\n");
+            rc = 198;
+            goto exit;
+        }
+    }
+
+    // The output is in Stata order, so the rows of each observation are
+    // simply appended (with greshape, dropmiss they may be fewer than
+    // klevels).
+
+    nrows = 0;
+    for (r0 = 0; r0 < N; r0 = r1) {
+        r1 = GTOOLS_PWMIN(N, r0 + nchunk);
+        l  = 0;
+        for (i = r0; i < r1; i++) {
             for (k = 0; k < kvars; k++) {
-                if ( (rc = SF_vdata(k + 1, i + st_info->in1, bufdbl + k)) ) goto exit;
+                if ( st_info->byvars_lens[k] > 0 ) {
+                    if ( (rc = SF_sdata(k + 1,
+                                        i + st_info->in1,
+                                        bufstr + st_info->positions[k])) ) goto exit;
+                }
+                else {
+                    if ( (rc = SF_vdata(k + 1,
+                                        i + st_info->in1,
+                                        &z)) ) goto exit;
+                    memcpy(bufstr + st_info->positions[k], &z, sizeof(ST_double));
+                }
             }
 
-            // Copy each of the xi variables
-            for (k = 0; k < kxi; k++) {
-                if ( (rc = SF_vdata(kvars + k + 1,
-                                    i + st_info->in1,
-                                    xidbl + k)) ) goto exit;
-            }
+            if ( (rc = sf_reshape_long_read(st_info, &map, i + st_info->in1, srcrow)) ) goto exit;
+            sf_reshape_long_rows(&map, srcrow, bufstr, outstr + l * outbytes, &nout);
+            l += nout;
+        }
 
-            for (j = 0; j < klevels; j++) {
-                // selx is the row in the output (long) vector
-                selx = i * krow * klevels + j * krow;
+        if ( fchunk != NULL ) {
+            rc = sf_reshape_save_chunk(st_info, fchunk, outstr, outbytes, l, zspill);
+        }
+        else {
+            rc = sf_reshape_save(st_info, outstr, outbytes, l, fname);
+            if ( st_info->greshape_inmem ) outstr = NULL;
+        }
+        if ( rc ) goto exit;
+        nrows += l;
+    }
 
-                // copy a row of the by variables to the output vector
-                for (k = 0; k < kvars; k++) {
-                    outdbl[selx + k] = bufdbl[k];
-                }
+    if ( (rc = SF_scal_save ("__gtools_greshape_nrows",
+                             (ST_double) nrows)) ) goto exit;
 
-                // Copy the j variable value
-                outdbl[selx + kvars] = jdbl[j];
-
-                // Copy each of the xij variables
-                for (k = 0; k < kout; k++) {
-                    if ( (l = maplevel[k * klevels + j]) > 0 ) {
-                        if ( (rc = SF_vdata(l, i + st_info->in1, &z)) ) goto exit;
-                        outdbl[selx + kvars + k + 1] = z;
-                    }
-                    else {
-                        outdbl[selx + kvars + k + 1] = SV_missval;
-                    }
-                }
+    if ( (rc = SF_scal_save ("__gtools_greshape_ncols",
+                             (ST_double) krow)) ) goto exit;
 
-                // Copy each of the xi variables
-                if ( kxi ) {
-                    memcpy(
-                        outdbl + selx + kvars + kout + 1,
-                        xidbl,
-                        kxi * sizeof(ST_double)
-                    );
-                }
-            }
-        }
+    if ( st_info->benchmark > 2 )
+        sf_running_timer (&timer, "\treshape long step 2: transposed data and copied it to disk");
+
+exit:
+    if ( fchunk != NULL ) fclose (fchunk);
+    sf_reshape_map_free(&map);
+    free(srcrow);
+
+    free(outpos);
+    free(outtyp);
+    free(outstr);
+    free(bufstr);
+    free(jstr);
+
+    return (rc);
+}
+
+/**
+ * @brief Reshape wide by scattering each observation into its output row
+ *
+ * Unlike sf_reshape_wide, the sources are not buffered and sorted within
+ * each i group. Each observation is read once, in Stata order, and its
+ * xij values are copied straight into the output cells for its j level.
+ * Cells for levels that never appear in a group keep their missing
+ * value. Duplicate j within i are caught with a group by level map and
+ * xi variables are checked against the first observation in the group.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param level (unused)
+ * @param fname file where to write the wide data
+ * @return Writes the wide data to @fname
+ */
+ST_retcode sf_reshape_fwide (struct StataInfo *st_info, int level, char *fname)
+{
+    GT_bool debug = st_info->debug;
+    if ( debug ) {
+        sf_printf_debug("debug 1 (sf_reshape): Starting greshape.\n");
     }
-    else {
-        if ( st_info->kvars_by_str ) {
-            for (i = 0; i < N; i++) {
-                memset(bufstr, '\0', st_info->rowbytes);
-                for (k = 0; k < kvars; k++) {
-                    if ( st_info->byvars_lens[k] > 0 ) {
-                        if ( (rc = SF_sdata(k + 1,
-                                            i + st_info->in1,
-                                            bufstr + st_info->positions[k])) ) goto exit;
-                    }
-                    else {
-                        if ( (rc = SF_vdata(k + 1,
-                                            i + st_info->in1,
-                                            &z)) ) goto exit;
-                        memcpy(bufstr + st_info->positions[k], &z, sizeof(ST_double));
-                    }
-                }
 
-                memset(xistr, '\0', xibytes);
-                for (k = 0; k < kxi; k++) {
-                    if ( st_info->greshape_xitypes[k] ) {
-                        if ( (rc = SF_sdata(kvars + k + 1,
-                                            i + st_info->in1,
-                                            xistr + xipos[k])) ) goto exit;
-                    }
-                    else {
-                        if ( (rc = SF_vdata(kvars + k + 1,
-                                            i + st_info->in1,
-                                            &z)) ) goto exit;
-                        memcpy(xistr + xipos[k], &z, sizeof(ST_double));
-                    }
-                }
+    /*********************************************************************
+     *                           Step 1: Setup                           *
+     *********************************************************************/
 
-                for (j = 0; j < klevels; j++) {
-                    selx = i * klevels * outbytes + j * outbytes;
-                    memcpy(
-                        outstr + selx,
-                        bufstr,
-                        outpos[0]
-                    );
-
-                    memcpy(
-                        outstr + selx + outpos[0],
-                        jstr + j * jbytes,
-                        jbytes
-                    );
-
-                    for (k = 0; k < kout; k++) {
-                        l = maplevel[k * klevels + j];
-                        if ( outtyp[k + 1] && (l > 0) ) {
-                            if ( (rc = SF_sdata(l,
-                                                i + st_info->in1,
-                                                outstr + selx + outpos[k + 1])) ) goto exit;
-                        }
-                        else {
-                            if ( l > 0 ) {
-                                if ( (rc = SF_vdata(l, i + st_info->in1, &z)) ) goto exit;
-                            }
-                            else {
-                                z = SV_missval;
-                            }
-                            memcpy(
-                                outstr + selx + outpos[k + 1],
-                                &z,
-                                sizeof(ST_double)
-                            );
-                        }
-                    }
-
-                    if ( kxi ) {
-                        memcpy(
-                            outstr + selx + outpos[kout + 1],
-                            xistr,
-                            xibytes
-                        );
-                    }
-                }
-            }
+    ST_retcode rc = 0;
+    ST_double z;
+
+    GT_size i, j, k, l, m, start, end, sel, rowbytes, outbytes, xibytes, xioffset;
+    GT_bool xianystr;
+    char *outrow;
+
+    GT_size kvars    = st_info->kvars_by;
+    GT_size kout     = st_info->greshape_kout;
+    GT_size kxij     = st_info->greshape_kxij;
+    GT_size kxi      = st_info->greshape_kxi;
+    GT_size kextra   = kxi? kxi: 1;
+    GT_size klevels  = st_info->greshape_klvls;
+    GT_size krow     = kvars + kxij + kxi;
+    GT_size ksources = kout + 1;
+    GT_size Nread    = st_info->Nread;
+    GT_size J        = st_info->J;
+    GT_size in1      = st_info->in1;
+    clock_t timer    = clock();
+
+    if ( debug ) {
+        sf_printf_debug("\tkvars:    "GT_size_cfmt"\n",  kvars);
+        sf_printf_debug("\tkout:     "GT_size_cfmt"\n",  kout);
+        sf_printf_debug("\tkxij:     "GT_size_cfmt"\n",  kxij);
+        sf_printf_debug("\tkxi:      "GT_size_cfmt"\n",  kxi);
+        sf_printf_debug("\tklevels:  "GT_size_cfmt"\n",  klevels);
+        sf_printf_debug("\tkrow:     "GT_size_cfmt"\n",  krow);
+        sf_printf_debug("\tNread:    "GT_size_cfmt"\n",  Nread);
+        sf_printf_debug("\tJ:        "GT_size_cfmt"\n",  J);
+    }
+
+    // The variables passed to the plugin are i, jcode, xij, and xi, same
+    // as sf_reshape_wide. The output is laid out as in sf_reshape_bytes
+    // whether or not it has any strings; an all-numeric output row is
+    // krow doubles, so outpos is valid for it as well and the bytes
+    // written to disk are the same as sf_reshape_wide's.
+
+    GT_size *xitypes  = st_info->greshape_xitypes;
+    GT_size *xipos    = calloc(kextra,     sizeof *xipos);
+    GT_size *outpos   = calloc(kxij + kxi, sizeof *outpos);
+    GT_size *outtyp   = calloc(kxij + kxi, sizeof *outtyp);
+    GT_size *index_st = calloc(Nread,      sizeof *index_st);
+    GT_bool *seen     = calloc(J * klevels + 1, sizeof *seen);
+    GT_bool *xiseen   = calloc(kxi? J: 1,  sizeof *xiseen);
+    char    *outstr   = NULL;
+    char    *xistr    = NULL;
+
+    if ( xipos    == NULL ) return(sf_oom_error("sf_reshape_fwide", "xipos"));
+    if ( outpos   == NULL ) return(sf_oom_error("sf_reshape_fwide", "outpos"));
+    if ( outtyp   == NULL ) return(sf_oom_error("sf_reshape_fwide", "outtyp"));
+    if ( index_st == NULL ) return(sf_oom_error("sf_reshape_fwide", "index_st"));
+    if ( seen     == NULL ) return(sf_oom_error("sf_reshape_fwide", "seen"));
+    if ( xiseen   == NULL ) return(sf_oom_error("sf_reshape_fwide", "xiseen"));
+
+    xianystr = xibytes = xipos[0] = 0;
+    for (k = 0; k < kxi; k++) {
+        if ( (l = xitypes[k]) ) {
+            xibytes += ((l + 1) * sizeof(char));
+            xianystr = 1;
         }
         else {
-            for (i = 0; i < N; i++) {
-                for (k = 0; k < kvars; k++) {
-                    if ( (rc = SF_vdata(k + 1, i + st_info->in1, bufdbl + k)) ) goto exit;
-                }
+            xibytes += sizeof(ST_double);
+        }
+        if ( k < (kxi - 1) ) {
+            xipos[k + 1] = xibytes;
+        }
+    }
 
-                memset(xistr, '\0', xibytes);
-                for (k = 0; k < kxi; k++) {
-                    if ( st_info->greshape_xitypes[k] ) {
-                        if ( (rc = SF_sdata(kvars + k + 1,
-                                            i + st_info->in1,
-                                            xistr + xipos[k])) ) goto exit;
-                    }
-                    else {
-                        if ( (rc = SF_vdata(kvars + k + 1,
-                                            i + st_info->in1,
-                                            &z)) ) goto exit;
-                        memcpy(xistr + xipos[k], &z, sizeof(ST_double));
-                    }
-                }
+    xibytes  = GTOOLS_PWMAX(xibytes, 1);
+    xistr    = calloc(1, xibytes);
+    outbytes = sf_reshape_bytes(st_info, outpos, outtyp);
+    outstr   = calloc(J, GTOOLS_PWMAX(outbytes, 1));
 
-                for (j = 0; j < klevels; j++) {
-                    selx = i * klevels * outbytes + j * outbytes;
-                    memcpy(
-                        outstr + selx,
-                        bufdbl,
-                        outpos[0]
-                    );
-
-                    memcpy(
-                        outstr + selx + outpos[0],
-                        jstr + j * jbytes,
-                        jbytes
-                    );
-
-                    for (k = 0; k < kout; k++) {
-                        l = maplevel[k * klevels + j];
-                        if ( outtyp[k + 1] && (l > 0) ) {
-                            if ( (rc = SF_sdata(l,
-                                                i + st_info->in1,
-                                                outstr + selx + outpos[k + 1])) ) goto exit;
-                        }
-                        else {
-                            if ( l > 0 ) {
-                                if ( (rc = SF_vdata(l, i + st_info->in1, &z)) ) goto exit;
-                            }
-                            else {
-                                z = SV_missval;
-                            }
-                            memcpy(
-                                outstr + selx + outpos[k + 1],
-                                &z,
-                                sizeof(ST_double)
-                            );
-                        }
-                    }
-
-                    if ( kxi ) {
-                        memcpy(
-                            outstr + selx + outpos[kout + 1],
-                            xistr,
-                            xibytes
-                        );
-                    }
-                }
+    if ( xistr  == NULL ) return(sf_oom_error("sf_reshape_fwide", "xistr"));
+    if ( outstr == NULL ) return(sf_oom_error("sf_reshape_fwide", "outstr"));
+
+    if ( outbytes == 0 ) {
+        rc = 198;
+        goto exit;
+    }
+
+    xioffset = outpos[klevels * kout];
+    rowbytes = st_info->rowbytes + sizeof(GT_size);
+
+    // Each output row starts with the by variables (sorted) and all of
+    // the numeric xij cells set to missing; strings are already empty.
+
+    for (j = 0; j < J; j++) {
+        outrow = outstr + j * outbytes;
+        if ( st_info->kvars_by_str ) {
+            memcpy(outrow, st_info->st_by_charx + j * rowbytes, outpos[0]);
+        }
+        else {
+            memcpy(outrow, st_info->st_by_numx + j * (kvars + 1), outpos[0]);
+        }
+        for (k = 0; k < kout; k++) {
+            if ( st_info->greshape_types[k] ) continue;
+            for (l = 0; l < klevels; l++) {
+                memcpy(outrow + outpos[klevels * k + l], &SV_missval, sizeof(ST_double));
             }
         }
     }
 
-    /* //
-    if ( st_info->greshape_anystr == 0 ) {
-        printf("\n");
-        for (i = 0; i < Nread; i++) {
-            for (j = 0; j < klevels; j++) {
-                selx = i * klevels + j;
-                printf("(%ld, %ld): ", i, j);
-                for (k = 0; k < kvars ; k++) {
-                    z = outdbl[selx + k];
-                    if ( z < SV_missval ) {
-                        printf("\t%.3f", z);
-                    }
-                    else {
-                        printf("\t.");
-                    }
-                }
-                for (k = 0; k < kout; k++) {
-                    l = maplevel[k * klevels + j];
-                    printf("\t(%ld, %ld, %ld)", outtyp[k + 1], l, outpos[k + 1]);
-                    z = outdbl[selx + kvars + k + 1];
-                    if ( z < SV_missval ) {
-                        printf("\t%.3f", z);
-                    }
-                    else {
-                        printf("\t.");
-                    }
-                }
-                for (k = 0; k < kxi; k++) {
-                    z = outdbl[selx + kvars + kout + k + 1];
-                    if ( z < SV_missval ) {
-                        printf("\t%.3f", z);
-                    }
-                    else {
-                        printf("\t.");
-                    }
-                }
-                printf("\n");
-            }
+    for (j = 0; j < J; j++) {
+        l     = st_info->ix[j];
+        start = st_info->info[l];
+        end   = st_info->info[l + 1];
+        for (i = start; i < end; i++) {
+            index_st[st_info->index[i]] = j + 1;
         }
     }
-    else {
-        printf("\n");
-        for (i = 0; i < Nread; i++) {
-            for (j = 0; j < klevels; j++) {
-                selx = i * klevels * outbytes + j * outbytes;
-                printf("(%ld, %ld): ", i, j);
-                for (k = 0; k < kvars ; k++) {
-                    if ( st_info->byvars_lens[k] > 0) {
-                        printf("\t%s", outstr + selx + st_info->positions[k]);
-                    }
-                    else {
-                        z = *((ST_double *) (outstr + selx + st_info->positions[k]));
-                        if ( z < SV_missval ) {
-                            printf("\t%.3f", z);
-                        }
-                        else {
-                            printf("\t.");
-                        }
-                    }
+
+    if ( st_info->benchmark > 2 )
+        sf_running_timer (&timer, "\t\treshape wide step 1: allocated output");
+
+    /*********************************************************************
+     *                  Step 2: Scatter into wide rows                   *
+     *********************************************************************/
+
+    if ( debug ) {
+        sf_printf_debug("debug 2 (sf_reshape): Scatter wide.\n");
+    }
+
+    for (i = 0; i < Nread; i++) {
+        if ( index_st[i] == 0 ) continue;
+        j = index_st[i] - 1;
+        outrow = outstr + j * outbytes;
+
+        if ( (rc = SF_vdata(kvars + 1, i + in1, &z)) ) goto exit;
+        l = ((GT_size) z) - 1;
+        if ( seen[j * klevels + l] ) {
+            rc = 18102;
+            goto exit;
+        }
+        seen[j * klevels + l] = 1;
+
+        for (k = 0; k < kout; k++) {
+            sel = outpos[klevels * k + l];
+            if ( (m = st_info->greshape_types[k]) ) {
+                if ( (rc = SF_sdata(kvars + k + 2, i + in1, outrow + sel)) ) goto exit;
+            }
+            else {
+                if ( (rc = SF_vdata(kvars + k + 2, i + in1, &z)) ) goto exit;
+                memcpy(outrow + sel, &z, sizeof(ST_double));
+            }
+        }
+
+        if ( kxi ) {
+            if ( xianystr ) memset(xistr, '\0', xibytes);
+            for (k = 0; k < kxi; k++) {
+                if ( xitypes[k] ) {
+                    if ( (rc = SF_sdata(kvars + ksources + k + 1,
+                                        i + in1,
+                                        xistr + xipos[k])) ) goto exit;
                 }
-                for (k = 0; k < kout; k++) {
-                    l = maplevel[k * klevels + j];
-                        printf("\t(%ld, %ld, %ld)", outtyp[k + 1], l, outpos[k + 1]);
-                    if ( outtyp[k + 1] && (l > 0) ) {
-                        printf("\t%s", outstr + selx + outpos[k + 1]);
-                    }
-                    else {
-                        z = *((ST_double *) (outstr + selx + outpos[k + 1]));
-                        if ( z < SV_missval ) {
-                            printf("\t%.3f", z);
-                        }
-                        else {
-                            printf("\t.");
-                        }
-                    }
+                else {
+                    if ( (rc = SF_vdata(kvars + ksources + k + 1,
+                                        i + in1,
+                                        &z)) ) goto exit;
+                    memcpy(xistr + xipos[k], &z, sizeof(ST_double));
                 }
-                for (k = 0; k < kxi; k++) {
-                    if ( xitypes[k] ) {
-                        printf("\t%s", outstr + selx + outpos[kout + 1 + k]);
-                    }
-                    else {
-                        z = *((ST_double *) (outstr + selx + outpos[kout + 1 + k]));
-                        if ( z < SV_missval ) {
-                            printf("\t%.3f", z);
-                        }
-                        else {
-                            printf("\t.");
-                        }
-                    }
+            }
+
+            if ( xiseen[j] ) {
+                if ( memcmp(outrow + xioffset, xistr, xibytes) != 0 ) {
+                    rc = 18103;
+                    goto exit;
                 }
-                printf("\n");
+            }
+            else {
+                memcpy(outrow + xioffset, xistr, xibytes);
+                xiseen[j] = 1;
             }
         }
     }
-    // */
 
     if ( st_info->benchmark > 2 )
-        sf_running_timer (&timer, "\treshape long step 2: transposed data");
+        sf_running_timer (&timer, "\t\treshape wide step 2: scattered data in stata order");
 
     /*********************************************************************
-     *                       Step 4: Copy to disk                        *
+     *                       Step 3: Copy to disk                        *
      *********************************************************************/
 
-    if ( (rc = SF_scal_save ("__gtools_greshape_nrows",
-                             (ST_double) N * klevels)) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_greshape_nrows", (ST_double) J)) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_greshape_ncols", (ST_double) krow)) ) goto exit;
 
-    if ( (rc = SF_scal_save ("__gtools_greshape_ncols",
-                             (ST_double) krow)) ) goto exit;
-
-    fhandle = fopen(fname, "wb");
-    if ( st_info->greshape_anystr ) {
-        rc = (fwrite(outstr, outbytes, N * klevels, fhandle) != (N * klevels));
-    }
-    else {
-        rc = (fwrite(outdbl, sizeof *outdbl, N * klevels * krow, fhandle) != (N * klevels * krow));
-    }
-    fclose (fhandle);
-
-    if ( rc ) {
-        sf_errprintf("unable to write output to disk\n");
-        rc = 198;
-        goto exit;
-    }
+    rc = sf_reshape_save(st_info, outstr, outbytes, J, fname);
+    if ( st_info->greshape_inmem ) outstr = NULL;
+    if ( rc ) goto exit;
 
     if ( st_info->benchmark > 2 )
-        sf_running_timer (&timer, "\treshape long step 3: copied reshaped data to disk");
+        sf_running_timer (&timer, "\t\treshape wide step 3: copied reshaped data to disk");
 
 exit:
+    free(xipos);
     free(outpos);
     free(outtyp);
-    free(outstr);
-    free(outdbl);
-    free(bufstr);
-    free(bufdbl);
-    free(xipos);
+    free(index_st);
+    free(seen);
+    free(xiseen);
     free(xistr);
-    free(xidbl);
-    free(jstr);
-    free(jdbl);
+    free(outstr);
 
     return (rc);
 }
@@ -0,0 +1,289 @@
+/*
+ * The fill stage of greshape long and wide. Once the sources have been
+ * read from Stata, the output rows of each i group are fully determined
+ * by info, ix, and maplevel: group j only reads its own sources and only
+ * writes its own rows. Hence the groups can be split into contiguous
+ * ranges and each range filled in a separate thread (multi-threaded
+ * plugin only). Reading from and writing back to Stata stay sequential,
+ * and results do not depend on the number of threads.
+ */
+
+typedef ST_retcode (*GtoolsReshapeGroupFn) (void *shared, GT_size j);
+
+struct GtoolsReshapeWideShared {
+    char    *buf;
+    char    *out;
+    char    *byrows;
+    char    *xistr;
+    GT_size *nj;
+    GT_size *outpos;
+    GT_size *srcoff;
+    GT_size *srcwid;
+    GT_size *srctyp;
+    GT_size kout;
+    GT_size kxi;
+    GT_size klevels;
+    GT_size srcbytes;
+    GT_size outbytes;
+    GT_size bybytes;
+    GT_size bystride;
+    GT_size xibytes;
+    GT_bool jdbl;
+};
+
+struct GtoolsReshapeLongShared {
+    struct GtoolsReshapeMap *map;
+    char    *src;
+    char    *out;
+    char    *byrows;
+    GT_size *cnt;
+    GT_size bystride;
+    GT_size r0;
+};
+
+struct GtoolsReshapeThread {
+    GtoolsReshapeGroupFn group;
+    void *shared;
+    GT_size jstart;
+    GT_size jend;
+    ST_retcode rc;
+};
+
+ST_retcode sf_reshape_wide_group (void *shared, GT_size j);
+ST_retcode sf_reshape_long_group (void *shared, GT_size m);
+void * sf_reshape_fill_thread (void *args);
+
+ST_retcode sf_reshape_fill (
+    struct StataInfo *st_info,
+    GtoolsReshapeGroupFn group,
+    void *shared,
+    GT_size jstart,
+    GT_size jend
+);
+
+/**
+ * @brief Sort the sources of wide group j and fill its output row
+ *
+ * The sources of the group are (j code, stubs) rows; they are sorted by
+ * the j code and copied to the position of each (stub, level) in the
+ * output row. Levels without a source are missing (numeric) or blank
+ * (string; the output buffer starts zeroed).
+ *
+ * @param shared struct GtoolsReshapeWideShared
+ * @param j group, in output order
+ * @return 18102 if j is repeated within the group
+ */
+ST_retcode sf_reshape_wide_group (void *shared, GT_size j)
+{
+    struct GtoolsReshapeWideShared *sh = shared;
+    GT_size k, l, jpos, jold;
+    ST_double z;
+    char *srcptr, *endptr, *row;
+
+    GT_size start = sh->nj[j];
+    GT_size end   = sh->nj[j + 1];
+
+    quicksort_bsd (
+        sh->buf + start * sh->srcbytes,
+        end - start,
+        sh->srcbytes,
+        xtileCompare,
+        NULL
+    );
+
+    row = sh->out + j * sh->outbytes;
+    memcpy(row, sh->byrows + j * sh->bystride, sh->bybytes);
+
+    // The j code is stored as a double if all the sources are numeric
+    // and as a GT_size otherwise (see sf_reshape_wide)
+
+    srcptr = sh->buf + start * sh->srcbytes;
+    endptr = sh->buf + end * sh->srcbytes;
+    if ( sh->jdbl ) {
+        memcpy(&z, srcptr, sizeof(ST_double));
+        jpos = ((GT_size) z) - 1;
+    }
+    else {
+        memcpy(&jpos, srcptr, sizeof(GT_size));
+        jpos--;
+    }
+
+    jold = jpos;
+    for (l = 0; l < sh->klevels; l++) {
+        if ( jpos == l && srcptr < endptr ) {
+            for (k = 0; k < sh->kout; k++) {
+                memcpy(
+                    row + sh->outpos[sh->klevels * k + l],
+                    srcptr + sh->srcoff[k],
+                    sh->srcwid[k]
+                );
+            }
+            srcptr += sh->srcbytes;
+            if ( srcptr < endptr ) {
+                if ( sh->jdbl ) {
+                    memcpy(&z, srcptr, sizeof(ST_double));
+                    jpos = ((GT_size) z) - 1;
+                }
+                else {
+                    memcpy(&jpos, srcptr, sizeof(GT_size));
+                    jpos--;
+                }
+                if ( jpos == jold ) {
+                    return (18102);
+                }
+                jold = jpos;
+            }
+        }
+        else {
+            for (k = 0; k < sh->kout; k++) {
+                if ( sh->srctyp[k] == 0 ) {
+                    memcpy(
+                        row + sh->outpos[sh->klevels * k + l],
+                        &SV_missval,
+                        sizeof(ST_double)
+                    );
+                }
+            }
+        }
+    }
+
+    if ( sh->kxi ) {
+        memcpy(
+            row + sh->outpos[sh->klevels * sh->kout],
+            sh->xistr + j * sh->xibytes,
+            sh->xibytes
+        );
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Fill the long rows of group m from its source row
+ *
+ * @param shared struct GtoolsReshapeLongShared
+ * @param m group, in output order
+ * @return writes the rows of @m to its klevels slots
+ */
+ST_retcode sf_reshape_long_group (void *shared, GT_size m)
+{
+    struct GtoolsReshapeLongShared *sh = shared;
+    GT_size r = m - sh->r0;
+
+    sf_reshape_long_rows(
+        sh->map,
+        sh->src + r * sh->map->srcbytes,
+        sh->byrows + m * sh->bystride,
+        sh->out + r * sh->map->klevels * sh->map->outbytes,
+        sh->cnt + r
+    );
+
+    return (0);
+}
+
+void * sf_reshape_fill_thread (void *args)
+{
+    GT_size j;
+    struct GtoolsReshapeThread *th = args;
+
+    th->rc = 0;
+    for (j = th->jstart; j < th->jend; j++) {
+        if ( (th->rc = th->group(th->shared, j)) ) break;
+    }
+
+    return (NULL);
+}
+
+/**
+ * @brief Fill the output of groups jstart through jend - 1
+ *
+ * With the multi-threaded plugin and greshape, threads(#) the groups
+ * are split into # contiguous ranges of about the same size, each filled
+ * in its own thread. Otherwise they are filled in order.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param group function that fills one group
+ * @param shared inputs and outputs for @group
+ * @param jstart first group
+ * @param jend one past the last group
+ * @return first non-zero return code from @group, if any
+ */
+ST_retcode sf_reshape_fill (
+    struct StataInfo *st_info,
+    GtoolsReshapeGroupFn group,
+    void *shared,
+    GT_size jstart,
+    GT_size jend)
+{
+    struct GtoolsReshapeThread serial;
+    GT_size nthreads = st_info->greshape_threads;
+
+#ifdef GTOOLS_PARALLEL
+    ST_retcode rc = 0;
+    GT_size t, ngroups, nstarted;
+
+    ngroups = jend - jstart;
+    if ( nthreads > ngroups ) nthreads = ngroups;
+    if ( nthreads > 1 ) {
+        pthread_t *threads = calloc(nthreads, sizeof *threads);
+        struct GtoolsReshapeThread *thargs = calloc(nthreads, sizeof *thargs);
+
+        if ( threads == NULL ) { rc = sf_oom_error("sf_reshape_fill", "threads"); goto exit; }
+        if ( thargs  == NULL ) { rc = sf_oom_error("sf_reshape_fill", "thargs");  goto exit; }
+
+        for (t = 0; t < nthreads; t++) {
+            thargs[t].group  = group;
+            thargs[t].shared = shared;
+            thargs[t].jstart = jstart + (ngroups / nthreads) * t;
+            thargs[t].jend   = (t == nthreads - 1)? jend: jstart + (ngroups / nthreads) * (t + 1);
+        }
+
+        nstarted = 0;
+        for (t = 0; t < nthreads; t++) {
+            if ( pthread_create(threads + t, NULL, sf_reshape_fill_thread, thargs + t) ) {
+                break;
+            }
+            nstarted++;
+        }
+
+        // Any range that could not get its own thread is done serially here
+        for (t = nstarted; t < nthreads; t++) {
+            sf_reshape_fill_thread(thargs + t);
+        }
+
+        for (t = 0; t < nstarted; t++) {
+            pthread_join(threads[t], NULL);
+        }
+
+        if ( st_info->verbose ) {
+            if ( nstarted < nthreads ) {
+                sf_printf("(note: only "GT_size_cfmt" of "GT_size_cfmt" threads started)\n",
+                          nstarted, nthreads);
+            }
+            else {
+                sf_printf("(reshaped "GT_size_cfmt" groups in "GT_size_cfmt" threads)\n",
+                          ngroups, nthreads);
+            }
+        }
+
+        for (t = 0; t < nthreads; t++) {
+            if ( (rc = thargs[t].rc) ) break;
+        }
+
+exit:
+        free (thargs);
+        free (threads);
+
+        return (rc);
+    }
+#endif
+
+    (void) nthreads;
+    serial.group  = group;
+    serial.shared = shared;
+    serial.jstart = jstart;
+    serial.jend   = jend;
+    sf_reshape_fill_thread(&serial);
+
+    return (serial.rc);
+}
@@ -1,6 +1,193 @@
 ST_retcode sf_top (struct StataInfo *st_info, int level);
 
+ST_retcode sf_top_levels (
+    struct StataInfo *st_info,
+    int level,
+    ST_double *topkey_in,
+    ST_double wsum_in
+);
+
+GT_bool gf_top_ismiss (struct StataInfo *st_info, GT_size j);
+
+GT_bool gf_top_better (
+    GT_size a,
+    GT_size b,
+    ST_double *topkey,
+    GT_bool invert
+);
+
+void gf_top_heap_push (
+    GT_size *heap,
+    GT_size *nheap,
+    GT_size ntop,
+    GT_size j,
+    ST_double *topkey,
+    GT_bool invert
+);
+
+void gf_top_heap_sort (
+    GT_size *heap,
+    GT_size nheap,
+    ST_double *topkey,
+    GT_bool invert
+);
+
+ST_retcode gf_top_pad (GT_size *topix, GT_size topprint, GT_size ntop, GT_size J);
+
+/**
+ * @brief Whether group j is excluded from the top levels as missing
+ *
+ * With groupmiss, a group is missing if any by variable is missing;
+ * otherwise only if all of them are.
+ */
+GT_bool gf_top_ismiss (struct StataInfo *st_info, GT_size j)
+{
+    ST_double z;
+    GT_size k, sel, rowmiss = 0;
+    GT_size kvars    = st_info->kvars_by;
+    GT_size rowbytes = (st_info->rowbytes + sizeof(GT_size));
+
+    for (k = 0; k < kvars; k++) {
+        if ( st_info->kvars_by_str > 0 ) {
+            sel = j * rowbytes + st_info->positions[k];
+            if ( st_info->byvars_lens[k] > 0 ) {
+                if ( strcmp(st_info->st_by_charx + sel, "") != 0 ) continue;
+            }
+            else {
+                z = *((ST_double *) (st_info->st_by_charx + sel));
+                if ( !SF_is_missing(z) ) continue;
+            }
+        }
+        else {
+            if ( !SF_is_missing(st_info->st_by_numx[j * (kvars + 1) + k]) ) continue;
+        }
+
+        rowmiss++;
+        if ( st_info->top_groupmiss ) return (1);
+    }
+
+    return (rowmiss == kvars);
+}
+
+/**
+ * @brief Whether group a ranks ahead of group b (ties go to a < b)
+ */
+GT_bool gf_top_better (GT_size a, GT_size b, ST_double *topkey, GT_bool invert)
+{
+    if ( topkey[a] == topkey[b] ) return (a < b);
+    return (invert? topkey[a] < topkey[b]: topkey[a] > topkey[b]);
+}
+
+/**
+ * @brief Offer group j to a bounded heap of the best ntop groups
+ *
+ * The root of the heap is the worst group kept so far; j replaces it
+ * if the heap is full and j ranks ahead of it.
+ */
+void gf_top_heap_push (
+    GT_size *heap,
+    GT_size *nheap,
+    GT_size ntop,
+    GT_size j,
+    ST_double *topkey,
+    GT_bool invert)
+{
+    GT_size i, c, p, swap;
+
+    if ( *nheap < ntop ) {
+        i = (*nheap)++;
+        heap[i] = j;
+        while ( i > 0 ) {
+            p = (i - 1) / 2;
+            if ( !gf_top_better(heap[p], heap[i], topkey, invert) ) break;
+            swap = heap[p]; heap[p] = heap[i]; heap[i] = swap;
+            i = p;
+        }
+        return;
+    }
+
+    if ( !gf_top_better(j, heap[0], topkey, invert) ) return;
+
+    heap[0] = j;
+    i = 0;
+    while ( (c = 2 * i + 1) < *nheap ) {
+        if ( (c + 1 < *nheap) && gf_top_better(heap[c], heap[c + 1], topkey, invert) ) c++;
+        if ( !gf_top_better(heap[i], heap[c], topkey, invert) ) break;
+        swap = heap[c]; heap[c] = heap[i]; heap[i] = swap;
+        i = c;
+    }
+}
+
+/**
+ * @brief Sort the heap in place, best group first
+ */
+void gf_top_heap_sort (
+    GT_size *heap,
+    GT_size nheap,
+    ST_double *topkey,
+    GT_bool invert)
+{
+    GT_size i, c, n, swap;
+
+    // Repeatedly move the worst group (the root) to the end
+    for (n = nheap; n > 1; n--) {
+        swap = heap[0]; heap[0] = heap[n - 1]; heap[n - 1] = swap;
+        i = 0;
+        while ( (c = 2 * i + 1) < n - 1 ) {
+            if ( (c + 1 < n - 1) && gf_top_better(heap[c], heap[c + 1], topkey, invert) ) c++;
+            if ( !gf_top_better(heap[i], heap[c], topkey, invert) ) break;
+            swap = heap[c]; heap[c] = heap[i]; heap[i] = swap;
+            i = c;
+        }
+    }
+}
+
+/**
+ * @brief Fill topix[topprint] through topix[ntop - 1] with unused groups
+ *
+ * sf_byx_save_top writes ntop levels; when fewer than ntop groups were
+ * selected, the remaining rows are filled with other groups, in group
+ * order, so that every index is valid.
+ */
+ST_retcode gf_top_pad (GT_size *topix, GT_size topprint, GT_size ntop, GT_size J)
+{
+    GT_size j, k;
+    char *used = calloc(J, sizeof *used);
+    if ( used == NULL ) return (sf_oom_error("gf_top_pad", "used"));
+
+    for (j = 0; j < topprint; j++)
+        used[topix[j]] = 1;
+
+    k = topprint;
+    for (j = 0; (j < J) && (k < ntop); j++) {
+        if ( !used[j] ) topix[k++] = j;
+    }
+
+    free (used);
+    return (0);
+}
+
 ST_retcode sf_top (struct StataInfo *st_info, int level)
+{
+    return (sf_top_levels(st_info, level, NULL, 0));
+}
+
+/**
+ * @brief Top levels by frequency
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param level (Ignored)
+ * @param topkey_in Count (or weighted sum) of each group, if already
+ *        known (e.g. from sf_top_approx); NULL computes them from the
+ *        group index
+ * @param wsum_in Sum of weights, if topkey_in is not NULL
+ * @return Writes top levels to _vals and the gtop result files
+ */
+ST_retcode sf_top_levels (
+    struct StataInfo *st_info,
+    int level,
+    ST_double *topkey_in,
+    ST_double wsum_in)
 {
 
     /*********************************************************************
@@ -35,6 +222,7 @@ ST_retcode sf_top (struct StataInfo *st_info, int level)
     GT_size kalloc   = st_info->top_matasave? 1: (knum > 0? knum * ntop: 1);
     ST_double Ndbl   = (ST_double) st_info->N;
     GT_bool debug    = st_info->debug;
+    GT_bool upper    = (topkey_in != NULL) & !st_info->top_verify;
     clock_t timer    = clock();
 
     FILE *ftopnum;
@@ -64,25 +252,28 @@ ST_retcode sf_top (struct StataInfo *st_info, int level)
     }
 
     /*********************************************************************
-     *                     Step 2: Sort group counts                     *
+     *                    Step 2: Select top group counts                *
      *********************************************************************/
 
-    ST_double *topnum = calloc(kalloc,                 sizeof *topnum);
-    ST_double *toptop = calloc(5 * nrows,              sizeof *toptop);
-    ST_double *topwgt = calloc(weights? st_info->J: 1, sizeof *topwgt);
-    GT_size   *topall = calloc(weights? 1: st_info->J, sizeof *topall);
-    GT_size   *topix  = calloc(st_info->J,             sizeof *topix);
+    // Only the top ntop groups are needed, so instead of sorting all J
+    // group counts (or weighted sums) we keep a bounded heap with the
+    // best ntop groups seen so far, O(J log ntop). Missing groups and
+    // groups below pct() or freq() never enter the heap; the count of
+    // missing groups and the "other" row only need totals, not order.
+
+    ST_double *topnum = calloc(kalloc,      sizeof *topnum);
+    ST_double *toptop = calloc(5 * nrows,   sizeof *toptop);
+    ST_double *topkey = topkey_in? topkey_in: calloc(st_info->J, sizeof *topkey);
+    GT_size   *topix  = calloc(ntop,        sizeof *topix);
 
-    if ( topnum == NULL ) sf_oom_error("sf_top", "topnum");
-    if ( toptop == NULL ) sf_oom_error("sf_top", "toptop");
-    if ( topwgt == NULL ) sf_oom_error("sf_top", "topwgt");
-    if ( topall == NULL ) sf_oom_error("sf_top", "topall");
-    if ( topix  == NULL ) sf_oom_error("sf_top", "topix");
+    if ( topnum == NULL ) return (sf_oom_error("sf_top", "topnum"));
+    if ( toptop == NULL ) return (sf_oom_error("sf_top", "toptop"));
+    if ( topkey == NULL ) return (sf_oom_error("sf_top", "topkey"));
+    if ( topix  == NULL ) return (sf_oom_error("sf_top", "topix"));
 
     GTOOLS_GC_ALLOCATED("topnum")
     GTOOLS_GC_ALLOCATED("toptop")
-    GTOOLS_GC_ALLOCATED("topwgt")
-    GTOOLS_GC_ALLOCATED("topall")
+    GTOOLS_GC_ALLOCATED("topkey")
     GTOOLS_GC_ALLOCATED("topix")
 
     if ( debug ) {
@@ -91,20 +282,18 @@ ST_retcode sf_top (struct StataInfo *st_info, int level)
 
     // Read weights, if requested
     wsum = 0;
-    if ( weights ) {
-        ST_double *sumwgt = calloc(2 * st_info->J, sizeof *sumwgt);
-        if ( sumwgt == NULL ) sf_oom_error("sf_top", "sumwgt");
-
+    if ( topkey_in != NULL ) {
+        wsum = wsum_in;
+    }
+    else if ( weights ) {
         for (j = 0; j < st_info->J; j++) {
-            sumwgt[2 * j]     = 0;
-            sumwgt[2 * j + 1] = j;
             l     = st_info->ix[j];
             start = st_info->info[l];
             end   = st_info->info[l + 1];
             for (i = start; i < end; i++) {
                 sel = st_info->index[i] + st_info->in1;
-                if ( (rc = SF_vdata(wpos, sel, &z)) ) goto errorw;
-                sumwgt[2 * j] += z;
+                if ( (rc = SF_vdata(wpos, sel, &z)) ) goto error;
+                topkey[j] += z;
                 wsum += z;
             }
         }
@@ -112,100 +301,74 @@ ST_retcode sf_top (struct StataInfo *st_info, int level)
         if ( debug ) {
             sf_printf_debug("debug 3 (sf_top): Top levels by weight.\n");
         }
-
-        // We sort by xtileCompareInvert by default to get stuff in
-        // descending order (largest to smallest; note have to use
-        // MultiQuicksortDbl to keep the sort order of the levels).
-
-        // quicksort_bsd (
-        //     sumwgt,
-        //     st_info->J,
-        //     2 * (sizeof *sumwgt),
-        //     invert? xtileCompare: xtileCompareInvert,
-        //     NULL
-        // );
-
-        GT_size invertwgt[2]; invertwgt[0] = !invert; invertwgt[1] = 0;
-        if ( (alpha == 0) | (ntop < st_info->J) ) {
-            MultiQuicksortDbl(
-                sumwgt,
-                st_info->J,
-                0,
-                1,
-                2 * (sizeof *sumwgt),
-                invertwgt
-            );
-        }
-
+    }
+    else {
         for (j = 0; j < st_info->J; j++) {
-            topwgt[j] = sumwgt[2 * j];
-            topix[j]  = (GT_size) sumwgt[2 * j + 1];
-        }
-
-errorw:
-        free (sumwgt);
-        if ( rc ) {
-            goto error;
+            l = st_info->ix[j];
+            topkey[j] = (ST_double) (st_info->info[l + 1] - st_info->info[l]);
         }
 
         if ( debug ) {
-            sf_printf_debug("debug 4 (sf_top): Sorted levels by weight.\n");
+            sf_printf_debug("debug 3 (sf_top): Top (or bottom) levels by count.\n");
         }
     }
-    else {
-        // Read group sizes as N - size so we sort in ascending order
-        if ( invert ) {
-            for (j = 0; j < st_info->J; j++) {
-                l = st_info->ix[j];
-                topall[j] = st_info->info[l + 1] - st_info->info[l];
-                topix[j]  = j;
-            }
-        }
-        else {
-            for (j = 0; j < st_info->J; j++) {
-                l = st_info->ix[j];
-                topall[j] = st_info->N - (st_info->info[l + 1] - st_info->info[l]);
-                topix[j]  = j;
-            }
-        }
 
-        for (j = 0; j < nrows; j++) {
-            for (k = 0; k < 5; k++)
-                toptop[j * 5 + k] = (ST_double) 0;
-        }
+    // Ties are broken by group order, as with a stable sort. With
+    // alpha and every group requested, groups are kept in group order.
 
-        if ( debug ) {
-            sf_printf_debug("debug 3 (sf_top): Top (or bottom) levels by count.\n");
+    GT_size topprint = 0;
+    GT_size totmiss  = 0;
+    GT_bool topsort  = (alpha == 0) | (ntop < st_info->J);
+    ST_double wtotal = weights? wsum: Ndbl;
+
+    for (j = 0; j < st_info->J; j++) {
+        if ( st_info->top_miss && gf_top_ismiss(st_info, j) ) {
+            totmiss += topkey[j];
+            continue;
         }
 
-        // Sort in ascending order, which is descending group order
-        GT_size min   = invert? st_info->nj_min: st_info->N - st_info->nj_max;
-        GT_size max   = invert? st_info->nj_max: st_info->N - st_info->nj_min;
-        GT_size range = (st_info->nj_max - st_info->nj_min);
-        GT_size ctol  = pow(2, 24);
+        if ( (topkey[j] * 100 / wtotal < st_info->top_pct) |
+             (topkey[j] < st_info->top_freq) )
+            continue;
 
-        if ( (alpha == 0) | (ntop < st_info->J) ) {
-            if ( range < ctol ) {
-                if ( (rc = gf_counting_sort (topall, topix, st_info->J, min, max)) )
-                    goto error;
-            }
-            else {
-                if ( (rc = gf_radix_sort16 (topall, topix, st_info->J)) )
-                    goto error;
-            }
+        if ( topsort ) {
+            gf_top_heap_push(topix, &topprint, ntop, j, topkey, invert);
         }
-
-        // Back to frequencies
-        if ( !invert ) {
-            for (j = 0; j < st_info->J; j++)
-                topall[j] = st_info->N - topall[j];
+        else if ( topprint < ntop ) {
+            topix[topprint++] = j;
         }
-
-        if ( debug ) {
-            sf_printf_debug("debug 4 (sf_top): Sorted levels by count.\n");
+        else if ( !st_info->top_miss ) {
+            break;
         }
     }
 
+    if ( topsort ) {
+        gf_top_heap_sort(topix, topprint, topkey, invert);
+    }
+
+    for (j = 0; j < topprint; j++) {
+        toptop[j * 5 + 0] = (ST_double) topix[j];
+        toptop[j * 5 + 1] = topkey[topix[j]];
+        toptop[j * 5 + 3] = topkey[topix[j]] * 100 / wtotal;
+    }
+
+    if ( alpha & (ntop < st_info->J) ) {
+        quicksort_bsd (
+            toptop,
+            topprint,
+            5 * (sizeof *toptop),
+            xtileCompare,
+            NULL
+        );
+    }
+
+    if ( debug ) {
+        sf_printf_debug("debug 4 (sf_top): Selected top levels.\n");
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 4: Selected top levels");
+
     /*********************************************************************
      *            Step 3: Set up variables to print to levels            *
      *********************************************************************/
@@ -260,6 +423,9 @@ errorw:
     if ( (rc = SF_macro_use("_sep",    sep,    (st_info->sep_len    + 1) * sizeof(char))) ) goto exit;
     if ( (rc = SF_macro_use("_numfmt", numfmt, (st_info->numfmt_len + 1) * sizeof(char))) ) goto exit;
 
+    struct GtoolsNumFmt nf;
+    gf_numfmt_init(&nf, numfmt);
+
     if ( debug ) {
         sf_printf_debug("debug 5 (sf_top): Read in locals with meta info.\n");
     }
@@ -268,412 +434,63 @@ errorw:
      *             Step 4: Get top groups and summary Stats              *
      *********************************************************************/
 
-    GT_size topprint = 0;
-    GT_size rowmiss  = 0;
-    GT_size totmiss  = 0;
     GT_size rowbytes = (st_info->rowbytes + sizeof(GT_size));
 
     strpos = macrobuffer;
-    if ( weights ) {
-        if ( st_info->kvars_by_str > 0 ) {
-            if ( st_info->top_miss ) {
-                for (j = 0; j < st_info->J; j++) {
-                    rowmiss = 0;
-                    for (k = 0; k < kvars; k++) {
-                        sel = topix[j] * rowbytes + st_info->positions[k];
-                        if ( st_info->byvars_lens[k] > 0 ) {
-                            if ( strcmp(st_info->st_by_charx + sel, "") == 0 ) {
-                                rowmiss++;
-                                if ( st_info->top_groupmiss )
-                                    goto countmiss_charw;
-                            }
-                        }
-                        else {
-                            z = *((ST_double *) (st_info->st_by_charx + sel));
-                            if ( SF_is_missing(z) ) {
-                                rowmiss++;
-                                if ( st_info->top_groupmiss )
-                                    goto countmiss_charw;
-                            }
-                        }
-                    }
-
-                    if ( st_info->top_miss & (rowmiss == kvars) )
-                        goto countmiss_charw;
-
-                    if ( topprint < ntop ) {
-                        toptop[topprint * 5 + 1] = topwgt[j];
-                        toptop[topprint * 5 + 3] = topwgt[j] * 100 / wsum;
-
-                        if ( (toptop[topprint * 5 + 3] < st_info->top_pct) |
-                             (toptop[topprint * 5 + 1] < st_info->top_freq) )
-                            continue;
-
-                        // toptop[topprint * 5] = (ST_double) j;
-                        toptop[topprint * 5] = (ST_double) topix[j];
-                        topprint++;
-                    }
-                    continue;
-
-countmiss_charw:
-                    totmiss += topwgt[j];
-                }
-            }
-            else {
-                for (j = 0; j < st_info->J; j++) {
-                    if ( topprint >= ntop ) break;
-
-                    toptop[topprint * 5 + 1] = topwgt[j];
-                    toptop[topprint * 5 + 3] = topwgt[j] * 100 / wsum;
-
-                    if ( (toptop[topprint * 5 + 3] < st_info->top_pct) |
-                         (toptop[topprint * 5 + 1] < st_info->top_freq) )
-                        continue;
-
-                    // toptop[topprint * 5] = (ST_double) j;
-                    toptop[topprint * 5] = (ST_double) topix[j];
-                    topprint++;
-                }
-            }
-
-            if ( alpha & (ntop < st_info->J) ) {
-                quicksort_bsd (
-                    toptop,
-                    topprint,
-                    5 * (sizeof *toptop),
-                    xtileCompare,
-                    NULL
-                );
-            }
-
-            if ( st_info->top_matasave ) {
-                strpos += sprintf(strpos, "%s", " ");
-                for (j = 0; j < topprint; j++) {
-                    topix[j] = (GT_size) toptop[j * 5];
-                    toptop[j * 5] = (ST_double) 1;
-                }
-            }
-            else {
-                for (j = 0; j < topprint; j++) {
-                    numpos = 0;
-                    topix[j] = l = (GT_size) toptop[j * 5];
-                    toptop[j * 5] = (ST_double) 1;
-                    if ( j > 0 ) strpos += sprintf(strpos, "%s", sep);
-                    if ( kvars > 1 ) strpos += sprintf(strpos, "`\"");
-                    for (k = 0; k < kvars; k++) {
-                        if ( k > 0 ) strpos += sprintf(strpos, "%s", colsep);
-                        sel = l * rowbytes + st_info->positions[k];
-                        if ( st_info->byvars_lens[k] > 0 ) {
-                            strpos += sprintf(strpos, sprintfmt, st_info->st_by_charx + sel);
-                        }
-                        else {
-                            z = *((ST_double *) (st_info->st_by_charx + sel));
-                            if ( SF_is_missing(z) ) {
-                                GTOOLS_SWITCH_MISSING
-                            }
-                            else {
-                                strpos += sprintf(strpos, numfmt, z);
-                            }
-                            topnum[j * knum + numpos] = z;
-                            numpos++;
-                            // if ( (rc = SF_mat_store("__gtools_top_num", j + 1, numpos, z)) ) goto exit;
-                        }
-                    }
-                    if ( kvars > 1 ) strpos += sprintf(strpos, "\"'");
-                }
-            }
+    if ( st_info->top_matasave ) {
+        strpos += sprintf(strpos, "%s", " ");
+        for (j = 0; j < topprint; j++) {
+            topix[j] = (GT_size) toptop[j * 5];
+            toptop[j * 5] = (ST_double) 1;
         }
-        else {
-            if ( st_info->top_miss ) {
-                for (j = 0; j < st_info->J; j++) {
-                    rowmiss = 0;
-                    for (k = 0; k < kvars; k++) {
-                        sel = topix[j] * (kvars + 1) + k;
-                        if ( SF_is_missing(st_info->st_by_numx[sel]) ) {
-                            rowmiss++;
-                            if ( st_info->top_groupmiss )
-                                goto countmiss_dblw;
-                        }
-                    }
-
-                    if ( st_info->top_miss & (rowmiss == kvars) )
-                        goto countmiss_dblw;
-
-                    if ( topprint < ntop ) {
-                        toptop[topprint * 5 + 1] = topwgt[j];
-                        toptop[topprint * 5 + 3] = topwgt[j] * 100 / wsum;
-
-                        if ( (toptop[topprint * 5 + 3] < st_info->top_pct) |
-                             (toptop[topprint * 5 + 1] < st_info->top_freq) )
-                            continue;
-
-                        // toptop[topprint * 5] = (ST_double) j;
-                        toptop[topprint * 5] = (ST_double) topix[j];
-                        topprint++;
-                    }
-                    continue;
-
-countmiss_dblw:
-                    totmiss += topwgt[j];
-                }
-            }
-            else {
-                for (j = 0; j < st_info->J; j++) {
-                    if ( topprint >= ntop ) break;
-
-                    toptop[topprint * 5 + 1] = topwgt[j];
-                    toptop[topprint * 5 + 3] = topwgt[j] * 100 / wsum;
-
-                    if ( (toptop[topprint * 5 + 3] < st_info->top_pct) |
-                         (toptop[topprint * 5 + 1] < st_info->top_freq) )
-                        continue;
-
-                    // toptop[topprint * 5] = (ST_double) j;
-                    toptop[topprint * 5] = (ST_double) topix[j];
-                    topprint++;
-                }
-            }
-
-            if ( alpha & (ntop < st_info->J) ) {
-                quicksort_bsd (
-                    toptop,
-                    topprint,
-                    5 * (sizeof *toptop),
-                    xtileCompare,
-                    NULL
-                );
-            }
-
-            if ( st_info->top_matasave ) {
-                strpos += sprintf(strpos, "%s", " ");
-                for (j = 0; j < topprint; j++) {
-                    topix[j] = (GT_size) toptop[j * 5];
-                    toptop[j * 5] = (ST_double) 1;
+    }
+    else if ( st_info->kvars_by_str > 0 ) {
+        for (j = 0; j < topprint; j++) {
+            numpos = 0;
+            topix[j] = l = (GT_size) toptop[j * 5];
+            toptop[j * 5] = (ST_double) 1;
+            if ( j > 0 ) strpos += sprintf(strpos, "%s", sep);
+            if ( kvars > 1 ) strpos += sprintf(strpos, "`\"");
+            for (k = 0; k < kvars; k++) {
+                if ( k > 0 ) strpos += sprintf(strpos, "%s", colsep);
+                sel = l * rowbytes + st_info->positions[k];
+                if ( st_info->byvars_lens[k] > 0 ) {
+                    strpos += sprintf(strpos, sprintfmt, st_info->st_by_charx + sel);
                 }
-            }
-            else {
-                for (j = 0; j < topprint; j++) {
-                    topix[j] = l = (GT_size) toptop[j * 5];
-                    toptop[j * 5] = (ST_double) 1;
-                    if ( j > 0 ) strpos += sprintf(strpos, "%s", sep);
-                    if ( kvars > 1 ) strpos += sprintf(strpos, "`\"");
-                    for (k = 0; k < kvars; k++) {
-                        if ( k > 0 ) strpos += sprintf(strpos, "%s", colsep);
-                        sel = l * (kvars + 1) + k;
-                        z  = st_info->st_by_numx[sel];
-                        if ( SF_is_missing(z) ) {
-                            GTOOLS_SWITCH_MISSING
-                        }
-                        else {
-                            strpos += sprintf(strpos, numfmt, z);
-                        }
-                        topnum[j * knum + k] = z;
-                        // if ( (rc = SF_mat_store("__gtools_top_num", j + 1, k + 1, z)) ) goto exit;
+                else {
+                    z = *((ST_double *) (st_info->st_by_charx + sel));
+                    if ( SF_is_missing(z) ) {
+                        GTOOLS_SWITCH_MISSING
+                    }
+                    else {
+                        strpos += gf_numfmt_print(strpos, z, &nf);
                     }
-                    if ( kvars > 1 ) strpos += sprintf(strpos, "\"'");
+                    topnum[j * knum + numpos] = z;
+                    numpos++;
                 }
             }
+            if ( kvars > 1 ) strpos += sprintf(strpos, "\"'");
         }
     }
     else {
-        if ( st_info->kvars_by_str > 0 ) {
-            if ( st_info->top_miss ) {
-                for (j = 0; j < st_info->J; j++) {
-                    rowmiss = 0;
-                    for (k = 0; k < kvars; k++) {
-                        sel = topix[j] * rowbytes + st_info->positions[k];
-                        if ( st_info->byvars_lens[k] > 0 ) {
-                            if ( strcmp(st_info->st_by_charx + sel, "") == 0 ) {
-                                rowmiss++;
-                                if ( st_info->top_groupmiss )
-                                    goto countmiss_char;
-                            }
-                        }
-                        else {
-                            z = *((ST_double *) (st_info->st_by_charx + sel));
-                            if ( SF_is_missing(z) ) {
-                                rowmiss++;
-                                if ( st_info->top_groupmiss )
-                                    goto countmiss_char;
-                            }
-                        }
-                    }
-
-                    if ( st_info->top_miss & (rowmiss == kvars) )
-                        goto countmiss_char;
-
-                    if ( topprint < ntop ) {
-                        toptop[topprint * 5 + 1] = (ST_double) topall[j];
-                        toptop[topprint * 5 + 3] = (ST_double) topall[j] * 100 / Ndbl;
-
-                        if ( (toptop[topprint * 5 + 3] < st_info->top_pct) |
-                             (toptop[topprint * 5 + 1] < st_info->top_freq) )
-                            continue;
-
-                        // toptop[topprint * 5] = (ST_double) j;
-                        toptop[topprint * 5] = (ST_double) topix[j];
-                        topprint++;
-                    }
-                    continue;
-
-countmiss_char:
-                    totmiss += topall[j];
-                }
-            }
-            else {
-                for (j = 0; j < st_info->J; j++) {
-                    if ( topprint >= ntop ) break;
-
-                    toptop[topprint * 5 + 1] = (ST_double) topall[j];
-                    toptop[topprint * 5 + 3] = (ST_double) topall[j] * 100 / Ndbl;
-
-                    if ( (toptop[topprint * 5 + 3] < st_info->top_pct) |
-                         (toptop[topprint * 5 + 1] < st_info->top_freq) )
-                        continue;
-
-                    // toptop[topprint * 5] = (ST_double) j;
-                    toptop[topprint * 5] = (ST_double) topix[j];
-                    topprint++;
+        for (j = 0; j < topprint; j++) {
+            topix[j] = l = (GT_size) toptop[j * 5];
+            toptop[j * 5] = (ST_double) 1;
+            if ( j > 0 ) strpos += sprintf(strpos, "%s", sep);
+            if ( kvars > 1 ) strpos += sprintf(strpos, "`\"");
+            for (k = 0; k < kvars; k++) {
+                if ( k > 0 ) strpos += sprintf(strpos, "%s", colsep);
+                sel = l * (kvars + 1) + k;
+                z  = st_info->st_by_numx[sel];
+                if ( SF_is_missing(z) ) {
+                    GTOOLS_SWITCH_MISSING
                 }
-            }
-
-            if ( alpha & (ntop < st_info->J) ) {
-                quicksort_bsd (
-                    toptop,
-                    topprint,
-                    5 * (sizeof *toptop),
-                    xtileCompare,
-                    NULL
-                );
-            }
-
-            if ( st_info->top_matasave ) {
-                strpos += sprintf(strpos, "%s", " ");
-                for (j = 0; j < topprint; j++) {
-                    topix[j] = (GT_size) toptop[j * 5];
-                    toptop[j * 5] = (ST_double) 1;
-                }
-            }
-            else {
-                for (j = 0; j < topprint; j++) {
-                    numpos = 0;
-                    topix[j] = l = (GT_size) toptop[j * 5];
-                    toptop[j * 5] = (ST_double) 1;
-                    if ( j > 0 ) strpos += sprintf(strpos, "%s", sep);
-                    if ( kvars > 1 ) strpos += sprintf(strpos, "`\"");
-                    for (k = 0; k < kvars; k++) {
-                        if ( k > 0 ) strpos += sprintf(strpos, "%s", colsep);
-                        sel = l * rowbytes + st_info->positions[k];
-                        if ( st_info->byvars_lens[k] > 0 ) {
-                            strpos += sprintf(strpos, sprintfmt, st_info->st_by_charx + sel);
-                        }
-                        else {
-                            z = *((ST_double *) (st_info->st_by_charx + sel));
-                            if ( SF_is_missing(z) ) {
-                                GTOOLS_SWITCH_MISSING
-                            }
-                            else {
-                                strpos += sprintf(strpos, numfmt, z);
-                            }
-                            topnum[j * knum + numpos] = z;
-                            numpos++;
-                            // if ( (rc = SF_mat_store("__gtools_top_num", j + 1, numpos, z)) ) goto exit;
-                        }
-                    }
-                    if ( kvars > 1 ) strpos += sprintf(strpos, "\"'");
-                }
-            }
-        }
-        else {
-            if ( st_info->top_miss ) {
-                for (j = 0; j < st_info->J; j++) {
-                    rowmiss = 0;
-                    for (k = 0; k < kvars; k++) {
-                        sel = topix[j] * (kvars + 1) + k;
-                        if ( SF_is_missing(st_info->st_by_numx[sel]) ) {
-                            rowmiss++;
-                            if ( st_info->top_groupmiss )
-                                goto countmiss_dbl;
-                        }
-                    }
-
-                    if ( st_info->top_miss & (rowmiss == kvars) )
-                        goto countmiss_dbl;
-
-                    if ( topprint < ntop ) {
-                        toptop[topprint * 5 + 1] = (ST_double) topall[j];
-                        toptop[topprint * 5 + 3] = (ST_double) topall[j] * 100 / Ndbl;
-
-                        if ( (toptop[topprint * 5 + 3] < st_info->top_pct) |
-                             (toptop[topprint * 5 + 1] < st_info->top_freq) )
-                            continue;
-
-                        // toptop[topprint * 5] = (ST_double) j;
-                        toptop[topprint * 5] = (ST_double) topix[j];
-                        topprint++;
-                    }
-                    continue;
-
-countmiss_dbl:
-                    totmiss += topall[j];
-                }
-            }
-            else {
-                for (j = 0; j < st_info->J; j++) {
-                    if ( topprint >= ntop ) break;
-
-                    toptop[topprint * 5 + 1] = (ST_double) topall[j];
-                    toptop[topprint * 5 + 3] = (ST_double) topall[j] * 100 / Ndbl;
-
-                    if ( (toptop[topprint * 5 + 3] < st_info->top_pct) |
-                         (toptop[topprint * 5 + 1] < st_info->top_freq) )
-                        continue;
-
-                    // toptop[topprint * 5] = (ST_double) j;
-                    toptop[topprint * 5] = (ST_double) topix[j];
-                    topprint++;
-                }
-            }
-
-            if ( alpha & (ntop < st_info->J) ) {
-                quicksort_bsd (
-                    toptop,
-                    topprint,
-                    5 * (sizeof *toptop),
-                    xtileCompare,
-                    NULL
-                );
-            }
-
-            if ( st_info->top_matasave ) {
-                strpos += sprintf(strpos, "%s", " ");
-                for (j = 0; j < topprint; j++) {
-                    topix[j] = (GT_size) toptop[j * 5];
-                    toptop[j * 5] = (ST_double) 1;
-                }
-            }
-            else {
-                for (j = 0; j < topprint; j++) {
-                    topix[j] = l = (GT_size) toptop[j * 5];
-                    toptop[j * 5] = (ST_double) 1;
-                    if ( j > 0 ) strpos += sprintf(strpos, "%s", sep);
-                    if ( kvars > 1 ) strpos += sprintf(strpos, "`\"");
-                    for (k = 0; k < kvars; k++) {
-                        if ( k > 0 ) strpos += sprintf(strpos, "%s", colsep);
-                        sel = l * (kvars + 1) + k;
-                        z  = st_info->st_by_numx[sel];
-                        if ( SF_is_missing(z) ) {
-                            GTOOLS_SWITCH_MISSING
-                        }
-                        else {
-                            strpos += sprintf(strpos, numfmt, z);
-                        }
-                        topnum[j * knum + k] = z;
-                        // if ( (rc = SF_mat_store("__gtools_top_num", j + 1, k + 1, z)) ) goto exit;
-                    }
-                    if ( kvars > 1 ) strpos += sprintf(strpos, "\"'");
+                else {
+                    strpos += gf_numfmt_print(strpos, z, &nf);
                 }
+                topnum[j * knum + k] = z;
             }
+            if ( kvars > 1 ) strpos += sprintf(strpos, "\"'");
         }
     }
 
@@ -711,9 +528,11 @@ countmiss_dbl:
         }
     }
     else if ( topprint > 0 ) {
-        if ( st_info->top_other & (toptop[(topprint - 1) * 5 + 2] < Ndbl) ) {
+        // Approximate counts (without verify) are upper bounds, so the top
+        // levels can add up to more than N; the other row is then 0.
+        if ( st_info->top_other & ((toptop[(topprint - 1) * 5 + 2] < Ndbl) | upper) ) {
             toptop[topprint * 5 + 0] = 3;
-            toptop[topprint * 5 + 1] = Ndbl - toptop[(topprint - 1) * 5 + 2];
+            toptop[topprint * 5 + 1] = GTOOLS_PWMAX(Ndbl - toptop[(topprint - 1) * 5 + 2], 0);
             toptop[topprint * 5 + 2] = Ndbl;
             toptop[topprint * 5 + 3] = 100 * toptop[topprint * 5 + 1] / Ndbl;
             toptop[topprint * 5 + 4] = 100;
@@ -753,6 +572,9 @@ countmiss_dbl:
 
     if ( st_info->top_matasave ) {
         if ( (alpha == 0) | (ntop < st_info->J) ) {
+            if ( topprint < ntop ) {
+                if ( (rc = gf_top_pad(topix, topprint, ntop, st_info->J)) ) goto exit;
+            }
             if ( (rc = sf_byx_save_top (st_info, ntop, topix)) ) goto exit;
         }
         else {
@@ -770,14 +592,12 @@ exit:
 error:
     free (topnum);
     free (toptop);
-    free (topwgt);
-    free (topall);
+    if ( topkey_in == NULL ) free (topkey);
     free (topix);
 
     GTOOLS_GC_FREED("topnum")
     GTOOLS_GC_FREED("toptop")
-    GTOOLS_GC_FREED("topwgt")
-    GTOOLS_GC_FREED("topall")
+    GTOOLS_GC_FREED("topkey")
     GTOOLS_GC_FREED("topix")
 
     return (rc);
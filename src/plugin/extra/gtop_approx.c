@@ -0,0 +1,420 @@
+/*
+ * Approximate top levels via the Space-Saving sketch (Metwally et al.,
+ * 2005). The by variables are read in one pass without grouping the
+ * data; m counters track the most frequent rows seen so far. A row that
+ * is already tracked increments its counter; otherwise it replaces the
+ * counter with the smallest count, inheriting that count as its error.
+ * Every level with frequency above N / m is guaranteed to be tracked,
+ * and each count overstates the true frequency by at most the smallest
+ * counter. With verify, a second pass counts the candidates exactly.
+ *
+ * Counters are kept in a min-heap by count, and tracked rows are found
+ * through an open-addressing table keyed on the 128-bit row hash (rows
+ * are compared byte by byte, so collisions only cost a memcmp).
+ */
+
+struct GtoolsSpaceSaving {
+    GT_size   m;
+    GT_size   used;
+    GT_size   rowbytes;
+    GT_size   tsize;
+    ST_double *cnt;
+    ST_double *err;
+    uint64_t  *hash;
+    char      *rows;
+    GT_size   *heap;
+    GT_size   *hpos;
+    GT_size   *table;
+};
+
+ST_retcode sf_top_approx (struct StataInfo *st_info, int level);
+
+ST_retcode gf_ss_init (struct GtoolsSpaceSaving *ss, GT_size m, GT_size rowbytes);
+void gf_ss_free (struct GtoolsSpaceSaving *ss);
+void gf_ss_sift_up   (struct GtoolsSpaceSaving *ss, GT_size i);
+void gf_ss_sift_down (struct GtoolsSpaceSaving *ss, GT_size i);
+GT_size gf_ss_find (struct GtoolsSpaceSaving *ss, char *row, uint64_t h, GT_size *slot);
+void gf_ss_delete (struct GtoolsSpaceSaving *ss, GT_size slot);
+void gf_ss_update (struct GtoolsSpaceSaving *ss, char *row, uint64_t h, ST_double w);
+
+ST_retcode sf_top_approx_read (
+    struct StataInfo *st_info,
+    GT_size i,
+    char *row,
+    ST_double *w
+);
+
+ST_retcode gf_ss_init (struct GtoolsSpaceSaving *ss, GT_size m, GT_size rowbytes)
+{
+    ss->m        = m;
+    ss->used     = 0;
+    ss->rowbytes = rowbytes;
+    ss->tsize    = 8;
+    while ( ss->tsize < 2 * m ) ss->tsize <<= 1;
+
+    ss->cnt   = calloc(m,            sizeof *ss->cnt);
+    ss->err   = calloc(m,            sizeof *ss->err);
+    ss->hash  = calloc(m,            sizeof *ss->hash);
+    ss->rows  = calloc(m,            rowbytes);
+    ss->heap  = calloc(m,            sizeof *ss->heap);
+    ss->hpos  = calloc(m,            sizeof *ss->hpos);
+    ss->table = calloc(ss->tsize,    sizeof *ss->table);
+
+    if ( ss->cnt   == NULL ) return (sf_oom_error("gf_ss_init", "ss->cnt"));
+    if ( ss->err   == NULL ) return (sf_oom_error("gf_ss_init", "ss->err"));
+    if ( ss->hash  == NULL ) return (sf_oom_error("gf_ss_init", "ss->hash"));
+    if ( ss->rows  == NULL ) return (sf_oom_error("gf_ss_init", "ss->rows"));
+    if ( ss->heap  == NULL ) return (sf_oom_error("gf_ss_init", "ss->heap"));
+    if ( ss->hpos  == NULL ) return (sf_oom_error("gf_ss_init", "ss->hpos"));
+    if ( ss->table == NULL ) return (sf_oom_error("gf_ss_init", "ss->table"));
+
+    return (0);
+}
+
+void gf_ss_free (struct GtoolsSpaceSaving *ss)
+{
+    free (ss->cnt);
+    free (ss->err);
+    free (ss->hash);
+    free (ss->rows);
+    free (ss->heap);
+    free (ss->hpos);
+    free (ss->table);
+}
+
+void gf_ss_sift_up (struct GtoolsSpaceSaving *ss, GT_size i)
+{
+    GT_size p, c = ss->heap[i];
+    while ( i > 0 ) {
+        p = (i - 1) / 2;
+        if ( ss->cnt[ss->heap[p]] <= ss->cnt[c] ) break;
+        ss->heap[i] = ss->heap[p];
+        ss->hpos[ss->heap[i]] = i;
+        i = p;
+    }
+    ss->heap[i] = c;
+    ss->hpos[c] = i;
+}
+
+void gf_ss_sift_down (struct GtoolsSpaceSaving *ss, GT_size i)
+{
+    GT_size l, c = ss->heap[i];
+    while ( (l = 2 * i + 1) < ss->used ) {
+        if ( (l + 1 < ss->used) && (ss->cnt[ss->heap[l + 1]] < ss->cnt[ss->heap[l]]) ) l++;
+        if ( ss->cnt[c] <= ss->cnt[ss->heap[l]] ) break;
+        ss->heap[i] = ss->heap[l];
+        ss->hpos[ss->heap[i]] = i;
+        i = l;
+    }
+    ss->heap[i] = c;
+    ss->hpos[c] = i;
+}
+
+/**
+ * @brief Counter tracking row, or m if untracked; *slot is its table slot
+ *        (or the empty slot where it would go)
+ */
+GT_size gf_ss_find (struct GtoolsSpaceSaving *ss, char *row, uint64_t h, GT_size *slot)
+{
+    GT_size c, mask = ss->tsize - 1, l = h & mask;
+    while ( ss->table[l] ) {
+        c = ss->table[l] - 1;
+        if ( (ss->hash[c] == h) && (memcmp(ss->rows + c * ss->rowbytes, row, ss->rowbytes) == 0) ) {
+            *slot = l;
+            return (c);
+        }
+        l = (l + 1) & mask;
+    }
+    *slot = l;
+    return (ss->m);
+}
+
+/**
+ * @brief Remove a table entry, shifting back the rest of its probe run
+ */
+void gf_ss_delete (struct GtoolsSpaceSaving *ss, GT_size slot)
+{
+    GT_size i = slot, j = slot, k, mask = ss->tsize - 1;
+    ss->table[i] = 0;
+    while ( 1 ) {
+        j = (j + 1) & mask;
+        if ( ss->table[j] == 0 ) break;
+        k = ss->hash[ss->table[j] - 1] & mask;
+        if ( (i <= j)? ((k <= i) || (k > j)): ((k <= i) && (k > j)) ) {
+            ss->table[i] = ss->table[j];
+            ss->table[j] = 0;
+            i = j;
+        }
+    }
+}
+
+void gf_ss_update (struct GtoolsSpaceSaving *ss, char *row, uint64_t h, ST_double w)
+{
+    GT_size c, slot;
+
+    if ( (c = gf_ss_find(ss, row, h, &slot)) < ss->m ) {
+        ss->cnt[c] += w;
+        gf_ss_sift_down(ss, ss->hpos[c]);
+        return;
+    }
+
+    if ( ss->used < ss->m ) {
+        c = ss->used++;
+        ss->cnt[c]  = w;
+        ss->err[c]  = 0;
+        ss->heap[c] = c;
+        gf_ss_sift_up(ss, c);
+    }
+    else {
+        c = ss->heap[0];
+        gf_ss_find(ss, ss->rows + c * ss->rowbytes, ss->hash[c], &slot);
+        gf_ss_delete(ss, slot);
+        gf_ss_find(ss, row, h, &slot);
+        ss->err[c]  = ss->cnt[c];
+        ss->cnt[c] += w;
+        gf_ss_sift_down(ss, 0);
+    }
+
+    memcpy(ss->rows + c * ss->rowbytes, row, ss->rowbytes);
+    ss->hash[c]     = h;
+    ss->table[slot] = c + 1;
+}
+
+/**
+ * @brief Read the by variables of observation i into row
+ *
+ * @return 0 if the row was read, -2 if it is skipped (if condition or
+ *         a missing value without the missing option), or an error code
+ */
+ST_retcode sf_top_approx_read (
+    struct StataInfo *st_info,
+    GT_size i,
+    char *row,
+    ST_double *w)
+{
+    ST_retcode rc = 0;
+    ST_double z;
+    GT_int  bytes;
+    GT_size k, sel;
+    GT_size in1 = st_info->in1;
+
+    if ( st_info->any_if && !SF_ifobs(i + in1) ) return (-2);
+
+    memset(row, '\0', st_info->rowbytes);
+    for (k = 0; k < st_info->kvars_by; k++) {
+        sel = st_info->positions[k];
+        if ( st_info->byvars_strL[k] ) {
+            bytes = SF_sdatalen(k + 1, i + in1);
+            if ( bytes > 0 ) {
+                if ( SF_strldata (k + 1, i + in1, row + sel, bytes + 1) == -1 ) return (-1);
+            }
+            else if ( st_info->missing == 0 ) {
+                return (-2);
+            }
+        }
+        else if ( st_info->byvars_lens[k] > 0 ) {
+            if ( (rc = SF_sdata(k + 1, i + in1, row + sel)) ) return (rc);
+            if ( (st_info->missing == 0) && (row[sel] == '\0') ) return (-2);
+        }
+        else {
+            if ( (rc = SF_vdata(k + 1, i + in1, &z)) ) return (rc);
+            if ( (st_info->missing == 0) && SF_is_missing(z) ) return (-2);
+            memcpy(row + sel, &z, sizeof(ST_double));
+        }
+    }
+
+    *w = 1;
+    if ( st_info->wcode > 0 ) {
+        if ( (rc = SF_vdata(st_info->wpos, i + in1, w)) ) return (rc);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Approximate top levels of the by variables in bounded memory
+ *
+ * The candidates left in the sketch are copied into the by-level arrays
+ * that sf_top_levels expects (sorted by level, as with a full grouping)
+ * together with their estimated or, with verify, exact counts.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param level (Ignored)
+ * @return Same output as sf_top, plus __gtools_top_approx_err
+ */
+ST_retcode sf_top_approx (struct StataInfo *st_info, int level)
+{
+    ST_retcode rc = 0, rrc;
+    ST_double w, wsum, errmax;
+    uint64_t h1, h2;
+    GT_size i, j, k, c, slot, nobs;
+    GT_size kvars    = st_info->kvars_by;
+    GT_size kstr     = st_info->kvars_by_str;
+    GT_size rowbytes = st_info->rowbytes;
+    GT_size byrow    = rowbytes + sizeof(GT_size);
+    GT_size m        = GTOOLS_PWMAX(st_info->top_approx, (GT_size) fabs(st_info->top_ntop));
+    clock_t timer    = clock();
+
+    struct GtoolsSpaceSaving ss;
+    ST_double *topkey = NULL;
+    st_info->st_by_charx = NULL;
+    st_info->st_by_numx  = NULL;
+
+    char *row = calloc(rowbytes + 1, sizeof *row);
+    if ( row == NULL ) return (sf_oom_error("sf_top_approx", "row"));
+
+    if ( (rc = gf_ss_init(&ss, GTOOLS_PWMAX(m, 1), rowbytes)) ) goto exit;
+
+    /*********************************************************************
+     *                    Step 1: One pass over the data                 *
+     *********************************************************************/
+
+    nobs = 0;
+    wsum = 0;
+    for (i = 0; i < st_info->N; i++) {
+        if ( (rrc = sf_top_approx_read(st_info, i, row, &w)) == -2 ) continue;
+        if ( (rc = rrc) ) goto exit;
+
+        h1 = h2 = 0;
+        spookyhash_128(row, rowbytes, &h1, &h2);
+        gf_ss_update(&ss, row, h1, w);
+        nobs++;
+        wsum += w;
+    }
+
+    if ( nobs == 0 ) {
+        rc = 17001;
+        goto exit;
+    }
+
+    errmax = (ss.used < ss.m)? 0: ss.cnt[ss.heap[0]];
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 1: Space-Saving pass over the data");
+
+    /*********************************************************************
+     *               Step 2: Optionally count candidates exactly         *
+     *********************************************************************/
+
+    if ( st_info->top_verify ) {
+        for (c = 0; c < ss.used; c++)
+            ss.err[c] = 0;
+
+        for (i = 0; i < st_info->N; i++) {
+            if ( (rrc = sf_top_approx_read(st_info, i, row, &w)) == -2 ) continue;
+            if ( (rc = rrc) ) goto exit;
+
+            h1 = h2 = 0;
+            spookyhash_128(row, rowbytes, &h1, &h2);
+            if ( (c = gf_ss_find(&ss, row, h1, &slot)) < ss.m ) {
+                ss.err[c] += w;
+            }
+        }
+
+        for (c = 0; c < ss.used; c++)
+            ss.cnt[c] = ss.err[c];
+
+        errmax = 0;
+
+        if ( st_info->benchmark > 1 )
+            sf_running_timer (&timer, "\tPlugin step 2: Verified candidate counts");
+    }
+
+    /*********************************************************************
+     *           Step 3: Candidates as by levels for sf_top_levels       *
+     *********************************************************************/
+
+    st_info->J = ss.used;
+    st_info->N = nobs;
+
+    topkey = calloc(st_info->J, sizeof *topkey);
+    if ( topkey == NULL ) {
+        rc = sf_oom_error("sf_top_approx", "topkey");
+        goto exit;
+    }
+
+    if ( kstr > 0 ) {
+        st_info->st_by_numx  = malloc(sizeof *st_info->st_by_numx);
+        st_info->st_by_charx = calloc(st_info->J, byrow);
+        if ( st_info->st_by_numx  == NULL ) { rc = sf_oom_error("sf_top_approx", "st_by_numx");  goto exit; }
+        if ( st_info->st_by_charx == NULL ) { rc = sf_oom_error("sf_top_approx", "st_by_charx"); goto exit; }
+
+        for (j = 0; j < st_info->J; j++) {
+            memcpy(st_info->st_by_charx + j * byrow, ss.rows + j * rowbytes, rowbytes);
+            memcpy(st_info->st_by_charx + j * byrow + st_info->positions[kvars], &j, sizeof(GT_size));
+        }
+
+        if ( st_info->mlast ) {
+            MultiQuicksortMCMlast (st_info->st_by_charx, st_info->J, 0, kvars - 1, byrow,
+                                   st_info->byvars_lens, st_info->invert, st_info->positions);
+        }
+        else {
+            MultiQuicksortMC (st_info->st_by_charx, st_info->J, 0, kvars - 1, byrow,
+                              st_info->byvars_lens, st_info->invert, st_info->positions);
+        }
+
+        for (j = 0; j < st_info->J; j++) {
+            c = *((GT_size *) (st_info->st_by_charx + j * byrow + st_info->positions[kvars]));
+            topkey[j] = ss.cnt[c];
+        }
+    }
+    else {
+        st_info->st_by_charx = malloc(sizeof *st_info->st_by_charx);
+        st_info->st_by_numx  = calloc(st_info->J * (kvars + 1), sizeof *st_info->st_by_numx);
+        if ( st_info->st_by_charx == NULL ) { rc = sf_oom_error("sf_top_approx", "st_by_charx"); goto exit; }
+        if ( st_info->st_by_numx  == NULL ) { rc = sf_oom_error("sf_top_approx", "st_by_numx");  goto exit; }
+
+        for (j = 0; j < st_info->J; j++) {
+            for (k = 0; k < kvars; k++) {
+                memcpy(st_info->st_by_numx + j * (kvars + 1) + k,
+                       ss.rows + j * rowbytes + st_info->positions[k],
+                       sizeof(ST_double));
+            }
+            st_info->st_by_numx[j * (kvars + 1) + kvars] = j;
+        }
+
+        if ( st_info->mlast ) {
+            MultiQuicksortDblMlast(st_info->st_by_numx, st_info->J, 0, kvars - 1,
+                                   (kvars + 1) * sizeof(ST_double), st_info->invert);
+        }
+        else {
+            MultiQuicksortDbl(st_info->st_by_numx, st_info->J, 0, kvars - 1,
+                              (kvars + 1) * sizeof(ST_double), st_info->invert);
+        }
+
+        for (j = 0; j < st_info->J; j++) {
+            c = (GT_size) st_info->st_by_numx[j * (kvars + 1) + kvars];
+            topkey[j] = ss.cnt[c];
+        }
+    }
+
+    if ( st_info->debug ) {
+        sf_printf_debug("debug (sf_top_approx): "GT_size_cfmt" obs, "GT_size_cfmt" candidates, error <= %.15g\n",
+                        nobs, st_info->J, errmax);
+    }
+
+    // J, minJ, and maxJ are not known without the full grouping
+    GTOOLS_CHAR(results, 32);
+    sprintf(results, "%.15g", (double) nobs);
+    rc = SF_macro_save("_r_N", results);
+    free (results);
+    if ( rc ) goto exit;
+
+    if ( (rc = SF_scal_save("__gtools_top_approx_err", errmax)) ) goto exit;
+    if ( (rc = sf_top_levels(st_info, level, topkey, st_info->wcode > 0? wsum: 0)) ) goto exit;
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 3: Top levels from candidates");
+
+exit:
+    if ( st_info->st_by_charx != NULL ) free (st_info->st_by_charx);
+    if ( st_info->st_by_numx  != NULL ) free (st_info->st_by_numx);
+    st_info->st_by_charx = NULL;
+    st_info->st_by_numx  = NULL;
+
+    gf_ss_free (&ss);
+    free (topkey);
+    free (row);
+
+    return (rc);
+}
@@ -1,7 +1,15 @@
 ST_retcode sf_hashsort (struct StataInfo *st_info, int level);
+ST_retcode sf_hashsort_permute (struct StataInfo *st_info);
+
+/*
+ * Number of numeric columns gathered together when permuting the data
+ * in place; each random access then reads one full cache line.
+ */
+#define GTOOLS_PERMUTE_BLOCK 8
 
 ST_retcode sf_hashsort (struct StataInfo *st_info, int level)
 {
+    if ( level == 1 ) return (sf_hashsort_permute(st_info));
 
     /*********************************************************************
      *                               Setup                               *
@@ -92,6 +100,160 @@ exit:
     return (rc);
 }
 
+/**
+ * @brief Sort the data in place by permuting every variable
+ *
+ * Instead of writing back _sortindex and having Stata shuffle the data,
+ * every variable passed to the plugin is permuted here. The plugin
+ * varlist is byvars, targets, and then every other variable in the
+ * data; the local permtypes has the string length of each (0 for
+ * numeric). It is a local rather than a matrix so that the number of
+ * variables is not limited by c(matsize). Numeric variables are read
+ * GTOOLS_PERMUTE_BLOCK at a time into a row-major buffer so the gather
+ * in sort order reads whole rows; string variables are gathered one at
+ * a time.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @return Data sorted in place (the caller still sets the sort order)
+ */
+ST_retcode sf_hashsort_permute (struct StataInfo *st_info)
+{
+    GT_size i, j, k, l, sel, out, start, end, src, nblock, bytes;
+    GT_size N      = st_info->N;
+    GT_size J      = st_info->J;
+    GT_size in1    = st_info->in1;
+    GT_size kperm  = 0;
+    GT_size tlen   = 0;
+    GT_size *perm  = NULL;
+    GT_size *block = NULL;
+    GT_int  *types = NULL;
+    ST_double *numbuf = NULL;
+    char *strbuf  = NULL;
+    char *typestr = NULL;
+    char *tptr, *tend;
+
+    ST_retcode rc = 0;
+    clock_t timer = clock();
+
+    if ( (rc = sf_scalar_size("__gtools_hashsort_kperm", &kperm)) ) return (rc);
+    if ( (rc = sf_scalar_size("__gtools_hashsort_tlen",  &tlen))  ) return (rc);
+
+    if ( kperm < 1 ) {
+        sf_errprintf("hashsort: no variables to permute\n");
+        return (198);
+    }
+
+    perm    = calloc(N, sizeof *perm);
+    block   = calloc(GTOOLS_PERMUTE_BLOCK, sizeof *block);
+    types   = calloc(kperm, sizeof *types);
+    typestr = calloc(tlen + 1, sizeof *typestr);
+
+    if ( perm    == NULL ) { rc = sf_oom_error("sf_hashsort_permute", "perm");    goto exit; }
+    if ( block   == NULL ) { rc = sf_oom_error("sf_hashsort_permute", "block");   goto exit; }
+    if ( types   == NULL ) { rc = sf_oom_error("sf_hashsort_permute", "types");   goto exit; }
+    if ( typestr == NULL ) { rc = sf_oom_error("sf_hashsort_permute", "typestr"); goto exit; }
+
+    if ( (rc = SF_macro_use("_permtypes", typestr, tlen + 1)) ) goto exit;
+
+    tptr = typestr;
+    for (k = 0; k < kperm; k++) {
+        types[k] = (GT_int) strtol(tptr, &tend, 10);
+        if ( (tend == tptr) || (types[k] < 0) ) {
+            sf_errprintf("hashsort: unable to parse the variable types\n");
+            rc = 198;
+            goto exit;
+        }
+        tptr = tend;
+    }
+
+    /*********************************************************************
+     *                  Source observation in sort order                 *
+     *********************************************************************/
+
+    if ( st_info->biject ) {
+        for (i = 0; i < N; i++)
+            perm[i] = st_info->index[i];
+    }
+    else {
+        out = 0;
+        for (j = 0; j < J; j++) {
+            sel    = st_info->ix[j];
+            start  = st_info->info[sel];
+            end    = st_info->info[sel + 1];
+            for (i = start; i < end; i++)
+                perm[out++] = st_info->index[i];
+        }
+    }
+
+    /*********************************************************************
+     *                         Numeric variables                         *
+     *********************************************************************/
+
+    numbuf = calloc(N * GTOOLS_PERMUTE_BLOCK, sizeof *numbuf);
+    if ( numbuf == NULL ) { rc = sf_oom_error("sf_hashsort_permute", "numbuf"); goto exit; }
+
+    k = 0;
+    while ( k < (GT_size) kperm ) {
+        nblock = 0;
+        while ( (k < (GT_size) kperm) && (nblock < GTOOLS_PERMUTE_BLOCK) ) {
+            if ( types[k] == 0 ) block[nblock++] = k + 1;
+            k++;
+        }
+        if ( nblock == 0 ) continue;
+
+        for (i = 0; i < N; i++) {
+            for (l = 0; l < nblock; l++) {
+                if ( (rc = SF_vdata(block[l], i + in1, numbuf + i * nblock + l)) ) goto exit;
+            }
+        }
+
+        for (i = 0; i < N; i++) {
+            src = perm[i] * nblock;
+            for (l = 0; l < nblock; l++) {
+                if ( (rc = SF_vstore(block[l], i + in1, numbuf[src + l])) ) goto exit;
+            }
+        }
+    }
+
+    free (numbuf);
+    numbuf = NULL;
+
+    /*********************************************************************
+     *                          String variables                         *
+     *********************************************************************/
+
+    for (k = 0; k < (GT_size) kperm; k++) {
+        if ( types[k] == 0 ) continue;
+
+        bytes  = types[k] + 1;
+        strbuf = calloc(N, bytes * sizeof *strbuf);
+        if ( strbuf == NULL ) { rc = sf_oom_error("sf_hashsort_permute", "strbuf"); goto exit; }
+
+        for (i = 0; i < N; i++) {
+            if ( (rc = SF_sdata(k + 1, i + in1, strbuf + i * bytes)) ) goto exit;
+        }
+
+        for (i = 0; i < N; i++) {
+            if ( (rc = SF_sstore(k + 1, i + in1, strbuf + perm[i] * bytes)) ) goto exit;
+        }
+
+        free (strbuf);
+        strbuf = NULL;
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 5: Permuted data in place");
+
+exit:
+    free (perm);
+    free (block);
+    free (types);
+    free (typestr);
+    free (numbuf);
+    free (strbuf);
+    return (rc);
+}
+
 /*
 index
 0
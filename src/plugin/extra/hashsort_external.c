@@ -0,0 +1,681 @@
+/*
+ * External memory sort for hashsort. The regular path needs the by
+ * variables for every observation in memory (N x rowbytes) plus several
+ * N-length index arrays. Here the data is read in runs that fit in the
+ * user's memory budget; each run is sorted and spilled to disk, and the
+ * runs are then merged with a binary heap to write _sortindex directly.
+ *
+ * Each record is the by variables in the same layout as st_charx (see
+ * sf_hash_byvars) followed by the observation number, which is used to
+ * break ties so the sort is stable across runs.
+ *
+ * At most GTOOLS_XSORT_FANIN runs are open at once: with more, groups
+ * of runs are first merged into longer runs on disk, as many times as
+ * needed. Each open run reads at least GTOOLS_XSORT_MINBUF records at a
+ * time, so a small memory budget does not mean one read per record.
+ */
+
+#define GTOOLS_XSORT_FANIN  128
+#define GTOOLS_XSORT_MINBUF 512
+
+struct GtoolsXSortInfo {
+    GT_size kvars;
+    GT_size rowbytes;
+    GT_size recbytes;
+    GT_size *lens;
+    GT_size *invert;
+    GT_size *positions;
+    GT_bool mlast;
+};
+
+struct GtoolsXSortRun {
+    FILE    *fhandle;
+    char    *buf;
+    GT_size id;
+    GT_size nbuf;
+    GT_size pos;
+    GT_size left;
+};
+
+ST_retcode sf_hashsort_external (struct StataInfo *st_info);
+
+int gf_xsort_compare_keys (const void *a, const void *b, void *thunk);
+int gf_xsort_compare (const void *a, const void *b, void *thunk);
+
+ST_retcode gf_xsort_read (
+    struct StataInfo *st_info,
+    struct GtoolsXSortInfo *xinfo,
+    char *buf,
+    GT_size start,
+    GT_size nrows
+);
+
+ST_retcode gf_xsort_refill (
+    struct GtoolsXSortRun *run,
+    GT_size recbytes
+);
+
+void gf_xsort_sift (
+    GT_size *heap,
+    GT_size nheap,
+    GT_size i,
+    struct GtoolsXSortRun *runs,
+    struct GtoolsXSortInfo *xinfo
+);
+
+ST_retcode gf_xsort_advance (
+    GT_size *heap,
+    GT_size *nheap,
+    struct GtoolsXSortRun *runs,
+    struct GtoolsXSortInfo *xinfo
+);
+
+ST_retcode gf_xsort_open (
+    struct GtoolsXSortRun *runs,
+    GT_size *heap,
+    GT_size *ids,
+    GT_size *counts,
+    GT_size n,
+    GT_size bufrows,
+    char *fprefix,
+    char *fname,
+    struct GtoolsXSortInfo *xinfo
+);
+
+void gf_xsort_close (
+    struct GtoolsXSortRun *runs,
+    GT_size n,
+    char *fprefix,
+    char *fname
+);
+
+ST_retcode gf_xsort_merge_pass (
+    struct GtoolsXSortRun *runs,
+    GT_size *heap,
+    GT_size n,
+    struct GtoolsXSortInfo *xinfo,
+    char *outbuf,
+    GT_size outrows,
+    FILE *fhandle
+);
+
+/**
+ * @brief Compare the by variables of two records
+ *
+ * @param a first record
+ * @param b second record
+ * @param thunk struct GtoolsXSortInfo with the record layout
+ * @return < 0, 0, or > 0 in the sort order requested by the user
+ */
+int gf_xsort_compare_keys (const void *a, const void *b, void *thunk)
+{
+    int cmp;
+    GT_size k;
+    struct GtoolsXSortInfo *xinfo = (struct GtoolsXSortInfo *) thunk;
+
+    for (k = 0; k < xinfo->kvars; k++) {
+        if ( xinfo->lens[k] > 0 ) {
+            cmp = xinfo->invert[k]?
+                AltCompareCharInvert(a, b, xinfo->positions + k):
+                AltCompareChar(a, b, xinfo->positions + k);
+        }
+        else if ( xinfo->invert[k] ) {
+            cmp = xinfo->mlast?
+                AltCompareNumInvertMlast(a, b, xinfo->positions + k):
+                AltCompareNumInvert(a, b, xinfo->positions + k);
+        }
+        else {
+            cmp = AltCompareNum(a, b, xinfo->positions + k);
+        }
+        if ( cmp ) return (cmp);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Compare two records; ties are broken by observation number
+ *
+ * @param a first record
+ * @param b second record
+ * @param thunk struct GtoolsXSortInfo with the record layout
+ * @return < 0, 0, or > 0 in the sort order requested by the user
+ */
+int gf_xsort_compare (const void *a, const void *b, void *thunk)
+{
+    int cmp;
+    GT_size aobs, bobs;
+    struct GtoolsXSortInfo *xinfo = (struct GtoolsXSortInfo *) thunk;
+
+    if ( (cmp = gf_xsort_compare_keys(a, b, thunk)) ) return (cmp);
+
+    memcpy(&aobs, (char *) a + xinfo->rowbytes, sizeof(GT_size));
+    memcpy(&bobs, (char *) b + xinfo->rowbytes, sizeof(GT_size));
+    return (BaseCompareNum(aobs, bobs));
+}
+
+/**
+ * @brief Read a run of observations into records
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param xinfo record layout
+ * @param buf buffer with room for @nrows records
+ * @param start first observation of the run (0-based, relative to in1)
+ * @param nrows number of observations in the run
+ * @return Fills @buf with one record per observation
+ */
+ST_retcode gf_xsort_read (
+    struct StataInfo *st_info,
+    struct GtoolsXSortInfo *xinfo,
+    char *buf,
+    GT_size start,
+    GT_size nrows)
+{
+    ST_retcode rc = 0;
+    ST_double z;
+    GT_size i, k, obs;
+    GT_size in1 = st_info->in1;
+    char *row;
+
+    memset(buf, '\0', nrows * xinfo->recbytes);
+    for (i = 0; i < nrows; i++) {
+        obs = start + i;
+        row = buf + i * xinfo->recbytes;
+        for (k = 0; k < xinfo->kvars; k++) {
+            if ( xinfo->lens[k] > 0 ) {
+                if ( (rc = SF_sdata(k + 1, obs + in1, row + xinfo->positions[k])) ) return (rc);
+            }
+            else {
+                if ( (rc = SF_vdata(k + 1, obs + in1, &z)) ) return (rc);
+                memcpy(row + xinfo->positions[k], &z, sizeof(ST_double));
+            }
+        }
+        memcpy(row + xinfo->rowbytes, &obs, sizeof(GT_size));
+    }
+
+    return (rc);
+}
+
+/**
+ * @brief Read the next block of records from a spilled run
+ *
+ * @param run run to refill
+ * @param recbytes bytes per record
+ * @return Refills the run buffer with up to nbuf records (nbuf is set
+ *         to the number read, so it only shrinks on the last block)
+ */
+ST_retcode gf_xsort_refill (struct GtoolsXSortRun *run, GT_size recbytes)
+{
+    GT_size nread = run->left < run->nbuf? run->left: run->nbuf;
+    if ( fread(run->buf, recbytes, nread, run->fhandle) != nread ) {
+        sf_errprintf("hashsort: unable to read sorted run from disk\n");
+        return (692);
+    }
+    run->pos  = 0;
+    run->nbuf = nread;
+    run->left = run->left - nread;
+    return (0);
+}
+
+/**
+ * @brief Restore the heap property below position i
+ *
+ * @param heap run numbers, ordered by their current record
+ * @param nheap number of runs in the heap
+ * @param i position to sift down from
+ * @param runs runs being merged
+ * @param xinfo record layout
+ * @return Re-orders @heap
+ */
+void gf_xsort_sift (
+    GT_size *heap,
+    GT_size nheap,
+    GT_size i,
+    struct GtoolsXSortRun *runs,
+    struct GtoolsXSortInfo *xinfo)
+{
+    GT_size l, r, m, swap;
+    char *cur, *other;
+
+    while ( 1 ) {
+        l = 2 * i + 1;
+        r = 2 * i + 2;
+        m = i;
+        if ( l < nheap ) {
+            cur   = runs[heap[m]].buf + runs[heap[m]].pos * xinfo->recbytes;
+            other = runs[heap[l]].buf + runs[heap[l]].pos * xinfo->recbytes;
+            if ( gf_xsort_compare(other, cur, xinfo) < 0 ) m = l;
+        }
+        if ( r < nheap ) {
+            cur   = runs[heap[m]].buf + runs[heap[m]].pos * xinfo->recbytes;
+            other = runs[heap[r]].buf + runs[heap[r]].pos * xinfo->recbytes;
+            if ( gf_xsort_compare(other, cur, xinfo) < 0 ) m = r;
+        }
+        if ( m == i ) break;
+        swap    = heap[i];
+        heap[i] = heap[m];
+        heap[m] = swap;
+        i = m;
+    }
+}
+
+/**
+ * @brief Move past the record at the top of the heap
+ *
+ * @param heap run numbers, ordered by their current record
+ * @param nheap number of runs in the heap; decremented when a run is done
+ * @param runs runs being merged
+ * @param xinfo record layout
+ * @return Refills the top run if needed and re-orders @heap
+ */
+ST_retcode gf_xsort_advance (
+    GT_size *heap,
+    GT_size *nheap,
+    struct GtoolsXSortRun *runs,
+    struct GtoolsXSortInfo *xinfo)
+{
+    ST_retcode rc = 0;
+    struct GtoolsXSortRun *top = runs + heap[0];
+
+    if ( ++(top->pos) >= top->nbuf ) {
+        if ( top->left > 0 ) {
+            if ( (rc = gf_xsort_refill(top, xinfo->recbytes)) ) return (rc);
+        }
+        else {
+            heap[0] = heap[--(*nheap)];
+        }
+    }
+    gf_xsort_sift(heap, *nheap, 0, runs, xinfo);
+
+    return (rc);
+}
+
+/**
+ * @brief Open spilled runs for merging
+ *
+ * @param runs where to open the runs (zeroed, so they can be closed on error)
+ * @param heap filled with the runs in heap order
+ * @param ids file number of each run (GTOOLS_SORT_FILE.#)
+ * @param counts number of records in each run
+ * @param n number of runs
+ * @param bufrows records read from each run at a time
+ * @param fprefix GTOOLS_SORT_FILE
+ * @param fname buffer for the file names
+ * @param xinfo record layout
+ * @return Opens @n runs with their first block read
+ */
+ST_retcode gf_xsort_open (
+    struct GtoolsXSortRun *runs,
+    GT_size *heap,
+    GT_size *ids,
+    GT_size *counts,
+    GT_size n,
+    GT_size bufrows,
+    char *fprefix,
+    char *fname,
+    struct GtoolsXSortInfo *xinfo)
+{
+    ST_retcode rc = 0;
+    GT_size r, i;
+
+    for (r = 0; r < n; r++) {
+        runs[r].id   = ids[r];
+        runs[r].left = counts[r];
+        runs[r].nbuf = bufrows;
+        runs[r].pos  = 0;
+        runs[r].buf  = calloc(bufrows, xinfo->recbytes);
+        if ( runs[r].buf == NULL ) return (sf_oom_error("gf_xsort_open", "runs[r].buf"));
+
+        sprintf(fname, "%s.%lu", fprefix, (unsigned long) ids[r]);
+        if ( (runs[r].fhandle = fopen(fname, "rb")) == NULL ) {
+            sf_errprintf("hashsort: unable to open %s for reading\n", fname);
+            return (603);
+        }
+        if ( (rc = gf_xsort_refill(runs + r, xinfo->recbytes)) ) return (rc);
+        heap[r] = r;
+    }
+
+    for (i = n / 2; i > 0; i--)
+        gf_xsort_sift(heap, n, i - 1, runs, xinfo);
+
+    return (rc);
+}
+
+/**
+ * @brief Close merged runs and delete their files
+ *
+ * @param runs runs to close
+ * @param n number of runs
+ * @param fprefix GTOOLS_SORT_FILE
+ * @param fname buffer for the file names
+ * @return Frees the run buffers and zeroes @runs
+ */
+void gf_xsort_close (
+    struct GtoolsXSortRun *runs,
+    GT_size n,
+    char *fprefix,
+    char *fname)
+{
+    GT_size r;
+    for (r = 0; r < n; r++) {
+        if ( runs[r].fhandle != NULL ) {
+            fclose(runs[r].fhandle);
+            sprintf(fname, "%s.%lu", fprefix, (unsigned long) runs[r].id);
+            remove(fname);
+        }
+        free (runs[r].buf);
+        memset(runs + r, '\0', sizeof *runs);
+    }
+}
+
+/**
+ * @brief Merge open runs into a single run on disk
+ *
+ * @param runs open runs
+ * @param heap runs in heap order (see gf_xsort_open)
+ * @param n number of runs
+ * @param xinfo record layout
+ * @param outbuf buffer with room for @outrows records
+ * @param outrows records written at a time
+ * @param fhandle output file
+ * @return Writes the records of every run to @fhandle in sort order
+ */
+ST_retcode gf_xsort_merge_pass (
+    struct GtoolsXSortRun *runs,
+    GT_size *heap,
+    GT_size n,
+    struct GtoolsXSortInfo *xinfo,
+    char *outbuf,
+    GT_size outrows,
+    FILE *fhandle)
+{
+    ST_retcode rc = 0;
+    GT_size nheap = n, nout = 0;
+
+    while ( nheap > 0 ) {
+        memcpy(outbuf + nout * xinfo->recbytes,
+               runs[heap[0]].buf + runs[heap[0]].pos * xinfo->recbytes,
+               xinfo->recbytes);
+        if ( ++nout == outrows ) {
+            if ( fwrite(outbuf, xinfo->recbytes, nout, fhandle) != nout ) goto error;
+            nout = 0;
+        }
+        if ( (rc = gf_xsort_advance(heap, &nheap, runs, xinfo)) ) return (rc);
+    }
+
+    if ( nout > 0 ) {
+        if ( fwrite(outbuf, xinfo->recbytes, nout, fhandle) != nout ) goto error;
+    }
+
+    return (rc);
+
+error:
+    sf_errprintf("hashsort: unable to write merged run to disk\n");
+    return (693);
+}
+
+/**
+ * @brief Sort the data in runs that fit in memory and merge them
+ *
+ * The memory budget (MiB) is in __gtools_hashsort_external and the
+ * runs are spilled to GTOOLS_SORT_FILE.#. As the merge outputs records
+ * in sort order, it writes the rank of each observation to _sortindex
+ * (or the observation at each rank if the index is inverted in mata)
+ * and the group ID to the generate() target, if requested.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @return Writes _sortindex and sets r(N), r(J), r(minJ), r(maxJ)
+ */
+ST_retcode sf_hashsort_external (struct StataInfo *st_info)
+{
+    ST_retcode rc = 0;
+    GT_size r, g, j, nrows, nruns, runrows, bufrows, budget, flen;
+    GT_size nlive, nfiles, nopen, nmax, npass;
+    GT_size obs, rank, nj, J, nj_min, nj_max;
+    GT_size N     = st_info->N;
+    GT_size in1   = st_info->in1;
+    GT_size kgen  = st_info->kvars_group > 0? st_info->kvars_by + 1: 0;
+    GT_size ksort = st_info->kvars_by + st_info->kvars_group + 1;
+    struct GtoolsXSortInfo xinfo;
+    struct GtoolsXSortRun *runs = NULL;
+    GT_size *heap   = NULL;
+    GT_size *ids    = NULL;
+    GT_size *counts = NULL;
+    char *buf     = NULL;
+    char *prev    = NULL;
+    char *rec     = NULL;
+    char *fprefix = NULL;
+    char *fname   = NULL;
+    FILE *fhandle = NULL;
+    clock_t timer = clock();
+
+    if ( st_info->kvars_by_strL > 0 ) {
+        sf_errprintf("hashsort: option external() does not support strL variables\n");
+        return (198);
+    }
+
+    xinfo.kvars     = st_info->kvars_by;
+    xinfo.rowbytes  = st_info->rowbytes;
+    xinfo.recbytes  = st_info->rowbytes + sizeof(GT_size);
+    xinfo.lens      = st_info->byvars_lens;
+    xinfo.invert    = st_info->invert;
+    xinfo.positions = st_info->positions;
+    xinfo.mlast     = st_info->mlast;
+
+    if ( (rc = sf_scalar_size("__gtools_hashsort_external", &budget)) ) return (rc);
+    if ( (rc = sf_scalar_size("__gtools_gfile_sort",        &flen))   ) return (rc);
+
+    budget  = budget * 1024 * 1024;
+    runrows = budget / xinfo.recbytes;
+    if ( runrows < 1024 ) runrows = 1024;
+    if ( runrows > N ) runrows = N > 0? N: 1;
+    nruns  = N > 0? (N + runrows - 1) / runrows: 0;
+    nmax   = nruns < GTOOLS_XSORT_FANIN? nruns: GTOOLS_XSORT_FANIN;
+    nfiles = nruns;
+
+    buf     = calloc(runrows, xinfo.recbytes);
+    prev    = calloc(1, xinfo.rowbytes + 1);
+    fprefix = calloc(flen, sizeof *fprefix);
+    fname   = calloc(flen + 32, sizeof *fname);
+    runs    = calloc(nmax  > 0? nmax:  1, sizeof *runs);
+    heap    = calloc(nmax  > 0? nmax:  1, sizeof *heap);
+    ids     = calloc(nruns > 0? nruns: 1, sizeof *ids);
+    counts  = calloc(nruns > 0? nruns: 1, sizeof *counts);
+
+    if ( buf     == NULL ) { rc = sf_oom_error("sf_hashsort_external", "buf");     goto exit; }
+    if ( prev    == NULL ) { rc = sf_oom_error("sf_hashsort_external", "prev");    goto exit; }
+    if ( fprefix == NULL ) { rc = sf_oom_error("sf_hashsort_external", "fprefix"); goto exit; }
+    if ( fname   == NULL ) { rc = sf_oom_error("sf_hashsort_external", "fname");   goto exit; }
+    if ( runs    == NULL ) { rc = sf_oom_error("sf_hashsort_external", "runs");    goto exit; }
+    if ( heap    == NULL ) { rc = sf_oom_error("sf_hashsort_external", "heap");    goto exit; }
+    if ( ids     == NULL ) { rc = sf_oom_error("sf_hashsort_external", "ids");     goto exit; }
+    if ( counts  == NULL ) { rc = sf_oom_error("sf_hashsort_external", "counts");  goto exit; }
+
+    if ( (rc = SF_macro_use("GTOOLS_SORT_FILE", fprefix, flen)) ) goto exit;
+
+    /*********************************************************************
+     *                      Step 1: Sort and spill runs                  *
+     *********************************************************************/
+
+    for (r = 0; r < nruns; r++) {
+        nrows = (r + 1 < nruns)? runrows: N - r * runrows;
+        if ( (rc = gf_xsort_read(st_info, &xinfo, buf, r * runrows, nrows)) ) goto exit;
+        quicksort_bsd(buf, nrows, xinfo.recbytes, gf_xsort_compare, &xinfo);
+
+        ids[r]    = r;
+        counts[r] = nrows;
+        if ( nruns == 1 ) break;
+
+        sprintf(fname, "%s.%lu", fprefix, (unsigned long) r);
+        if ( (fhandle = fopen(fname, "wb")) == NULL ) {
+            sf_errprintf("hashsort: unable to open %s for writing\n", fname);
+            rc = 603;
+            goto exit;
+        }
+        if ( fwrite(buf, xinfo.recbytes, nrows, fhandle) != nrows ) {
+            sf_errprintf("hashsort: unable to write sorted run to disk\n");
+            rc = 693;
+            goto exit;
+        }
+        fclose(fhandle);
+        fhandle = NULL;
+    }
+
+    if ( st_info->benchmark > 1 ) {
+        sf_printf("\tPlugin step 2: Sorted "GT_size_cfmt" run(s) of up to "GT_size_cfmt" obs\n",
+                  nruns, runrows);
+        sf_running_timer (&timer, "\tPlugin step 2: Sorted and spilled runs");
+    }
+
+    /*********************************************************************
+     *              Step 2: Merge runs down to the fan-in cap            *
+     *********************************************************************/
+
+    // Each pass merges groups of up to GTOOLS_XSORT_FANIN runs into one
+    // longer run (GTOOLS_SORT_FILE.nfiles); a leftover single run is
+    // carried over as is. ids and counts hold the live runs.
+
+    nlive = nruns;
+    npass = 0;
+    if ( nlive > GTOOLS_XSORT_FANIN ) {
+        free (buf);
+        bufrows = runrows / (GTOOLS_XSORT_FANIN + 1);
+        if ( bufrows < GTOOLS_XSORT_MINBUF ) bufrows = GTOOLS_XSORT_MINBUF;
+        if ( (buf = calloc(bufrows, xinfo.recbytes)) == NULL ) {
+            rc = sf_oom_error("sf_hashsort_external", "buf");
+            goto exit;
+        }
+    }
+
+    while ( nlive > GTOOLS_XSORT_FANIN ) {
+        for (g = 0, j = 0; g < nlive; g += nopen, j++) {
+            nopen = nlive - g < GTOOLS_XSORT_FANIN? nlive - g: GTOOLS_XSORT_FANIN;
+            if ( nopen == 1 ) {
+                ids[j]    = ids[g];
+                counts[j] = counts[g];
+                continue;
+            }
+
+            rc = gf_xsort_open(runs, heap, ids + g, counts + g, nopen,
+                               bufrows, fprefix, fname, &xinfo);
+            if ( rc ) goto exit;
+
+            sprintf(fname, "%s.%lu", fprefix, (unsigned long) nfiles);
+            if ( (fhandle = fopen(fname, "wb")) == NULL ) {
+                sf_errprintf("hashsort: unable to open %s for writing\n", fname);
+                rc = 603;
+                goto exit;
+            }
+            rc = gf_xsort_merge_pass(runs, heap, nopen, &xinfo, buf, bufrows, fhandle);
+            fclose(fhandle);
+            fhandle = NULL;
+            if ( rc ) goto exit;
+
+            gf_xsort_close(runs, nopen, fprefix, fname);
+            for (nrows = 0, r = g; r < g + nopen; r++)
+                nrows += counts[r];
+
+            ids[j]    = nfiles++;
+            counts[j] = nrows;
+        }
+        nlive = j;
+        npass++;
+    }
+
+    if ( (st_info->benchmark > 1) && (npass > 0) )
+        sf_printf("\tPlugin step 3: Merged runs in "GT_size_cfmt" extra pass(es)\n", npass);
+
+    /*********************************************************************
+     *                    Step 3: Merge runs in order                    *
+     *********************************************************************/
+
+    if ( nruns == 1 ) {
+        runs[0].buf  = buf;
+        runs[0].nbuf = counts[0];
+        runs[0].left = 0;
+        runs[0].pos  = 0;
+        heap[0] = 0;
+        buf = NULL;
+    }
+    else if ( nruns > 1 ) {
+        free (buf);
+        buf = NULL;
+
+        bufrows = runrows / nlive;
+        if ( bufrows < GTOOLS_XSORT_MINBUF ) bufrows = GTOOLS_XSORT_MINBUF;
+        rc = gf_xsort_open(runs, heap, ids, counts, nlive,
+                           bufrows, fprefix, fname, &xinfo);
+        if ( rc ) goto exit;
+    }
+
+    J      = 0;
+    nj     = 0;
+    nj_min = N;
+    nj_max = 0;
+    r      = nlive;
+    for (rank = 0; rank < N; rank++) {
+        rec = runs[heap[0]].buf + runs[heap[0]].pos * xinfo.recbytes;
+        memcpy(&obs, rec + xinfo.rowbytes, sizeof(GT_size));
+
+        if ( (rank == 0) || gf_xsort_compare_keys(prev, rec, &xinfo) ) {
+            if ( rank > 0 ) {
+                if ( nj < nj_min ) nj_min = nj;
+                if ( nj > nj_max ) nj_max = nj;
+            }
+            memcpy(prev, rec, xinfo.rowbytes);
+            nj = 0;
+            J++;
+        }
+        nj++;
+
+        if ( st_info->invertix ) {
+            if ( (rc = SF_vstore(ksort, obs + in1, rank + 1)) ) goto exit;
+        }
+        else {
+            if ( (rc = SF_vstore(ksort, rank + in1, obs + 1)) ) goto exit;
+        }
+
+        if ( kgen ) {
+            if ( (rc = SF_vstore(kgen, obs + in1, J)) ) goto exit;
+        }
+
+        if ( (rc = gf_xsort_advance(heap, &r, runs, &xinfo)) ) goto exit;
+    }
+
+    if ( N > 0 ) {
+        if ( nj < nj_min ) nj_min = nj;
+        if ( nj > nj_max ) nj_max = nj;
+    }
+    else {
+        nj_min = 0;
+    }
+
+    st_info->J      = J;
+    st_info->nj_min = nj_min;
+    st_info->nj_max = nj_max;
+    rc = sf_set_rinfo(st_info, 0);
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 3: Merged runs and wrote back _sortindex");
+
+exit:
+    if ( fhandle != NULL ) fclose(fhandle);
+    if ( (fprefix != NULL) && (fname != NULL) ) {
+        if ( runs != NULL ) gf_xsort_close(runs, nmax, fprefix, fname);
+        for (r = 0; (nruns > 1) && (r < nfiles); r++) {
+            sprintf(fname, "%s.%lu", fprefix, (unsigned long) r);
+            remove(fname);
+        }
+    }
+
+    free (runs);
+    free (heap);
+    free (ids);
+    free (counts);
+    free (buf);
+    free (prev);
+    free (fprefix);
+    free (fname);
+
+    return (rc);
+}
@@ -27,6 +27,8 @@
 #include "common/fixes.c"
 #include "common/quicksortMultiLevel.c"
 #include "common/readWrite.c"
+#include "common/numfmt.c"
+#include "common/gtools_spill.c"
 #include "hash/gtools_hash.c"
 #include "common/encode.c"
 
@@ -40,10 +42,14 @@
 #include "collapse/gegen.c"
 
 #include "extra/gisid.c"
+#include "extra/gdistinct.c"
 #include "extra/glevelsof.c"
 #include "extra/hashsort.c"
+#include "extra/hashsort_external.c"
 #include "extra/gcontract.c"
+#include "extra/gduplicates.c"
 #include "extra/gtop.c"
+#include "extra/gtop_approx.c"
 #include "extra/greshape.c"
 #include "extra/greshape_fast.c"
 #include "stats/gstats.c"
@@ -77,6 +83,8 @@ STDLL stata_call(int argc, char *argv[])
     strcpy (todo, argv[0]);
 
     int free_level = 0;
+    int dupcode    = 0;
+    GT_bool gcache_hit = 0;
     struct StataInfo *st_info = malloc(sizeof(*st_info));
     st_info->free = 0;
     GTOOLS_GC_INIT
@@ -91,10 +99,13 @@ STDLL stata_call(int argc, char *argv[])
      *     - recast:    Bulk copy sources into targets.                       *
      *     - hash:      Generic (read, hash, sort, generate, summary stats).  *
      *     - isid:      Do by vars uniquely identify obs?                     *
+     *     - distinct:  Number of levels of each by var, separately.          *
      *     - levelsof:  Levels of by variables.                               *
-     *     - top:       Top levels by frequency.                              *
+     *     - top:       Top levels by frequency (approx: Space-Saving sketch) *
      *     - contract:  Frequency counts of levels.                           *
-     *     - hashsort:  Sort data by variables.                               *
+     *     - duplicates: tag, drop, or report duplicate observations.         *
+     *     - hashsort:  Sort data by variables (permute: sort data in place;  *
+     *                  external: sort in runs that are spilled to disk).     *
      *     - quantiles: Percentiles, xtile, bin counts, and more.             *
      *     - collapse:  Summary stat by group.                                *
      *     - stats:     Several stat functions and transforms.                *
@@ -289,9 +300,13 @@ STDLL stata_call(int argc, char *argv[])
         }
     }
     else if ( strcmp(todo, "hash") == 0 ) {
-        if ( (rc = sf_parse_info   (st_info, 0))  ) goto exit;
-        if ( (rc = sf_hash_byvars  (st_info, 0))  ) goto exit;
-        if ( (rc = sf_check_hash   (st_info, 22)) ) goto exit; // (Note: discards by copy)
+        if ( (rc = sf_parse_info     (st_info, 0))  ) goto exit;
+        if ( (rc = sf_gcache_restore (st_info, &gcache_hit)) ) goto exit;
+        if ( gcache_hit == 0 ) {
+            if ( (rc = sf_hash_byvars  (st_info, 0))  ) goto exit;
+            if ( (rc = sf_check_hash   (st_info, 22)) ) goto exit; // (Note: discards by copy)
+            if ( (rc = sf_gcache_store (st_info))     ) goto exit;
+        }
         if ( (rc = sf_encode       (st_info, 0))  ) goto exit;
         if ( (rc = sf_egen_bulk    (st_info, 0))  ) goto exit;
         if ( (rc = sf_write_output (st_info, 0, st_info->kvars_targets, "")) ) goto exit;
@@ -300,6 +315,11 @@ STDLL stata_call(int argc, char *argv[])
         if ( (rc = sf_parse_info  (st_info, 0)) ) goto exit;
         if ( (rc = sf_hash_byvars (st_info, 2)) ) goto exit;
     }
+    else if ( strcmp(todo, "distinct") == 0 ) {
+        if ( (rc = sf_parse_info  (st_info, 0))   ) goto exit;
+        if ( (rc = sf_hash_byvars (st_info, 111)) ) goto exit; // quit before by hashing
+        if ( (rc = sf_distinct    (st_info, 0))   ) goto exit;
+    }
     else if ( strcmp(todo, "levelsof") == 0 ) {
         if ( (rc = sf_parse_info  (st_info, 0)) ) goto exit;
         if ( (rc = sf_hash_byvars (st_info, 0)) ) goto exit;
@@ -307,6 +327,11 @@ STDLL stata_call(int argc, char *argv[])
         if ( (rc = sf_levelsof    (st_info, 0)) ) goto exit;
         if ( (rc = sf_encode      (st_info, 0)) ) goto exit;
     }
+    else if ( (strcmp(todo, "top") == 0) && (argc > 1) && (strcmp(argv[1], "approx") == 0) ) {
+        if ( (rc = sf_parse_info  (st_info, 0))   ) goto exit;
+        if ( (rc = sf_hash_byvars (st_info, 111)) ) goto exit; // quit before by hashing
+        if ( (rc = sf_top_approx  (st_info, 0))   ) goto exit;
+    }
     else if ( strcmp(todo, "top") == 0 ) {
         if ( (rc = sf_parse_info  (st_info, 0)) ) goto exit;
         if ( (rc = sf_hash_byvars (st_info, 0)) ) goto exit;
@@ -321,24 +346,60 @@ STDLL stata_call(int argc, char *argv[])
         if ( (rc = sf_contract    (st_info, 0)) ) goto exit;
         if ( (rc = sf_write_collapsed (st_info, 8, st_info->contract_vars, "")) ) goto exit;
     }
+    else if ( strcmp(todo, "duplicates") == 0 ) {
+        if ( argc > 1 ) {
+            if ( strcmp(argv[1], "tag")    == 0 ) dupcode = 1;
+            if ( strcmp(argv[1], "drop")   == 0 ) dupcode = 2;
+            if ( strcmp(argv[1], "report") == 0 ) dupcode = 3;
+        }
+        if ( dupcode == 0 ) {
+            sf_errprintf("duplicates: expected one of tag, drop, or report\n");
+            rc = 198;
+            goto exit;
+        }
+        if ( (rc = sf_parse_info  (st_info, 0))       ) goto exit;
+        if ( (rc = sf_hash_byvars (st_info, 0))       ) goto exit;
+        if ( (rc = sf_check_hash  (st_info, 22))      ) goto exit; // (Note: discards by copy)
+        if ( (rc = sf_duplicates  (st_info, dupcode)) ) goto exit;
+    }
+    else if ( strcmp(todo, "hashsort") == 0 && (argc > 1) && (strcmp(argv[1], "external") == 0) ) {
+        if ( (rc = sf_parse_info        (st_info, 0))   ) goto exit;
+        if ( (rc = sf_hash_byvars       (st_info, 111)) ) goto exit; // quit before by hashing
+        if ( (rc = sf_hashsort_external (st_info))      ) goto exit;
+    }
     else if ( strcmp(todo, "hashsort") == 0 ) {
         if ( (rc = sf_parse_info  (st_info, 0))  ) goto exit;
         if ( (rc = sf_hash_byvars (st_info, 3))  ) goto exit;
         if ( (rc = sf_check_hash  (st_info, 22)) ) goto exit; // (Note: discards by copy)
         // todo xx keep by copy with by and 2
         if ( (rc = sf_encode      (st_info, 0))  ) goto exit;
-        if ( (rc = sf_hashsort    (st_info, 0))  ) goto exit;
+        if ( (argc > 1) && (strcmp(argv[1], "permute") == 0) ) {
+            if ( (rc = sf_hashsort (st_info, 1)) ) goto exit;
+        }
+        else {
+            if ( (rc = sf_hashsort (st_info, 0)) ) goto exit;
+        }
     }
     else if ( strcmp(todo, "quantiles") == 0 ) {
         if ( (rc = sf_parse_info (st_info, 0)) ) goto exit;
         if ( st_info->kvars_by == 0 ) {
-            if ( (rc = sf_xtile  (st_info, 0)) ) goto exit;
+            if ( st_info->xtile_approx > 0 ) {
+                if ( (rc = sf_xtile_approx (st_info, 0)) ) goto exit;
+            }
+            else {
+                if ( (rc = sf_xtile (st_info, 0)) ) goto exit;
+            }
         }
         else {
             if ( (rc = sf_hash_byvars (st_info, 0))  ) goto exit;
             if ( (rc = sf_check_hash  (st_info, 22)) ) goto exit; // (Note: discards by copy)
             if ( (rc = sf_encode      (st_info, 0))  ) goto exit;
-            if ( (rc = sf_xtile_by    (st_info, 0))  ) goto exit;
+            if ( st_info->xtile_approx > 0 ) {
+                if ( (rc = sf_xtile_approx (st_info, 0)) ) goto exit;
+            }
+            else {
+                if ( (rc = sf_xtile_by (st_info, 0)) ) goto exit;
+            }
         }
     }
     else if ( strcmp(todo, "stats") == 0 ) {
@@ -367,7 +428,13 @@ STDLL stata_call(int argc, char *argv[])
 
         if ( strcmp(tostat, "fwrite") == 0 ) {
             if ( (rc = sf_parse_info   (st_info, 0))        ) goto exit;
-            if ( (rc = sf_hash_byvars  (st_info, 111))      ) goto exit;
+            if ( st_info->greshape_code == 2 ) {
+                if ( (rc = sf_hash_byvars (st_info, 0)) ) goto exit;
+                if ( (rc = sf_check_hash  (st_info, 2)) ) goto exit; // (Note: keeps by copy)
+            }
+            else {
+                if ( (rc = sf_hash_byvars (st_info, 111)) ) goto exit;
+            }
             if ( (rc = sf_reshape_fast (st_info, 0, fname)) ) goto exit;
         }
         else if ( strcmp(tostat, "write") == 0 ) {
@@ -454,6 +521,8 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
             top_lmiss,
             top_lother,
             top_nrows,
+            top_approx,
+            top_verify,
             levels_return,
             levels_matasave,
             levels_gen,
@@ -478,6 +547,9 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
             xtile_dedup,
             xtile_cutifin,
             xtile_cutby,
+            xtile_threads,
+            xtile_sketch,
+            xtile_sketch_merge,
             gstats_code,
             winsor_trim,
             winsor_cutl,
@@ -496,7 +568,13 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
             greshape_klvls,
             greshape_str,
             greshape_jfile,
+            greshape_inmem,
+            greshape_maxmem,
+            greshape_dropmiss,
+            greshape_threads,
             hash_method,
+            gcache,
+            gcache_len,
             wcode,
             wpos,
             wselective,
@@ -586,6 +664,8 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     if ( (rc = sf_scalar_size("__gtools_subtract",         &subtract)         )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_ctolerance",       &ctolerance)       )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_hash_method",      &hash_method)      )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_gcache",           &gcache)           )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_gcache_len",       &gcache_len)       )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_weight_code",      &wcode)            )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_weight_pos",       &wpos)             )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_weight_sel",       &wselective)       )) goto exit;
@@ -620,6 +700,8 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     if ( (rc = sf_scalar_size("__gtools_top_lmiss",        &top_lmiss)        )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_top_lother",       &top_lother)       )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_top_nrows",        &top_nrows)        )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_top_approx",       &top_approx)       )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_top_verify",       &top_verify)       )) goto exit;
 
     if ( (rc = sf_scalar_size("__gtools_levels_return",    &levels_return)    )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_levels_matasave",  &levels_matasave)  )) goto exit;
@@ -646,6 +728,9 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     if ( (rc = sf_scalar_size("__gtools_xtile_dedup",      &xtile_dedup)      )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_xtile_cutifin",    &xtile_cutifin)    )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_xtile_cutby",      &xtile_cutby)      )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_xtile_threads",    &xtile_threads)    )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_xtile_sketch",     &xtile_sketch)     )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_xtile_sketch_merge", &xtile_sketch_merge)) ) goto exit;
 
     if ( (rc = sf_scalar_size("__gtools_gstats_code",      &gstats_code)      )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_winsor_trim",      &winsor_trim)      )) goto exit;
@@ -666,6 +751,10 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     if ( (rc = sf_scalar_size("__gtools_greshape_klvls",   &greshape_klvls)   )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_greshape_str",     &greshape_str)     )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_greshape_jfile",   &greshape_jfile)   )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_greshape_inmem",   &greshape_inmem)   )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_greshape_maxmem",  &greshape_maxmem)  )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_greshape_dropmiss", &greshape_dropmiss) )) goto exit;
+    if ( (rc = sf_scalar_size("__gtools_greshape_threads",  &greshape_threads)  )) goto exit;
 
     if ( (rc = sf_scalar_size("__gtools_encode",           &encode)           )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_group_data",       &group_data)       )) goto exit;
@@ -688,6 +777,12 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     if ( (rc = SF_scal_use("__gtools_top_ntop",  &(st_info->top_ntop)  )) ) return (rc);
     if ( (rc = SF_scal_use("__gtools_top_pct",   &(st_info->top_pct)   )) ) return (rc);
 
+    // Accuracy for approximate quantiles
+    if ( (rc = SF_scal_use("__gtools_xtile_approx", &(st_info->xtile_approx) )) ) return (rc);
+
+    // Accuracy for approximate nunique
+    if ( (rc = SF_scal_use("__gtools_nunique_approx", &(st_info->nunique_approx) )) ) return (rc);
+
     // Parse number of variables
     if ( (rc = sf_scalar_size("__gtools_kvars",      &kvars_by)      )) goto exit;
     if ( (rc = sf_scalar_size("__gtools_kvars_int",  &kvars_by_int)  )) goto exit;
@@ -847,6 +942,8 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     st_info->subtract         = subtract;
     st_info->ctolerance       = ctolerance;
     st_info->hash_method      = hash_method;
+    st_info->gcache           = gcache;
+    st_info->gcache_len       = gcache_len;
     st_info->wcode            = wcode;
     st_info->wpos             = wpos;
     st_info->wselective       = wselective;
@@ -881,6 +978,8 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     st_info->top_lmiss        = top_lmiss;
     st_info->top_lother       = top_lother;
     st_info->top_nrows        = top_nrows;
+    st_info->top_approx       = top_approx;
+    st_info->top_verify       = top_verify;
 
     st_info->levels_return    = levels_return;
     st_info->levels_matasave  = levels_matasave;
@@ -907,6 +1006,9 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     st_info->xtile_dedup      = xtile_dedup;
     st_info->xtile_cutifin    = xtile_cutifin;
     st_info->xtile_cutby      = xtile_cutby;
+    st_info->xtile_threads    = xtile_threads;
+    st_info->xtile_sketch     = xtile_sketch;
+    st_info->xtile_sketch_merge = xtile_sketch_merge;
 
     st_info->gstats_code      = gstats_code;
     st_info->winsor_trim      = winsor_trim;
@@ -927,6 +1029,10 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
     st_info->greshape_klvls   = greshape_klvls;
     st_info->greshape_str     = greshape_str;
     st_info->greshape_jfile   = greshape_jfile;
+    st_info->greshape_inmem   = greshape_inmem;
+    st_info->greshape_maxmem  = greshape_maxmem;
+    st_info->greshape_dropmiss = greshape_dropmiss;
+    st_info->greshape_threads  = greshape_threads;
     st_info->greshape_anystr  = 0;
 
     st_info->encode           = encode;
@@ -988,6 +1094,8 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
         sf_printf_debug("\ttop_other:        "GT_size_cfmt"\n",  top_other       );
         sf_printf_debug("\ttop_lmiss:        "GT_size_cfmt"\n",  top_lmiss       );
         sf_printf_debug("\ttop_lother:       "GT_size_cfmt"\n",  top_lother      );
+        sf_printf_debug("\ttop_approx:       "GT_size_cfmt"\n",  top_approx      );
+        sf_printf_debug("\ttop_verify:       "GT_size_cfmt"\n",  top_verify      );
         sf_printf_debug("\n");
         sf_printf_debug("\tlevels_return:    "GT_size_cfmt"\n",  levels_return   );
         sf_printf_debug("\tlevels_matasave:  "GT_size_cfmt"\n",  levels_matasave );
@@ -1014,6 +1122,9 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
         sf_printf_debug("\txtile_dedup:      "GT_size_cfmt"\n",  xtile_dedup     );
         sf_printf_debug("\txtile_cutifin:    "GT_size_cfmt"\n",  xtile_cutifin   );
         sf_printf_debug("\txtile_cutby:      "GT_size_cfmt"\n",  xtile_cutby     );
+        sf_printf_debug("\txtile_threads:    "GT_size_cfmt"\n",  xtile_threads   );
+        sf_printf_debug("\txtile_sketch:     "GT_size_cfmt"\n",  xtile_sketch    );
+        sf_printf_debug("\txtile_sketch_merge: "GT_size_cfmt"\n", xtile_sketch_merge);
         sf_printf_debug("\n");
         sf_printf_debug("\tgstats_code:      "GT_size_cfmt"\n",  gstats_code     );
         sf_printf_debug("\twinsor_trim:      "GT_size_cfmt"\n",  winsor_trim     );
@@ -1028,6 +1139,8 @@ ST_retcode sf_parse_info (struct StataInfo *st_info, int level)
         sf_printf_debug("\tsummarize_kstats: "GT_size_cfmt"\n",  summarize_kstats);
         sf_printf_debug("\n");
         sf_printf_debug("\thash_method:      "GT_size_cfmt"\n",  hash_method     );
+        sf_printf_debug("\tgcache:           "GT_size_cfmt"\n",  gcache          );
+        sf_printf_debug("\tgcache_len:       "GT_size_cfmt"\n",  gcache_len      );
         sf_printf_debug("\twcode:            "GT_size_cfmt"\n",  wcode           );
         sf_printf_debug("\twpos:             "GT_size_cfmt"\n",  wpos            );
         sf_printf_debug("\twselective:       "GT_size_cfmt"\n",  wselective      );
@@ -1257,7 +1370,11 @@ ST_retcode sf_hash_byvars (struct StataInfo *st_info, int level)
 
     if ( (rc = sf_read_byvars (st_info,
                                level,
-                               index)) ) goto exit;
+                               index)) ) {
+        if ( (rc == 17459) && st_info->verbose )
+            sf_printf("(duplicate row found while reading by variables)\n");
+        goto exit;
+    }
 
     if ( st_info->debug ) {
         printf("debug 8: Read in by variables\n");
@@ -1298,6 +1415,23 @@ ST_retcode sf_hash_byvars (struct StataInfo *st_info, int level)
      *                  Check whether is id (isid only)                  *
      *********************************************************************/
 
+    // With isid, sf_read_byvars adds each row to a hash set as it is
+    // read and stops at the first duplicate; if it got this far then
+    // the by variables are an id. If the set could not be allocated we
+    // fall back to checking whether the data is sorted or hashing.
+
+    if ( (level == 2) && st_info->isid_stream ) {
+        if ( st_info->verbose )
+            sf_printf("(varlist is id; no duplicates found while reading)\n");
+
+        st_info->J = st_info->N;
+        st_info->nj_min = 1;
+        st_info->nj_max = 1;
+
+        rc = sf_set_rinfo (st_info, level);
+        goto exit;
+    }
+
     if ( level == 2 ) {
         if ( st_info->debug ) {
             printf("debug 10: isid\n");
@@ -1952,10 +2086,26 @@ ST_retcode sf_switch_io (struct StataInfo *st_info, int level, char* fname)
     // index, and ix in Stata and generate the variables there. We pick
     // up from this point and collapse to memory.
 
+    //
+    // The disk and SPI rates are measured once per temporary directory
+    // and cached there (see gf_io_cache_read). Both paths store every
+    // target for the J groups in Stata; in addition,
+    //
+    //     disk:   J x extra targets written to and read from disk, and
+    //             the extra targets added to J observations in Stata.
+    //     memory: the extra targets added to N observations in Stata
+    //             (st_time), and index, ix, and info stored in and read
+    //             back from Stata (2 x (N + 2 J) values).
+
     ST_retcode rc = 0;
     GT_size i, j;
     clock_t timer = clock();
 
+    GT_size kvars    = st_info->kvars_by;
+    GT_size ksources = st_info->kvars_sources;
+    GT_size kgroup   = st_info->kvars_group;
+    GT_size ipos     = kvars + kgroup + ksources + ksources + 1;
+
     ST_double st_time;
     if ( (rc = SF_scal_use ("__gtools_st_time", &st_time)) ) goto exit;
 
@@ -1963,21 +2113,35 @@ ST_retcode sf_switch_io (struct StataInfo *st_info, int level, char* fname)
         printf("debug 46: I/O switching code.\n");
     }
 
-    ST_double c_rate      = gf_benchmark(fname);
+    ST_double c_rate, spi_rate, codec_rate;
+    GT_bool cached = gf_io_cache_read(fname, &c_rate, &spi_rate, &codec_rate);
+    if ( !cached || (spi_rate < 0) ) {
+        if ( !cached ) {
+            c_rate     = gf_benchmark(fname);
+            codec_rate = gf_spill_benchmark();
+        }
+        if ( (rc = sf_switch_spi(st_info, ipos, &spi_rate)) ) goto exit;
+        if ( (c_rate > 0) && (codec_rate > 0) ) {
+            gf_io_cache_write(fname, c_rate, spi_rate, codec_rate);
+        }
+    }
+
     ST_double time_vars   = (ST_double) (st_info->kvars_targets - st_info->kvars_sources);
     ST_double mib_base    = time_vars * 8 / 1024 / 1024;
-    ST_double time_c      = (ST_double) st_info->J * c_rate * mib_base;
+    ST_double mib_rate    = (codec_rate > 0) && (c_rate * GTOOLS_SPILL_SAVING > codec_rate)?
+                            c_rate * (1 - GTOOLS_SPILL_SAVING) + codec_rate: c_rate;
+    ST_double time_c      = (ST_double) st_info->J * mib_rate * mib_base;
     ST_double time_cstata = (ST_double) st_info->J * st_time / st_info->N;
+    ST_double time_spi    = 2 * spi_rate * (ST_double) (st_info->N + 2 * st_info->J);
     ST_double c_time      = time_c + time_cstata;
+    ST_double m_time      = st_time + time_spi;
 
-    GT_bool used_io;
-    if ( GTOOLS_QUERY_FREE_SPACE ) {
+    // A failed disk benchmark means the temporary file is not usable
+    GT_bool used_io = (c_rate > 0) && (c_time < m_time);
+    if ( GTOOLS_QUERY_FREE_SPACE && used_io ) {
         ST_double mib_free = gf_query_free_space(fname);
         ST_double mib_c    = st_info->J * mib_base;
-        used_io            = ( (mib_c < mib_free) & (c_time < st_time) );
-    }
-    else {
-        used_io = (c_time < st_time);
+        used_io            = (mib_c < mib_free);
     }
 
     if ( st_info->debug ) {
@@ -1995,13 +2159,17 @@ ST_retcode sf_switch_io (struct StataInfo *st_info, int level, char* fname)
         sf_printf ((st_time > 1)? "%.1f": "%.2g", st_time);
         sf_printf(" seconds.\n");
 
+        sf_printf("\tStoring and reading back index and info estimated to take ");
+        sf_printf ((time_spi > 1)? "%.1f": "%.2g", time_spi);
+        sf_printf(" seconds.\n");
+
         sf_printf("\tAdding targets after collapse estimated to take ");
         sf_printf ((time_cstata > 1)? "%.1f": "%.2g", time_cstata);
         sf_printf(" seconds.\n");
 
         sf_printf("\tWriting/reading targets to/from disk estimated to take ");
         sf_printf ((time_c > 1)? "%.1f": "%.2g", time_c);
-        sf_printf(" seconds.\n");
+        sf_printf (cached? " seconds (cached disk rate).\n": " seconds.\n");
 
         if ( used_io ) {
             sf_printf("Will write to disk and read back later to save time.\n");
@@ -2019,11 +2187,6 @@ ST_retcode sf_switch_io (struct StataInfo *st_info, int level, char* fname)
         }
     }
     else {
-        GT_size kvars    = st_info->kvars_by;
-        GT_size ksources = st_info->kvars_sources;
-        GT_size kgroup   = st_info->kvars_group;
-        GT_size ipos     = kvars + kgroup + ksources + ksources + 1;
-
         for (i = 0; i < st_info->N; i++)
             if ( (rc = SF_vstore(ipos, i + st_info->in1, st_info->index[i])) ) goto exit;
 
@@ -2049,6 +2212,31 @@ exit:
     return (rc);
 }
 
+/**
+ * @brief Time storing values in Stata via the SPI
+ *
+ * Stores the first few entries of index in the index variable at
+ * @pos; it is scratch at this point and, if the collapse is done in
+ * memory, overwritten with the full index right after.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param pos position of the index variable
+ * @param spi_rate seconds per value stored
+ * @return Stores the rate in @spi_rate
+ */
+ST_retcode sf_switch_spi (struct StataInfo *st_info, GT_size pos, ST_double *spi_rate)
+{
+    ST_retcode rc = 0;
+    GT_size i, nstore = GTOOLS_PWMIN(st_info->N, 65536);
+    ST_double timer = gf_wall_time();
+
+    for (i = 0; i < nstore; i++)
+        if ( (rc = SF_vstore(pos, i + st_info->in1, st_info->index[i])) ) return (rc);
+
+    *spi_rate = (nstore > 0)? (gf_wall_time() - timer) / nstore: 0;
+    return (rc);
+}
+
 ST_retcode sf_switch_mem (struct StataInfo *st_info, int level)
 {
 
@@ -52,6 +52,11 @@
 #include <inttypes.h>
 #include <sys/types.h>
 
+// Multi-threaded plugin only (see GTOOLS_FORCE_PARALLEL)
+#ifdef GTOOLS_PARALLEL
+#include <pthread.h>
+#endif
+
 // Container structure for Stata-provided info
 struct StataInfo {
     GT_size   start;
@@ -96,6 +101,8 @@ struct StataInfo {
     GT_size   top_lother;
     GT_size   top_lmiss;
     GT_size   top_nrows;
+    GT_size   top_approx;
+    GT_bool   top_verify;
     //
     GT_bool   levels_return;
     GT_bool   levels_matasave;
@@ -116,12 +123,16 @@ struct StataInfo {
     GT_bool xtile_missing;
     GT_bool xtile_strict;
     GT_bool xtile_minmax;
-    GT_bool xtile_method;
+    GT_size xtile_method;
     GT_bool xtile_bincount;
     GT_bool xtile__pctile;
     GT_bool xtile_dedup;
     GT_bool xtile_cutifin;
     GT_bool xtile_cutby;
+    GT_size xtile_threads;
+    ST_double xtile_approx;
+    GT_size xtile_sketch;
+    GT_bool xtile_sketch_merge;
     //
     GT_size   gstats_code;
     GT_bool   winsor_trim;
@@ -143,15 +154,23 @@ struct StataInfo {
     GT_size   greshape_klvls;
     GT_size   greshape_str;
     GT_size   greshape_jfile;
+    GT_size   greshape_inmem;
+    GT_size   greshape_maxmem;
+    GT_size   greshape_dropmiss;
+    GT_size   greshape_threads;
     GT_size   greshape_anystr;
     GT_size   *greshape_types;
     GT_size   *greshape_xitypes;
     GT_size   *greshape_maplevel;
     //
     GT_bool   hash_method;
+    GT_bool   gcache;
+    GT_size   gcache_len;
     GT_bool   wcode;
     GT_bool   nunique;
+    ST_double nunique_approx;
     GT_bool   sorted;
+    GT_bool   isid_stream;
     GT_bool   cleanstr;
     GT_bool   init_targ;
     GT_bool   any_if;
@@ -303,6 +322,10 @@ struct StataInfo {
 
 // statvfs is POSIX only; repalce with dummies on windows
 #define GTOOLS_QUERY_FREE_SPACE 0
+
+// No mmap; collapsed output is exchanged via stdio
+#define GTOOLS_MMAP 0
+#define GTOOLS_MMAP_WRITE 0
 struct statvfs {
     int f_bsize;
     int f_bfree;
@@ -327,6 +350,21 @@ char * strndup (const char *s, size_t n)
 #define GTOOLS_QUERY_FREE_SPACE 1
 #include <sys/statvfs.h>
 
+// Exchange collapsed output via memory-mapped files
+#define GTOOLS_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+// The file is written through the map only if its blocks can be
+// reserved up front (posix_fallocate); a page fault on a file that
+// cannot grow raises SIGBUS instead of returning an error.
+#if defined(__linux__)
+#define GTOOLS_MMAP_WRITE 1
+#else
+#define GTOOLS_MMAP_WRITE 0
+#endif
+
 #endif
 
 // Functions
@@ -336,6 +374,7 @@ ST_retcode sf_parse_info  (struct StataInfo *st_info, int level);
 ST_retcode sf_hash_byvars (struct StataInfo *st_info, int level);
 ST_retcode sf_check_hash  (struct StataInfo *st_info, int level);
 ST_retcode sf_switch_io   (struct StataInfo *st_info, int level, char* fname);
+ST_retcode sf_switch_spi  (struct StataInfo *st_info, GT_size pos, ST_double *spi_rate);
 ST_retcode sf_switch_mem  (struct StataInfo *st_info, int level);
 ST_retcode sf_set_rinfo   (struct StataInfo *st_info, int level);
 
@@ -0,0 +1,239 @@
+#include "gtools_gcache.h"
+
+static struct GtoolsGroupCache GtoolsGroupCacheSlots[GTOOLS_GCACHE_SLOTS];
+static GT_size GtoolsGroupCacheClock = 0;
+
+/**
+ * @brief Read the data signature passed by Stata
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param sig signature (the caller frees it)
+ * @return local gcache_sig in @sig
+ */
+ST_retcode sf_gcache_signature (struct StataInfo *st_info, char **sig)
+{
+    ST_retcode rc = 0;
+    GT_size len = st_info->gcache_len + 1;
+
+    *sig = calloc(len, sizeof(char));
+    if ( *sig == NULL ) return (sf_oom_error("sf_gcache_signature", "sig"));
+
+    if ( (rc = SF_macro_use("_gcache_sig", *sig, len)) ) {
+        free (*sig);
+        *sig = NULL;
+    }
+
+    return (rc);
+}
+
+/**
+ * @brief Options that change the group index
+ */
+GT_size gf_gcache_flags (struct StataInfo *st_info)
+{
+    return (
+        (st_info->missing  ? 1: 0) |
+        (st_info->unsorted ? 2: 0) |
+        (st_info->nomiss   ? 4: 0) |
+        (st_info->mlast    ? 8: 0) |
+        (st_info->any_if   ? 16: 0) |
+        (st_info->hash_method << 5)
+    );
+}
+
+/**
+ * @brief Whether a cached index was built with the current by variables,
+ * range, and options (the data signature is checked separately)
+ */
+GT_bool gf_gcache_match (struct GtoolsGroupCache *slot, struct StataInfo *st_info, GT_size flags)
+{
+    GT_size k;
+
+    if ( slot->sig == NULL ) return (0);
+    if ( slot->kvars != st_info->kvars_by ) return (0);
+    if ( slot->in1   != st_info->in1      ) return (0);
+    if ( slot->in2   != st_info->in2      ) return (0);
+    if ( slot->Nread != st_info->Nread    ) return (0);
+    if ( slot->flags != flags             ) return (0);
+
+    for (k = 0; k < slot->kvars; k++) {
+        if ( slot->lens[k]   != st_info->byvars_lens[k] ) return (0);
+        if ( slot->invert[k] != st_info->invert[k]      ) return (0);
+    }
+
+    return (1);
+}
+
+void gf_gcache_free (struct GtoolsGroupCache *slot)
+{
+    free (slot->sig);
+    free (slot->lens);
+    free (slot->invert);
+    free (slot->info);
+    free (slot->index);
+    free (slot->ix);
+    memset (slot, '\0', sizeof *slot);
+}
+
+/**
+ * @brief Reuse a cached group index, if there is one
+ *
+ * On a hit @st_info is left as sf_hash_byvars and sf_check_hash (level
+ * 22) would have left it: fresh copies of info, index, and ix, plus the
+ * group counts.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @param hit whether a cached index was used
+ * @return restores the group index into @st_info
+ */
+ST_retcode sf_gcache_restore (struct StataInfo *st_info, GT_bool *hit)
+{
+    ST_retcode rc = 0;
+    GT_size s, flags;
+    char *sig;
+    struct GtoolsGroupCache *slot = NULL;
+    clock_t timer = clock();
+
+    *hit = 0;
+    if ( (st_info->gcache == 0) || (st_info->kvars_by == 0) ) return (0);
+    if ( (rc = sf_gcache_signature(st_info, &sig)) ) return (rc);
+
+    flags = gf_gcache_flags(st_info);
+    for (s = 0; s < GTOOLS_GCACHE_SLOTS; s++) {
+        if ( gf_gcache_match(GtoolsGroupCacheSlots + s, st_info, flags) ) {
+            if ( strcmp(GtoolsGroupCacheSlots[s].sig, sig) == 0 ) {
+                slot = GtoolsGroupCacheSlots + s;
+                break;
+            }
+        }
+    }
+    free (sig);
+
+    if ( slot == NULL ) return (0);
+    if ( (rc = sf_hash_byvars (st_info, 111)) ) return (rc);
+
+    st_info->info  = calloc(slot->J + 1, sizeof *st_info->info);
+    st_info->index = calloc(st_info->Nread, sizeof *st_info->index);
+    st_info->ix    = calloc(slot->J, sizeof *st_info->ix);
+
+    if ( st_info->info  == NULL ) { rc = sf_oom_error("sf_gcache_restore", "st_info->info");  goto error; }
+    if ( st_info->index == NULL ) { rc = sf_oom_error("sf_gcache_restore", "st_info->index"); goto error; }
+    if ( st_info->ix    == NULL ) { rc = sf_oom_error("sf_gcache_restore", "st_info->ix");    goto error; }
+
+    GTOOLS_GC_ALLOCATED("st_info->info")
+    GTOOLS_GC_ALLOCATED("st_info->index")
+    GTOOLS_GC_ALLOCATED("st_info->ix")
+
+    memcpy (st_info->info,  slot->info,  (slot->J + 1) * sizeof(GT_size));
+    memcpy (st_info->index, slot->index, slot->N * sizeof(GT_size));
+    memcpy (st_info->ix,    slot->ix,    slot->J * sizeof(GT_size));
+
+    st_info->free   = 8;
+    st_info->N      = slot->N;
+    st_info->J      = slot->J;
+    st_info->nj_min = slot->nj_min;
+    st_info->nj_max = slot->nj_max;
+    slot->stamp     = ++GtoolsGroupCacheClock;
+
+    if ( (rc = sf_set_rinfo (st_info, 0)) ) return (rc);
+
+    if ( st_info->verbose ) {
+        sf_printf("(reused group index of a previous call: "GT_size_cfmt" obs, "GT_size_cfmt" groups)\n",
+                  st_info->N, st_info->J);
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\tPlugin step 1: Restored group index from cache");
+
+    *hit = 1;
+    return (rc);
+
+error:
+    // st_info->free is not yet 8, so the caller would not free these
+    free (st_info->info);
+    free (st_info->index);
+    free (st_info->ix);
+    st_info->info  = NULL;
+    st_info->index = NULL;
+    st_info->ix    = NULL;
+    return (rc);
+}
+
+/**
+ * @brief Keep a copy of the group index for later calls
+ *
+ * A cached index with the same by variables, range, and options but a
+ * different data signature is stale and is replaced; otherwise the least
+ * recently used slot is. The cache is only an optimization, so if the
+ * copy cannot be allocated nothing is cached.
+ *
+ * @param st_info Pointer to container structure for Stata info
+ * @return copies info, index, and ix from @st_info into the cache
+ */
+ST_retcode sf_gcache_store (struct StataInfo *st_info)
+{
+    ST_retcode rc = 0;
+    GT_size s, k, flags;
+    char *sig;
+    struct GtoolsGroupCache *slot = NULL;
+
+    if ( (st_info->gcache == 0) || (st_info->kvars_by == 0) ) return (0);
+    if ( (rc = sf_gcache_signature(st_info, &sig)) ) return (rc);
+
+    flags = gf_gcache_flags(st_info);
+    for (s = 0; s < GTOOLS_GCACHE_SLOTS; s++) {
+        if ( gf_gcache_match(GtoolsGroupCacheSlots + s, st_info, flags) ) {
+            slot = GtoolsGroupCacheSlots + s;
+            break;
+        }
+    }
+
+    if ( slot == NULL ) {
+        slot = GtoolsGroupCacheSlots;
+        for (s = 1; s < GTOOLS_GCACHE_SLOTS; s++) {
+            if ( GtoolsGroupCacheSlots[s].stamp < slot->stamp ) {
+                slot = GtoolsGroupCacheSlots + s;
+            }
+        }
+    }
+
+    gf_gcache_free (slot);
+
+    slot->sig    = sig;
+    slot->lens   = calloc(st_info->kvars_by,  sizeof *slot->lens);
+    slot->invert = calloc(st_info->kvars_by,  sizeof *slot->invert);
+    slot->info   = calloc(st_info->J + 1,     sizeof *slot->info);
+    slot->index  = calloc(st_info->N,         sizeof *slot->index);
+    slot->ix     = calloc(st_info->J,         sizeof *slot->ix);
+
+    if ( (slot->lens  == NULL) || (slot->invert == NULL) || (slot->info == NULL) ||
+         (slot->index == NULL) || (slot->ix     == NULL) ) {
+        gf_gcache_free (slot);
+        if ( st_info->verbose ) {
+            sf_printf("(not enough memory to cache the group index)\n");
+        }
+        return (0);
+    }
+
+    for (k = 0; k < st_info->kvars_by; k++) {
+        slot->lens[k]   = st_info->byvars_lens[k];
+        slot->invert[k] = st_info->invert[k];
+    }
+
+    memcpy (slot->info,  st_info->info,  (st_info->J + 1) * sizeof(GT_size));
+    memcpy (slot->index, st_info->index, st_info->N * sizeof(GT_size));
+    memcpy (slot->ix,    st_info->ix,    st_info->J * sizeof(GT_size));
+
+    slot->kvars  = st_info->kvars_by;
+    slot->in1    = st_info->in1;
+    slot->in2    = st_info->in2;
+    slot->Nread  = st_info->Nread;
+    slot->flags  = flags;
+    slot->N      = st_info->N;
+    slot->J      = st_info->J;
+    slot->nj_min = st_info->nj_min;
+    slot->nj_max = st_info->nj_max;
+    slot->stamp  = ++GtoolsGroupCacheClock;
+
+    return (0);
+}
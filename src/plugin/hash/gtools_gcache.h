@@ -0,0 +1,42 @@
+#ifndef GTOOLS_GCACHE
+#define GTOOLS_GCACHE
+
+// The plugin stays loaded between calls, so the group index of a hash
+// call (info, index, ix) can be kept and reused by a later call with
+// the same by variables, sample, and data. Stata computes the data
+// signature of the by variables and the sample (see gcache_signature in
+// _gtools_internal.ado) and passes it in the local gcache_sig; the
+// plugin adds the options that change the index. At most
+// GTOOLS_GCACHE_SLOTS indexes are kept; the least recently used one is
+// dropped first.
+
+#define GTOOLS_GCACHE_SLOTS 4
+
+struct GtoolsGroupCache {
+    char    *sig;
+    GT_size *lens;
+    GT_size *invert;
+    GT_size *info;
+    GT_size *index;
+    GT_size *ix;
+    GT_size kvars;
+    GT_size in1;
+    GT_size in2;
+    GT_size Nread;
+    GT_size flags;
+    GT_size N;
+    GT_size J;
+    GT_size nj_min;
+    GT_size nj_max;
+    GT_size stamp;
+};
+
+ST_retcode sf_gcache_signature (struct StataInfo *st_info, char **sig);
+GT_size gf_gcache_flags (struct StataInfo *st_info);
+GT_bool gf_gcache_match (struct GtoolsGroupCache *slot, struct StataInfo *st_info, GT_size flags);
+void gf_gcache_free (struct GtoolsGroupCache *slot);
+
+ST_retcode sf_gcache_restore (struct StataInfo *st_info, GT_bool *hit);
+ST_retcode sf_gcache_store (struct StataInfo *st_info);
+
+#endif
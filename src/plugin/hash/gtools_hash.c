@@ -1,6 +1,7 @@
 #include "gtools_hash.h"
 #include "gtools_sort.c"
 #include "gtools_hash_fast.c"
+#include "gtools_gcache.c"
 
 ST_retcode gf_hash (
     uint64_t *h1,
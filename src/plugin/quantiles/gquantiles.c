@@ -1,4 +1,5 @@
 #include "gquantiles_by.c"
+#include "gquantiles_approx.c"
 
 ST_retcode sf_xtile (struct StataInfo *st_info, int level);
 
@@ -7,7 +8,7 @@ ST_retcode sf_xtile (struct StataInfo *st_info, int level)
 
     ST_double z, w, nqdbl, xmin, xmax;
     ST_double *xptr, *qptr, *optr, *gptr, *ixptr, *xptr2;
-    GT_bool failmiss = 0, sorted = 0;
+    GT_bool failmiss = 0, sorted = 0, wselect = 0;
     GT_size i, q, sel, obs, N, qtot;
     ST_retcode rc = 0;
     clock_t  timer = clock();
@@ -17,7 +18,7 @@ ST_retcode sf_xtile (struct StataInfo *st_info, int level)
      *                           Step 1: Setup                           *
      *********************************************************************/
 
-    GT_bool method = st_info->xtile_method;
+    GT_size method = st_info->xtile_method;
     ST_double m1_etime, m2_etime, m_ratio;
 
     GT_size nq      = st_info->xtile_nq;
@@ -67,7 +68,7 @@ ST_retcode sf_xtile (struct StataInfo *st_info, int level)
         sf_printf_debug("\t"GT_size_cfmt" read, "GT_size_cfmt" groups.\n", Nread, st_info->J);
         sf_printf_debug("\tin1 / in2: "GT_size_cfmt" / "GT_size_cfmt"\n", st_info->in1, st_info->in2);
         sf_printf_debug("\n");
-        sf_printf_debug("\tmethod:            %u\n",              method);
+        sf_printf_debug("\tmethod:            "GT_size_cfmt"\n",  method);
         sf_printf_debug("\tnout:              %u\n",              nout);
         sf_printf_debug("\tnq:                "GT_size_cfmt"\n",  nq);
         sf_printf_debug("\tnq2:               "GT_size_cfmt"\n",  nq2);
@@ -382,8 +383,17 @@ ST_retcode sf_xtile (struct StataInfo *st_info, int level)
         method = 1;
     }
 
+    // With weights, method 1 sorts the source. However, if we only
+    // need the quantiles (no xtile and no bin counts, which are counted
+    // off the sorted source) we can select them instead (method(1)
+    // still forces the sort).
+    if ( weights & !kgen & !altdef & !(bincount | pctpct) & (st_info->xtile_method != 1) ) {
+        wselect = (nq > 0) | (nq2 > 0) | (nquants > 0);
+    }
+
     if ( debug ) {
-        sf_printf_debug("debug 15 (sf_xtile): Chose execution method %u.\n", method);
+        sf_printf_debug("debug 15 (sf_xtile): Chose execution method "GT_size_cfmt".\n", method);
+        sf_printf_debug("debug 15 (sf_xtile): Weighted selection %u.\n", wselect);
     }
 
     // method = 0; // expected optimal
@@ -696,6 +706,12 @@ ST_retcode sf_xtile (struct StataInfo *st_info, int level)
             }
         }
     }
+    else if ( wselect ) {
+        sorted = 0;
+        if ( debug ) {
+            sf_printf_debug("debug 20.2 (sf_xtile): weighted selection; method 1.\n");
+        }
+    }
     else if ( weights ) {
         MultiQuicksortDbl(
             xsources,
@@ -826,6 +842,20 @@ ST_retcode sf_xtile (struct StataInfo *st_info, int level)
                 qptr = xquant;
             }
         }
+        else if ( wselect ) {
+            if ( nquants > 0 ) {
+                gf_quantiles_qselect_w (xquants, xsources, xquants, nquants, N, kx);
+                qptr = xquants;
+            }
+            else if ( nq2 > 0 ) {
+                gf_quantiles_qselect_w (xquant, xsources, st_info->xtile_quantiles, nq2, N, kx);
+                qptr = xquant;
+            }
+            else if ( nq > 0 ) {
+                gf_quantiles_nq_qselect_w (xquant, xsources, nq, N, kx);
+                qptr = xquant;
+            }
+        }
         else if ( weights ) {
             if ( nquants > 0 ) {
                 gf_quantiles_w (xquants, xsources, xquants, nquants, N, kx);
@@ -864,6 +894,13 @@ ST_retcode sf_xtile (struct StataInfo *st_info, int level)
         xmin = gf_array_dmin_range(xptr2, 0, N);
         xmax = qptr[nout - 1];
     }
+    else if ( wselect ) {
+        xmin = xsources[0];
+        for (xptr = xsources; xptr < xsources + kx * N; xptr += kx) {
+            if ( *xptr < xmin ) xmin = *xptr;
+        }
+        xmax = qptr[nout - 1];
+    }
     else {
         xmin = xsources[0];
         xmax = qptr[nout - 1];
@@ -876,7 +913,10 @@ ST_retcode sf_xtile (struct StataInfo *st_info, int level)
             }
         }
         else {
-            if ( (nq2 > 0) | (nq > 0) | (nquants > 0) ) {
+            if ( wselect ) {
+                sf_running_timer (&timer, "\txtile step 3: Computed quantiles (weighted selection)");
+            }
+            else if ( (nq2 > 0) | (nq > 0) | (nquants > 0) ) {
                 sf_running_timer (&timer, "\txtile step 3: Sorted source and computed quantiles");
             }
             else {
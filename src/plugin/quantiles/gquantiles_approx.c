@@ -0,0 +1,650 @@
+/*
+ * Approximate quantiles via KLL sketches (Karnin, Lang, and Liberty,
+ * 2016). A sketch is a stack of compactors: Level h holds items that
+ * each stand for 2^h observations. When a level fills up it is sorted
+ * and every other item (with a random offset) is promoted to the next
+ * level. Memory is O(k log(n / k)) per group regardless of the number
+ * of observations, and two sketches with the same k can be merged by
+ * stacking their levels and compacting.
+ *
+ * The normalized rank error of a quantile is below
+ *
+ *     GTOOLS_KLL_EPS_A / k^GTOOLS_KLL_EPS_B
+ *
+ * with 99% probability (single quantile); we pick the smallest k such
+ * that this is at most the requested epsilon.
+ */
+
+#define GTOOLS_KLL_EPS_A  2.296
+#define GTOOLS_KLL_EPS_B  0.9723
+#define GTOOLS_KLL_MINK   8
+#define GTOOLS_KLL_MAXK   1048576
+#define GTOOLS_KLL_MAXH   64
+#define GTOOLS_KLL_MAGIC  "GTKLL001"
+
+struct GtoolsKLL {
+    GT_size   k;
+    GT_size   n;
+    GT_size   H;
+    GT_size   cap0;
+    GT_size   *size;
+    GT_size   *alloc;
+    ST_double **items;
+    ST_double min;
+    ST_double max;
+    uint64_t  rng;
+};
+
+GT_size   gf_kll_k        (ST_double epsilon);
+ST_double gf_kll_epsilon  (GT_size k);
+GT_size   gf_kll_capacity (struct GtoolsKLL *sk, GT_size h);
+
+void       gf_kll_init     (struct GtoolsKLL *sk, GT_size k);
+void       gf_kll_free     (struct GtoolsKLL *sk);
+ST_retcode gf_kll_grow     (struct GtoolsKLL *sk, GT_size h, GT_size need);
+ST_retcode gf_kll_compress (struct GtoolsKLL *sk);
+ST_retcode gf_kll_update   (struct GtoolsKLL *sk, ST_double z);
+ST_retcode gf_kll_merge    (struct GtoolsKLL *sk, struct GtoolsKLL *other);
+ST_retcode gf_kll_write    (struct GtoolsKLL *sk, char *fname);
+ST_retcode gf_kll_read     (struct GtoolsKLL *sk, char *fname);
+
+ST_retcode gf_kll_quantiles (
+    struct GtoolsKLL *sk,
+    ST_double *qout,
+    ST_double *quants,
+    GT_size nquants,
+    GT_size nq
+);
+
+ST_retcode sf_xtile_approx (struct StataInfo *st_info, int level);
+
+/*********************************************************************
+ *                           KLL sketches                            *
+ *********************************************************************/
+
+GT_size gf_kll_k (ST_double epsilon)
+{
+    ST_double k = ceil(pow(GTOOLS_KLL_EPS_A / epsilon, 1 / GTOOLS_KLL_EPS_B));
+    if ( k < GTOOLS_KLL_MINK ) return (GTOOLS_KLL_MINK);
+    if ( k > GTOOLS_KLL_MAXK ) return (GTOOLS_KLL_MAXK);
+    return ((GT_size) k);
+}
+
+ST_double gf_kll_epsilon (GT_size k)
+{
+    return (GTOOLS_KLL_EPS_A / pow((ST_double) k, GTOOLS_KLL_EPS_B));
+}
+
+/**
+ * @brief Capacity of level h; lower levels get geometrically smaller
+ */
+GT_size gf_kll_capacity (struct GtoolsKLL *sk, GT_size h)
+{
+    GT_size cap = (GT_size) ceil(sk->k * pow(2.0 / 3.0, (ST_double) (sk->H - 1 - h)));
+    return (cap < 2? 2: cap);
+}
+
+void gf_kll_init (struct GtoolsKLL *sk, GT_size k)
+{
+    sk->k     = k;
+    sk->n     = 0;
+    sk->H     = 0;
+    sk->cap0  = 0;
+    sk->size  = NULL;
+    sk->alloc = NULL;
+    sk->items = NULL;
+    sk->min   = 0;
+    sk->max   = 0;
+    sk->rng   = 0x9E3779B97F4A7C15ULL;
+}
+
+void gf_kll_free (struct GtoolsKLL *sk)
+{
+    GT_size h;
+    for (h = 0; h < sk->H; h++)
+        free (sk->items[h]);
+
+    free (sk->items);
+    free (sk->size);
+    free (sk->alloc);
+
+    sk->items = NULL;
+    sk->size  = NULL;
+    sk->alloc = NULL;
+    sk->H     = 0;
+}
+
+/**
+ * @brief Make sure level h exists and has room for @need items
+ */
+ST_retcode gf_kll_grow (struct GtoolsKLL *sk, GT_size h, GT_size need)
+{
+    GT_size l, alloc;
+    ST_double *items;
+
+    if ( h >= sk->H ) {
+        sk->size  = realloc(sk->size,  (h + 1) * sizeof *sk->size);
+        sk->alloc = realloc(sk->alloc, (h + 1) * sizeof *sk->alloc);
+        sk->items = realloc(sk->items, (h + 1) * sizeof *sk->items);
+        if ( sk->size  == NULL ) return(sf_oom_error("gf_kll_grow", "size"));
+        if ( sk->alloc == NULL ) return(sf_oom_error("gf_kll_grow", "alloc"));
+        if ( sk->items == NULL ) return(sf_oom_error("gf_kll_grow", "items"));
+        for (l = sk->H; l <= h; l++) {
+            sk->size[l]  = 0;
+            sk->alloc[l] = 0;
+            sk->items[l] = NULL;
+        }
+        sk->H    = h + 1;
+        sk->cap0 = gf_kll_capacity(sk, 0);
+    }
+
+    if ( need > sk->alloc[h] ) {
+        alloc = GTOOLS_PWMAX(need, 2 * sk->alloc[h]);
+        alloc = GTOOLS_PWMAX(alloc, 8);
+        items = realloc(sk->items[h], alloc * sizeof *items);
+        if ( items == NULL ) return(sf_oom_error("gf_kll_grow", "items"));
+        sk->items[h] = items;
+        sk->alloc[h] = alloc;
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Compact every level that is at or above capacity
+ *
+ * Sort the level and promote every other item, starting at a random
+ * offset, to the level above. With an odd number of items the largest
+ * stays behind, so the total weight is unchanged.
+ */
+ST_retcode gf_kll_compress (struct GtoolsKLL *sk)
+{
+    ST_retcode rc = 0;
+    GT_size h, i, npairs, offset, above;
+    ST_double *src, *dst;
+
+    for (h = 0; h < sk->H; h++) {
+        if ( sk->size[h] < gf_kll_capacity(sk, h) ) continue;
+
+        npairs = sk->size[h] / 2;
+        above  = (h + 1 < sk->H)? sk->size[h + 1]: 0;
+        if ( (rc = gf_kll_grow(sk, h + 1, above + npairs)) ) return (rc);
+
+        src = sk->items[h];
+        quicksort_bsd (src, sk->size[h], sizeof *src, xtileCompare, NULL);
+
+        sk->rng ^= sk->rng << 13;
+        sk->rng ^= sk->rng >> 7;
+        sk->rng ^= sk->rng << 17;
+        offset = sk->rng & 1;
+
+        dst = sk->items[h + 1] + sk->size[h + 1];
+        for (i = 0; i < npairs; i++)
+            dst[i] = src[2 * i + offset];
+
+        sk->size[h + 1] += npairs;
+        if ( sk->size[h] % 2 ) {
+            src[0] = src[sk->size[h] - 1];
+            sk->size[h] = 1;
+        }
+        else {
+            sk->size[h] = 0;
+        }
+    }
+
+    return (rc);
+}
+
+ST_retcode gf_kll_update (struct GtoolsKLL *sk, ST_double z)
+{
+    ST_retcode rc = 0;
+
+    if ( sk->n == 0 ) {
+        sk->min = sk->max = z;
+    }
+    else {
+        if ( z < sk->min ) sk->min = z;
+        if ( z > sk->max ) sk->max = z;
+    }
+
+    if ( (sk->H == 0) || (sk->size[0] >= sk->alloc[0]) ) {
+        if ( (rc = gf_kll_grow(sk, 0, (sk->H? sk->size[0]: 0) + 1)) ) return (rc);
+    }
+
+    sk->items[0][sk->size[0]++] = z;
+    sk->n++;
+
+    if ( sk->size[0] >= sk->cap0 ) {
+        rc = gf_kll_compress(sk);
+    }
+
+    return (rc);
+}
+
+/**
+ * @brief Merge @other into @sk; both must have the same k
+ */
+ST_retcode gf_kll_merge (struct GtoolsKLL *sk, struct GtoolsKLL *other)
+{
+    ST_retcode rc = 0;
+    GT_size h;
+
+    if ( other->n == 0 ) return (0);
+    if ( sk->k != other->k ) {
+        sf_errprintf("cannot merge sketches with different accuracy\n");
+        return (198);
+    }
+
+    for (h = 0; h < other->H; h++) {
+        if ( (rc = gf_kll_grow(sk, h, (h < sk->H? sk->size[h]: 0) + other->size[h])) ) return (rc);
+        memcpy(sk->items[h] + sk->size[h], other->items[h], other->size[h] * sizeof(ST_double));
+        sk->size[h] += other->size[h];
+    }
+
+    if ( sk->n == 0 ) {
+        sk->min = other->min;
+        sk->max = other->max;
+    }
+    else {
+        if ( other->min < sk->min ) sk->min = other->min;
+        if ( other->max > sk->max ) sk->max = other->max;
+    }
+
+    sk->n += other->n;
+    return (gf_kll_compress(sk));
+}
+
+/**
+ * @brief Quantiles from a sketch
+ *
+ * Collect the items and their weights, sort them, and walk the
+ * cumulative weight. As with the exact quantiles, if the target rank
+ * falls exactly on the boundary between two items, take their average.
+ *
+ * @param sk Sketch
+ * @param qout Output (nquants + 1 or nq entries; the last is the max)
+ * @param quants Percentiles to compute (ascending), if any
+ * @param nquants Number of percentiles in @quants
+ * @param nq Number of quantiles (if @nquants is 0)
+ * @return Quantiles in @qout
+ */
+ST_retcode gf_kll_quantiles (
+    struct GtoolsKLL *sk,
+    ST_double *qout,
+    ST_double *quants,
+    GT_size nquants,
+    GT_size nq)
+{
+    GT_size h, i, s, m, nout;
+    ST_double target, cumsum, w;
+
+    m = 0;
+    for (h = 0; h < sk->H; h++)
+        m += sk->size[h];
+
+    ST_double *xw = calloc(2 * GTOOLS_PWMAX(m, 1), sizeof *xw);
+    if ( xw == NULL ) return(sf_oom_error("gf_kll_quantiles", "xw"));
+
+    s = 0;
+    w = 1;
+    for (h = 0; h < sk->H; h++, w *= 2) {
+        for (i = 0; i < sk->size[h]; i++, s++) {
+            xw[2 * s]     = sk->items[h][i];
+            xw[2 * s + 1] = w;
+        }
+    }
+
+    GT_size invert[2]; invert[0] = 0; invert[1] = 0;
+    MultiQuicksortDbl(xw, m, 0, 1, 2 * (sizeof *xw), invert);
+
+    nout   = nquants? nquants: nq - 1;
+    s      = 0;
+    cumsum = xw[1];
+    for (i = 0; i < nout; i++) {
+        target = nquants? quants[i] * sk->n / 100: ((ST_double) (i + 1)) * sk->n / nq;
+        while ( ((cumsum - target) < -GTOOLS_WQUANTILES_TOL) & (s + 1 < m) ) {
+            cumsum += xw[2 * (++s) + 1];
+        }
+
+        if ( (fabs(cumsum - target) < GTOOLS_WQUANTILES_TOL) & (s + 1 < m) ) {
+            qout[i] = (xw[2 * s] + xw[2 * (s + 1)]) / 2;
+        }
+        else {
+            qout[i] = xw[2 * s];
+        }
+    }
+    qout[nout] = sk->max;
+
+    free (xw);
+    return (0);
+}
+
+ST_retcode gf_kll_write (struct GtoolsKLL *sk, char *fname)
+{
+    GT_size h;
+    GT_bool ok = 1;
+    FILE *fhandle = fopen(fname, "wb");
+    if ( fhandle == NULL ) {
+        sf_errprintf("unable to write sketch to %s\n", fname);
+        return (603);
+    }
+
+    ok = ok & (fwrite(GTOOLS_KLL_MAGIC, 1, 8, fhandle) == 8);
+    ok = ok & (fwrite(&(sk->k),   sizeof sk->k,   1, fhandle) == 1);
+    ok = ok & (fwrite(&(sk->n),   sizeof sk->n,   1, fhandle) == 1);
+    ok = ok & (fwrite(&(sk->H),   sizeof sk->H,   1, fhandle) == 1);
+    ok = ok & (fwrite(&(sk->min), sizeof sk->min, 1, fhandle) == 1);
+    ok = ok & (fwrite(&(sk->max), sizeof sk->max, 1, fhandle) == 1);
+    ok = ok & (fwrite(&(sk->rng), sizeof sk->rng, 1, fhandle) == 1);
+    for (h = 0; h < sk->H; h++) {
+        ok = ok & (fwrite(sk->size + h, sizeof *sk->size, 1, fhandle) == 1);
+        ok = ok & (fwrite(sk->items[h], sizeof(ST_double), sk->size[h], fhandle) == sk->size[h]);
+    }
+    fclose (fhandle);
+
+    if ( !ok ) {
+        sf_errprintf("unable to write sketch to %s\n", fname);
+        return (693);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Read a sketch written by gf_kll_write
+ *
+ * Level h holds at most k items of weight 2^h and the weights add up
+ * to n, so a file with a k, H, or level size that does not fit is
+ * rejected rather than used to size the allocations.
+ *
+ * @param sk Sketch (initialized, empty)
+ * @param fname Sketch file
+ * @return Reads the sketch into @sk; 610 if the file is not valid
+ */
+ST_retcode gf_kll_read (struct GtoolsKLL *sk, char *fname)
+{
+    ST_retcode rc = 0;
+    GT_size h, H, size, total = 0;
+    GT_bool ok = 1;
+    char magic[8];
+
+    FILE *fhandle = fopen(fname, "rb");
+    if ( fhandle == NULL ) {
+        sf_errprintf("sketch file %s not found\n", fname);
+        return (601);
+    }
+
+    ok = ok & (fread(magic, 1, 8, fhandle) == 8);
+    ok = ok && (memcmp(magic, GTOOLS_KLL_MAGIC, 8) == 0);
+    ok = ok && (fread(&(sk->k),   sizeof sk->k,   1, fhandle) == 1);
+    ok = ok && (fread(&(sk->n),   sizeof sk->n,   1, fhandle) == 1);
+    ok = ok && (fread(&H,         sizeof H,       1, fhandle) == 1);
+    ok = ok && (fread(&(sk->min), sizeof sk->min, 1, fhandle) == 1);
+    ok = ok && (fread(&(sk->max), sizeof sk->max, 1, fhandle) == 1);
+    ok = ok && (fread(&(sk->rng), sizeof sk->rng, 1, fhandle) == 1);
+    ok = ok && (sk->k >= GTOOLS_KLL_MINK) && (sk->k <= GTOOLS_KLL_MAXK);
+    ok = ok && (H <= GTOOLS_KLL_MAXH);
+    for (h = 0; ok && (h < H); h++) {
+        ok = ok && (fread(&size, sizeof size, 1, fhandle) == 1);
+        ok = ok && (size <= sk->k) && (size <= ((sk->n - total) >> h));
+        if ( ok ) {
+            if ( (rc = gf_kll_grow(sk, h, size)) ) break;
+            ok = (fread(sk->items[h], sizeof(ST_double), size, fhandle) == size);
+            sk->size[h] = size;
+            total += size << h;
+        }
+    }
+    ok = ok && (total == sk->n) && (fgetc(fhandle) == EOF);
+    fclose (fhandle);
+
+    if ( rc ) return (rc);
+    if ( !ok ) {
+        sf_errprintf("%s is not a valid sketch file\n", fname);
+        return (610);
+    }
+
+    return (0);
+}
+
+/*********************************************************************
+ *                   Approximate quantiles (Stata)                   *
+ *********************************************************************/
+
+/**
+ * @brief Approximate quantiles, optionally by group, in one pass
+ *
+ * Only the quantiles are computed (pctile, _pctile, genp); each group
+ * keeps a sketch instead of all its values. Without by, the sketch can
+ * be merged with one saved to disk by a previous call and then saved,
+ * so the quantiles of data processed in chunks can be combined.
+ */
+ST_retcode sf_xtile_approx (struct StataInfo *st_info, int level)
+{
+    ST_retcode rc = 0;
+    ST_double z, nqdbl;
+    GT_size i, j, l, q, nj, obs, start, qtot;
+    clock_t timer = clock();
+
+    GT_size nq      = st_info->xtile_nq;
+    GT_size nq2     = st_info->xtile_nq2;
+    GT_bool pctile  = st_info->xtile_pctile;
+    GT_bool genpct  = st_info->xtile_genpct;
+    GT_bool minmax  = st_info->xtile_minmax;
+    GT_bool _pctile = st_info->xtile__pctile;
+    GT_bool debug   = st_info->debug;
+    GT_bool by      = st_info->kvars_by > 0;
+    GT_size J       = by? st_info->J: 1;
+    GT_size k       = gf_kll_k(st_info->xtile_approx);
+
+    GT_size kvars          = st_info->kvars_by;
+    GT_size ksources       = st_info->kvars_sources;
+    GT_size ktargets       = st_info->kvars_targets;
+    GT_size start_sources  = kvars + st_info->kvars_group + 1;
+    GT_size start_targets  = start_sources + ksources;
+    GT_size start_xtile    = start_targets + ktargets;
+    GT_size start_genpct   = start_xtile + pctile;
+    GT_size start_xsources = start_xtile + pctile + genpct;
+
+    GT_size in1   = st_info->in1;
+    GT_size Nread = st_info->Nread;
+
+    nq2 = (nq2 == 0)? 0: gf_xtile_clean(st_info->xtile_quantiles, nq2, 1, st_info->xtile_dedup);
+    GT_size nout = GTOOLS_PWMAX(nq, nq2 + 1);
+    GT_size ncut = nq2? nq2: nq - 1;
+
+    if ( debug ) {
+        sf_printf_debug("debug 1 (sf_xtile_approx): epsilon = %.6g, k = "GT_size_cfmt"\n",
+                        st_info->xtile_approx, k);
+        sf_printf_debug("\tnq:      "GT_size_cfmt"\n", nq);
+        sf_printf_debug("\tnq2:     "GT_size_cfmt"\n", nq2);
+        sf_printf_debug("\tJ:       "GT_size_cfmt"\n", J);
+    }
+
+    struct GtoolsKLL *sketches = calloc(J, sizeof *sketches);
+    ST_double *qout = calloc(nout + 1, sizeof *qout);
+    GT_size *index_st = calloc(by? Nread: 1, sizeof *index_st);
+
+    if ( sketches == NULL ) { rc = sf_oom_error("sf_xtile_approx", "sketches"); goto exit; }
+    if ( qout     == NULL ) { rc = sf_oom_error("sf_xtile_approx", "qout");     goto exit; }
+    if ( index_st == NULL ) { rc = sf_oom_error("sf_xtile_approx", "index_st"); goto exit; }
+
+    for (j = 0; j < J; j++)
+        gf_kll_init(sketches + j, k);
+
+    /*********************************************************************
+     *                    Build the sketches (1 pass)                    *
+     *********************************************************************/
+
+    if ( by ) {
+        for (j = 0; j < J; j++) {
+            for (i = st_info->info[j]; i < st_info->info[j + 1]; i++)
+                index_st[st_info->index[i]] = j + 1;
+        }
+
+        for (i = 0; i < Nread; i++) {
+            if ( index_st[i] == 0 ) continue;
+            if ( (rc = SF_vdata(start_xsources, i + in1, &z)) ) goto exit;
+            if ( SF_is_missing(z) ) continue;
+            if ( (rc = gf_kll_update(sketches + index_st[i] - 1, z)) ) goto exit;
+        }
+    }
+    else {
+        for (i = 0; i < Nread; i++) {
+            if ( st_info->any_if && !SF_ifobs(i + in1) ) continue;
+            if ( (rc = SF_vdata(start_xsources, i + in1, &z)) ) goto exit;
+            if ( SF_is_missing(z) ) continue;
+            if ( (rc = gf_kll_update(sketches, z)) ) goto exit;
+        }
+
+        if ( st_info->xtile_sketch && st_info->xtile_sketch_merge ) {
+            struct GtoolsKLL previous;
+            gf_kll_init(&previous, k);
+            char *fname = calloc(st_info->xtile_sketch, sizeof *fname);
+            if ( fname == NULL ) {
+                rc = sf_oom_error("sf_xtile_approx", "fname");
+            }
+            else {
+                rc = SF_macro_use("GTOOLS_XTILE_SKETCH", fname, st_info->xtile_sketch);
+            }
+            if ( rc == 0 ) rc = gf_kll_read(&previous, fname);
+            if ( rc == 0 ) {
+                if ( previous.k != k ) {
+                    sf_errprintf("sketch in %s was built with a different approx()\n", fname);
+                    rc = 198;
+                }
+                else {
+                    rc = gf_kll_merge(sketches, &previous);
+                }
+            }
+            gf_kll_free(&previous);
+            free (fname);
+            if ( rc ) goto exit;
+        }
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\txtile step 1: Built quantile sketches");
+
+    obs = 0;
+    for (j = 0; j < J; j++)
+        obs += sketches[j].n;
+
+    if ( obs == 0 ) {
+        sf_errprintf("no observations\n");
+        rc = 17001;
+        goto exit;
+    }
+
+    /*********************************************************************
+     *                   Quantiles and copy to Stata                     *
+     *********************************************************************/
+
+    if ( by ) {
+        for (j = 0; j < J; j++) {
+            if ( sketches[j].n == 0 ) continue;
+
+            start = st_info->info[j];
+            nj    = st_info->info[j + 1] - start;
+            if ( st_info->xtile_strict && (ncut > nj) ) continue;
+
+            if ( (rc = gf_kll_quantiles(sketches + j,
+                                        qout,
+                                        st_info->xtile_quantiles,
+                                        nq2,
+                                        nq)) ) goto exit;
+
+            nj = GTOOLS_PWMIN(ncut, nj);
+            for (q = 0; q < nj; q++) {
+                l = st_info->index[start + q];
+                if ( pctile ) {
+                    if ( (rc = SF_vstore(start_xtile, l + in1, qout[q])) ) goto exit;
+                }
+            }
+        }
+    }
+    else {
+        if ( (rc = gf_kll_quantiles(sketches,
+                                    qout,
+                                    st_info->xtile_quantiles,
+                                    nq2,
+                                    nq)) ) goto exit;
+
+        qtot = GTOOLS_PWMIN((nout - 1), SF_nobs());
+        if ( pctile ) {
+            for (q = 0; q < qtot; q++) {
+                if ( (rc = SF_vstore(start_xtile, q + 1, qout[q])) ) goto exit;
+            }
+        }
+
+        if ( genpct ) {
+            if ( nq2 > 0 ) {
+                for (q = 0; q < nq2; q++) {
+                    if ( (rc = SF_vstore(start_genpct, q + 1, st_info->xtile_quantiles[q]) )) goto exit;
+                }
+            }
+            else {
+                nqdbl = (ST_double) nq;
+                for (q = 0; q < (nq - 1); q++) {
+                    if ( (rc = SF_vstore(start_genpct, q + 1, (100 * (q + 1) / nqdbl)) )) goto exit;
+                }
+            }
+        }
+
+        if ( nq2 > 0 ) {
+            for (q = 0; q < nq2; q++) {
+                if ( (rc = SF_mat_store("__gtools_xtile_quantiles", 1, q + 1, qout[q]) )) goto exit;
+            }
+        }
+        else if ( _pctile ) {
+            for (q = 0; q < (nq - 1); q++) {
+                if ( (rc = SF_mat_store("__gtools_xtile_quantiles", 1, q + 1, qout[q]) )) goto exit;
+            }
+        }
+
+        if ( minmax ) {
+            if ( (rc = SF_scal_save ("__gtools_xtile_min", sketches[0].min)) ) goto exit;
+            if ( (rc = SF_scal_save ("__gtools_xtile_max", sketches[0].max)) ) goto exit;
+        }
+
+        if ( st_info->xtile_sketch ) {
+            char *fname = calloc(st_info->xtile_sketch, sizeof *fname);
+            if ( fname == NULL ) {
+                rc = sf_oom_error("sf_xtile_approx", "fname");
+            }
+            else {
+                rc = SF_macro_use("GTOOLS_XTILE_SKETCH", fname, st_info->xtile_sketch);
+            }
+            if ( rc == 0 ) rc = gf_kll_write(sketches, fname);
+            free (fname);
+            if ( rc ) goto exit;
+        }
+
+        // With a merged sketch, the count includes previous chunks
+        obs = sketches[0].n;
+    }
+
+    if ( st_info->benchmark > 1 )
+        sf_running_timer (&timer, "\txtile step 2: Computed quantiles and copied to Stata");
+
+    if ( (rc = SF_scal_save ("__gtools_xtile_nq",         (ST_double) nq  )) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_xtile_nq2",        (ST_double) nq2 )) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_xtile_cutvars",    0               )) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_xtile_ncuts",      0               )) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_xtile_qvars",      0               )) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_xtile_xvars",      (ST_double) obs )) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_xtile_method",     0               )) ) goto exit;
+    if ( (rc = SF_scal_save ("__gtools_xtile_approx_eps", gf_kll_epsilon(k))) ) goto exit;
+
+exit:
+    // Sketches are zeroed by calloc, so freeing one never initialized is fine
+    if ( sketches != NULL ) {
+        for (j = 0; j < J; j++)
+            gf_kll_free(sketches + j);
+    }
+
+    free (sketches);
+    free (qout);
+    free (index_st);
+
+    return (rc);
+}
@@ -1,3 +1,6 @@
+#include "gquantiles_by_threads.c"
+#include "gquantiles_by_radix.c"
+
 ST_retcode sf_xtile_by (struct StataInfo *st_info, int level);
 
 ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
@@ -37,11 +40,20 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
     GT_bool altdef  = st_info->xtile_altdef;
     GT_bool debug   = st_info->debug;
 
+    // Threads are only available with the multi-threaded plugin
+    GT_bool threaded = 0;
+#ifdef GTOOLS_PARALLEL
+    threaded = (st_info->xtile_threads > 1) & (st_info->J > 1);
+#endif
+
     // NOT ALLOWED WITH BY
     // GT_bool _pctile  = st_info->xtile__pctile;
     // GT_bool bincount = st_info->xtile_bincount;
     // GT_bool minmax   = st_info->xtile_minmax;
-    // GT_bool method   = st_info->xtile_method;
+    // GT_size method   = st_info->xtile_method;
+
+    // method(3) sorts all groups at once on (group, value)
+    GT_bool radix = (st_info->xtile_method == 3);
 
     GT_size kvars          = st_info->kvars_by;
     GT_size ksources       = st_info->kvars_sources;
@@ -80,6 +92,7 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
         sf_printf_debug("\tncuts:     "GT_size_cfmt"\n", ncuts);
         sf_printf_debug("\tqvars:     "GT_size_cfmt"\n", qvars);
         sf_printf_debug("\tcutvars:   "GT_size_cfmt"\n", cutvars);
+        sf_printf_debug("\tthreads:   "GT_size_cfmt"\n", st_info->xtile_threads);
     }
 
     /*********************************************************************
@@ -850,7 +863,49 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
      *********************************************************************/
 
     GT_size invert[2]; invert[0] = 0; invert[1] = 0;
-    if ( cutvars & st_info->xtile_cutby ) {
+    if ( threaded ) {
+#ifdef GTOOLS_PARALLEL
+        if ( debug ) {
+            sf_printf_debug("debug 13 (sf_xtile_by): sort and compute with "GT_size_cfmt" threads\n",
+                            st_info->xtile_threads);
+        }
+
+        struct GtoolsXtileByShared shared;
+
+        shared.st_info        = st_info;
+        shared.xsources       = xsources;
+        shared.xpoints        = xpoints;
+        shared.xquants        = xquants;
+        shared.qshared        = (ncuts > 0)? st_info->xtile_cutoffs: xpoints;
+        shared.nshared        = (ncuts > 0)? ncuts: ((npoints > 0)? npoints: 0);
+        shared.offsets_buffer = offsets_buffer;
+        shared.all_nonmiss    = all_nonmiss;
+        shared.points_nonmiss = points_nonmiss;
+        shared.nj_buffer      = nj_buffer;
+        shared.xcount         = xcount;
+        shared.wcount         = wcount;
+        shared.xqout          = xqout;
+        shared.xoutput        = xoutput;
+        shared.kx             = kx;
+        shared.nq             = nq;
+        shared.nq2            = nq2;
+        shared.ncuts          = ncuts;
+        shared.npoints        = npoints;
+        shared.nquants        = nquants;
+        shared.nout           = nout;
+        shared.kgen           = kgen;
+        shared.cutvars        = (cutvars > 0);
+        shared.qvars          = (qvars > 0);
+        shared.cstartj        = cstartj;
+        shared.pctile         = pctile;
+        shared.pctpct         = pctpct;
+        shared.weights        = weights;
+        shared.altdef         = altdef;
+
+        if ( (rc = gf_xtile_by_threads(&shared, J, st_info->xtile_threads)) ) goto exit;
+#endif
+    }
+    else if ( cutvars & st_info->xtile_cutby ) {
         if ( debug ) {
             sf_printf_debug("debug 13 (sf_xtile_by): cutvars, cutby\n");
         }
@@ -997,7 +1052,23 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
             sf_printf_debug("debug 13 (sf_xtile_by): no cutby\n");
         }
 
-        if ( weights ) {
+        // With many small groups, default to the composite radix sort
+        if ( (st_info->xtile_method == 0) & (J > 1) ) {
+            radix = (obs >= GTOOLS_XTILE_RADIX_MINOBS) & (obs <= GTOOLS_XTILE_RADIX_MAXAVG * J);
+        }
+
+        if ( radix ) {
+            if ( debug ) {
+                sf_printf_debug("debug 13 (sf_xtile_by): composite (group, value) radix sort\n");
+            }
+            if ( (rc = gf_xtile_by_radix(xsources,
+                                         offsets_buffer,
+                                         all_nonmiss,
+                                         J,
+                                         kx,
+                                         st_info->ctolerance)) ) goto exit;
+        }
+        else if ( weights ) {
             for (j = 0; j < J; j++) {
                 start = kx * offsets_buffer[j];
                 end   = all_nonmiss[j];
@@ -1041,8 +1112,14 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
         }
     }
 
-    if ( st_info->benchmark > 1 )
-        sf_running_timer (&stimer, "\txtile step 3: Sorted inputs by group");
+    if ( st_info->benchmark > 1 ) {
+        if ( threaded ) {
+            sf_running_timer (&timer, "\txtile step 3: Sorted inputs and computed xtile by group");
+        }
+        else {
+            sf_running_timer (&stimer, "\txtile step 3: Sorted inputs by group");
+        }
+    }
 
     /*********************************************************************
      *      Turn quantiles into cutoffs (or point qptr to cutoffs)       *
@@ -1070,7 +1147,12 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
         sf_printf_debug("debug 14 (sf_xtile_by): assign qptr to %p (NULL is %p)\n", qptr, NULL);
     }
 
-    if ( kgen & (pctpct | pctile) ) {
+    if ( threaded ) {
+        if ( debug ) {
+            sf_printf_debug("debug 15 (sf_xtile_by): computed by threads\n");
+        }
+    }
+    else if ( kgen & (pctpct | pctile) ) {
         if ( debug ) {
             sf_printf_debug("debug 15 (sf_xtile_by): kgen and pctile or pctpct (cstartj = %u, J = %lu)\n", cstartj, J);
         }
@@ -1200,26 +1282,6 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
 
         if ( st_info->benchmark > 2 )
             sf_running_timer (&stimer, "\t\txtile step 4.1: Computed xtile and pctile");
-
-        optr = xoutput;
-        if ( (obs < Nread) | (st_info->xtile_strict) ) {
-            for (i = 0; i < Nread; i++, optr++) {
-                if ( *optr ) {
-                    if ( (rc = SF_vstore(start_xtile, i + in1, *optr)) ) goto exit;
-                }
-            }
-        }
-        else {
-            for (i = 0; i < Nread; i++, optr++) {
-                if ( (rc = SF_vstore(start_xtile, i + in1, *optr)) ) goto exit;
-            }
-        }
-
-        if ( st_info->benchmark > 2 )
-            sf_running_timer (&stimer, "\t\txtile step 4.2: Copied xtile to Stata sequentially");
-
-        if ( st_info->benchmark > 1 )
-            sf_running_timer (&timer, "\txtile step 4: Computed xtile and copied to Stata");
     }
     else if ( kgen ) {
         if ( debug ) {
@@ -1318,26 +1380,6 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
 
         if ( st_info->benchmark > 2 )
             sf_running_timer (&stimer, "\t\txtile step 4.1: Computed xtile");
-
-        optr = xoutput;
-        if ( (obs < Nread) | (st_info->xtile_strict) ) {
-            for (i = 0; i < Nread; i++, optr++) {
-                if ( *optr ) {
-                    if ( (rc = SF_vstore(start_xtile, i + in1, *optr)) ) goto exit;
-                }
-            }
-        }
-        else {
-            for (i = 0; i < Nread; i++, optr++) {
-                if ( (rc = SF_vstore(start_xtile, i + in1, *optr)) ) goto exit;
-            }
-        }
-
-        if ( st_info->benchmark > 2 )
-            sf_running_timer (&stimer, "\t\txtile step 4.2: Copied xtile to Stata sequentially");
-
-        if ( st_info->benchmark > 1 )
-            sf_running_timer (&timer, "\txtile step 4: Computed xtile and copied to Stata");
     }
     else if ( pctpct | pctile ) {
         if ( debug ) {
@@ -1465,6 +1507,28 @@ ST_retcode sf_xtile_by (struct StataInfo *st_info, int level)
         }
     }
 
+    if ( kgen ) {
+        optr = xoutput;
+        if ( (obs < Nread) | (st_info->xtile_strict) ) {
+            for (i = 0; i < Nread; i++, optr++) {
+                if ( *optr ) {
+                    if ( (rc = SF_vstore(start_xtile, i + in1, *optr)) ) goto exit;
+                }
+            }
+        }
+        else {
+            for (i = 0; i < Nread; i++, optr++) {
+                if ( (rc = SF_vstore(start_xtile, i + in1, *optr)) ) goto exit;
+            }
+        }
+
+        if ( st_info->benchmark > 2 )
+            sf_running_timer (&stimer, "\t\txtile step 4.2: Copied xtile to Stata sequentially");
+
+        if ( st_info->benchmark > 1 )
+            sf_running_timer (&timer, "\txtile step 4: Computed xtile and copied to Stata");
+    }
+
     if ( debug ) {
         sf_printf_debug("debug 16 (sf_xtile_by): done with main computations\n");
     }
@@ -0,0 +1,131 @@
+/*
+ * With many small groups, sorting each group's segment separately means
+ * millions of tiny quicksort calls. Instead we can sort every group at
+ * once on the composite key (group, value): A stable radix sort on an
+ * order-preserving integer image of the values followed by a stable
+ * counting pass on the group (the most significant "digit"). Each group's
+ * segment of xsources is then sorted and its quantiles can be read off
+ * the sorted run directly.
+ */
+
+#define GTOOLS_XTILE_RADIX_MINOBS  262144
+#define GTOOLS_XTILE_RADIX_MAXAVG  16
+
+uint64_t gf_xtile_radix_key (ST_double x);
+
+ST_retcode gf_xtile_by_radix (
+    ST_double *xsources,
+    GT_size   *offsets_buffer,
+    GT_size   *all_nonmiss,
+    GT_size   J,
+    GT_size   kx,
+    GT_size   ctol
+);
+
+/**
+ * @brief Order-preserving unsigned image of a double
+ *
+ * Flip the sign bit of non-negative numbers and all the bits of negative
+ * numbers, so that unsigned integer comparison of the images matches
+ * floating-point comparison of the inputs. -0 and 0 share an image.
+ *
+ * @param x Non-missing double
+ * @return Integer image of @x
+ */
+uint64_t gf_xtile_radix_key (ST_double x)
+{
+    uint64_t u;
+    if ( x == 0 ) x = 0;
+    memcpy(&u, &x, sizeof u);
+    return ((u >> 63)? ~u: (u | ((uint64_t) 1 << 63)));
+}
+
+/**
+ * @brief Sort every group's sources at once on (group, value)
+ *
+ * The non-missing sources of group j are the all_nonmiss[j] rows
+ * (kx entries each, value first) starting at row offsets_buffer[j].
+ *
+ * @param xsources Source rows, by group
+ * @param offsets_buffer Starting row of each group
+ * @param all_nonmiss Number of non-missing rows in each group
+ * @param J Number of groups
+ * @param kx Entries per row
+ * @param ctol Range below which to use a counting sort
+ * @return Each group's rows in @xsources sorted by value
+ */
+ST_retcode gf_xtile_by_radix (
+    ST_double *xsources,
+    GT_size   *offsets_buffer,
+    GT_size   *all_nonmiss,
+    GT_size   J,
+    GT_size   kx,
+    GT_size   ctol)
+{
+    ST_retcode rc = 0;
+    GT_size i, j, n, N, start, end;
+    ST_double *xptr;
+
+    N = 0;
+    for (j = 0; j < J; j++)
+        N += all_nonmiss[j];
+
+    if ( N < 2 ) return (0);
+
+    uint64_t  *keys   = calloc(N, sizeof *keys);
+    GT_size   *index  = calloc(N, sizeof *index);
+    GT_size   *group  = calloc(N, sizeof *group);
+    GT_size   *cursor = calloc(J, sizeof *cursor);
+    ST_double *xcopy  = calloc(N * kx, sizeof *xcopy);
+
+    if ( keys   == NULL ) { rc = sf_oom_error("gf_xtile_by_radix", "keys");   goto exit; }
+    if ( index  == NULL ) { rc = sf_oom_error("gf_xtile_by_radix", "index");  goto exit; }
+    if ( group  == NULL ) { rc = sf_oom_error("gf_xtile_by_radix", "group");  goto exit; }
+    if ( cursor == NULL ) { rc = sf_oom_error("gf_xtile_by_radix", "cursor"); goto exit; }
+    if ( xcopy  == NULL ) { rc = sf_oom_error("gf_xtile_by_radix", "xcopy");  goto exit; }
+
+    // Pack the non-missing rows and their keys
+    // ----------------------------------------
+
+    n = 0;
+    for (j = 0; j < J; j++) {
+        start = kx * offsets_buffer[j];
+        end   = all_nonmiss[j];
+        memcpy(xcopy + kx * n, xsources + start, kx * end * sizeof(ST_double));
+        for (xptr = xsources + start; xptr < xsources + start + kx * end; xptr += kx, n++) {
+            keys[n]  = gf_xtile_radix_key(*xptr);
+            index[n] = n;
+            group[n] = j;
+        }
+        cursor[j] = start;
+    }
+
+    // Stable sort on the values; shifting by the min lets the sort
+    // pick a counting sort or fewer radix passes when it can
+    // ------------------------------------------------------------
+
+    GTOOLS_MIN (keys, N, min, i)
+    for (i = 0; i < N; i++)
+        keys[i] -= min;
+
+    if ( (rc = gf_sort_hash (keys, index, N, 0, ctol)) ) goto exit;
+
+    // Stable counting pass on the group
+    // ---------------------------------
+
+    for (i = 0; i < N; i++) {
+        n = index[i];
+        j = group[n];
+        memcpy(xsources + cursor[j], xcopy + kx * n, kx * sizeof(ST_double));
+        cursor[j] += kx;
+    }
+
+exit:
+    free (keys);
+    free (index);
+    free (group);
+    free (cursor);
+    free (xcopy);
+
+    return (rc);
+}
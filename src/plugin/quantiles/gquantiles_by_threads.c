@@ -0,0 +1,345 @@
+#ifdef GTOOLS_PARALLEL
+
+/*
+ * Per-group quantiles are independent: each group sorts its own segment
+ * of xsources, computes its own quantiles, and writes its outputs to the
+ * positions of its own observations. Hence we can split the groups into
+ * contiguous ranges and process each range in a separate thread. The
+ * only shared scratch in the sequential code is the quantile buffer
+ * (xquant) and the sentinel slot at the end of the cutoffs, so each
+ * thread gets its own copy of those. Results do not depend on the number
+ * of threads.
+ */
+
+struct GtoolsXtileByShared {
+    struct StataInfo *st_info;
+    ST_double *xsources;
+    ST_double *xpoints;
+    ST_double *xquants;
+    ST_double *qshared;
+    GT_size   *offsets_buffer;
+    GT_size   *all_nonmiss;
+    GT_size   *points_nonmiss;
+    GT_size   *nj_buffer;
+    GT_size   *xcount;
+    ST_double *wcount;
+    ST_double *xqout;
+    ST_double *xoutput;
+    GT_size   kx;
+    GT_size   nq;
+    GT_size   nq2;
+    GT_size   ncuts;
+    GT_size   npoints;
+    GT_size   nquants;
+    GT_size   nshared;
+    GT_size   nout;
+    GT_size   kgen;
+    GT_bool   cutvars;
+    GT_bool   qvars;
+    GT_bool   cstartj;
+    GT_bool   pctile;
+    GT_bool   pctpct;
+    GT_bool   weights;
+    GT_bool   altdef;
+};
+
+struct GtoolsXtileByThread {
+    struct GtoolsXtileByShared *shared;
+    GT_size jstart;
+    GT_size jend;
+    ST_double *xquant;
+};
+
+void gf_xtile_by_sort_group (struct GtoolsXtileByShared *sh, GT_size j);
+void gf_xtile_by_compute_group (struct GtoolsXtileByShared *sh, GT_size j, ST_double *xquant);
+void * gf_xtile_by_thread (void *args);
+
+ST_retcode gf_xtile_by_threads (
+    struct GtoolsXtileByShared *sh,
+    GT_size J,
+    GT_size nthreads
+);
+
+/**
+ * @brief Sort the sources of group j (and clean its cutoffs with cutby)
+ */
+void gf_xtile_by_sort_group (struct GtoolsXtileByShared *sh, GT_size j)
+{
+    GT_size i, cstart, cend, start, end;
+    ST_double *xptr, *xptr2, *gptr;
+    GT_size invert[2]; invert[0] = 0; invert[1] = 0;
+
+    GT_size kx = sh->kx;
+    start = kx * sh->offsets_buffer[j];
+    end   = sh->all_nonmiss[j];
+    xptr  = sh->xsources + start;
+
+    if ( sh->cstartj ) {
+        cstart = sh->offsets_buffer[j] + j;
+        cend   = sh->points_nonmiss[j];
+        gptr   = (sh->cutvars? sh->xpoints: sh->xquants) + cstart;
+
+        if ( (end == 0) || (cend == 0) ) {
+            sh->all_nonmiss[j]    = 0;
+            sh->points_nonmiss[j] = 0;
+            return;
+        }
+
+        sh->points_nonmiss[j] = gf_xtile_clean(gptr, cend, 1, sh->st_info->xtile_dedup);
+        if ( sh->points_nonmiss[j] == 0 ) return;
+    }
+    else if ( end == 0 ) {
+        return;
+    }
+
+    if ( sh->weights ) {
+        MultiQuicksortDbl(
+            xptr,
+            end,
+            0,
+            1,
+            kx * (sizeof *xptr),
+            invert
+        );
+    }
+    else {
+        i = 0;
+        for (xptr2 = xptr; xptr2 < xptr + kx * (end - 1); xptr2 += kx, i++) {
+            if ( *xptr2 > *(xptr2 + kx) ) break;
+        }
+        i++;
+
+        if ( i < end ) {
+            quicksort_bsd (
+                xptr,
+                end,
+                kx * (sizeof *xptr),
+                xtileCompare,
+                NULL
+            );
+        }
+    }
+}
+
+/**
+ * @brief Compute the quantiles, xtile, and bin counts of group j
+ *
+ * @param xquant Thread-specific buffer of length nout for the quantiles
+ */
+void gf_xtile_by_compute_group (struct GtoolsXtileByShared *sh, GT_size j, ST_double *xquant)
+{
+    GT_size q, cstart, cend, start, end, nj, ixstart;
+    ST_double *xptr, *xptr2, *qptr2;
+    GT_size *jptr;
+
+    struct StataInfo *st_info = sh->st_info;
+    GT_size kx = sh->kx;
+
+    cend = sh->points_nonmiss[j];
+    end  = sh->all_nonmiss[j];
+    nj   = sh->nj_buffer[j];
+
+    if ( (end == 0) || (cend == 0) ) return;
+    if ( st_info->xtile_strict && (cend > nj) ) return;
+
+    cstart = sh->cstartj? sh->offsets_buffer[j] + j: 0;
+    start  = kx * (ixstart = sh->offsets_buffer[j]);
+    xptr   = sh->xsources + start;
+
+    // With cutby the cutoffs live in the group's own segment; otherwise
+    // use this thread's buffer (the cutoffs were copied there already).
+    if ( sh->cstartj ) {
+        qptr2 = (sh->cutvars? sh->xpoints: sh->xquants) + cstart;
+    }
+    else {
+        qptr2 = xquant;
+    }
+
+    if ( (sh->ncuts > 0) || (sh->npoints > 0) ) {
+        qptr2[cend] = xptr[kx * end - kx];
+    }
+    else if ( sh->weights ) {
+        if ( sh->nquants > 0 ) {
+            gf_quantiles_w (qptr2, xptr, sh->xquants + cstart, cend, end, kx);
+        }
+        else if ( sh->nq2 > 0 ) {
+            gf_quantiles_w (qptr2, xptr, st_info->xtile_quantiles, cend, end, kx);
+        }
+        else if ( sh->nq > 0 ) {
+            gf_quantiles_nq_w (qptr2, xptr, cend + 1, end, kx);
+        }
+    }
+    else if ( sh->altdef ) {
+        if ( sh->nquants > 0 ) {
+            gf_quantiles_altdef (qptr2, xptr, sh->xquants + cstart, cend, end, kx);
+        }
+        else if ( sh->nq2 > 0 ) {
+            gf_quantiles_altdef (qptr2, xptr, st_info->xtile_quantiles, cend, end, kx);
+        }
+        else if ( sh->nq > 0 ) {
+            gf_quantiles_nq_altdef (qptr2, xptr, cend + 1, end, kx);
+        }
+    }
+    else {
+        if ( sh->nquants > 0 ) {
+            gf_quantiles (qptr2, xptr, sh->xquants + cstart, cend, end, kx);
+        }
+        else if ( sh->nq2 > 0 ) {
+            gf_quantiles (qptr2, xptr, st_info->xtile_quantiles, cend, end, kx);
+        }
+        else if ( sh->nq > 0 ) {
+            gf_quantiles_nq (qptr2, xptr, cend + 1, end, kx);
+        }
+    }
+
+    if ( sh->pctile | sh->pctpct ) {
+        nj = GTOOLS_PWMIN(cend, nj);
+        q  = 0;
+        for (jptr = st_info->index + ixstart;
+             jptr < st_info->index + ixstart + nj;
+             jptr++, q++) {
+            if ( sh->weights ) {
+                sh->wcount[*jptr] = 1;
+            }
+            else {
+                sh->xcount[*jptr] = 1;
+            }
+            sh->xqout[*jptr] = qptr2[q];
+        }
+
+        q    = 0;
+        jptr = st_info->index + ixstart;
+        for (xptr2 = xptr; xptr2 < xptr + kx * end; xptr2 += kx) {
+            while ( *xptr2 > qptr2[q] ) {
+                q++;
+                jptr++;
+            }
+            if ( q < nj ) {
+                if ( sh->weights ) {
+                    sh->wcount[*jptr] += *(xptr2 + 1);
+                }
+                else {
+                    sh->xcount[*jptr]++;
+                }
+            }
+            if ( sh->kgen ) {
+                sh->xoutput[(GT_size) *(xptr2 + kx - 1)] = q + 1;
+            }
+        }
+    }
+    else if ( sh->kgen ) {
+        q = 0;
+        for (xptr2 = xptr; xptr2 < xptr + kx * end; xptr2 += kx) {
+            while ( *xptr2 > qptr2[q] ) q++;
+            sh->xoutput[(GT_size) *(xptr2 + kx - 1)] = q + 1;
+        }
+    }
+}
+
+void * gf_xtile_by_thread (void *args)
+{
+    GT_size j;
+    struct GtoolsXtileByThread *th = args;
+    struct GtoolsXtileByShared *sh = th->shared;
+
+    if ( (sh->cstartj == 0) && (sh->nshared > 0) ) {
+        memcpy(th->xquant, sh->qshared, sh->nshared * sizeof(ST_double));
+    }
+
+    for (j = th->jstart; j < th->jend; j++) {
+        gf_xtile_by_sort_group(sh, j);
+        gf_xtile_by_compute_group(sh, j, th->xquant);
+    }
+
+    return (NULL);
+}
+
+/**
+ * @brief Sort and compute quantiles by group using multiple threads
+ *
+ * Groups are split into contiguous ranges with roughly the same number
+ * of non-missing observations. Each thread owns a quantile buffer.
+ *
+ * @param sh Shared inputs and outputs
+ * @param J Number of groups
+ * @param nthreads Number of threads requested
+ * @return Sorted sources and filled outputs in @sh
+ */
+ST_retcode gf_xtile_by_threads (
+    struct GtoolsXtileByShared *sh,
+    GT_size J,
+    GT_size nthreads)
+{
+    ST_retcode rc = 0;
+    GT_size j, t, total, target, cumsum, nstarted;
+
+    if ( nthreads > J ) nthreads = J;
+    if ( nthreads < 1 ) nthreads = 1;
+
+    pthread_t *threads = calloc(nthreads, sizeof *threads);
+    struct GtoolsXtileByThread *thargs = calloc(nthreads, sizeof *thargs);
+    ST_double *xquant = calloc(nthreads * sh->nout, sizeof *xquant);
+
+    if ( threads == NULL ) { rc = sf_oom_error("gf_xtile_by_threads", "threads"); goto exit; }
+    if ( thargs  == NULL ) { rc = sf_oom_error("gf_xtile_by_threads", "thargs");  goto exit; }
+    if ( xquant  == NULL ) { rc = sf_oom_error("gf_xtile_by_threads", "xquant");  goto exit; }
+
+    total = 0;
+    for (j = 0; j < J; j++)
+        total += sh->all_nonmiss[j] + 1;
+
+    j = 0;
+    cumsum = 0;
+    for (t = 0; t < nthreads; t++) {
+        thargs[t].shared = sh;
+        thargs[t].xquant = xquant + t * sh->nout;
+        thargs[t].jstart = j;
+        target = (total / nthreads) * (t + 1);
+        if ( t == nthreads - 1 ) {
+            j = J;
+        }
+        else {
+            while ( (j < J) && (cumsum < target) ) {
+                cumsum += sh->all_nonmiss[j++] + 1;
+            }
+        }
+        thargs[t].jend = j;
+    }
+
+    nstarted = 0;
+    for (t = 0; t < nthreads; t++) {
+        if ( pthread_create(threads + t, NULL, gf_xtile_by_thread, thargs + t) ) {
+            break;
+        }
+        nstarted++;
+    }
+
+    // Any range that could not get its own thread is done serially here
+    for (t = nstarted; t < nthreads; t++) {
+        gf_xtile_by_thread(thargs + t);
+    }
+
+    for (t = 0; t < nstarted; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    if ( sh->st_info->verbose ) {
+        if ( nstarted < nthreads ) {
+            sf_printf("(note: only "GT_size_cfmt" of "GT_size_cfmt" threads started)\n",
+                      nstarted, nthreads);
+        }
+        else {
+            sf_printf("(computed quantiles of "GT_size_cfmt" groups in "GT_size_cfmt" threads)\n",
+                      J, nthreads);
+        }
+    }
+
+exit:
+    free (xquant);
+    free (thargs);
+    free (threads);
+
+    return (rc);
+}
+
+#endif
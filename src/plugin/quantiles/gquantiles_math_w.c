@@ -169,3 +169,132 @@ void gf_quantiles_w (
     }
     qout[nquants] = x[kx * N - kx];
 }
+
+/*********************************************************************
+ *                  Weighted quantiles via selection                 *
+ *********************************************************************/
+
+// These give the same results as gf_quantiles_nq_w and gf_quantiles_w
+// but x need not be sorted. Each quantile is found via weighted
+// selection starting at the previous one, so x ends up partially
+// ordered (enough for bin counts but not for xtile).
+
+ST_double gf_quantiles_qselect_w_next (
+    ST_double *x,
+    GT_size   N,
+    GT_size   kx,
+    ST_double qdbl,
+    ST_double cumnorm,
+    GT_size   *ix,
+    ST_double *cumsum,
+    ST_double *prev)
+{
+    GT_bool rfoo;
+    *ix  = gf_qselect_weighted(x, *ix, N, kx, qdbl, cumnorm, cumsum, prev);
+    rfoo = !((qdbl - *cumsum) > GTOOLS_WQUANTILES_TOL);
+
+    if ( rfoo && (*ix > 0) ) {
+        if ( *prev == x[kx * *ix] ) {
+            return (*prev);
+        }
+        else {
+            return ((*prev + x[kx * *ix]) / 2);
+        }
+    }
+    else {
+        return (x[kx * *ix]);
+    }
+}
+
+ST_double gf_quantiles_qselect_w_max (ST_double *x, GT_size start, GT_size N, GT_size kx)
+{
+    ST_double *xptr;
+    ST_double xmax = x[kx * start];
+    for (xptr = x + kx * start; xptr < x + kx * N; xptr += kx) {
+        if ( *xptr > xmax ) xmax = *xptr;
+    }
+    return (xmax);
+}
+
+void gf_quantiles_nq_qselect_w (
+    ST_double *qout,
+    ST_double *x,
+    GT_size nquants,
+    GT_size N,
+    GT_size kx)
+{
+    GT_size i, ix;
+    ST_double Ndbl;
+    ST_double nqdbl;
+    ST_double qdbl, cumsum, cumnorm, wsum, prev;
+    GT_size   Ndiv;
+    GT_size   Nmod = N % nquants;
+
+    ix   = 0;
+    wsum = 0;
+    for (i = 0; i < N; i++)
+        wsum += x[kx * i + 1];
+
+    prev    = 0;
+    cumsum  = 0;
+    cumnorm = ((ST_double) N) / wsum;
+
+    if ( Nmod ) { // Numerical precision foo...
+        for (i = 0; i < (nquants - 1); i++) {
+            Ndiv  = gf_quantiles_gcd(nquants, Nmod);
+            Ndbl  = N / Ndiv;
+            nqdbl = nquants / Ndiv;
+            qdbl  = Ndbl * ((i + 1) / nqdbl);
+            qout[i] = gf_quantiles_qselect_w_next(x, N, kx, qdbl, cumnorm, &ix, &cumsum, &prev);
+        }
+    }
+    else {
+        Ndiv = N / nquants;
+        for (i = 0; i < (nquants - 1); i++) {
+            qdbl = (i + 1) * Ndiv;
+            qout[i] = gf_quantiles_qselect_w_next(x, N, kx, qdbl, cumnorm, &ix, &cumsum, &prev);
+        }
+    }
+    qout[nquants - 1] = gf_quantiles_qselect_w_max(x, ix, N, kx);
+}
+
+void gf_quantiles_qselect_w (
+    ST_double *qout,
+    ST_double *x,
+    ST_double *quants,
+    GT_size nquants,
+    GT_size N,
+    GT_size kx)
+{
+    GT_size i, ix;
+    ST_double qdbl, cumsum, cumnorm, wsum, prev;
+    ST_double Ndbl = (ST_double) N;
+    GT_size   Nmod = N % 100;
+    ST_double Ndiv;
+
+    // See gf_quantiles_w for the numerical precision foo
+
+    ix   = 0;
+    wsum = 0;
+    for (i = 0; i < N; i++)
+        wsum += x[kx * i + 1];
+
+    prev    = 0;
+    cumsum  = 0;
+    cumnorm = Ndbl / wsum;
+
+    if ( Nmod ) {
+        for (i = 0; i < nquants; i++) {
+            qdbl = quants[i] * Ndbl / 100;
+            qout[i] = gf_quantiles_qselect_w_next(x, N, kx, qdbl, cumnorm, &ix, &cumsum, &prev);
+        }
+    }
+    else {
+        Ndiv = N / 100;
+        for (i = 0; i < nquants; i++) {
+            qdbl = quants[i] * Ndiv;
+            qout[i] = gf_quantiles_qselect_w_next(x, N, kx, qdbl, cumnorm, &ix, &cumsum, &prev);
+        }
+    }
+    qout[nquants] = gf_quantiles_qselect_w_max(x, ix, N, kx);
+}
@@ -18,4 +18,39 @@ void gf_quantiles_w (
     GT_size kx
 );
 
+ST_double gf_quantiles_qselect_w_next (
+    ST_double *x,
+    GT_size   N,
+    GT_size   kx,
+    ST_double qdbl,
+    ST_double cumnorm,
+    GT_size   *ix,
+    ST_double *cumsum,
+    ST_double *prev
+);
+
+ST_double gf_quantiles_qselect_w_max (
+    ST_double *x,
+    GT_size start,
+    GT_size N,
+    GT_size kx
+);
+
+void gf_quantiles_nq_qselect_w (
+    ST_double *qout,
+    ST_double *x,
+    GT_size nquants,
+    GT_size N,
+    GT_size kx
+);
+
+void gf_quantiles_qselect_w (
+    ST_double *qout,
+    ST_double *x,
+    ST_double *quants,
+    GT_size nquants,
+    GT_size N,
+    GT_size kx
+);
+
 #endif
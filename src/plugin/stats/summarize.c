@@ -67,32 +67,8 @@ ST_retcode sf_stats_summarize (struct StataInfo *st_info, int level, char *fname
             nj_max = (st_info->info[j + 1] - st_info->info[j]);
     }
 
-    GT_size  *nuniq_ix;
-    uint64_t *nuniq_h1;
-    uint64_t *nuniq_h2;
-    uint64_t *nuniq_h3;
-    uint64_t *nuniq_xcopy;
-
-    if ( st_info->nunique ) {
-        nuniq_ix    = calloc(nj_max, sizeof *nuniq_ix);
-        nuniq_h1    = calloc(nj_max, sizeof *nuniq_h1);
-        nuniq_h2    = calloc(nj_max, sizeof *nuniq_h2);
-        nuniq_h3    = calloc(nj_max, sizeof *nuniq_h3);
-        nuniq_xcopy = calloc(nj_max, sizeof *nuniq_xcopy);
-    }
-    else {
-        nuniq_ix    = malloc(sizeof *nuniq_ix);
-        nuniq_h1    = malloc(sizeof *nuniq_h1);
-        nuniq_h2    = malloc(sizeof *nuniq_h2);
-        nuniq_h3    = malloc(sizeof *nuniq_h3);
-        nuniq_xcopy = malloc(sizeof *nuniq_xcopy);
-    }
-
-    if ( nuniq_ix    == NULL ) return(sf_oom_error("sf_stats_summarize", "nuniq_ix"));
-    if ( nuniq_h1    == NULL ) return(sf_oom_error("sf_stats_summarize", "nuniq_h1"));
-    if ( nuniq_h2    == NULL ) return(sf_oom_error("sf_stats_summarize", "nuniq_h2"));
-    if ( nuniq_h3    == NULL ) return(sf_oom_error("sf_stats_summarize", "nuniq_h3"));
-    if ( nuniq_xcopy == NULL ) return(sf_oom_error("sf_stats_summarize", "nuniq_xcopy"));
+    struct GtoolsNuniqSet nuniq_set;
+    if ( (rc = gf_nuniq_set_init(&nuniq_set, st_info->nunique? nj_max: 0)) ) return (rc);
 
     ST_double *all_buffer     = calloc(N * ksources, sizeof *all_buffer);
     GT_bool   *all_firstmiss  = calloc(J * ksources, sizeof *all_firstmiss);
@@ -268,16 +244,11 @@ ST_retcode sf_stats_summarize (struct StataInfo *st_info, int level, char *fname
                         output[offset_output + l] = lastnm[k];
                     }
                     else if ( scode == -18 ) { // nunique
-                        if ( (rc = gf_array_nunique_range (
+                        if ( (rc = gf_array_nunique_set (
                                 output + offset_output + l,
                                 all_buffer + start,
                                 nj,
-                                (end == 0),
-                                nuniq_h1,
-                                nuniq_h2,
-                                nuniq_h3,
-                                nuniq_ix,
-                                nuniq_xcopy
+                                &nuniq_set
                             )
                         ) ) return (rc);
                     }
@@ -376,11 +347,7 @@ exit:
     free (statcode);
     free (index_st);
 
-    free (nuniq_h1);
-    free (nuniq_h2);
-    free (nuniq_h3);
-    free (nuniq_ix);
-    free (nuniq_xcopy);
+    gf_nuniq_set_free (&nuniq_set);
 
     free (all_buffer);
     free (all_firstmiss);
@@ -456,32 +423,8 @@ ST_retcode sf_stats_summarize_p (struct StataInfo *st_info, int level, char *fna
             nj_max = (st_info->info[j + 1] - st_info->info[j]);
     }
 
-    GT_size  *nuniq_ix;
-    uint64_t *nuniq_h1;
-    uint64_t *nuniq_h2;
-    uint64_t *nuniq_h3;
-    uint64_t *nuniq_xcopy;
-
-    if ( st_info->nunique ) {
-        nuniq_ix    = calloc(nj_max * ksources, sizeof *nuniq_ix);
-        nuniq_h1    = calloc(nj_max * ksources, sizeof *nuniq_h1);
-        nuniq_h2    = calloc(nj_max * ksources, sizeof *nuniq_h2);
-        nuniq_h3    = calloc(nj_max * ksources, sizeof *nuniq_h3);
-        nuniq_xcopy = calloc(nj_max * ksources, sizeof *nuniq_xcopy);
-    }
-    else {
-        nuniq_ix    = malloc(sizeof(nuniq_ix));
-        nuniq_h1    = malloc(sizeof(nuniq_h1));
-        nuniq_h2    = malloc(sizeof(nuniq_h2));
-        nuniq_h3    = malloc(sizeof(nuniq_h3));
-        nuniq_xcopy = malloc(sizeof(nuniq_xcopy));
-    }
-
-    if ( nuniq_ix    == NULL ) return(sf_oom_error("sf_stats_summarize_p", "nuniq_ix"));
-    if ( nuniq_h1    == NULL ) return(sf_oom_error("sf_stats_summarize_p", "nuniq_h1"));
-    if ( nuniq_h2    == NULL ) return(sf_oom_error("sf_stats_summarize_p", "nuniq_h2"));
-    if ( nuniq_h3    == NULL ) return(sf_oom_error("sf_stats_summarize_p", "nuniq_h3"));
-    if ( nuniq_xcopy == NULL ) return(sf_oom_error("sf_stats_summarize_p", "nuniq_xcopy"));
+    struct GtoolsNuniqSet nuniq_set;
+    if ( (rc = gf_nuniq_set_init(&nuniq_set, st_info->nunique? nj_max * ksources: 0)) ) return (rc);
 
     ST_double *all_buffer     = calloc(N * ksources, sizeof *all_buffer);
     GT_bool   *all_firstmiss  = calloc(J, sizeof *all_firstmiss);
@@ -629,16 +572,11 @@ ST_retcode sf_stats_summarize_p (struct StataInfo *st_info, int level, char *fna
                     output[offset_output + k] = lastnm[0];
                 }
                 else if ( scode == -18 ) { // nunique
-                    if ( (rc = gf_array_nunique_range (
+                    if ( (rc = gf_array_nunique_set (
                             output + offset_output + k,
                             all_buffer + start,
                             nj * ksources,
-                            (end == 0),
-                            nuniq_h1,
-                            nuniq_h2,
-                            nuniq_h3,
-                            nuniq_ix,
-                            nuniq_xcopy
+                            &nuniq_set
                         )
                     ) ) return (rc);
                 }
@@ -714,11 +652,7 @@ exit:
     free (statcode);
     free (index_st);
 
-    free (nuniq_h1);
-    free (nuniq_h2);
-    free (nuniq_h3);
-    free (nuniq_ix);
-    free (nuniq_xcopy);
+    gf_nuniq_set_free (&nuniq_set);
 
     free (all_buffer);
     free (all_firstmiss);
@@ -798,32 +732,8 @@ ST_retcode sf_stats_summarize_w (struct StataInfo *st_info, int level, char *fna
             nj_max = (st_info->info[j + 1] - st_info->info[j]);
     }
 
-    GT_size  *nuniq_ix;
-    uint64_t *nuniq_h1;
-    uint64_t *nuniq_h2;
-    uint64_t *nuniq_h3;
-    uint64_t *nuniq_xcopy;
-
-    if ( st_info->nunique ) {
-        nuniq_ix    = calloc(nj_max, sizeof *nuniq_ix);
-        nuniq_h1    = calloc(nj_max, sizeof *nuniq_h1);
-        nuniq_h2    = calloc(nj_max, sizeof *nuniq_h2);
-        nuniq_h3    = calloc(nj_max, sizeof *nuniq_h3);
-        nuniq_xcopy = calloc(nj_max, sizeof *nuniq_xcopy);
-    }
-    else {
-        nuniq_ix    = malloc(sizeof(nuniq_ix));
-        nuniq_h1    = malloc(sizeof(nuniq_h1));
-        nuniq_h2    = malloc(sizeof(nuniq_h2));
-        nuniq_h3    = malloc(sizeof(nuniq_h3));
-        nuniq_xcopy = malloc(sizeof(nuniq_xcopy));
-    }
-
-    if ( nuniq_ix    == NULL ) return(sf_oom_error("sf_stats_summarize_w", "nuniq_ix"));
-    if ( nuniq_h1    == NULL ) return(sf_oom_error("sf_stats_summarize_w", "nuniq_h1"));
-    if ( nuniq_h2    == NULL ) return(sf_oom_error("sf_stats_summarize_w", "nuniq_h2"));
-    if ( nuniq_h3    == NULL ) return(sf_oom_error("sf_stats_summarize_w", "nuniq_h3"));
-    if ( nuniq_xcopy == NULL ) return(sf_oom_error("sf_stats_summarize_w", "nuniq_xcopy"));
+    struct GtoolsNuniqSet nuniq_set;
+    if ( (rc = gf_nuniq_set_init(&nuniq_set, st_info->nunique? nj_max: 0)) ) return (rc);
 
     ST_double *p_buffer = calloc(2 * nj_max, sizeof *p_buffer);
     ST_double *weights  = calloc(N, sizeof *weights);
@@ -1008,16 +918,11 @@ ST_retcode sf_stats_summarize_w (struct StataInfo *st_info, int level, char *fna
                         output[offset_output + k] = lastnm[l];
                     }
                     else if ( scode == -18 ) { // nunique
-                        if ( (rc = gf_array_nunique_range (
+                        if ( (rc = gf_array_nunique_set (
                                 output + offset_output + k,
                                 all_buffer + start,
                                 nj,
-                                (endwraw == SV_missval),
-                                nuniq_h1,
-                                nuniq_h2,
-                                nuniq_h3,
-                                nuniq_ix,
-                                nuniq_xcopy
+                                &nuniq_set
                             )
                         ) ) return (rc);
                     }
@@ -1152,11 +1057,7 @@ exit:
     free (statcode);
     free (index_st);
 
-    free (nuniq_h1);
-    free (nuniq_h2);
-    free (nuniq_h3);
-    free (nuniq_ix);
-    free (nuniq_xcopy);
+    gf_nuniq_set_free (&nuniq_set);
 
     free (p_buffer);
     free (weights);